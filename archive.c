@@ -0,0 +1,622 @@
+
+#include <TH.h>
+#include <luaT.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if LUA_VERSION_NUM >= 503
+#define luaL_checklong(L,n)     ((long)luaL_checkinteger(L, (n)))
+#endif
+
+/* Image archives: many encoded images packed into one file, with an index
+ * at the end for random access by position or by name.
+ *
+ *   "TIMGARC1"            file magic
+ *   blobs                 back to back, each starting 8-byte aligned
+ *   entries[n]            ARCHIVE_ENTRY_SIZE bytes each
+ *   names                 concatenated, not terminated
+ *   buckets[nbuckets]     hash table of the names: entry + 1, 0 if empty
+ *   trailer               ARCHIVE_TRAILER_SIZE bytes
+ *
+ * Integers are little-endian. An entry holds the offset and size of its
+ * blob, the offset and length of its name, its format and its dimensions
+ * (0 when they could not be read from the header). The trailer holds n,
+ * the offsets of the entries, names and buckets, the size of the names,
+ * nbuckets (a power of 2) and the index magic, so that readers find the
+ * index from the end of the file.
+ */
+#define ARCHIVE_MAGIC        "TIMGARC1"
+#define ARCHIVE_INDEX_MAGIC  "TIMGIDX1"
+#define ARCHIVE_ENTRY_SIZE   48
+#define ARCHIVE_TRAILER_SIZE 56
+
+static const char *archive_formats[] = {
+  "", "jpg", "png", "pgm", "ppm", "pam", "pfm", "qoi", "bmp", NULL
+};
+
+static int archive_format_code(const char *format)
+{
+  int k;
+  for (k=1; archive_formats[k]; k++) {
+    if (!strcmp(format, archive_formats[k])) {
+      return k;
+    }
+  }
+  return 0;
+}
+
+static inline uint32_t archive_get32(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t archive_get64(const unsigned char *p)
+{
+  return archive_get32(p) | ((uint64_t)archive_get32(p + 4) << 32);
+}
+
+static inline void archive_put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static inline void archive_put64(unsigned char *p, uint64_t v)
+{
+  archive_put32(p, (uint32_t)v);
+  archive_put32(p + 4, (uint32_t)(v >> 32));
+}
+
+static inline uint32_t archive_get32be(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* FNV-1a */
+static uint64_t archive_hash(const char *name, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i=0; i<len; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+/* Whitespace-separated header integer of a PNM file. */
+static int archive_pnm_int(const unsigned char *p, size_t len, size_t *pos, long *v)
+{
+  size_t i = *pos;
+  while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == '\r' || p[i] == '\n' ||
+                     p[i] == '#')) {
+    if (p[i] == '#') {
+      while (i < len && p[i] != '\n') {
+        i++;
+      }
+    } else {
+      i++;
+    }
+  }
+  if (i >= len || p[i] < '0' || p[i] > '9') {
+    return 0;
+  }
+  *v = 0;
+  while (i < len && p[i] >= '0' && p[i] <= '9' && *v < (1L << 24)) {
+    *v = *v * 10 + (p[i++] - '0');
+  }
+  *pos = i;
+  return 1;
+}
+
+/* Read the dimensions of an encoded image from its header, for the index.
+ * They are left at 0 when the header cannot be read (e.g. PAM, whose depth
+ * is a named field).
+ */
+static void archive_probe(int format, const unsigned char *p, size_t len,
+                          long *C, long *H, long *W)
+{
+  size_t pos;
+  *C = *H = *W = 0;
+  if (!strcmp(archive_formats[format], "jpg")) {
+    // walk the markers up to the start of frame
+    pos = 2;
+    while (pos + 4 <= len && p[pos] == 0xff) {
+      const int marker = p[pos+1];
+      const size_t seglen = (p[pos+2] << 8) | p[pos+3];
+      if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 &&
+          marker != 0xcc) {
+        if (pos + 10 <= len) {
+          *H = (p[pos+5] << 8) | p[pos+6];
+          *W = (p[pos+7] << 8) | p[pos+8];
+          *C = (p[pos+9] == 1) ? 1 : 3;
+        }
+        return;
+      }
+      pos += 2 + seglen;
+    }
+  } else if (!strcmp(archive_formats[format], "png")) {
+    static const int channels[7] = {1, 0, 3, 3, 2, 0, 4};
+    if (len >= 26 && !memcmp(p + 12, "IHDR", 4) && p[25] <= 6) {
+      *W = archive_get32be(p + 16);
+      *H = archive_get32be(p + 20);
+      *C = channels[p[25]];
+    }
+  } else if (!strcmp(archive_formats[format], "pgm") ||
+             !strcmp(archive_formats[format], "ppm") ||
+             !strcmp(archive_formats[format], "pfm")) {
+    long w, h;
+    pos = 2;
+    if (archive_pnm_int(p, len, &pos, &w) && archive_pnm_int(p, len, &pos, &h)) {
+      *W = w;
+      *H = h;
+      *C = (p[1] == '2' || p[1] == '5' || p[1] == 'f') ? 1 : 3;
+    }
+  } else if (!strcmp(archive_formats[format], "qoi")) {
+    if (len >= 14) {
+      *W = archive_get32be(p + 4);
+      *H = archive_get32be(p + 8);
+      *C = p[12];
+    }
+  }
+}
+
+/* Writer: blobs are appended as they come; the entries, names and hash
+ * table are kept in memory and written out by close.
+ */
+typedef struct {
+  FILE *fp;
+  uint64_t pos;         /* bytes written so far */
+  unsigned char *entries;
+  uint64_t n;
+  uint64_t cap;
+  char *names;
+  uint64_t names_size;
+  uint64_t names_cap;
+  uint32_t *buckets;
+  uint64_t nbuckets;
+} archive_writer;
+
+static const char *archive_writer_name(const archive_writer *w, uint64_t i, size_t *len)
+{
+  const unsigned char *e = w->entries + i*ARCHIVE_ENTRY_SIZE;
+  *len = archive_get32(e + 24);
+  return w->names + archive_get64(e + 16);
+}
+
+/* The bucket holding name, or the empty bucket where it would go. */
+static uint64_t archive_writer_slot(const archive_writer *w, const char *name, size_t len)
+{
+  uint64_t b = archive_hash(name, len) & (w->nbuckets - 1);
+  while (w->buckets[b]) {
+    size_t elen;
+    const char *ename = archive_writer_name(w, w->buckets[b] - 1, &elen);
+    if (elen == len && !memcmp(ename, name, len)) {
+      break;
+    }
+    b = (b + 1) & (w->nbuckets - 1);
+  }
+  return b;
+}
+
+static int archive_writer_rehash(archive_writer *w, uint64_t nbuckets)
+{
+  uint32_t *old = w->buckets;
+  const uint64_t oldn = w->nbuckets;
+  uint64_t b;
+  w->buckets = calloc(nbuckets, sizeof(uint32_t));
+  if (!w->buckets) {
+    w->buckets = old;
+    return 0;
+  }
+  w->nbuckets = nbuckets;
+  for (b=0; b<oldn; b++) {
+    if (old[b]) {
+      size_t len;
+      const char *name = archive_writer_name(w, old[b] - 1, &len);
+      w->buckets[archive_writer_slot(w, name, len)] = old[b];
+    }
+  }
+  free(old);
+  return 1;
+}
+
+static int archive_write(archive_writer *w, const void *p, size_t n)
+{
+  if (n && fwrite(p, 1, n, w->fp) != n) {
+    return 0;
+  }
+  w->pos += n;
+  return 1;
+}
+
+static void archive_writer_release(archive_writer *w)
+{
+  if (w->fp) {
+    fclose(w->fp);
+    w->fp = NULL;
+  }
+  free(w->entries);
+  free(w->names);
+  free(w->buckets);
+  w->entries = NULL;
+  w->names = NULL;
+  w->buckets = NULL;
+}
+
+/* Write the index and close the file. */
+static int archive_writer_finish(archive_writer *w)
+{
+  static const unsigned char zeros[8] = {0};
+  unsigned char trailer[ARCHIVE_TRAILER_SIZE];
+  int ok = archive_write(w, zeros, (8 - w->pos % 8) % 8);
+  const uint64_t entries_off = w->pos;
+  ok = ok && archive_write(w, w->entries, w->n * ARCHIVE_ENTRY_SIZE);
+  const uint64_t names_off = w->pos;
+  ok = ok && archive_write(w, w->names, w->names_size);
+  ok = ok && archive_write(w, zeros, (4 - w->pos % 4) % 4);
+  const uint64_t buckets_off = w->pos;
+  uint64_t b;
+  for (b=0; ok && b<w->nbuckets; b++) {
+    unsigned char v[4];
+    archive_put32(v, w->buckets[b]);
+    ok = archive_write(w, v, 4);
+  }
+  archive_put64(trailer, w->n);
+  archive_put64(trailer + 8, entries_off);
+  archive_put64(trailer + 16, names_off);
+  archive_put64(trailer + 24, w->names_size);
+  archive_put64(trailer + 32, buckets_off);
+  archive_put64(trailer + 40, w->nbuckets);
+  memcpy(trailer + 48, ARCHIVE_INDEX_MAGIC, 8);
+  ok = ok && archive_write(w, trailer, ARCHIVE_TRAILER_SIZE);
+  ok = (fclose(w->fp) == 0) && ok;
+  w->fp = NULL;
+  archive_writer_release(w);
+  return ok;
+}
+
+static int libarchive_Writer_new(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  archive_writer *w = luaT_alloc(L, sizeof(archive_writer));
+  memset(w, 0, sizeof(archive_writer));
+  luaT_pushudata(L, w, "libarchive.Writer");
+
+  w->nbuckets = 16;
+  w->buckets = calloc(w->nbuckets, sizeof(uint32_t));
+  w->fp = fopen(filename, "wb");
+  if (!w->fp) {
+    luaL_error(L, "cannot open file <%s> for writing", filename);
+  }
+  if (!w->buckets || !archive_write(w, ARCHIVE_MAGIC, 8)) {
+    archive_writer_release(w);
+    luaL_error(L, "write error");
+  }
+  return 1;
+}
+
+/* add(name, bytes, format): append an encoded image; returns its index. */
+static int libarchive_Writer_add(lua_State *L)
+{
+  static const unsigned char zeros[8] = {0};
+  archive_writer *w = luaT_checkudata(L, 1, "libarchive.Writer");
+  size_t len;
+  const char *name = luaL_checklstring(L, 2, &len);
+  THByteTensor *bytes = luaT_checkudata(L, 3, "torch.ByteTensor");
+  const int format = archive_format_code(luaL_checkstring(L, 4));
+  if (!w->fp) {
+    luaL_error(L, "attempt to use a closed archive");
+  }
+  if (!format) {
+    luaL_error(L, "unknown format <%s>", lua_tostring(L, 4));
+  }
+  if (bytes->nDimension != 1 || !THByteTensor_isContiguous(bytes)) {
+    luaL_error(L, "expecting a contiguous 1D ByteTensor");
+  }
+  if (w->n >= UINT32_MAX - 1 || len > UINT32_MAX) {
+    luaL_error(L, "archive too large");
+  }
+  // keep the table at most half full
+  if (2*(w->n + 1) > w->nbuckets && !archive_writer_rehash(w, 2*w->nbuckets)) {
+    luaL_error(L, "out of memory");
+  }
+  const uint64_t slot = archive_writer_slot(w, name, len);
+  if (w->buckets[slot]) {
+    luaL_error(L, "duplicate entry <%s>", name);
+  }
+  if (w->n == w->cap) {
+    const uint64_t cap = w->cap ? 2*w->cap : 64;
+    unsigned char *entries = realloc(w->entries, cap * ARCHIVE_ENTRY_SIZE);
+    if (!entries) {
+      luaL_error(L, "out of memory");
+    }
+    w->entries = entries;
+    w->cap = cap;
+  }
+  if (w->names_size + len > w->names_cap) {
+    uint64_t cap = w->names_cap ? 2*w->names_cap : 4096;
+    while (cap < w->names_size + len) {
+      cap *= 2;
+    }
+    char *names = realloc(w->names, cap);
+    if (!names) {
+      luaL_error(L, "out of memory");
+    }
+    w->names = names;
+    w->names_cap = cap;
+  }
+
+  const unsigned char *p = THByteTensor_data(bytes);
+  const size_t size = bytes->size[0];
+  if (!archive_write(w, zeros, (8 - w->pos % 8) % 8)) {
+    luaL_error(L, "write error");
+  }
+  const uint64_t offset = w->pos;
+  if (!archive_write(w, p, size)) {
+    luaL_error(L, "write error");
+  }
+
+  long C, H, W;
+  archive_probe(format, p, size, &C, &H, &W);
+  unsigned char *e = w->entries + w->n*ARCHIVE_ENTRY_SIZE;
+  archive_put64(e, offset);
+  archive_put64(e + 8, size);
+  archive_put64(e + 16, w->names_size);
+  archive_put32(e + 24, len);
+  archive_put32(e + 28, format);
+  archive_put32(e + 32, C);
+  archive_put32(e + 36, H);
+  archive_put32(e + 40, W);
+  archive_put32(e + 44, 0);
+  memcpy(w->names + w->names_size, name, len);
+  w->names_size += len;
+  w->buckets[slot] = ++w->n;
+
+  lua_pushnumber(L, (lua_Number)w->n);
+  return 1;
+}
+
+static int libarchive_Writer_close(lua_State *L)
+{
+  archive_writer *w = luaT_checkudata(L, 1, "libarchive.Writer");
+  if (w->fp && !archive_writer_finish(w)) {
+    luaL_error(L, "write error");
+  }
+  return 0;
+}
+
+static int libarchive_Writer_free(lua_State *L)
+{
+  archive_writer *w = luaT_checkudata(L, 1, "libarchive.Writer");
+  // an archive dropped without close still gets its index
+  if (w->fp) {
+    archive_writer_finish(w);
+  }
+  archive_writer_release(w);
+  luaT_free(L, w);
+  return 0;
+}
+
+static const luaL_Reg libarchive_Writer__[] =
+{
+  {"add", libarchive_Writer_add},
+  {"close", libarchive_Writer_close},
+  {NULL, NULL}
+};
+
+/* Reader: the whole file is mapped; entries are views on the mapping. */
+typedef struct {
+  THByteStorage *map;
+  uint64_t n;
+  const unsigned char *entries;
+  const char *names;
+  uint64_t names_size;
+  const unsigned char *buckets;
+  uint64_t nbuckets;
+  uint64_t blobs_end;   /* blobs lie before the index */
+} archive_reader;
+
+static int archive_reader_open(archive_reader *r)
+{
+  const unsigned char *p = r->map->data;
+  const uint64_t size = r->map->size;
+  if (size < 8 + ARCHIVE_TRAILER_SIZE || memcmp(p, ARCHIVE_MAGIC, 8) ||
+      memcmp(p + size - 8, ARCHIVE_INDEX_MAGIC, 8)) {
+    return 0;
+  }
+  const unsigned char *t = p + size - ARCHIVE_TRAILER_SIZE;
+  const uint64_t end = size - ARCHIVE_TRAILER_SIZE;
+  const uint64_t entries_off = archive_get64(t + 8);
+  const uint64_t names_off = archive_get64(t + 16);
+  const uint64_t buckets_off = archive_get64(t + 32);
+  r->n = archive_get64(t);
+  r->names_size = archive_get64(t + 24);
+  r->nbuckets = archive_get64(t + 40);
+  // overflow-safe checks that each section fits before the next
+  if (entries_off < 8 || entries_off > end || r->n > (end - entries_off) / ARCHIVE_ENTRY_SIZE ||
+      names_off < entries_off + r->n*ARCHIVE_ENTRY_SIZE || names_off > end ||
+      r->names_size > end - names_off ||
+      buckets_off < names_off + r->names_size || buckets_off > end ||
+      r->nbuckets > (end - buckets_off) / 4 || r->nbuckets < r->n || !r->nbuckets ||
+      (r->nbuckets & (r->nbuckets - 1))) {
+    return 0;
+  }
+  r->entries = p + entries_off;
+  // format codes index archive_formats, from 1: 0 is no format
+  uint64_t i;
+  for (i=0; i<r->n; i++) {
+    const uint32_t format = archive_get32(r->entries + i*ARCHIVE_ENTRY_SIZE + 28);
+    if (format < 1 || format >= sizeof(archive_formats)/sizeof(archive_formats[0]) - 1) {
+      return 0;
+    }
+  }
+  r->names = (const char *)p + names_off;
+  r->buckets = p + buckets_off;
+  r->blobs_end = entries_off;
+  return 1;
+}
+
+static archive_reader *archive_checkreader(lua_State *L, int idx)
+{
+  archive_reader *r = luaT_checkudata(L, idx, "libarchive.Reader");
+  if (!r->map) {
+    luaL_error(L, "attempt to use a closed archive");
+  }
+  return r;
+}
+
+/* Entry i (1-based), after checking that it points inside the file. */
+static const unsigned char *archive_checkentry(lua_State *L, archive_reader *r, int idx)
+{
+  const long i = luaL_checklong(L, idx);
+  if (i < 1 || (uint64_t)i > r->n) {
+    luaL_error(L, "entry %d out of range (1-%d)", (int)i, (int)r->n);
+  }
+  const unsigned char *e = r->entries + (i-1)*ARCHIVE_ENTRY_SIZE;
+  const uint64_t offset = archive_get64(e);
+  const uint64_t size = archive_get64(e + 8);
+  const uint64_t name_off = archive_get64(e + 16);
+  const uint32_t name_len = archive_get32(e + 24);
+  // format codes were checked by archive_reader_open
+  if (offset > r->blobs_end || size > r->blobs_end - offset ||
+      name_off > r->names_size || name_len > r->names_size - name_off) {
+    luaL_error(L, "corrupted archive entry %d", (int)i);
+  }
+  return e;
+}
+
+static int libarchive_Reader_new(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  archive_reader *r = luaT_alloc(L, sizeof(archive_reader));
+  memset(r, 0, sizeof(archive_reader));
+  luaT_pushudata(L, r, "libarchive.Reader");
+
+  r->map = THByteStorage_newWithMapping(filename, 0, 0);
+  if (!archive_reader_open(r)) {
+    THByteStorage_free(r->map);
+    r->map = NULL;
+    luaL_error(L, "<%s> is not an image archive", filename);
+  }
+  return 1;
+}
+
+static int libarchive_Reader_size(lua_State *L)
+{
+  archive_reader *r = archive_checkreader(L, 1);
+  lua_pushnumber(L, (lua_Number)r->n);
+  return 1;
+}
+
+/* find(name): the index of the entry, or nil. */
+static int libarchive_Reader_find(lua_State *L)
+{
+  archive_reader *r = archive_checkreader(L, 1);
+  size_t len;
+  const char *name = luaL_checklstring(L, 2, &len);
+  uint64_t b = archive_hash(name, len) & (r->nbuckets - 1);
+  uint64_t probes;
+  for (probes=0; probes<r->nbuckets; probes++) {
+    const uint32_t v = archive_get32(r->buckets + 4*b);
+    if (!v || v > r->n) {
+      break;
+    }
+    const unsigned char *e = r->entries + (v-1)*ARCHIVE_ENTRY_SIZE;
+    const uint64_t name_off = archive_get64(e + 16);
+    if (archive_get32(e + 24) == len && len <= r->names_size &&
+        name_off <= r->names_size - len &&
+        !memcmp(r->names + name_off, name, len)) {
+      lua_pushnumber(L, v);
+      return 1;
+    }
+    b = (b + 1) & (r->nbuckets - 1);
+  }
+  lua_pushnil(L);
+  return 1;
+}
+
+/* entry(i): name, format, size in bytes, and depth, height and width. */
+static int libarchive_Reader_entry(lua_State *L)
+{
+  archive_reader *r = archive_checkreader(L, 1);
+  const unsigned char *e = archive_checkentry(L, r, 2);
+  lua_pushlstring(L, r->names + archive_get64(e + 16), archive_get32(e + 24));
+  lua_pushstring(L, archive_formats[archive_get32(e + 28)]);
+  lua_pushnumber(L, (lua_Number)archive_get64(e + 8));
+  lua_pushnumber(L, archive_get32(e + 32));
+  lua_pushnumber(L, archive_get32(e + 36));
+  lua_pushnumber(L, archive_get32(e + 40));
+  return 6;
+}
+
+/* bytes(i): the encoded image, as a ByteTensor viewing the mapping. */
+static int libarchive_Reader_bytes(lua_State *L)
+{
+  archive_reader *r = archive_checkreader(L, 1);
+  const unsigned char *e = archive_checkentry(L, r, 2);
+  const long size = (long)archive_get64(e + 8);
+  THByteTensor *bytes = THByteTensor_newWithStorage1d(r->map, (long)archive_get64(e),
+                                                      size > 0 ? size : 1, 1);
+  if (size == 0) {
+    THByteTensor_resize1d(bytes, 0);
+  }
+  luaT_pushudata(L, bytes, "torch.ByteTensor");
+  return 1;
+}
+
+static void archive_reader_release(archive_reader *r)
+{
+  if (r->map) {
+    // views handed out keep the mapping alive
+    THByteStorage_free(r->map);
+    r->map = NULL;
+  }
+}
+
+static int libarchive_Reader_close(lua_State *L)
+{
+  archive_reader *r = luaT_checkudata(L, 1, "libarchive.Reader");
+  archive_reader_release(r);
+  return 0;
+}
+
+static int libarchive_Reader_free(lua_State *L)
+{
+  archive_reader *r = luaT_checkudata(L, 1, "libarchive.Reader");
+  archive_reader_release(r);
+  luaT_free(L, r);
+  return 0;
+}
+
+static const luaL_Reg libarchive_Reader__[] =
+{
+  {"size", libarchive_Reader_size},
+  {"find", libarchive_Reader_find},
+  {"entry", libarchive_Reader_entry},
+  {"bytes", libarchive_Reader_bytes},
+  {"close", libarchive_Reader_close},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int luaopen_liblua_archive(lua_State *L)
+{
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, "libarchive");
+
+  luaT_newmetatable(L, "libarchive.Writer", NULL,
+                    libarchive_Writer_new, libarchive_Writer_free, NULL);
+  luaT_setfuncs(L, libarchive_Writer__, 0);
+  lua_pop(L, 1);
+
+  luaT_newmetatable(L, "libarchive.Reader", NULL,
+                    libarchive_Reader_new, libarchive_Reader_free, NULL);
+  luaT_setfuncs(L, libarchive_Reader__, 0);
+  lua_pop(L, 1);
+
+  return 1;
+}
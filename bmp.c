@@ -0,0 +1,210 @@
+
+#include <TH.h>
+#include <luaT.h>
+#include <stdint.h>
+
+#if LUA_VERSION_NUM >= 503
+#define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
+#define luaL_optint(L,n,d)      ((int)luaL_optinteger(L, (n), (d)))
+#endif
+
+#define torch_(NAME) TH_CONCAT_3(torch_, Real, NAME)
+#define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
+#define libbmp_(NAME) TH_CONCAT_3(libbmp_, Real, NAME)
+
+#define BMP_OK          0
+#define BMP_CORRUPTED   1
+#define BMP_UNSUPPORTED 2
+
+/* Compression methods */
+#define BI_RGB       0
+#define BI_BITFIELDS 3
+
+#define BMP_FILEHEADER_SIZE 14
+#define BMP_INFOHEADER_SIZE 40
+#define BMP_V4HEADER_SIZE   108
+
+typedef struct {
+  long W, H;
+  int topdown;          /* rows are stored top row first */
+  int bpp;              /* bits per pixel: 1, 4, 8, 16, 24 or 32 */
+  int compression;
+  long offset;          /* of the pixel array */
+  long stride;          /* bytes per row, padded to 4 */
+  uint32_t mask[4];     /* R, G, B, A masks (BI_BITFIELDS) */
+  int shift[4];
+  uint32_t max[4];      /* largest value of each masked field */
+  int ncolors;
+  unsigned char palette[256][3]; /* R, G, B */
+  int C;                /* channels of the loaded tensor */
+} bmp_header;
+
+static inline uint32_t bmp_get16(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t bmp_get32(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void bmp_put16(unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static inline void bmp_put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static void bmp_set_mask(bmp_header *h, int k, uint32_t mask)
+{
+  h->mask[k] = mask;
+  h->shift[k] = 0;
+  h->max[k] = 0;
+  if (mask) {
+    while (!((mask >> h->shift[k]) & 1)) {
+      h->shift[k]++;
+    }
+    h->max[k] = mask >> h->shift[k];
+  }
+}
+
+/* Parse the file and DIB headers (any of the core, info, V2-V5 versions)
+ * and the palette, out of the first len bytes of the file.
+ */
+static int bmp_read_header(const unsigned char *p, size_t len, bmp_header *h)
+{
+  int k;
+  if (len < BMP_FILEHEADER_SIZE + 12 || p[0] != 'B' || p[1] != 'M') {
+    return BMP_CORRUPTED;
+  }
+  h->offset = bmp_get32(p + 10);
+
+  const unsigned char *dib = p + BMP_FILEHEADER_SIZE;
+  const uint32_t dibsize = bmp_get32(dib);
+  const unsigned char *pal;
+  int entry;
+  if (BMP_FILEHEADER_SIZE + (size_t)dibsize > len) {
+    return BMP_CORRUPTED;
+  }
+  if (dibsize == 12) {
+    // OS/2 core header
+    h->W = bmp_get16(dib + 4);
+    h->H = bmp_get16(dib + 6);
+    h->bpp = bmp_get16(dib + 10);
+    h->compression = BI_RGB;
+    h->ncolors = 0;
+    pal = dib + dibsize;
+    entry = 3;
+  } else if (dibsize >= BMP_INFOHEADER_SIZE) {
+    h->W = (int32_t)bmp_get32(dib + 4);
+    h->H = (int32_t)bmp_get32(dib + 8);
+    h->bpp = bmp_get16(dib + 14);
+    h->compression = bmp_get32(dib + 16);
+    h->ncolors = bmp_get32(dib + 32);
+    pal = dib + dibsize;
+    entry = 4;
+    if (h->compression == BI_BITFIELDS) {
+      // masks are part of V2+ headers, or follow an info header
+      const unsigned char *m = dib + BMP_INFOHEADER_SIZE;
+      if (dibsize == BMP_INFOHEADER_SIZE) {
+        pal += 12;
+      }
+      if (m + 12 > p + len) {
+        return BMP_CORRUPTED;
+      }
+      for (k=0; k<3; k++) {
+        bmp_set_mask(h, k, bmp_get32(m + 4*k));
+      }
+      bmp_set_mask(h, 3, dibsize >= 56 ? bmp_get32(m + 12) : 0);
+    }
+  } else {
+    return BMP_CORRUPTED;
+  }
+
+  h->topdown = (h->H < 0);
+  if (h->topdown) {
+    h->H = -h->H;
+  }
+  if (h->W <= 0 || h->H <= 0 || h->W > (1L << 24) || h->H > (1L << 24)) {
+    return BMP_CORRUPTED;
+  }
+  h->stride = ((h->W * h->bpp + 31) / 32) * 4;
+
+  if (h->compression == BI_RGB) {
+    if (h->bpp == 24 || h->bpp == 32) {
+      // the 4th byte of 32-bit pixels is unused
+      h->C = 3;
+    } else if (h->bpp == 1 || h->bpp == 4 || h->bpp == 8) {
+      if (h->ncolors <= 0 || h->ncolors > (1 << h->bpp)) {
+        h->ncolors = 1 << h->bpp;
+      }
+      if (pal + entry*h->ncolors > p + len) {
+        return BMP_CORRUPTED;
+      }
+      // gray palettes give 1-channel images
+      h->C = 1;
+      for (k=0; k<h->ncolors; k++) {
+        h->palette[k][0] = pal[entry*k + 2];
+        h->palette[k][1] = pal[entry*k + 1];
+        h->palette[k][2] = pal[entry*k + 0];
+        if (h->palette[k][0] != h->palette[k][1] || h->palette[k][1] != h->palette[k][2]) {
+          h->C = 3;
+        }
+      }
+    } else {
+      return BMP_UNSUPPORTED;
+    }
+  } else if (h->compression == BI_BITFIELDS && (h->bpp == 16 || h->bpp == 32)) {
+    if (!h->mask[0] || !h->mask[1] || !h->mask[2]) {
+      return BMP_CORRUPTED;
+    }
+    h->C = h->mask[3] ? 4 : 3;
+  } else {
+    // RLE, embedded JPEG/PNG, ...
+    return BMP_UNSUPPORTED;
+  }
+
+  return BMP_OK;
+}
+
+#include "interleave.c"
+#include "limits.c"
+
+#include "generic/bmp.c"
+#include "THGenerateAllTypes.h"
+
+DLL_EXPORT int luaopen_libbmp(lua_State *L)
+{
+  libbmp_FloatMain_init(L);
+  libbmp_DoubleMain_init(L);
+  libbmp_ByteMain_init(L);
+
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, "libbmp");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libbmp_DoubleMain__, 0);
+  lua_setfield(L, -2, "double");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libbmp_FloatMain__, 0);
+  lua_setfield(L, -2, "float");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libbmp_ByteMain__, 0);
+  lua_setfield(L, -2, "byte");
+
+  lua_pushcfunction(L, image_simd_lua);
+  lua_setfield(L, -2, "simd");
+
+  return 1;
+}
@@ -0,0 +1,26 @@
+
+/* Reads from a file descriptor, for the codecs that decode streams (pipes,
+ * sockets) rather than files: libppm.Stream and liby4m.
+ */
+
+/* Read up to n bytes: all of them unless the stream ends, or (if !all) just
+ * whatever the first successful read returns.
+ */
+static size_t image_read_fd(int fd, unsigned char *dst, size_t n, int all)
+{
+  size_t k = 0;
+  while (k < n) {
+    ssize_t m = read(fd, dst + k, n - k);
+    if (m < 0 && errno == EINTR) {
+      continue;
+    }
+    if (m <= 0) {
+      break;
+    }
+    k += m;
+    if (!all) {
+      break;
+    }
+  }
+  return k;
+}
@@ -0,0 +1,290 @@
+#ifndef TH_GENERIC_FILE
+#define TH_GENERIC_FILE "generic/bmp.c"
+#else
+
+/* Convert the pixel array into a CxHxW tensor in a single pass, flipping
+ * bottom-up files and skipping the row padding on the way.
+ */
+static void libbmp_(Main_decode)(const unsigned char *pixels, const bmp_header *h,
+                                 real *data)
+{
+  const long W = h->W, H = h->H, N = W*H;
+  real *d0 = data;
+  real *d1 = (h->C >= 3) ? data + N : NULL;
+  real *d2 = (h->C >= 3) ? data + 2*N : NULL;
+  real *d3 = (h->C == 4) ? data + 3*N : NULL;
+  long x, y, k;
+
+  for (y=0; y<H; y++) {
+    const unsigned char *row = pixels + (h->topdown ? y : H-1-y) * h->stride;
+    const long o = y*W;
+    if (h->compression == BI_BITFIELDS) {
+      real *d[4] = {d0, d1, d2, d3};
+      for (x=0; x<W; x++) {
+        const uint32_t v = (h->bpp == 32) ? bmp_get32(row + 4*x) : bmp_get16(row + 2*x);
+        for (k=0; k<h->C; k++) {
+          const uint32_t c = (v & h->mask[k]) >> h->shift[k];
+          d[k][o+x] = (real)(h->max[k] == 255 ? c : ((uint64_t)c*255 + h->max[k]/2) / h->max[k]);
+        }
+      }
+    } else if (h->bpp == 24) {
+      /* BGR: the planes in reverse order */
+      image_(unpack)(d2 + o, -N, row, W, 3, 1, NULL);
+    } else if (h->bpp == 32) {
+      for (x=0; x<W; x++) {
+        const unsigned char *px = row + 4*x;
+        d0[o+x] = (real)px[2];
+        d1[o+x] = (real)px[1];
+        d2[o+x] = (real)px[0];
+      }
+    } else {
+      const int ppb = 8 / h->bpp;
+      const int mask = (1 << h->bpp) - 1;
+      for (x=0; x<W; x++) {
+        const int shift = 8 - h->bpp * (x % ppb + 1);
+        int idx = (row[x / ppb] >> shift) & mask;
+        if (idx >= h->ncolors) {
+          idx = 0;
+        }
+        d0[o+x] = (real)h->palette[idx][0];
+        if (d1) {
+          d1[o+x] = (real)h->palette[idx][1];
+          d2[o+x] = (real)h->palette[idx][2];
+        }
+      }
+    }
+  }
+}
+
+static int libbmp_(Main_headerError)(lua_State *L, int res)
+{
+  if (res == BMP_UNSUPPORTED) {
+    luaL_error(L, "unsupported BMP format (only uncompressed, bitfields and palette images are supported)");
+  }
+  return luaL_error(L, "corrupted BMP file");
+}
+
+static int libbmp_(Main_size)(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  THByteStorage *map = THByteStorage_newWithMapping(filename, 0, 0);
+  bmp_header hdr;
+  int res = bmp_read_header(map->data, map->size, &hdr);
+  THByteStorage_free(map);
+  if (res != BMP_OK) {
+    libbmp_(Main_headerError)(L, res);
+  }
+
+  lua_pushnumber(L, hdr.C);
+  lua_pushnumber(L, hdr.H);
+  lua_pushnumber(L, hdr.W);
+  return 3;
+}
+
+/* Files are mapped rather than read: the pixels are converted straight out
+ * of the mapping.
+ */
+static int libbmp_(Main_load)(lua_State *L)
+{
+  const int load_from_file = luaL_checkint(L, 1);
+  THByteStorage *map = NULL;
+  const unsigned char *bytes;
+  size_t len;
+  bmp_header hdr;
+  image_limits limits;
+
+  image_limits_check(L, 3, &limits);
+
+  if (load_from_file == 1) {
+    const char *filename = luaL_checkstring(L, 2);
+    map = THByteStorage_newWithMapping(filename, 0, 0);
+    bytes = map->data;
+    len = map->size;
+  } else {
+    /* We're loading from a ByteTensor */
+    THByteTensor *src = luaT_checkudata(L, 2, "torch.ByteTensor");
+    luaL_argcheck(L, src->nDimension == 1 && THByteTensor_isContiguous(src), 2,
+                  "expecting a contiguous 1D ByteTensor");
+    bytes = THByteTensor_data(src);
+    len = src->size[0];
+  }
+
+  int res = bmp_read_header(bytes, len, &hdr);
+  if (res == BMP_OK && (hdr.offset < 0 || (size_t)hdr.offset > len ||
+                        (size_t)(hdr.stride * hdr.H) > len - hdr.offset)) {
+    res = BMP_CORRUPTED;
+  }
+  if (res != BMP_OK) {
+    if (map) {
+      THByteStorage_free(map);
+    }
+    libbmp_(Main_headerError)(L, res);
+  }
+  const char *over = image_limits_exceeded(&limits, hdr.W, hdr.H, hdr.C, sizeof(real));
+  if (over) {
+    if (map) {
+      THByteStorage_free(map);
+    }
+    luaL_error(L, IMAGE_LIMITS_ERR_MSG, hdr.W, hdr.H, over);
+  }
+
+  THTensor *tensor = THTensor_(newWithSize3d)(hdr.C, hdr.H, hdr.W);
+  libbmp_(Main_decode)(bytes + hdr.offset, &hdr, THTensor_(data)(tensor));
+  if (map) {
+    THByteStorage_free(map);
+  }
+
+  luaT_pushudata(L, tensor, torch_Tensor);
+  return 1;
+}
+
+/* Encode a CxHxW tensor as a bottom-up BMP: 8-bit gray palette for C = 1,
+ * 24-bit BI_RGB for C = 3, and 32-bit BI_BITFIELDS with alpha (V4 header)
+ * for C = 4. out must hold libbmp_(Main_encodedSize) bytes.
+ */
+static size_t libbmp_(Main_encodedSize)(long C, long H, long W, long *stride, long *offset)
+{
+  const int bpp = (C == 1) ? 8 : (C == 3 ? 24 : 32);
+  *stride = ((W * bpp + 31) / 32) * 4;
+  *offset = BMP_FILEHEADER_SIZE + (C == 4 ? BMP_V4HEADER_SIZE : BMP_INFOHEADER_SIZE) +
+            (C == 1 ? 256*4 : 0);
+  return *offset + *stride * H;
+}
+
+static void libbmp_(Main_encode)(const real *data, long C, long H, long W,
+                                 unsigned char *out)
+{
+  const long N = W*H;
+  long stride, offset, x, y, k;
+  const size_t size = libbmp_(Main_encodedSize)(C, H, W, &stride, &offset);
+  const uint32_t dibsize = (C == 4) ? BMP_V4HEADER_SIZE : BMP_INFOHEADER_SIZE;
+  unsigned char *dib = out + BMP_FILEHEADER_SIZE;
+
+  memset(out, 0, offset);
+  out[0] = 'B';
+  out[1] = 'M';
+  bmp_put32(out + 2, size);
+  bmp_put32(out + 10, offset);
+  bmp_put32(dib, dibsize);
+  bmp_put32(dib + 4, W);
+  bmp_put32(dib + 8, H);
+  bmp_put16(dib + 12, 1);
+  bmp_put16(dib + 14, (C == 1) ? 8 : (C == 3 ? 24 : 32));
+  bmp_put32(dib + 16, (C == 4) ? BI_BITFIELDS : BI_RGB);
+  bmp_put32(dib + 20, stride * H);
+  bmp_put32(dib + 24, 2835); // 72 dpi
+  bmp_put32(dib + 28, 2835);
+  if (C == 1) {
+    bmp_put32(dib + 32, 256);
+    for (k=0; k<256; k++) {
+      unsigned char *e = dib + dibsize + 4*k;
+      e[0] = e[1] = e[2] = k;
+    }
+  } else if (C == 4) {
+    bmp_put32(dib + 40, 0x00ff0000);
+    bmp_put32(dib + 44, 0x0000ff00);
+    bmp_put32(dib + 48, 0x000000ff);
+    bmp_put32(dib + 52, 0xff000000);
+    memcpy(dib + 56, "BGRs", 4); // LCS_sRGB
+  }
+
+  for (y=0; y<H; y++) {
+    unsigned char *row = out + offset + (H-1-y) * stride;
+    const long o = y*W;
+    if (C == 1) {
+      image_(pack)(row, data + o, N, W, 1, 1, NULL);
+      x = W;
+    } else if (C == 3) {
+      image_(pack)(row, data + 2*N + o, -N, W, 3, 1, NULL);
+      x = 3*W;
+    } else {
+      for (x=0; x<W; x++) {
+        unsigned char *px = row + 4*x;
+        px[0] = (unsigned char)data[2*N+o+x];
+        px[1] = (unsigned char)data[N+o+x];
+        px[2] = (unsigned char)data[o+x];
+        px[3] = (unsigned char)data[3*N+o+x];
+      }
+      x = 4*W;
+    }
+    memset(row + x, 0, stride - x);
+  }
+}
+
+int libbmp_(Main_save)(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  const int save_to_file = luaL_optint(L, 3, 1);
+  THByteTensor *tensor_dest = NULL;
+  if (save_to_file == 0) {
+    tensor_dest = luaT_checkudata(L, 4, "torch.ByteTensor");
+  }
+
+  long C, H, W;
+  if (tensor->nDimension == 3) {
+    C = tensor->size[0];
+    H = tensor->size[1];
+    W = tensor->size[2];
+  } else if (tensor->nDimension == 2) {
+    C = 1;
+    H = tensor->size[0];
+    W = tensor->size[1];
+  } else {
+    C = W = H = 0;
+  }
+  if (C != 1 && C != 3 && C != 4) {
+    luaL_error(L, "can only export tensor with geometry: HxW, 1xHxW, 3xHxW or 4xHxW");
+  }
+  if (W < 1 || H < 1 || W > (1L << 24) || H > (1L << 24)) {
+    luaL_error(L, "image size not supported");
+  }
+
+  THTensor *tensorc = THTensor_(newContiguous)(tensor);
+  long stride, offset;
+  const size_t size = libbmp_(Main_encodedSize)(C, H, W, &stride, &offset);
+  if (save_to_file == 1) {
+    unsigned char *bytes = malloc(size);
+    if (!bytes) {
+      THTensor_(free)(tensorc);
+      luaL_error(L, "out of memory");
+    }
+    libbmp_(Main_encode)(THTensor_(data)(tensorc), C, H, W, bytes);
+    THTensor_(free)(tensorc);
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+      free(bytes);
+      luaL_error(L, "cannot open file <%s> for writing", filename);
+    }
+    size_t n = fwrite(bytes, 1, size, fp);
+    fclose(fp);
+    free(bytes);
+    if (n != size) {
+      luaL_error(L, "write error");
+    }
+  } else {
+    THByteTensor_resize1d(tensor_dest, size);
+    libbmp_(Main_encode)(THTensor_(data)(tensorc), C, H, W,
+                         THByteTensor_data(tensor_dest));
+    THTensor_(free)(tensorc);
+  }
+
+  return 1;
+}
+
+static const luaL_Reg libbmp_(Main__)[] =
+{
+  {"load", libbmp_(Main_load)},
+  {"save", libbmp_(Main_save)},
+  {"size", libbmp_(Main_size)},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int libbmp_(Main_init)(lua_State *L)
+{
+  luaT_pushmetatable(L, torch_Tensor);
+  luaT_registeratname(L, libbmp_(Main__), "libbmp");
+  return 1;
+}
+
+#endif
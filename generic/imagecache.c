@@ -0,0 +1,58 @@
+#ifndef TH_GENERIC_FILE
+#define TH_GENERIC_FILE "generic/imagecache.c"
+#else
+
+static void libimagecache_(Main_retain)(void *tensor)
+{
+  THTensor_(retain)(tensor);
+}
+
+static void *libimagecache_(Main_clone)(void *tensor)
+{
+  return THTensor_(newClone)(tensor);
+}
+
+static void libimagecache_(Main_free)(void *tensor)
+{
+  THTensor_(free)(tensor);
+}
+
+/* put(key, tensor, [bytes]): cache a copy of tensor under key, so that
+ * neither the caller nor those of get can change what the cache holds, with
+ * bytes, the encoded image of blob keys, which get then compares.
+ */
+static int libimagecache_(Main_put)(lua_State *L)
+{
+  size_t len;
+  const char *key = luaL_checklstring(L, 1, &len);
+  THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  THByteTensor *blob = lua_isnoneornil(L, 3) ? NULL
+                                             : luaT_checkudata(L, 3, "torch.ByteTensor");
+  THByteTensor *blobc = blob ? THByteTensor_newContiguous(blob) : NULL;
+  THTensor *copy = THTensor_(newClone)(tensor);
+  const size_t bytes = THTensor_(nElement)(copy) * sizeof(real);
+  imagecache_put(key, len, blobc ? THByteTensor_data(blobc) : NULL,
+                 blobc ? (size_t)THByteTensor_nElement(blobc) : 0, copy, torch_Tensor,
+                 bytes, libimagecache_(Main_retain), libimagecache_(Main_clone),
+                 libimagecache_(Main_free));
+  THTensor_(free)(copy);
+  if (blobc) {
+    THByteTensor_free(blobc);
+  }
+  return 0;
+}
+
+static const luaL_Reg libimagecache_(Main__)[] =
+{
+  {"put", libimagecache_(Main_put)},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int libimagecache_(Main_init)(lua_State *L)
+{
+  luaT_pushmetatable(L, torch_Tensor);
+  luaT_registeratname(L, libimagecache_(Main__), "libimagecache");
+  return 1;
+}
+
+#endif
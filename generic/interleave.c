@@ -0,0 +1,193 @@
+#ifndef TH_GENERIC_FILE
+#define TH_GENERIC_FILE "generic/interleave.c"
+#else
+
+/* Convert n staged samples, 8-bit or 16-bit if wide, as sample * scale + bias. */
+static void image_(widen)(real *data, const void *stage, long n, int wide,
+                          double scale, double bias)
+{
+#if defined(TH_REAL_IS_FLOAT)
+  image_il_widen_float(data, stage, n, wide, (float)scale, (float)bias);
+#elif defined(TH_REAL_IS_DOUBLE)
+  image_il_widen_double(data, stage, n, wide, scale, bias);
+#else
+  const real s = (real)scale;
+  const real b = (real)bias;
+  long i;
+  if (wide) {
+    for (i=0; i<n; i++) {
+      data[i] = ((const uint16_t *)stage)[i] * s + b;
+    }
+  } else {
+    for (i=0; i<n; i++) {
+      data[i] = ((const unsigned char *)stage)[i] * s + b;
+    }
+  }
+#endif
+}
+
+/* Convert n samples to 8-bit ones, or 16-bit ones if wide, cast as they are. */
+static void image_(narrow)(void *stage, const real *data, long n, int wide)
+{
+  long i;
+  if (wide) {
+    for (i=0; i<n; i++) {
+#if defined(TH_REAL_IS_FLOAT) || defined(TH_REAL_IS_DOUBLE)
+      ((uint16_t *)stage)[i] = image_il_sat16(data[i]);
+#else
+      ((uint16_t *)stage)[i] = (uint16_t)(unsigned int)data[i];
+#endif
+    }
+    return;
+  }
+#if defined(TH_REAL_IS_FLOAT)
+  image_il_narrow_float(stage, data, n);
+#elif defined(TH_REAL_IS_DOUBLE)
+  image_il_narrow_double(stage, data, n);
+#else
+  for (i=0; i<n; i++) {
+    ((unsigned char *)stage)[i] = (unsigned char)data[i];
+  }
+#endif
+}
+
+/* Quantize n samples to 8-bit ones, or 16-bit ones if wide, as q says;
+ * first is the index of the first one in its plane, for the dither. Only
+ * float and double samples are quantized: others are cast as they are.
+ */
+static void image_(quantize)(void *stage, const real *data, long n, int wide,
+                             const image_quant *q, long first)
+{
+#if defined(TH_REAL_IS_FLOAT) || defined(TH_REAL_IS_DOUBLE)
+  const real maxval = (real)q->maxval;
+  long i;
+  if (!q->dither && !wide) {
+#if defined(TH_REAL_IS_FLOAT)
+    image_il_quantize_float(stage, data, n, maxval);
+#else
+    image_il_quantize_double(stage, data, n, maxval);
+#endif
+    return;
+  }
+  // where the first sample is, then step through the pixels
+  long p = first / q->step, c = first % q->step;
+  long x = p % q->width, y = q->y + p / q->width;
+  for (i=0; i<n; i++) {
+    const real offset = q->dither ? (real)image_il_bayer[y & 3][x & 3] : (real)0.5;
+    real v = data[i] * maxval;
+    v = (v > 0) ? (v < maxval ? v : maxval) : 0;
+    if (wide) {
+      ((uint16_t *)stage)[i] = (uint16_t)(v + offset);
+    } else {
+      ((unsigned char *)stage)[i] = (unsigned char)(v + offset);
+    }
+    if (++c == q->step) {
+      c = 0;
+      if (++x == q->width) {
+        x = 0;
+        y++;
+      }
+    }
+  }
+#else
+  image_(narrow)(stage, data, n, wide);
+#endif
+}
+
+/* Unpack n pixels of chans samples, of 1 byte each or 2 (big-endian), into
+ * chans planes of data, plane elements apart. With a map, plane k receives
+ * channel map->src[k] scaled; without one the samples are kept as they are,
+ * except for 8-bit tensors, which keep the high byte of 16-bit samples.
+ * HxWxC tensors are a single plane of n*C samples.
+ */
+static void image_(unpack)(real *data, long plane, const unsigned char *src, long n,
+                           int chans, int bytes, const image_chanmap *map)
+{
+  uint16_t stage[IMAGE_IL_CHANS * IMAGE_IL_BLOCK];
+  long i;
+  int k;
+#if defined(TH_REAL_IS_BYTE) || defined(TH_REAL_IS_CHAR)
+  if (!map) {
+    image_il_unpack(data, plane, src, n, chans, bytes == 2 ? IMAGE_IL_16TO8 : IMAGE_IL_8TO8);
+    return;
+  }
+#endif
+  if (chans > IMAGE_IL_CHANS) {
+    for (k=0; k<chans; k++) {
+      real *d = data + k*plane;
+      const unsigned char *s = src + k*bytes;
+      for (i=0; i<n; i++) {
+        d[i] = (real)((bytes == 2) ? (s[2*chans*i] << 8) | s[2*chans*i+1] : s[chans*i]);
+      }
+    }
+    return;
+  }
+  for (i=0; i<n; i+=IMAGE_IL_BLOCK) {
+    const long m = (n - i < IMAGE_IL_BLOCK) ? n - i : IMAGE_IL_BLOCK;
+    image_il_unpack(stage, IMAGE_IL_BLOCK, src + i*chans*bytes, m, chans,
+                    bytes == 2 ? IMAGE_IL_16TO16 : IMAGE_IL_8TO8);
+    for (k=0; k<chans; k++) {
+      const int c = map ? map->src[k] : k;
+      const void *s = (bytes == 2) ? (const void *)(stage + c*IMAGE_IL_BLOCK)
+                                   : (const void *)((unsigned char *)stage + c*IMAGE_IL_BLOCK);
+      image_(widen)(data + k*plane + i, s, m, bytes == 2,
+                    map ? map->scale[k] : 1, map ? map->bias[k] : 0);
+    }
+  }
+}
+
+/* Pack chans planes of data, plane elements apart, into n pixels at dst of
+ * 1-byte or 2-byte (big-endian) samples, quantized with q, or without one
+ * cast as they are.
+ */
+static void image_(pack)(unsigned char *dst, const real *data, long plane, long n,
+                         int chans, int bytes, const image_quant *q)
+{
+  uint16_t stage[IMAGE_IL_CHANS * IMAGE_IL_BLOCK];
+  long i, j;
+  int k;
+#if defined(TH_REAL_IS_BYTE) || defined(TH_REAL_IS_CHAR)
+  if (bytes == 1) {
+    image_il_pack(dst, data, plane, n, chans, IMAGE_IL_8TO8);
+    return;
+  }
+#endif
+  if (chans > IMAGE_IL_CHANS) {
+    for (i=0; i<n; i+=IMAGE_IL_BLOCK) {
+      const long m = (n - i < IMAGE_IL_BLOCK) ? n - i : IMAGE_IL_BLOCK;
+      for (k=0; k<chans; k++) {
+        unsigned char *s = dst + (i*chans + k)*bytes;
+        if (q) {
+          image_(quantize)(stage, data + k*plane + i, m, bytes == 2, q, i);
+        } else {
+          image_(narrow)(stage, data + k*plane + i, m, bytes == 2);
+        }
+        for (j=0; j<m; j++) {
+          if (bytes == 2) {
+            s[2*chans*j] = (unsigned char)(stage[j] >> 8);
+            s[2*chans*j+1] = (unsigned char)stage[j];
+          } else {
+            s[chans*j] = ((unsigned char *)stage)[j];
+          }
+        }
+      }
+    }
+    return;
+  }
+  for (i=0; i<n; i+=IMAGE_IL_BLOCK) {
+    const long m = (n - i < IMAGE_IL_BLOCK) ? n - i : IMAGE_IL_BLOCK;
+    for (k=0; k<chans; k++) {
+      void *s = (bytes == 2) ? (void *)(stage + k*IMAGE_IL_BLOCK)
+                             : (void *)((unsigned char *)stage + k*IMAGE_IL_BLOCK);
+      if (q) {
+        image_(quantize)(s, data + k*plane + i, m, bytes == 2, q, i);
+      } else {
+        image_(narrow)(s, data + k*plane + i, m, bytes == 2);
+      }
+    }
+    image_il_pack(dst + i*chans*bytes, stage, IMAGE_IL_BLOCK, m, chans,
+                  bytes == 2 ? IMAGE_IL_16TO16 : IMAGE_IL_8TO8);
+  }
+}
+
+#endif
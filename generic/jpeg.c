@@ -39,22 +39,10 @@
  * standard JPEG error handler object.  (If we were using C++, we'd say we
  * were making a subclass of the regular error handler.)
  *
- * Here's the extended error handler struct:
+ * The extended error handler struct (my_error_mgr) is defined in jpeg.c,
+ * where the MJPEG reader keeps one alongside its decompressor.
  */
 
-#ifndef _LIBJPEG_ERROR_STRUCTS_
-#define _LIBJPEG_ERROR_STRUCTS_
-struct my_error_mgr {
-  struct jpeg_error_mgr pub;	/* "public" fields */
-
-  jmp_buf setjmp_buffer;	/* for return to caller */
-
-  char msg[JMSG_LENGTH_MAX]; /* last error message */
-};
-
-typedef struct my_error_mgr * my_error_ptr;
-#endif
-
 /*
  * Here's the routine that will replace the standard error_exit method:
  */
@@ -131,7 +119,7 @@ static int libjpeg_(Main_size)(lua_State *L)
      */
     jpeg_destroy_decompress(&cinfo);
     fclose(infile);
-    luaL_error(L, jerr.msg);
+    luaL_error(L, "%s", jerr.msg);
   }
 
   /* Now we can initialize the JPEG decompression object. */
@@ -187,9 +175,68 @@ static int libjpeg_(Main_size)(lua_State *L)
   return 3;
 }
 
+/* Read all scanlines of a started decompressor into a CxHxW tensor, or
+ * an HxWxC one if hwc, normalized by norm unless it is NULL.
+ */
+static void libjpeg_(Main_readScanlines)(j_decompress_ptr cinfo, real *tdata,
+                                         const image_norm *norm, int hwc)
+{
+  JSAMPARRAY buffer;		/* Output row buffer */
+  int i, k;
+
+  /* Make a one-row-high sample array that will go away when done with image */
+  const unsigned int chans = cinfo->output_components;
+  const unsigned int height = cinfo->output_height;
+  const unsigned int width = cinfo->output_width;
+  buffer = (*cinfo->mem->alloc_sarray)
+    ((j_common_ptr) cinfo, JPOOL_IMAGE, chans * width, 1);
+
+  /* Step 6: while (scan lines remain to be read) */
+  /*           jpeg_read_scanlines(...); */
+
+  /* Here we use the library's state variable cinfo.output_scanline as the
+   * loop counter, so that we don't have to keep track ourselves.
+   */
+  while (cinfo->output_scanline < height) {
+#if defined(TH_REAL_IS_BYTE)
+    if (hwc && !norm) { /* decode straight into the tensor's rows */
+      JSAMPROW row = tdata + cinfo->output_scanline * width * chans;
+      (void) jpeg_read_scanlines(cinfo, &row, 1);
+      continue;
+    }
+#endif
+    /* jpeg_read_scanlines expects an array of pointers to scanlines.
+     * Here the array is only one element long, but you could ask for
+     * more than one scanline at a time if that's more convenient.
+     */
+    (void) jpeg_read_scanlines(cinfo, buffer, 1);
+    const unsigned int j = cinfo->output_scanline-1;
+
+    if (hwc && norm) { /* interleaved, as decoded */
+      real *td = tdata + j * width * chans;
+      const unsigned char *buf = buffer[0];
+      for(i = 0; i < width; i++) {
+        for(k = 0; k < chans; k++) {
+          td[chans * i + k] = buf[chans * i + norm->src[k]] * (real)norm->scale[k]
+            + (real)norm->bias[k];
+        }
+      }
+    } else if (hwc) {
+      image_(unpack)(tdata + j * width * chans, 0, buffer[0], width * chans, 1, 1, NULL);
+    } else {
+      image_(unpack)(tdata + j * width, height * width, buffer[0], width, chans, 1, norm);
+    }
+  }
+}
+
 static int libjpeg_(Main_load)(lua_State *L)
 {
   const int load_from_file = luaL_checkint(L, 1);
+  image_norm_opts normopts;
+  image_norm norm;
+  image_limits limits;
+  image_norm_check(L, 3, &normopts);
+  image_limits_check(L, 3, &limits);
 
 #if !defined(HAVE_JPEG_MEM_SRC)
   if (load_from_file != 1) {
@@ -210,9 +257,6 @@ static int libjpeg_(Main_load)(lua_State *L)
   FILE * infile;		    /* source file (if loading from file) */
   unsigned char * inmem;    /* source memory (if loading from memory) */
   unsigned long inmem_size; /* source memory size (bytes) */
-  JSAMPARRAY buffer;		/* Output row buffer */
-  /* int row_stride;		/1* physical row width in output buffer *1/ */
-  int i, k;
 
   THTensor *tensor = NULL;
 
@@ -232,6 +276,8 @@ static int libjpeg_(Main_load)(lua_State *L)
   } else {
     /* We're loading from a ByteTensor */
     THByteTensor *src = luaT_checkudata(L, 2, "torch.ByteTensor");
+    luaL_argcheck(L, src->nDimension == 1 && THByteTensor_isContiguous(src), 2,
+                  "expecting a contiguous 1D ByteTensor");
     inmem = THByteTensor_data(src);
     inmem_size = src->size[0];
     infile = NULL;
@@ -252,7 +298,7 @@ static int libjpeg_(Main_load)(lua_State *L)
     if (infile) {
       fclose(infile);
     }
-    luaL_error(L, jerr.msg);
+    luaL_error(L, "%s", jerr.msg);
   }
   /* Now we can initialize the JPEG decompression object. */
   jpeg_create_decompress(&cinfo);
@@ -275,9 +321,26 @@ static int libjpeg_(Main_load)(lua_State *L)
 
   /* Step 4: set parameters for decompression */
 
-  /* In this example, we don't need to change any of the defaults set by
-   * jpeg_read_header(), so we do nothing here.
+  /* Check the size of the image against the limits before anything is
+   * allocated; with downscale, shrink it with DCT scaling until it fits.
    */
+  jpeg_calc_output_dimensions(&cinfo);
+  const char *over = image_limits_exceeded(&limits, cinfo.output_width, cinfo.output_height,
+                                           cinfo.output_components, sizeof(real));
+  while (over && limits.downscale && cinfo.scale_denom < 8) {
+    cinfo.scale_denom *= 2;
+    jpeg_calc_output_dimensions(&cinfo);
+    over = image_limits_exceeded(&limits, cinfo.output_width, cinfo.output_height,
+                                 cinfo.output_components, sizeof(real));
+  }
+  if (over) {
+    const long W = cinfo.image_width, H = cinfo.image_height;
+    jpeg_destroy_decompress(&cinfo);
+    if (infile) {
+      fclose(infile);
+    }
+    luaL_error(L, IMAGE_LIMITS_ERR_MSG, W, H, over);
+  }
 
   /* Step 5: Start decompressor */
 
@@ -293,54 +356,16 @@ static int libjpeg_(Main_load)(lua_State *L)
    * In this example, we need to make an output work buffer of the right size.
    */
 
-  /* Make a one-row-high sample array that will go away when done with image */
-  const unsigned int chans = cinfo.output_components;
-  const unsigned int height = cinfo.output_height;
-  const unsigned int width = cinfo.output_width;
-  tensor = THTensor_(newWithSize3d)(chans, height, width);
-  real *tdata = THTensor_(data)(tensor);
-  buffer = (*cinfo.mem->alloc_sarray)
-    ((j_common_ptr) &cinfo, JPOOL_IMAGE, chans * width, 1);
-
-  /* Step 6: while (scan lines remain to be read) */
-  /*           jpeg_read_scanlines(...); */
-
-  /* Here we use the library's state variable cinfo.output_scanline as the
-   * loop counter, so that we don't have to keep track ourselves.
-   */
-  while (cinfo.output_scanline < height) {
-    /* jpeg_read_scanlines expects an array of pointers to scanlines.
-     * Here the array is only one element long, but you could ask for
-     * more than one scanline at a time if that's more convenient.
-     */
-    (void) jpeg_read_scanlines(&cinfo, buffer, 1);
-    const unsigned int j = cinfo.output_scanline-1;
-
-    if (chans == 3) { /* special-case for speed */
-      real *td1 = tdata + 0 * (height * width) + j * width;
-      real *td2 = tdata + 1 * (height * width) + j * width;
-      real *td3 = tdata + 2 * (height * width) + j * width;
-      const unsigned char *buf = buffer[0];
-      for(i = 0; i < width; i++) {
-        *td1++ = (real)buf[chans * i + 0];
-        *td2++ = (real)buf[chans * i + 1];
-        *td3++ = (real)buf[chans * i + 2];
-      }
-    } else if (chans == 1) { /* special-case for speed */
-      real *td = tdata + j * width;
-      for(i = 0; i < width; i++) {
-        *td++ = (real)buffer[0][i];
-      }
-    } else { /* general case */
-      for(k = 0; k < chans; k++) {
-        const unsigned int k_ = k;
-        real *td = tdata + k_ * (height * width) + j * width;
-        for(i = 0; i < width; i++) {
-          *td++ = (real)buffer[0][chans * i + k_];
-        }
-      }
-    }
+  const int normalized = image_norm_plan(&normopts, cinfo.output_components, 255, &norm);
+  if (normopts.hwc) {
+    tensor = THTensor_(newWithSize3d)(cinfo.output_height, cinfo.output_width,
+                                      cinfo.output_components);
+  } else {
+    tensor = THTensor_(newWithSize3d)(cinfo.output_components,
+                                      cinfo.output_height, cinfo.output_width);
   }
+  libjpeg_(Main_readScanlines)(&cinfo, THTensor_(data)(tensor), normalized ? &norm : NULL,
+                               normopts.hwc);
   /* Step 7: Finish decompression */
 
   (void) jpeg_finish_decompress(&cinfo);
@@ -368,6 +393,58 @@ static int libjpeg_(Main_load)(lua_State *L)
 
   /* And we're done! */
   luaT_pushudata(L, tensor, torch_Tensor);
+  lua_pushboolean(L, normalized);
+  return 2;
+}
+
+/*
+ * read(stream, tensor): decode the next frame of a Motion-JPEG stream into
+ * tensor, resized as needed. Returns nil at the end of the stream.
+ */
+static int libjpeg_(Main_read)(lua_State *L)
+{
+  mjpeg_stream *s = luaT_checkudata(L, 1, "libjpeg.MJPEGStream");
+  THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+
+#if !defined(HAVE_JPEG_MEM_SRC)
+  luaL_error(L, JPEG_MEM_SRC_ERR_MSG);
+#endif
+  if (s->fd < 0) {
+    luaL_error(L, "attempt to read from a closed stream");
+  }
+
+  const long len = mjpeg_next_frame(s);
+  if (len == 0) {
+    lua_pushnil(L);
+    return 1;
+  } else if (len < 0) {
+    luaL_error(L, "corrupted stream");
+  }
+
+  if (setjmp(s->jerr.setjmp_buffer)) {
+    /* The decompressor is kept for the next frame: just reset it, and move
+     * past the broken one.
+     */
+    jpeg_abort_decompress(&s->cinfo);
+    mjpeg_consume(s, len);
+    luaL_error(L, "%s", s->jerr.msg);
+  }
+
+  jpeg_mem_src(&s->cinfo, s->buf + s->start, len);
+  (void) jpeg_read_header(&s->cinfo, TRUE);
+  (void) jpeg_start_decompress(&s->cinfo);
+
+  THTensor_(resize3d)(tensor, s->cinfo.output_components,
+                      s->cinfo.output_height, s->cinfo.output_width);
+  if (!THTensor_(isContiguous)(tensor)) {
+    jpeg_abort_decompress(&s->cinfo);
+    luaL_error(L, "destination tensor should be contiguous");
+  }
+  libjpeg_(Main_readScanlines)(&s->cinfo, THTensor_(data)(tensor), NULL, 0);
+  (void) jpeg_finish_decompress(&s->cinfo);
+  mjpeg_consume(s, len);
+
+  lua_pushvalue(L, 2);
   return 1;
 }
 
@@ -390,6 +467,9 @@ int libjpeg_(Main_save)(lua_State *L) {
   /* get args */
   const char *filename = luaL_checkstring(L, 1);
   THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  const int hwc = lua_toboolean(L, 6);
+  image_quant quant;
+  image_quant *q = image_quant_check(L, 7, 255, &quant);
   THTensor *tensorc = THTensor_(newContiguous)(tensor);
   real *tensor_data = THTensor_(data)(tensorc);
 
@@ -414,9 +494,9 @@ int libjpeg_(Main_save)(lua_State *L) {
   int width=0, height=0, bytes_per_pixel=0;
   int color_space=0;
   if (tensorc->nDimension == 3) {
-    bytes_per_pixel = tensorc->size[0];
-    height = tensorc->size[1];
-    width = tensorc->size[2];
+    bytes_per_pixel = tensorc->size[hwc ? 2 : 0];
+    height = tensorc->size[hwc ? 0 : 1];
+    width = tensorc->size[hwc ? 1 : 2];
     if (bytes_per_pixel == 3) {
       color_space = JCS_RGB;
     } else if (bytes_per_pixel == 1) {
@@ -433,16 +513,27 @@ int libjpeg_(Main_save)(lua_State *L) {
     luaL_error(L, "supports only 1 or 3 dimension tensors");
   }
 
-  /* alloc raw image data */
-  raw_image = (unsigned char *)malloc((sizeof (unsigned char))*width*height*bytes_per_pixel);
-
-  /* convert tensor to raw bytes */
-  int x,y,k;
-  for (k=0; k<bytes_per_pixel; k++) {
-    for (y=0; y<height; y++) {
-      for (x=0; x<width; x++) {
-        raw_image[(y*width+x)*bytes_per_pixel+k] = *tensor_data++;
-      }
+  /* convert tensor to raw bytes: HxWxC ByteTensors (and HxW ones) already
+   * are, other interleaved tensors are only converted */
+  const long n = (long)width*height*bytes_per_pixel;
+#if defined(TH_REAL_IS_BYTE)
+  const int raw = (hwc || bytes_per_pixel == 1);
+#else
+  const int raw = 0;
+#endif
+  if (raw) {
+    raw_image = (unsigned char *)tensor_data;
+  } else {
+    raw_image = (unsigned char *)malloc((sizeof (unsigned char))*n);
+    if (q) {
+      q->width = width;
+      q->step = hwc ? bytes_per_pixel : 1;
+    }
+    if (hwc || bytes_per_pixel == 1) {
+      image_(pack)(raw_image, tensor_data, 0, n, 1, 1, q);
+    } else {
+      image_(pack)(raw_image, tensor_data, (long)width*height, (long)width*height,
+                   bytes_per_pixel, 1, q);
     }
   }
 
@@ -502,7 +593,9 @@ int libjpeg_(Main_save)(lua_State *L) {
   }
 
   /* some cleanup */
-  free(raw_image);
+  if (!raw) {
+    free(raw_image);
+  }
   THTensor_(free)(tensorc);
 
   /* success code is 1! */
@@ -512,6 +605,7 @@ int libjpeg_(Main_save)(lua_State *L) {
 static const luaL_Reg libjpeg_(Main__)[] =
 {
   {"size", libjpeg_(Main_size)},
+  {"read", libjpeg_(Main_read)},
   {"load", libjpeg_(Main_load)},
   {"save", libjpeg_(Main_save)},
   {NULL, NULL}
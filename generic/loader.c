@@ -0,0 +1,503 @@
+#ifndef TH_GENERIC_FILE
+#define TH_GENERIC_FILE "generic/loader.c"
+#else
+
+/* ByteTensors hold 8-bit samples, other types samples in [0, 1]. */
+static inline real libloader_(Main_fromFloat)(float v)
+{
+#if defined(TH_REAL_IS_BYTE)
+  v += 0.5f;
+  return (real)(v <= 0 ? 0 : (v >= 255 ? 255 : v));
+#else
+  return (real)(v / 255.f);
+#endif
+}
+
+/* Convert the worker's decoded image into one CxHxW slice of the batch:
+ * the channels are converted to the batch depth and the image is resized
+ * (as with image.scale) to the batch size if needed.
+ */
+static int libloader_(Main_store)(loader_worker *w, long C, long H, long W, real *dst)
+{
+  const loader_image *img = &w->img;
+  const long sC = img->C, sH = img->H, sW = img->W, sN = sH*sW;
+  long i, k, y, x;
+  int map[4];
+  loader_channel_map(sC, C, map);
+
+  if (sH == H && sW == W) {
+    for (k=0; k<C; k++) {
+      const int m = map[k];
+      real *d = dst + k*H*W;
+      if (m >= 0) {
+        const unsigned char *s = img->data + m;
+        for (i=0; i<sN; i++) {
+          d[i] = libloader_(Main_fromFloat)(s[i*sC]);
+        }
+      } else {
+        for (i=0; i<sN; i++) {
+          d[i] = libloader_(Main_fromFloat)(loader_sample(img->data + i*sC, m));
+        }
+      }
+    }
+    return 1;
+  }
+
+  // planar source, then rows, then columns
+  const size_t n = C*sH*sW + C*sH*W + H;
+  if (n > w->tmp_cap) {
+    float *tmp = realloc(w->tmp, n * sizeof(float));
+    if (!tmp) {
+      return loader_fail(w->err, "out of memory");
+    }
+    w->tmp = tmp;
+    w->tmp_cap = n;
+  }
+  float *src = w->tmp;
+  float *mid = src + C*sN;
+  float *col = mid + C*sH*W;
+  for (k=0; k<C; k++) {
+    for (i=0; i<sN; i++) {
+      src[k*sN+i] = loader_sample(img->data + i*sC, map[k]);
+    }
+    for (y=0; y<sH; y++) {
+      loader_scale_line(src + k*sN + y*sW, 1, sW, mid + (k*sH + y)*W, 1, W);
+    }
+    for (x=0; x<W; x++) {
+      loader_scale_line(mid + k*sH*W + x, W, sH, col, 1, H);
+      for (y=0; y<H; y++) {
+        dst[(k*H + y)*W + x] = libloader_(Main_fromFloat)(col[y]);
+      }
+    }
+  }
+  return 1;
+}
+
+/* Worker thread: read and decode runs of items until the batch is exhausted.
+ * Failed items are zeroed and their error recorded.
+ */
+static void *libloader_(Main_work)(void *arg)
+{
+  loader_batch *b = arg;
+  loader_worker w;
+  const long S = b->C*b->H*b->W;
+  const long depth = loader_read_depth(LOADER_READ_INFLIGHT, b->nthreads);
+  const char *names[LOADER_READ_MAX];
+  int cached[LOADER_READ_MAX];
+  char opts[LOADER_CACHE_OPTLEN];
+  loader_cache_entry entry;
+  long first, count, k;
+  memset(&w, 0, sizeof(w));
+  loader_cache_batch_opts(opts, b->C, b->H, b->W);
+
+  while ((count = loader_batch_claim(b, depth, &first)) > 0) {
+    for (k=0; k<count; k++) {
+      const char *filename = b->items[first+k].filename;
+      const int fd = filename ? loader_cache_open_batch(filename, torch_Tensor, opts,
+                                                        sizeof(real), b->C, b->H, b->W,
+                                                        &entry) : -1;
+      // cache hits are neither read nor decoded
+      cached[k] = fd >= 0 && loader_cache_fetch(fd, &entry, (real *)b->out + (first+k)*S);
+      names[k] = cached[k] ? NULL : filename;
+    }
+    loader_reader_start(&w.reader, names, count);
+    for (k=0; k<count; k++) {
+      const long i = first + k;
+      real *dst = (real *)b->out + i*S;
+      if (cached[k]) {
+        continue;
+      }
+      if (!loader_decode_read(&w, &b->items[i], k, 0) ||
+          !libloader_(Main_store)(&w, b->C, b->H, b->W, dst)) {
+        memset(dst, 0, S * sizeof(real));
+        b->errors[i] = loader_strdup(w.err);
+      } else if (b->items[i].filename) {
+        loader_cache_write(b->items[i].filename, torch_Tensor, opts, sizeof(real), 3,
+                           b->C, b->H, b->W, &w.img, dst);
+      }
+    }
+  }
+  loader_worker_free(&w);
+  return NULL;
+}
+
+/* loadBatch(out, items, [depth, height, width, threads]): decode a table of
+ * file names and/or ByteTensors (encoded JPEG, PNG or binary PPM/PGM) into
+ * out, resized to NxCxHxW, on a pool of threads. Missing dimensions are
+ * taken from the first image that can be read. Returns out, and a table of
+ * error messages indexed by the items that failed.
+ */
+static int libloader_(Main_loadBatch)(lua_State *L)
+{
+  THTensor *tensor = luaT_checkudata(L, 1, torch_Tensor);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  long C = luaL_optint(L, 3, 0);
+  long H = luaL_optint(L, 4, 0);
+  long W = luaL_optint(L, 5, 0);
+  long nthreads = luaL_optint(L, 6, 0);
+  const long n = lua_objlen(L, 2);
+  long i;
+
+  if (n < 1) {
+    luaL_error(L, "empty batch");
+  }
+  if (C < 0 || C > 4 || H < 0 || W < 0) {
+    luaL_error(L, "invalid batch geometry");
+  }
+  loader_item *items = lua_newuserdata(L, n * sizeof(loader_item));
+  loader_check_items(L, 2, items, n);
+  loader_probe(L, items, n, &C, &H, &W);
+
+  THTensor_(resize4d)(tensor, n, C, H, W);
+  if (!THTensor_(isContiguous)(tensor)) {
+    luaL_error(L, "destination tensor should be contiguous");
+  }
+
+  loader_batch b;
+  b.items = items;
+  b.n = n;
+  b.next = 0;
+  b.out = THTensor_(data)(tensor);
+  b.C = C;
+  b.H = H;
+  b.W = W;
+  b.errors = calloc(n, sizeof(char *));
+  if (!b.errors) {
+    luaL_error(L, "out of memory");
+  }
+  pthread_mutex_init(&b.mutex, NULL);
+
+  if (nthreads <= 0) {
+    nthreads = loader_default_threads();
+  }
+  if (nthreads > n) {
+    nthreads = n;
+  }
+  b.nthreads = nthreads;
+  // the calling thread works too
+  pthread_t *threads = (nthreads > 1) ? malloc((nthreads - 1) * sizeof(pthread_t)) : NULL;
+  long started = 0;
+  while (threads && started < nthreads - 1 &&
+         pthread_create(&threads[started], NULL, libloader_(Main_work), &b) == 0) {
+    started++;
+  }
+  libloader_(Main_work)(&b);
+  for (i=0; i<started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&b.mutex);
+
+  lua_pushvalue(L, 1);
+  lua_newtable(L);
+  for (i=0; i<n; i++) {
+    if (b.errors[i]) {
+      lua_pushstring(L, b.errors[i]);
+      lua_rawseti(L, -2, i+1);
+      free(b.errors[i]);
+    }
+  }
+  free(b.errors);
+  return 2;
+}
+
+/* Output row y of loadTransformed, into a CxHxW tensor. */
+static void libloader_(Main_emitRow)(void *dst, const loader_transform *t, long y,
+                                     const float *row)
+{
+  real *d = (real *)dst + y*t->W;
+  long k, x;
+  for (k=0; k<t->C; k++) {
+    for (x=0; x<t->W; x++) {
+      d[k*t->H*t->W + x] = libloader_(Main_fromFloat)(row[k*t->W + x]);
+    }
+  }
+}
+
+/* loadTransformed(source, [opts]): decode a file name or a ByteTensor
+ * (encoded JPEG, PNG or binary PPM/PGM) straight into a CxHxW tensor of its
+ * crop {x1, y1, x2, y2} (or {at, w, h}, as image.crop), resized to size
+ * {h, w} (or a square) and mirrored with hflip; see loader_transform.
+ */
+static int libloader_(Main_loadTransformed)(lua_State *L)
+{
+  loader_transform t;
+  loader_worker w;
+  const char *filename = NULL;
+  const unsigned char *p = NULL;
+  size_t len = 0;
+  THByteTensor *blob;
+
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    filename = lua_tostring(L, 1);
+  } else if ((blob = luaT_toudata(L, 1, "torch.ByteTensor"))) {
+    if (blob->nDimension != 1 || !THByteTensor_isContiguous(blob)) {
+      luaL_error(L, "expecting a contiguous 1D ByteTensor");
+    }
+    p = THByteTensor_data(blob);
+    len = blob->size[0];
+  } else {
+    luaL_error(L, "expecting a file name or a ByteTensor");
+  }
+  loader_transform_check(L, 2, &t);
+
+  memset(&w, 0, sizeof(w));
+  loader_reader_start(&w.reader, &filename, 1);
+  int ok = (!filename || loader_reader_get(&w.reader, 0, filename, &p, &len, w.err)) &&
+           loader_decode(p, len, &w.img, 1, w.err) &&
+           loader_transform_plan(&t, w.img.C, w.img.H, w.img.W, w.err);
+  THTensor *tensor = ok ? THTensor_(newWithSize3d)(t.C, t.H, t.W) : NULL;
+  ok = ok && loader_transform_decode(p, len, &t, libloader_(Main_emitRow),
+                                     THTensor_(data)(tensor), w.err);
+  loader_worker_free(&w);
+  if (!ok) {
+    if (tensor) {
+      THTensor_(free)(tensor);
+    }
+    luaL_error(L, "%s", w.err);
+  }
+  luaT_pushudata(L, tensor, torch_Tensor);
+  return 1;
+}
+
+static int libloader_(Main_storeAny)(loader_worker *w, long C, long H, long W, void *dst)
+{
+  return libloader_(Main_store)(w, C, H, W, dst);
+}
+
+static void libloader_(Main_freeTensor)(void *tensor)
+{
+  THTensor_(free)(tensor);
+}
+
+/* prefetcher(items, [depth, height, width, batch, queue, threads, shuffle,
+ * seed, epochs]): start decoding items ahead, into a ring of queue slots of
+ * this tensor type. With a batch size, batches are delivered instead of
+ * single images. Without epochs, the items are gone through again and again
+ * (reshuffled each time with shuffle).
+ */
+static int libloader_(Main_prefetcher)(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  long C = luaL_optint(L, 2, 0);
+  long H = luaL_optint(L, 3, 0);
+  long W = luaL_optint(L, 4, 0);
+  const long B = luaL_optint(L, 5, 0);
+  const long K = luaL_optint(L, 6, 4);
+  long nthreads = luaL_optint(L, 7, 0);
+  const int shuffle = lua_toboolean(L, 8);
+  const uint64_t seed = (uint64_t)luaL_optnumber(L, 9, 0);
+  const long epochs = luaL_optint(L, 10, 0);
+  const long n = lua_objlen(L, 1);
+  long i, k;
+
+  if (n < 1) {
+    luaL_error(L, "no images to load");
+  }
+  if (C < 0 || C > 4 || H < 0 || W < 0 || B < 0 || epochs < 0) {
+    luaL_error(L, "invalid prefetcher geometry");
+  }
+  if (K < 2) {
+    luaL_error(L, "the queue needs at least 2 slots");
+  }
+  loader_item *items = lua_newuserdata(L, n * sizeof(loader_item));
+  loader_check_items(L, 1, items, n);
+  loader_probe(L, items, n, &C, &H, &W);
+  if (nthreads <= 0) {
+    nthreads = loader_default_threads();
+  }
+
+  loader_prefetcher *p = luaT_alloc(L, sizeof(loader_prefetcher));
+  memset(p, 0, sizeof(loader_prefetcher));
+  p->n = n;
+  p->shuffle = shuffle;
+  p->rng = seed ? seed : 0x9e3779b97f4a7c15ULL;
+  p->total = epochs ? epochs * n : -1;
+  p->C = C;
+  p->H = H;
+  p->W = W;
+  p->batched = (B > 0);
+  p->B = B > 0 ? B : 1;
+  p->K = K;
+  p->elsize = sizeof(real);
+  p->type = torch_Tensor;
+  p->store = libloader_(Main_storeAny);
+  p->free_tensor = libloader_(Main_freeTensor);
+
+  // items are copied, since workers outlive this call
+  p->items = calloc(n, sizeof(loader_item));
+  p->order = malloc(n * sizeof(long));
+  p->slots = calloc(K, sizeof(loader_slot));
+  for (i=0; i<n; i++) {
+    p->items[i] = items[i];
+    p->items[i].filename = items[i].filename ? loader_strdup(items[i].filename) : NULL;
+    if (items[i].blob) {
+      THByteTensor_retain(items[i].blob);
+    }
+    p->order[i] = i;
+  }
+  for (k=0; k<K; k++) {
+    loader_slot *slot = &p->slots[k];
+    THTensor *tensor = p->batched ? THTensor_(newWithSize4d)(p->B, C, H, W)
+                                  : THTensor_(newWithSize3d)(C, H, W);
+    slot->tensor = tensor;
+    slot->data = (char *)THTensor_(data)(tensor);
+    slot->seq = k;
+    slot->pending = loader_batch_count(p, k);
+    slot->indices = calloc(p->B, sizeof(long));
+    slot->errors = calloc(p->B, sizeof(char *));
+  }
+  if (shuffle) {
+    loader_shuffle(p);
+  }
+  loader_prefetch_start(p, nthreads);
+
+  luaT_pushudata(L, p, "libloader.Prefetcher");
+  return 1;
+}
+
+/* next(prefetcher): the next image (or batch), in order, or nil once all
+ * epochs are done. Also returns the index of the item (or a table of them)
+ * and its error message (or a table of them, by position). The returned
+ * tensor is recycled on the following call.
+ */
+static int libloader_(Main_next)(lua_State *L)
+{
+  loader_prefetcher *p = luaT_checkudata(L, 1, "libloader.Prefetcher");
+  long i;
+  if (!p->slots) {
+    luaL_error(L, "attempt to use a closed prefetcher");
+  }
+  if (strcmp(p->type, torch_Tensor)) {
+    luaL_error(L, "this prefetcher delivers %s", p->type);
+  }
+
+  pthread_mutex_lock(&p->mutex);
+  if (p->held) {
+    loader_prefetch_recycle(p, &p->slots[(p->delivered - 1) % p->K]);
+    p->held = 0;
+  }
+  const long s = p->delivered;
+  const long count = loader_batch_count(p, s);
+  loader_slot *slot = &p->slots[s % p->K];
+  if (count == 0) {
+    pthread_mutex_unlock(&p->mutex);
+    lua_pushnil(L);
+    return 1;
+  }
+  while (slot->seq != s || slot->pending > 0) {
+    pthread_cond_wait(&p->filled, &p->mutex);
+  }
+  p->delivered++;
+  p->held = 1;
+  pthread_mutex_unlock(&p->mutex);
+
+  THTensor *tensor = slot->tensor;
+  if (!p->batched) {
+    THTensor_(retain)(tensor);
+    luaT_pushudata(L, tensor, torch_Tensor);
+    lua_pushnumber(L, slot->indices[0] + 1);
+    if (slot->errors[0]) {
+      lua_pushstring(L, slot->errors[0]);
+    } else {
+      lua_pushnil(L);
+    }
+    return 3;
+  }
+
+  luaT_pushudata(L, THTensor_(newNarrow)(tensor, 0, 0, count), torch_Tensor);
+  lua_newtable(L);
+  for (i=0; i<count; i++) {
+    lua_pushnumber(L, slot->indices[i] + 1);
+    lua_rawseti(L, -2, i+1);
+  }
+  lua_newtable(L);
+  for (i=0; i<count; i++) {
+    if (slot->errors[i]) {
+      lua_pushstring(L, slot->errors[i]);
+      lua_rawseti(L, -2, i+1);
+    }
+  }
+  return 3;
+}
+
+/* cacheGet(filename, [depth]): the image.load result cached for filename
+ * and depth (0 for the image's own), mapped from the cache file, or nil.
+ * The mapping is private: writes to the tensor stay out of the cache.
+ */
+static int libloader_(Main_cacheGet)(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  const int depth = luaL_optint(L, 2, 0);
+  char opts[LOADER_CACHE_OPTLEN];
+  loader_cache_entry e;
+  snprintf(opts, sizeof(opts), "load %d", depth);
+  const int fd = loader_cache_open(filename, torch_Tensor, opts, sizeof(real), &e);
+  if (fd < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+  loader_cache_map *m = malloc(sizeof(loader_cache_map));
+  if (m) {
+    m->len = e.offset + e.size;
+    m->base = mmap(NULL, m->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (!m || m->base == MAP_FAILED) {
+    free(m);
+    lua_pushnil(L);
+    return 1;
+  }
+
+  THStorage *storage = THStorage_(newWithDataAndAllocator)(
+    (real *)((char *)m->base + e.offset), e.size / sizeof(real), &loader_cache_allocator, m);
+  THStorage_(clearFlag)(storage, TH_STORAGE_RESIZABLE);
+  THTensor *tensor = (e.ndim == 3)
+    ? THTensor_(newWithStorage3d)(storage, 0, e.C, e.H*e.W, e.H, e.W, e.W, 1)
+    : THTensor_(newWithStorage2d)(storage, 0, e.H, e.W, e.W, 1);
+  THStorage_(free)(storage);
+  luaT_pushudata(L, tensor, torch_Tensor);
+  return 1;
+}
+
+/* cachePut(filename, depth, tensor): cache the image.load result of
+ * filename, an HxW or CxHxW tensor.
+ */
+static int libloader_(Main_cachePut)(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  const int depth = luaL_optint(L, 2, 0);
+  THTensor *tensor = luaT_checkudata(L, 3, torch_Tensor);
+  char opts[LOADER_CACHE_OPTLEN];
+  const int ndim = tensor->nDimension;
+  if (ndim != 2 && ndim != 3) {
+    return 0;
+  }
+  snprintf(opts, sizeof(opts), "load %d", depth);
+  THTensor *tensorc = THTensor_(newContiguous)(tensor);
+  loader_cache_write(filename, torch_Tensor, opts, sizeof(real), ndim,
+                     ndim == 3 ? tensor->size[0] : 1, tensor->size[ndim-2],
+                     tensor->size[ndim-1], NULL, THTensor_(data)(tensorc));
+  THTensor_(free)(tensorc);
+  return 0;
+}
+
+static const luaL_Reg libloader_(Main__)[] =
+{
+  {"loadBatch", libloader_(Main_loadBatch)},
+  {"loadTransformed", libloader_(Main_loadTransformed)},
+  {"cacheGet", libloader_(Main_cacheGet)},
+  {"cachePut", libloader_(Main_cachePut)},
+  {"prefetcher", libloader_(Main_prefetcher)},
+  {"next", libloader_(Main_next)},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int libloader_(Main_init)(lua_State *L)
+{
+  luaT_pushmetatable(L, torch_Tensor);
+  luaT_registeratname(L, libloader_(Main__), "libloader");
+  return 1;
+}
+
+#endif
@@ -26,8 +26,13 @@ static int libpng_(Main_load)(lua_State *L)
   FILE* fp;
   libpng_inmem_buffer inmem = {0};    /* source memory (if loading from memory) */
   libpng_errmsg errmsg;
+  image_norm_opts normopts;
+  image_norm norm;
+  image_limits limits;
 
   const int load_from_file = luaL_checkint(L, 1);
+  image_norm_check(L, 3, &normopts);
+  image_limits_check(L, 3, &limits);
 
   if (load_from_file == 1){
     const char *file_name = luaL_checkstring(L, 2);
@@ -43,6 +48,8 @@ static int libpng_(Main_load)(lua_State *L)
   } else {
     /* We're loading from a ByteTensor */
     THByteTensor *src = luaT_checkudata(L, 2, "torch.ByteTensor");
+    luaL_argcheck(L, src->nDimension == 1 && THByteTensor_isContiguous(src), 2,
+                  "expecting a contiguous 1D ByteTensor");
     inmem.buffer = THByteTensor_data(src);
     inmem.length = src->size[0];
     inmem.offset = 8;
@@ -113,6 +120,16 @@ static int libpng_(Main_load)(lua_State *L)
     luaL_error(L, "[read_png_file] Unknown color space");
   }
 
+  /* fail fast on images over the limits, before any allocation */
+  const char *over = image_limits_exceeded(&limits, width, height, depth, sizeof(real));
+  if (over) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    if (fp) {
+      fclose(fp);
+    }
+    luaL_error(L, "[read_png] " IMAGE_LIMITS_ERR_MSG, (long)width, (long)height, over);
+  }
+
   if (bit_depth < 8) {
     png_set_strip_16(png_ptr);
   }
@@ -129,52 +146,61 @@ static int libpng_(Main_load)(lua_State *L)
   }
 
   /* alloc tensor */
-  THTensor *tensor = THTensor_(newWithSize3d)(depth, height, width);
+  const int hwc = normopts.hwc;
+  THTensor *tensor = hwc ? THTensor_(newWithSize3d)(height, width, depth)
+                         : THTensor_(newWithSize3d)(depth, height, width);
   real *tensor_data = THTensor_(data)(tensor);
+  const int normalized =
+    image_norm_plan(&normopts, depth, (bit_depth == 16) ? 65535 : 255, &norm);
 
-  /* alloc data in lib format */
+  /* alloc data in lib format: 8-bit HxWxC ByteTensors are read in place */
+#if defined(TH_REAL_IS_BYTE)
+  const int direct = hwc && !normalized &&
+    png_get_rowbytes(png_ptr,info_ptr) == (png_size_t)width*depth;
+#else
+  const int direct = 0;
+#endif
   row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
   int y;
   for (y=0; y<height; y++)
-    row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr,info_ptr));
+    row_pointers[y] = direct ? (png_byte*)tensor_data + (size_t)y*width*depth
+                             : (png_byte*) malloc(png_get_rowbytes(png_ptr,info_ptr));
 
   /* read image in */
   png_read_image(png_ptr, row_pointers);
 
   /* convert image to dest tensor */
+  const int bytes = (bit_depth == 16) ? 2 : 1;
   int x,k;
-  if ((bit_depth == 16) && (sizeof(real) > 1)) {
-    for (k=0; k<depth; k++) {
-      for (y=0; y<height; y++) {
-	png_byte* row = row_pointers[y];
-	for (x=0; x<width; x++) {
-	  // PNG is big-endian
-	  int val = ((int)row[(x*depth+k)*2] << 8) + row[(x*depth+k)*2+1];
-	  *tensor_data++ = (real)val;
+  if (direct) {
+    /* already there */
+  } else if (hwc && normalized) {
+    for (y=0; y<height; y++) {
+      png_byte* row = row_pointers[y];
+      for (x=0; x<width; x++) {
+	for (k=0; k<depth; k++) {
+	  const png_byte *s = row + (x*depth+norm.src[k])*bytes;
+	  int val = (bytes == 2) ? ((int)s[0] << 8) + s[1] : s[0];
+	  *tensor_data++ = val * (real)norm.scale[k] + (real)norm.bias[k];
 	}
       }
     }
-  } else {
-    int stride = 1;
-    if (bit_depth == 16) {
-      /* PNG has 16 bit color depth, but the tensor type is byte. */
-      stride = 2;
+  } else if (hwc) {
+    for (y=0; y<height; y++) {
+      image_(unpack)(tensor_data + (long)y*width*depth, 0, row_pointers[y],
+                     (long)width*depth, 1, bytes, NULL);
     }
-    for (k=0; k<depth; k++) {
-      for (y=0; y<height; y++) {
-	png_byte* row = row_pointers[y];
-	for (x=0; x<width; x++) {
-	  *tensor_data++ = (real)row[(x*depth+k)*stride];
-	  //png_byte val = row[x*depth+k];
-	  //THTensor_(set3d)(tensor, k, y, x, (real)val);
-	}
-      }
+  } else {
+    /* PNG is big-endian; ByteTensors keep the high byte of 16-bit samples */
+    for (y=0; y<height; y++) {
+      image_(unpack)(tensor_data + (long)y*width, (long)height*width, row_pointers[y],
+                     width, depth, bytes, normalized ? &norm : NULL);
     }
   }
 
 
   /* cleanup heap allocation */
-  for (y=0; y<height; y++)
+  for (y=0; y<height && !direct; y++)
     free(row_pointers[y]);
   free(row_pointers);
 
@@ -194,8 +220,9 @@ static int libpng_(Main_load)(lua_State *L)
     bit_depth = 8;
   }
   lua_pushnumber(L, bit_depth);
+  lua_pushboolean(L, normalized);
 
-  return 2;
+  return 3;
 }
 
 
@@ -204,6 +231,9 @@ static int libpng_(Main_save)(lua_State *L)
   THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
   const char *file_name = luaL_checkstring(L, 1);
   const int save_to_file = luaL_checkint(L, 3);
+  const int hwc = lua_toboolean(L, 5);
+  image_quant quant;
+  image_quant *q = image_quant_check(L, 6, 255, &quant);
   
   struct libpng_inmem_write_struct _inmem;
  
@@ -229,9 +259,9 @@ static int libpng_(Main_save)(lua_State *L)
   }
   
   if (tensorc->nDimension == 3) {
-    depth = tensorc->size[0];
-    height = tensorc->size[1];
-    width = tensorc->size[2];
+    depth = tensorc->size[hwc ? 2 : 0];
+    height = tensorc->size[hwc ? 0 : 1];
+    width = tensorc->size[hwc ? 1 : 2];
   } else if (tensorc->nDimension == 2) {
     depth = 1;
     height = tensorc->size[0];
@@ -285,21 +315,42 @@ static int libpng_(Main_save)(lua_State *L)
 
   png_write_info(png_ptr, info_ptr);
 
-  /* convert tensor to 8bit bytes */
+  /* convert tensor to 8bit bytes: HxWxC ByteTensors (and HxW ones)
+   * already are, and are written in place */
+#if defined(TH_REAL_IS_BYTE)
+  const int direct = (hwc || depth == 1);
+#else
+  const int direct = 0;
+#endif
   row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * height);
   int y;
   for (y=0; y<height; y++)
-    row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr,info_ptr));
-
-  /* convert image to dest tensor */
-  int x,k;
-  for (k=0; k<depth; k++) {
+    row_pointers[y] = direct ? (png_byte*)tensor_data + (size_t)y*width*depth
+                             : (png_byte*) malloc(png_get_rowbytes(png_ptr,info_ptr));
+
+  /* convert image to dest tensor, quantizing float and double samples row
+   * by row */
+  if (q) {
+    q->width = width;
+    q->step = (hwc || depth == 1) ? depth : 1;
+  }
+  if (direct) {
+    /* already there */
+  } else if (hwc || depth == 1) {
     for (y=0; y<height; y++) {
-      png_byte* row = row_pointers[y];
-      for (x=0; x<width; x++) {
-        //row[x*depth+k] = (png_byte)THTensor_(get3d)(tensor, k, y, x);
-        row[x*depth+k] = *tensor_data++;
+      if (q) {
+        q->y = y;
+      }
+      image_(pack)(row_pointers[y], tensor_data + (long)y*width*depth, 0,
+                   (long)width*depth, 1, 1, q);
+    }
+  } else {
+    for (y=0; y<height; y++) {
+      if (q) {
+        q->y = y;
       }
+      image_(pack)(row_pointers[y], tensor_data + (long)y*width, (long)height*width,
+                   width, depth, 1, q);
     }
   }
 
@@ -318,7 +369,7 @@ static int libpng_(Main_save)(lua_State *L)
   png_destroy_write_struct(&png_ptr, &info_ptr);
 
   /* cleanup heap allocation */
-  for (y=0; y<height; y++)
+  for (y=0; y<height && !direct; y++)
     free(row_pointers[y]);
   free(row_pointers);
 
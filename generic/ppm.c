@@ -2,161 +2,366 @@
 #define TH_GENERIC_FILE "generic/ppm.c"
 #else
 
+/* Raise the Lua error matching a ppm_read_header() failure. */
+static void libppm_(Main_headerError)(lua_State *L, ppm_reader *rd, int res, int magic)
+{
+  ppm_reader_close(rd);
+  if (res == PPM_UNSUPPORTED) {
+    luaL_error(L, "unsupported magic number: P%c", magic);
+  }
+  luaL_error(L, "corrupted file");
+}
+
 static int libppm_(Main_size)(lua_State *L)
 {
   const char *filename = luaL_checkstring(L, 1);
-  FILE* fp = fopen ( filename, "r" );
-  if ( !fp ) {
+  ppm_reader rd;
+  ppm_header hdr;
+  if ( !ppm_reader_open(&rd, filename) ) {
     luaL_error(L, "cannot open file <%s> for reading", filename);
   }
 
-  long W,H,C;
-  char p,n;
-
-  // magic number
-  p = (char)getc(fp);
-  if ( p != 'P' ) {
-    W = H = 0;
-    fclose(fp);
-    luaL_error(L, "corrupted file");
+  int res = ppm_read_header(&rd, &hdr);
+  if (res != PPM_OK) {
+    libppm_(Main_headerError)(L, &rd, res, hdr.magic);
   }
 
-  n = (char)getc(fp);
+  ppm_reader_close(&rd);
 
-  // Dimensions
-  W = ppm_get_long(fp);
-  H = ppm_get_long(fp);
+  lua_pushnumber(L, hdr.C);
+  lua_pushnumber(L, hdr.H);
+  lua_pushnumber(L, hdr.W);
 
-  if ( n=='3' || n == '6') {
-    C = 3;
-  } else if ( n=='2' || n=='5' ) {
-    C = 1;
-  } else {
-    W=H=C=0;
-    fclose ( fp );
-    luaL_error(L, "unsupported magic number: P%c", n);
+  return 3;
+}
+
+/* Scale a sample to the tensor's range. ByteTensors always hold 8-bit
+ * samples; other types keep the file's values, up to maxval D.
+ */
+static inline real libppm_(Main_sample)(long c, long D)
+{
+#if defined(TH_REAL_IS_BYTE)
+  if (D != 255) {
+    return (real)(c >= D ? 255 : 255*c / D);
   }
+#endif
+  return (real)c;
+}
 
-  fclose(fp);
+/* Convert packed samples (as stored in the file) to a CxHxW tensor. */
+static void libppm_(Main_unpack)(real *data, const unsigned char *r, long C, long N, int bpc, long D)
+{
+#if defined(TH_REAL_IS_BYTE)
+  long i,k;
+  if (D != 255) {
+    const long stride = C*bpc;
+    for (k=0; k<C; k++) {
+      real *d = data + k*N;
+      const unsigned char *s = r + k*bpc;
+      for (i=0; i<N; i++) {
+        // 16-bit samples are big-endian
+        long val = (bpc == 1) ? s[i*stride] : (s[i*stride] << 8) | s[i*stride+1];
+        d[i] = libppm_(Main_sample)(val, D);
+      }
+    }
+    return;
+  }
+#endif
+  image_(unpack)(data, N, r, N, C, bpc, NULL);
+}
 
-  lua_pushnumber(L, C);
-  lua_pushnumber(L, H);
-  lua_pushnumber(L, W);
+/* Scan ASCII samples straight into a CxHxW tensor. */
+static int libppm_(Main_scan)(ppm_reader *rd, real *data, long C, long N, long D)
+{
+  long i,k,c;
+  for (i=0; i<N; i++) {
+    for (k=0; k<C; k++) {
+      c = ppm_get_long(rd);
+      if (c < 0) {
+        return 0;
+      }
+      data[k*N+i] = libppm_(Main_sample)(c, D);
+    }
+  }
+  return 1;
+}
 
-  return 3;
+/* Convert one PFM row (file order) to row y of a CxHxW tensor. */
+static void libppm_(Main_unpackFloatRow)(real *data, const unsigned char *r,
+                                         long C, long H, long W, long y, int swap)
+{
+  long x,k;
+  const long N = H*W;
+#if defined(TH_REAL_IS_FLOAT)
+  if (C == 1 && !swap) { /* special-case for speed */
+    memcpy(data + y*W, r, W*sizeof(float));
+    return;
+  }
+#endif
+  for (k=0; k<C; k++) {
+    real *d = data + k*N + y*W;
+    const unsigned char *s = r + 4*k;
+    for (x=0; x<W; x++) {
+      float f = ppm_get_float(s + 4*C*x, swap);
+#if defined(TH_REAL_IS_BYTE)
+      // ByteTensors hold 8-bit samples
+      f = f <= 0 ? 0 : (f >= 1 ? 255 : f*255 + 0.5f);
+#endif
+      d[x] = (real)f;
+    }
+  }
 }
 
-static int libppm_(Main_load)(lua_State *L)
+/* Convert all PFM rows, flipping them: files store the bottom row first. */
+static void libppm_(Main_unpackFloat)(real *data, const unsigned char *r,
+                                      long C, long H, long W, int swap)
 {
-  const char *filename = luaL_checkstring(L, 1);
-  FILE* fp = fopen ( filename, "r" );
-  if ( !fp ) {
-    luaL_error(L, "cannot open file <%s> for reading", filename);
+  long y;
+  for (y=0; y<H; y++) {
+    libppm_(Main_unpackFloatRow)(data, r + 4*C*W*y, C, H, W, H-1-y, swap);
   }
+}
 
-  long W,H,C;
-  char p,n;
-  int D, bps, bpc;
+/* Convert samples in the layout of the file's header. */
+static void libppm_(Main_unpackAny)(real *data, const unsigned char *r, ppm_header *hdr)
+{
+  if (hdr->pfm) {
+    libppm_(Main_unpackFloat)(data, r, hdr->C, hdr->H, hdr->W, hdr->swap);
+  } else {
+    libppm_(Main_unpack)(data, r, hdr->C, hdr->H*hdr->W, hdr->D > 255 ? 2 : 1, hdr->D);
+  }
+}
 
-  // magic number
-  p = (char)getc(fp);
-  if ( p != 'P' ) {
-    W = H = 0;
-    fclose(fp);
-    luaL_error(L, "corrupted file");
+/* Read the samples following a header into a CxHxW tensor. Binary samples
+ * are staged in *buf, grown to *cap bytes as needed, so that callers reading
+ * several images can keep the buffer from one image to the next.
+ */
+static int libppm_(Main_readSamples)(ppm_reader *rd, ppm_header *hdr, real *data,
+                                     unsigned char **buf, size_t *cap)
+{
+  const long W = hdr->W, H = hdr->H, C = hdr->C, D = hdr->D;
+  const size_t s = W*H*C*ppm_sample_bytes(hdr);
+  int ok = 1;
+
+  if ( hdr->ascii ) {
+    return libppm_(Main_scan)(rd, data, C, H*W, D);
+  }
+  if ( !rd->fp && rd->fd < 0 ) {
+    // in memory: convert straight from the source bytes
+    if (rd->len - rd->pos < s) {
+      return 0;
+    }
+    libppm_(Main_unpackAny)(data, rd->buf + rd->pos, hdr);
+    rd->pos += s;
+    return 1;
+  }
+#if defined(TH_REAL_IS_BYTE)
+  if (C == 1 && D == 255 && !hdr->pfm) {
+    // samples are already in the tensor's layout
+    return ppm_read(rd, data, s);
   }
+#endif
 
-  n = (char)getc(fp);
+  // float maps can be large: go through one row at a time
+  const size_t n = hdr->pfm ? 4*C*W : s;
+  if (n > *cap) {
+    unsigned char *b = realloc(*buf, n);
+    if (!b) {
+      return 0;
+    }
+    *buf = b;
+    *cap = n;
+  }
+  if ( hdr->pfm ) {
+    long y;
+    for (y=0; y<H && ok; y++) {
+      ok = ppm_read(rd, *buf, n);
+      if (ok) {
+        libppm_(Main_unpackFloatRow)(data, *buf, C, H, W, H-1-y, hdr->swap);
+      }
+    }
+  } else {
+    ok = ppm_read(rd, *buf, n);
+    if (ok) {
+      libppm_(Main_unpackAny)(data, *buf, hdr);
+    }
+  }
+  return ok;
+}
 
-  // Dimensions
-  W = ppm_get_long(fp);
-  H = ppm_get_long(fp);
+/* The header of the samples of hdr read as a single plane: that is, in
+ * the file's interleaved order, for HxWxC tensors.
+ */
+static ppm_header libppm_(Main_interleaved)(const ppm_header *hdr)
+{
+  ppm_header flat = *hdr;
+  flat.W = hdr->W * hdr->C;
+  flat.C = 1;
+  return flat;
+}
 
-  // Max color value
-  D = ppm_get_long(fp);
+/* Map a binary file instead of reading it. 8-bit PGM files loaded into a
+ * ByteTensor share the (private, copy-on-write) mapping without any copy,
+ * as do all 8-bit files loaded as HxWxC (hwc) ByteTensors; everything else
+ * is converted in a single pass straight out of the mapping.
+ */
+static int libppm_(Main_loadMapped)(lua_State *L, const char *filename,
+                                    long offset, ppm_header *hdr, size_t s, int hwc)
+{
+  const long W = hdr->W, H = hdr->H, C = hdr->C, D = hdr->D;
+  THByteStorage *map = THByteStorage_newWithMapping(filename, 0, 0);
+  if (map->size < offset + s) {
+    THByteStorage_free(map);
+    luaL_error(L, "corrupted file or read error");
+  }
 
-  // Either 8 or 16 bits per pixel
-  bps = 8;
-  if (D > 255) {
-     bps = 16;
+  THTensor *tensor = NULL;
+#if defined(TH_REAL_IS_BYTE)
+  if (hwc && D == 255 && !hdr->pfm) {
+    tensor = THTensor_(newWithStorage3d)(map, offset, H, W*C, W, C, C, 1);
+  } else if (C == 1 && D == 255 && !hdr->pfm) {
+    tensor = THTensor_(newWithStorage3d)(map, offset, 1, H*W, H, W, W, 1);
   }
-  bpc = bps / 8;
+#endif
+  if (!tensor && hwc) {
+    ppm_header flat = libppm_(Main_interleaved)(hdr);
+    tensor = THTensor_(newWithSize3d)(H,W,C);
+    libppm_(Main_unpackAny)(THTensor_(data)(tensor), map->data + offset, &flat);
+  } else if (!tensor) {
+    tensor = THTensor_(newWithSize3d)(C,H,W);
+    libppm_(Main_unpackAny)(THTensor_(data)(tensor), map->data + offset, hdr);
+  }
+  THByteStorage_free(map);
 
-  //printf("Loading PPM\nMAGIC: %c%c\nWidth: %ld, Height: %ld\nChannels: %d, Bits-per-pixel: %d\n", p, n, W, H, D, bps);
+  luaT_pushudata(L, tensor, torch_Tensor);
+  lua_pushnumber(L, D);
+  return 2;
+}
 
-  // load data
-  int ok = 1;
-  size_t s;
-  unsigned char *r = NULL;
-  if ( n=='6' ) {
-    C = 3;
-    s = W*H*C*bpc;
-    r = malloc(s);
-    if (fread ( r, 1, s, fp ) < s) ok = 0;
-  } else if ( n=='5' ) {
-    C = 1;
-    s = W*H*C*bpc;
-    r = malloc(s);
-    if (fread ( r, 1, s, fp ) < s) ok = 0;
-  } else if ( n=='3' ) {
-    int c,i;
-    C = 3;
-    s = W*H*C;
-    r = malloc(s);
-    for (i=0; i<s; i++) {
-      if (fscanf ( fp, "%d", &c ) != 1) { ok = 0; break; }
-      r[i] = 255*c / D;
-    }
-  } else if ( n=='2' ) {
-    int c,i;
-    C = 1;
-    s = W*H*C;
-    r = malloc(s);
-    for (i=0; i<s; i++) {
-      if (fscanf ( fp, "%d", &c ) != 1) { ok = 0; break; }
-      r[i] = 255*c / D;
+static int libppm_(Main_load)(lua_State *L)
+{
+  const int load_from_file = luaL_checkint(L, 1);
+  const int hwc = lua_toboolean(L, 4);
+  const char *filename = NULL;
+  int use_mmap = 0;
+  ppm_reader rd;
+  ppm_header hdr;
+  image_limits limits;
+  image_limits_check(L, 5, &limits);
+
+  if (load_from_file == 1) {
+    filename = luaL_checkstring(L, 2);
+    use_mmap = lua_toboolean(L, 3);
+    if ( !ppm_reader_open(&rd, filename) ) {
+      luaL_error(L, "cannot open file <%s> for reading", filename);
     }
   } else {
-    W=H=C=0;
-    fclose ( fp );
-    luaL_error(L, "unsupported magic number: P%c", n);
+    /* We're loading from a ByteTensor */
+    THByteTensor *src = luaT_checkudata(L, 2, "torch.ByteTensor");
+    luaL_argcheck(L, src->nDimension == 1 && THByteTensor_isContiguous(src), 2,
+                  "expecting a contiguous 1D ByteTensor");
+    ppm_reader_init_mem(&rd, THByteTensor_data(src), src->size[0]);
   }
 
-  if (!ok) {
-    fclose ( fp );
-    luaL_error(L, "corrupted file or read error");
+  int res = ppm_read_header(&rd, &hdr);
+  if (res != PPM_OK) {
+    libppm_(Main_headerError)(L, &rd, res, hdr.magic);
+  }
+  const long W = hdr.W, H = hdr.H, C = hdr.C, D = hdr.D;
+  const char *over = image_limits_exceeded(&limits, W, H, C, sizeof(real));
+  if (over) {
+    ppm_reader_close(&rd);
+    luaL_error(L, IMAGE_LIMITS_ERR_MSG, W, H, over);
   }
 
-  // export tensor
-  THTensor *tensor = THTensor_(newWithSize3d)(C,H,W);
-  real *data = THTensor_(data)(tensor);
-  long i,k,j=0;
-  int val;
-  for (i=0; i<W*H; i++) {
-    for (k=0; k<C; k++) {
-       if (bpc == 1) {
-          data[k*H*W+i] = (real)r[j++];
-       } else if (bpc == 2) {
-          val = r[j] | (r[j+1] << 8);
-          j += 2;
-          data[k*H*W+i] = (real)val;
-       }
-    }
+  // binary payloads can be mapped rather than read
+  if ( use_mmap && !hdr.ascii ) {
+    long offset = ppm_tell(&rd);
+    ppm_reader_close(&rd);
+    return libppm_(Main_loadMapped)(L, filename, offset, &hdr,
+                                    W*H*C*ppm_sample_bytes(&hdr), hwc);
   }
 
+  // load data, interleaved samples as a single plane
+  ppm_header flat = hwc ? libppm_(Main_interleaved)(&hdr) : hdr;
+  THTensor *tensor = hwc ? THTensor_(newWithSize3d)(H,W,C) : THTensor_(newWithSize3d)(C,H,W);
+  unsigned char *buf = NULL;
+  size_t cap = 0;
+  int ok = libppm_(Main_readSamples)(&rd, &flat, THTensor_(data)(tensor), &buf, &cap);
+
   // cleanup
-  free(r);
-  fclose(fp);
+  free(buf);
+  ppm_reader_close(&rd);
 
-  // return loaded image
+  if (!ok) {
+    THTensor_(free)(tensor);
+    luaL_error(L, "corrupted file or read error");
+  }
+
+  // return loaded image and its max color value
   luaT_pushudata(L, tensor, torch_Tensor);
-  return 1;
+  lua_pushnumber(L, D);
+  return 2;
+}
+
+/* Read the next image of a stream into a tensor, resized as needed.
+ * Returns nil at the end of the stream.
+ */
+static int libppm_(Main_read)(lua_State *L)
+{
+  ppm_stream *stream = luaT_checkudata(L, 1, "libppm.Stream");
+  THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  ppm_reader *rd = &stream->rd;
+  ppm_header hdr;
+
+  if (rd->fd < 0) {
+    luaL_error(L, "attempt to read from a closed stream");
+  }
+  if (ppm_peek(rd) == EOF) {
+    lua_pushnil(L);
+    return 1;
+  }
+
+  int res = ppm_read_header(rd, &hdr);
+  if (res == PPM_UNSUPPORTED) {
+    luaL_error(L, "unsupported magic number: P%c", hdr.magic);
+  } else if (res != PPM_OK) {
+    luaL_error(L, "corrupted stream");
+  }
+
+  THTensor_(resize3d)(tensor, hdr.C, hdr.H, hdr.W);
+  if (!THTensor_(isContiguous)(tensor)) {
+    luaL_error(L, "destination tensor should be contiguous");
+  }
+  if (!libppm_(Main_readSamples)(rd, &hdr, THTensor_(data)(tensor),
+                                 &stream->buf, &stream->cap)) {
+    luaL_error(L, "corrupted stream or read error");
+  }
+
+  // return the destination and the image's max color value
+  lua_pushvalue(L, 2);
+  lua_pushnumber(L, hdr.D);
+  return 2;
 }
 
 int libppm_(Main_save)(lua_State *L) {
   // get args
   const char *filename = luaL_checkstring(L, 1);
   THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  const int save_to_file = luaL_optint(L, 3, 1);
+  THByteTensor *tensor_dest = NULL;
+  if (save_to_file == 0) {
+    tensor_dest = luaT_checkudata(L, 4, "torch.ByteTensor");
+  }
+  const long D = luaL_optlong(L, 5, 255);
+  const char *format = luaL_optstring(L, 6, "pnm");
+  const int pam = (strcmp(format, "pam") == 0);
+  const int pfm = (strcmp(format, "pfm") == 0);
+  if (D < 1 || D > 65535) {
+    luaL_error(L, "max color value should be between 1 and 65535");
+  }
+  image_quant quant;
+  image_quant *q = image_quant_check(L, 7, D, &quant);
   THTensor *tensorc = THTensor_(newContiguous)(tensor);
   real *data = THTensor_(data)(tensorc);
 
@@ -172,39 +377,98 @@ int libppm_(Main_save)(lua_State *L) {
     W = tensorc->size[1];
   } else {
     C=W=H=0;
+  }
+  if (pam ? C < 1 : (C != 1 && C != 3)) {
+    THTensor_(free)(tensorc);
+    if (pam) {
+      luaL_error(L, "can only export tensor with geometry: HxW or CxHxW");
+    }
     luaL_error(L, "can only export tensor with geometry: HxW or 1xHxW or 3xHxW");
   }
-  N = C*H*W;
-
-  // convert to chars
-  unsigned char *bytes = (unsigned char*)malloc(N);
-  long i,k,j=0;
-  for (i=0; i<W*H; i++) {
-    for (k=0; k<C; k++) {
-      bytes[j++] = (unsigned char)data[k*H*W+i];
+  const int bpc = pfm ? 4 : (D > 255) ? 2 : 1;
+  N = C*H*W*bpc;
+
+  // header: 3 or 1 channel(s), or any depth for PAM
+  char header[128];
+  int hlen;
+  if (pam) {
+    static const char *tupltypes[] = {
+      "GRAYSCALE", "GRAYSCALE_ALPHA", "RGB", "RGB_ALPHA"
+    };
+    hlen = snprintf(header, sizeof(header), "P7\nWIDTH %ld\nHEIGHT %ld\nDEPTH %ld\nMAXVAL %ld\n",
+                    W, H, C, D);
+    if (C <= 4) {
+      hlen += snprintf(header + hlen, sizeof(header) - hlen, "TUPLTYPE %s\n", tupltypes[C-1]);
     }
+    hlen += snprintf(header + hlen, sizeof(header) - hlen, "ENDHDR\n");
+  } else if (pfm) {
+    // a negative scale marks little-endian samples
+    hlen = snprintf(header, sizeof(header), "P%c\n%ld %ld\n-1.0\n",
+                    C == 3 ? 'F' : 'f', W, H);
+  } else {
+    hlen = snprintf(header, sizeof(header), "P%c\n%ld %ld\n%ld\n",
+                    C == 3 ? '6' : '5', W, H, D);
   }
 
-  // open file
-  FILE* fp = fopen(filename, "w");
-  if ( !fp ) {
-    luaL_error(L, "cannot open file <%s> for writing", filename);
+  // open file, or size the destination to hold header and samples
+  FILE *fp = NULL;
+  unsigned char *bytes;
+  if (save_to_file == 1) {
+    fp = fopen(filename, "wb");
+    if ( !fp ) {
+      THTensor_(free)(tensorc);
+      luaL_error(L, "cannot open file <%s> for writing", filename);
+    }
+    bytes = (unsigned char*)malloc(N);
+    if ( !bytes ) {
+      fclose(fp);
+      THTensor_(free)(tensorc);
+      luaL_error(L, "out of memory");
+    }
+  } else {
+    THByteTensor_resize1d(tensor_dest, hlen + N);
+    memcpy(THByteTensor_data(tensor_dest), header, hlen);
+    bytes = THByteTensor_data(tensor_dest) + hlen;
   }
 
-  // write 3 or 1 channel(s) header
-  if (C == 3) {
-    fprintf(fp, "P6\n%ld %ld\n%d\n", W, H, 255);
+  // interleave, one plane at a time
+  long k;
+  const long HW = H*W;
+  if (pfm) {
+    // bottom row first, unscaled except for 8-bit samples
+    const int swap = !ppm_little_endian();
+    long x,y;
+    for (k=0; k<C; k++) {
+      for (y=0; y<H; y++) {
+        const real *d = data + k*HW + (H-1-y)*W;
+        unsigned char *b = bytes + 4*(y*W*C + k);
+        for (x=0; x<W; x++) {
+#if defined(TH_REAL_IS_BYTE)
+          ppm_put_float(b + 4*C*x, d[x] / 255.f, swap);
+#else
+          ppm_put_float(b + 4*C*x, (float)d[x], swap);
+#endif
+        }
+      }
+    }
   } else {
-    fprintf(fp, "P5\n%ld %ld\n%d\n", W, H, 255);
+    // 16-bit samples are big-endian
+    if (q) {
+      q->width = W;
+    }
+    image_(pack)(bytes, data, HW, HW, C, bpc, q);
   }
 
-  // write data
-  fwrite(bytes, 1, N, fp);
+  // write header and data
+  if (fp) {
+    fwrite(header, 1, hlen, fp);
+    fwrite(bytes, 1, N, fp);
+    free(bytes);
+    fclose (fp);
+  }
 
   // cleanup
   THTensor_(free)(tensorc);
-  free(bytes);
-  fclose (fp);
 
   // return result
   return 1;
@@ -215,6 +479,7 @@ static const luaL_Reg libppm_(Main__)[] =
   {"load", libppm_(Main_load)},
   {"save", libppm_(Main_save)},
   {"size", libppm_(Main_size)},
+  {"read", libppm_(Main_read)},
   {NULL, NULL}
 };
 
@@ -0,0 +1,305 @@
+#ifndef TH_GENERIC_FILE
+#define TH_GENERIC_FILE "generic/qoi.c"
+#else
+
+/* Decode the ops following a header straight into a CxHxW tensor. */
+static int libqoi_(Main_decode)(const unsigned char *bytes, size_t len,
+                                const qoi_header *h, real *data)
+{
+  const long N = h->W*h->H;
+  real *d0 = data;
+  real *d1 = data + N;
+  real *d2 = data + 2*N;
+  real *d3 = (h->C == 4) ? data + 3*N : NULL;
+  qoi_rgba index[64];
+  qoi_rgba px = {0, 0, 0, 255};
+  size_t p = QOI_HEADER_SIZE;
+  long i;
+  int run = 0;
+
+  if (len < QOI_HEADER_SIZE + QOI_PADDING) {
+    return 0;
+  }
+  /* ops are at most 5 bytes long, so reading one that starts before the
+   * padding never goes past the end of the buffer */
+  const size_t end = len - QOI_PADDING;
+  memset(index, 0, sizeof(index));
+
+  for (i=0; i<N; i++) {
+    if (run > 0) {
+      run--;
+    } else if (p < end) {
+      const int b1 = bytes[p++];
+      if (b1 == QOI_OP_RGB) {
+        px.r = bytes[p++];
+        px.g = bytes[p++];
+        px.b = bytes[p++];
+      } else if (b1 == QOI_OP_RGBA) {
+        px.r = bytes[p++];
+        px.g = bytes[p++];
+        px.b = bytes[p++];
+        px.a = bytes[p++];
+      } else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+        px = index[b1];
+      } else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+        px.r += ((b1 >> 4) & 0x03) - 2;
+        px.g += ((b1 >> 2) & 0x03) - 2;
+        px.b += ( b1       & 0x03) - 2;
+      } else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+        const int b2 = bytes[p++];
+        const int vg = (b1 & 0x3f) - 32;
+        px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+        px.g += vg;
+        px.b += vg - 8 +  (b2       & 0x0f);
+      } else {
+        run = (b1 & 0x3f);
+      }
+      index[qoi_hash(px)] = px;
+    } else {
+      return 0;
+    }
+
+    d0[i] = (real)px.r;
+    d1[i] = (real)px.g;
+    d2[i] = (real)px.b;
+    if (d3) {
+      d3[i] = (real)px.a;
+    }
+  }
+  return 1;
+}
+
+/* Encode a CxHxW tensor (C = 1, 3 or 4; gray is stored as RGB) into out,
+ * which must hold QOI_HEADER_SIZE + W*H*(channels+1) + QOI_PADDING bytes.
+ * Returns the encoded size.
+ */
+static size_t libqoi_(Main_encode)(const real *data, long C, long H, long W,
+                                   unsigned char *out)
+{
+  const long N = W*H;
+  const real *d0 = data;
+  const real *d1 = (C >= 3) ? data + N : data;
+  const real *d2 = (C >= 3) ? data + 2*N : data;
+  const real *d3 = (C == 4) ? data + 3*N : NULL;
+  qoi_rgba index[64];
+  qoi_rgba px, prev = {0, 0, 0, 255};
+  size_t p = 0;
+  long i;
+  int run = 0;
+
+  memcpy(out, "qoif", 4);
+  qoi_put32(out + 4, W);
+  qoi_put32(out + 8, H);
+  out[12] = (C == 4) ? 4 : 3;
+  out[13] = 0;
+  p = QOI_HEADER_SIZE;
+  memset(index, 0, sizeof(index));
+
+  px.a = 255;
+  for (i=0; i<N; i++) {
+    px.r = (unsigned char)d0[i];
+    px.g = (unsigned char)d1[i];
+    px.b = (unsigned char)d2[i];
+    if (d3) {
+      px.a = (unsigned char)d3[i];
+    }
+
+    if (qoi_equal(px, prev)) {
+      run++;
+      if (run == 62 || i == N-1) {
+        out[p++] = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      out[p++] = QOI_OP_RUN | (run - 1);
+      run = 0;
+    }
+
+    const int h = qoi_hash(px);
+    if (qoi_equal(index[h], px)) {
+      out[p++] = QOI_OP_INDEX | h;
+    } else {
+      index[h] = px;
+      if (px.a == prev.a) {
+        const signed char vr = px.r - prev.r;
+        const signed char vg = px.g - prev.g;
+        const signed char vb = px.b - prev.b;
+        const signed char vg_r = vr - vg;
+        const signed char vg_b = vb - vg;
+        if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+          out[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+        } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                   vg_b > -9 && vg_b < 8) {
+          out[p++] = QOI_OP_LUMA | (vg + 32);
+          out[p++] = (vg_r + 8) << 4 | (vg_b + 8);
+        } else {
+          out[p++] = QOI_OP_RGB;
+          out[p++] = px.r;
+          out[p++] = px.g;
+          out[p++] = px.b;
+        }
+      } else {
+        out[p++] = QOI_OP_RGBA;
+        out[p++] = px.r;
+        out[p++] = px.g;
+        out[p++] = px.b;
+        out[p++] = px.a;
+      }
+    }
+    prev = px;
+  }
+
+  memcpy(out + p, qoi_padding, QOI_PADDING);
+  return p + QOI_PADDING;
+}
+
+static int libqoi_(Main_size)(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  unsigned char bytes[QOI_HEADER_SIZE];
+  qoi_header hdr;
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    luaL_error(L, "cannot open file <%s> for reading", filename);
+  }
+  size_t n = fread(bytes, 1, QOI_HEADER_SIZE, fp);
+  fclose(fp);
+  if (!qoi_read_header(bytes, n, &hdr)) {
+    luaL_error(L, "corrupted file");
+  }
+
+  lua_pushnumber(L, hdr.C);
+  lua_pushnumber(L, hdr.H);
+  lua_pushnumber(L, hdr.W);
+  return 3;
+}
+
+static int libqoi_(Main_load)(lua_State *L)
+{
+  const int load_from_file = luaL_checkint(L, 1);
+  unsigned char *bytes;
+  unsigned char *owned = NULL;
+  size_t len;
+  qoi_header hdr;
+  image_limits limits;
+
+  image_limits_check(L, 3, &limits);
+
+  if (load_from_file == 1) {
+    const char *filename = luaL_checkstring(L, 2);
+    bytes = owned = qoi_read_file(filename, &len);
+    if (!bytes) {
+      luaL_error(L, "cannot read file <%s>", filename);
+    }
+  } else {
+    /* We're loading from a ByteTensor */
+    THByteTensor *src = luaT_checkudata(L, 2, "torch.ByteTensor");
+    luaL_argcheck(L, src->nDimension == 1 && THByteTensor_isContiguous(src), 2,
+                  "expecting a contiguous 1D ByteTensor");
+    bytes = THByteTensor_data(src);
+    len = src->size[0];
+  }
+
+  if (!qoi_read_header(bytes, len, &hdr)) {
+    free(owned);
+    luaL_error(L, "corrupted file");
+  }
+  const char *over = image_limits_exceeded(&limits, hdr.W, hdr.H, hdr.C, sizeof(real));
+  if (over) {
+    free(owned);
+    luaL_error(L, IMAGE_LIMITS_ERR_MSG, hdr.W, hdr.H, over);
+  }
+
+  THTensor *tensor = THTensor_(newWithSize3d)(hdr.C, hdr.H, hdr.W);
+  int ok = libqoi_(Main_decode)(bytes, len, &hdr, THTensor_(data)(tensor));
+  free(owned);
+  if (!ok) {
+    THTensor_(free)(tensor);
+    luaL_error(L, "corrupted file");
+  }
+
+  luaT_pushudata(L, tensor, torch_Tensor);
+  return 1;
+}
+
+int libqoi_(Main_save)(lua_State *L) {
+  const char *filename = luaL_checkstring(L, 1);
+  THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  const int save_to_file = luaL_optint(L, 3, 1);
+  THByteTensor *tensor_dest = NULL;
+  if (save_to_file == 0) {
+    tensor_dest = luaT_checkudata(L, 4, "torch.ByteTensor");
+  }
+
+  long C, H, W;
+  if (tensor->nDimension == 3) {
+    C = tensor->size[0];
+    H = tensor->size[1];
+    W = tensor->size[2];
+  } else if (tensor->nDimension == 2) {
+    C = 1;
+    H = tensor->size[0];
+    W = tensor->size[1];
+  } else {
+    C = W = H = 0;
+  }
+  if (C != 1 && C != 3 && C != 4) {
+    luaL_error(L, "can only export tensor with geometry: HxW, 1xHxW, 3xHxW or 4xHxW");
+  }
+  if (W < 1 || H < 1 || H >= QOI_PIXELS_MAX / W) {
+    luaL_error(L, "image size not supported");
+  }
+
+  THTensor *tensorc = THTensor_(newContiguous)(tensor);
+  const size_t max_size = QOI_HEADER_SIZE + W*H*((C == 4 ? 4 : 3) + 1) + QOI_PADDING;
+  size_t size;
+  if (save_to_file == 1) {
+    unsigned char *bytes = malloc(max_size);
+    if (!bytes) {
+      THTensor_(free)(tensorc);
+      luaL_error(L, "out of memory");
+    }
+    size = libqoi_(Main_encode)(THTensor_(data)(tensorc), C, H, W, bytes);
+    THTensor_(free)(tensorc);
+
+    FILE *fp = fopen(filename, "wb");
+    if (!fp) {
+      free(bytes);
+      luaL_error(L, "cannot open file <%s> for writing", filename);
+    }
+    size_t n = fwrite(bytes, 1, size, fp);
+    fclose(fp);
+    free(bytes);
+    if (n != size) {
+      luaL_error(L, "write error");
+    }
+  } else {
+    // encode in place, then trim to the encoded size
+    THByteTensor_resize1d(tensor_dest, max_size);
+    size = libqoi_(Main_encode)(THTensor_(data)(tensorc), C, H, W,
+                                THByteTensor_data(tensor_dest));
+    THByteTensor_resize1d(tensor_dest, size);
+    THTensor_(free)(tensorc);
+  }
+
+  return 1;
+}
+
+static const luaL_Reg libqoi_(Main__)[] =
+{
+  {"load", libqoi_(Main_load)},
+  {"save", libqoi_(Main_save)},
+  {"size", libqoi_(Main_size)},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int libqoi_(Main_init)(lua_State *L)
+{
+  luaT_pushmetatable(L, torch_Tensor);
+  luaT_registeratname(L, libqoi_(Main__), "libqoi");
+  return 1;
+}
+
+#endif
@@ -0,0 +1,90 @@
+#ifndef TH_GENERIC_FILE
+#define TH_GENERIC_FILE "generic/shmcache.c"
+#else
+
+/* get(cache, filename, depth): the image.load result of filename if it is
+ * in the cache, as a copy-on-write view on the shared memory, or nil.
+ */
+static int libshmcache_(Main_get)(lua_State *L)
+{
+  shmcache *c = shmcache_check(L, 1);
+  const char *filename = luaL_checkstring(L, 2);
+  const int depth = luaL_optint(L, 3, 0);
+  shmcache_header *h = shmcache_head(c->map);
+  char key[SHMCACHE_KEYLEN];
+  const size_t len = shmcache_key(filename, torch_Tensor, depth, key);
+  const shmcache_entry *e = len
+    ? shmcache_find(c->map, key, len, shmcache_hash(key, len)) : NULL;
+  if (!e || e->elsize != sizeof(real)) {
+    __atomic_add_fetch(&h->misses, 1, __ATOMIC_RELAXED);
+    lua_pushnil(L);
+    return 1;
+  }
+  shmcache_view *view;
+  const long n = (long)e->C * e->H * e->W;
+  real *data = shmcache_map_view(c->map, e, shmcache_align(sizeof(shmcache_entry) + len),
+                                 n * sizeof(real), &view);
+  if (!data) {
+    __atomic_add_fetch(&h->misses, 1, __ATOMIC_RELAXED);
+    lua_pushnil(L);
+    return 1;
+  }
+  __atomic_add_fetch(&h->hits, 1, __ATOMIC_RELAXED);
+
+  THStorage *storage = THStorage_(newWithDataAndAllocator)(
+    data, n, &shmcache_allocator, view);
+  THStorage_(clearFlag)(storage, TH_STORAGE_RESIZABLE);
+  THTensor *tensor = (e->ndim == 3)
+    ? THTensor_(newWithStorage3d)(storage, 0, e->C, e->H*e->W, e->H, e->W, e->W, 1)
+    : THTensor_(newWithStorage2d)(storage, 0, e->H, e->W, e->W, 1);
+  THStorage_(free)(storage);
+  luaT_pushudata(L, tensor, torch_Tensor);
+  return 1;
+}
+
+/* put(cache, filename, depth, tensor): cache the image.load result of
+ * filename, an HxW or CxHxW tensor. It is copied to the shared memory.
+ */
+static int libshmcache_(Main_put)(lua_State *L)
+{
+  shmcache *c = shmcache_check(L, 1);
+  const char *filename = luaL_checkstring(L, 2);
+  const int depth = luaL_optint(L, 3, 0);
+  THTensor *tensor = luaT_checkudata(L, 4, torch_Tensor);
+  char key[SHMCACHE_KEYLEN];
+  const int ndim = tensor->nDimension;
+  if (ndim != 2 && ndim != 3) {
+    return 0;
+  }
+  const size_t len = shmcache_key(filename, torch_Tensor, depth, key);
+  if (!len) {
+    return 0;
+  }
+  const uint64_t hash = shmcache_hash(key, len);
+  if (shmcache_find(c->map, key, len, hash)) {
+    return 0;
+  }
+  THTensor *tensorc = THTensor_(newContiguous)(tensor);
+  shmcache_insert(c->map, key, len, hash, sizeof(real), ndim,
+                  ndim == 3 ? tensorc->size[0] : 1,
+                  tensorc->size[ndim-2], tensorc->size[ndim-1],
+                  THTensor_(data)(tensorc));
+  THTensor_(free)(tensorc);
+  return 0;
+}
+
+static const luaL_Reg libshmcache_(Main__)[] =
+{
+  {"get", libshmcache_(Main_get)},
+  {"put", libshmcache_(Main_put)},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int libshmcache_(Main_init)(lua_State *L)
+{
+  luaT_pushmetatable(L, torch_Tensor);
+  luaT_registeratname(L, libshmcache_(Main__), "libshmcache");
+  return 1;
+}
+
+#endif
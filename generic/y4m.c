@@ -0,0 +1,282 @@
+#ifndef TH_GENERIC_FILE
+#define TH_GENERIC_FILE "generic/y4m.c"
+#else
+
+/* ByteTensors hold 8-bit samples, other types samples in [0, 1]. */
+static inline real liby4m_(Main_fromByte)(unsigned char c)
+{
+#if defined(TH_REAL_IS_BYTE)
+  return (real)c;
+#else
+  return (real)(c / 255.);
+#endif
+}
+
+/* Convert a value in [0, 255] (possibly out of gamut) to a sample. */
+static inline real liby4m_(Main_fromFloat)(float v)
+{
+#if defined(TH_REAL_IS_BYTE)
+  return (real)y4m_clamp(v);
+#else
+  return (real)(v <= 0 ? 0 : (v >= 255 ? 1 : v / 255.f));
+#endif
+}
+
+/* Convert a sample to a value in [0, 255]. */
+static inline float liby4m_(Main_toFloat)(real v)
+{
+#if defined(TH_REAL_IS_BYTE)
+  return (float)v;
+#else
+  return (float)v * 255.f;
+#endif
+}
+
+static void liby4m_(Main_checkContiguous)(lua_State *L, THTensor *tensor)
+{
+  if (!THTensor_(isContiguous)(tensor)) {
+    luaL_error(L, "destination tensor should be contiguous");
+  }
+}
+
+/* Read one plane into a contiguous tensor, resized to hxw. */
+static int liby4m_(Main_readPlane)(lua_State *L, y4m_reader *r, THTensor *tensor,
+                                   long h, long w)
+{
+  THTensor_(resize2d)(tensor, h, w);
+  liby4m_(Main_checkContiguous)(L, tensor);
+#if defined(TH_REAL_IS_BYTE)
+  return y4m_read(r, THTensor_(data)(tensor), h*w);
+#else
+  long i;
+  real *data = THTensor_(data)(tensor);
+  unsigned char *b = y4m_staging(r, h*w);
+  if (!b || !y4m_read(r, b, h*w)) {
+    return 0;
+  }
+  for (i=0; i<h*w; i++) {
+    data[i] = liby4m_(Main_fromByte)(b[i]);
+  }
+  return 1;
+#endif
+}
+
+/* Skip the next frame header, returning 0 (and pushing nil) at the end. */
+static int liby4m_(Main_nextFrame)(lua_State *L, y4m_reader *r)
+{
+  int corrupted;
+  if (r->fd < 0) {
+    luaL_error(L, "attempt to read from a closed stream");
+  }
+  if (!y4m_read_frame_header(r, &corrupted)) {
+    if (corrupted) {
+      luaL_error(L, "corrupted stream");
+    }
+    lua_pushnil(L);
+    return 0;
+  }
+  return 1;
+}
+
+/* read(reader, y, u, v): read the next frame's planes into y (HxW), u and v
+ * (subsampled), resized as needed. Returns y, u, v (u, v are nil for mono
+ * streams), or nil at the end of the stream.
+ */
+static int liby4m_(Main_read)(lua_State *L)
+{
+  y4m_reader *r = luaT_checkudata(L, 1, "liby4m.Reader");
+  THTensor *y = luaT_checkudata(L, 2, torch_Tensor);
+  THTensor *u = luaT_checkudata(L, 3, torch_Tensor);
+  THTensor *v = luaT_checkudata(L, 4, torch_Tensor);
+  const int mono = (r->hdr.chroma == Y4M_MONO);
+  long cw, ch;
+  y4m_chroma_size(&r->hdr, &cw, &ch);
+
+  if (!liby4m_(Main_nextFrame)(L, r)) {
+    return 1;
+  }
+  int ok = liby4m_(Main_readPlane)(L, r, y, r->hdr.H, r->hdr.W);
+  if (ok && !mono) {
+    ok = liby4m_(Main_readPlane)(L, r, u, ch, cw) &&
+         liby4m_(Main_readPlane)(L, r, v, ch, cw);
+  }
+  if (!ok) {
+    luaL_error(L, "corrupted stream or read error");
+  }
+
+  lua_pushvalue(L, 2);
+  if (mono) {
+    return 1;
+  }
+  lua_pushvalue(L, 3);
+  lua_pushvalue(L, 4);
+  return 3;
+}
+
+/* readRGB(reader, out): read the next frame and convert it (BT.601) to RGB
+ * in a single pass, into out (3xHxW, resized as needed). Returns out, or nil
+ * at the end of the stream.
+ */
+static int liby4m_(Main_readRGB)(lua_State *L)
+{
+  y4m_reader *r = luaT_checkudata(L, 1, "liby4m.Reader");
+  THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  const long W = r->hdr.W, H = r->hdr.H;
+  const int sx = (r->hdr.chroma == Y4M_420 || r->hdr.chroma == Y4M_422);
+  const int sy = (r->hdr.chroma == Y4M_420);
+  const int mono = (r->hdr.chroma == Y4M_MONO);
+  long cw, ch, i, j;
+  y4m_chroma_size(&r->hdr, &cw, &ch);
+  y4m_coefs c;
+  y4m_get_coefs(&c, r->hdr.full);
+
+  if (!liby4m_(Main_nextFrame)(L, r)) {
+    return 1;
+  }
+  const size_t n = W*H + 2*cw*ch;
+  unsigned char *b = y4m_staging(r, n);
+  if (!b || !y4m_read(r, b, n)) {
+    luaL_error(L, "corrupted stream or read error");
+  }
+
+  THTensor_(resize3d)(tensor, 3, H, W);
+  liby4m_(Main_checkContiguous)(L, tensor);
+  real *dr = THTensor_(data)(tensor);
+  real *dg = dr + W*H;
+  real *db = dg + W*H;
+  for (i=0; i<H; i++) {
+    const unsigned char *py = b + i*W;
+    const unsigned char *pu = b + W*H + (i >> sy)*cw;
+    const unsigned char *pv = pu + cw*ch;
+    for (j=0; j<W; j++) {
+      const float yy = c.ky * (py[j] - c.y0);
+      const float uu = mono ? 0 : pu[j >> sx] - 128.f;
+      const float vv = mono ? 0 : pv[j >> sx] - 128.f;
+      dr[i*W+j] = liby4m_(Main_fromFloat)(yy + c.rv*vv);
+      dg[i*W+j] = liby4m_(Main_fromFloat)(yy - c.gu*uu - c.gv*vv);
+      db[i*W+j] = liby4m_(Main_fromFloat)(yy + c.bu*uu);
+    }
+  }
+
+  lua_pushvalue(L, 2);
+  return 1;
+}
+
+/* Copy one plane, of size hxw, into the frame being written. */
+static void liby4m_(Main_writePlane)(lua_State *L, unsigned char *dst, THTensor *tensor,
+                                     long h, long w)
+{
+  long i;
+  if (tensor->nDimension != 2 || tensor->size[0] != h || tensor->size[1] != w) {
+    luaL_error(L, "expecting a %ldx%ld plane", h, w);
+  }
+  THTensor *tensorc = THTensor_(newContiguous)(tensor);
+  real *data = THTensor_(data)(tensorc);
+  for (i=0; i<h*w; i++) {
+    dst[i] = y4m_clamp(liby4m_(Main_toFloat)(data[i]));
+  }
+  THTensor_(free)(tensorc);
+}
+
+/* write(writer, y, [u, v]): write a frame from its planes. */
+static int liby4m_(Main_write)(lua_State *L)
+{
+  y4m_writer *w = luaT_checkudata(L, 1, "liby4m.Writer");
+  const long W = w->hdr.W, H = w->hdr.H;
+  long cw, ch;
+  y4m_chroma_size(&w->hdr, &cw, &ch);
+  if (w->fd < 0) {
+    luaL_error(L, "attempt to write to a closed stream");
+  }
+
+  unsigned char *b = w->frame + 6;
+  liby4m_(Main_writePlane)(L, b, luaT_checkudata(L, 2, torch_Tensor), H, W);
+  if (w->hdr.chroma != Y4M_MONO) {
+    liby4m_(Main_writePlane)(L, b + W*H, luaT_checkudata(L, 3, torch_Tensor), ch, cw);
+    liby4m_(Main_writePlane)(L, b + W*H + cw*ch, luaT_checkudata(L, 4, torch_Tensor), ch, cw);
+  }
+  if (!y4m_write_fd(w->fd, w->frame, w->size)) {
+    luaL_error(L, "write error");
+  }
+  return 0;
+}
+
+/* writeRGB(writer, rgb): convert a 3xHxW image (BT.601) and write it as a
+ * frame. Chroma is averaged over each subsampled block.
+ */
+static int liby4m_(Main_writeRGB)(lua_State *L)
+{
+  y4m_writer *w = luaT_checkudata(L, 1, "liby4m.Writer");
+  THTensor *tensor = luaT_checkudata(L, 2, torch_Tensor);
+  const long W = w->hdr.W, H = w->hdr.H;
+  const int sx = (w->hdr.chroma == Y4M_420 || w->hdr.chroma == Y4M_422);
+  const int sy = (w->hdr.chroma == Y4M_420);
+  long cw, ch, i, j, x, y;
+  y4m_chroma_size(&w->hdr, &cw, &ch);
+  y4m_coefs c;
+  y4m_get_coefs(&c, w->hdr.full);
+  if (w->fd < 0) {
+    luaL_error(L, "attempt to write to a closed stream");
+  }
+  if (tensor->nDimension != 3 || tensor->size[0] != 3 ||
+      tensor->size[1] != H || tensor->size[2] != W) {
+    luaL_error(L, "expecting a 3x%ldx%ld image", H, W);
+  }
+
+  THTensor *tensorc = THTensor_(newContiguous)(tensor);
+  const real *dr = THTensor_(data)(tensorc);
+  const real *dg = dr + W*H;
+  const real *db = dg + W*H;
+  unsigned char *py = w->frame + 6;
+  unsigned char *pu = py + W*H;
+  unsigned char *pv = pu + cw*ch;
+
+  for (i=0; i<W*H; i++) {
+    const float l = 0.299f*liby4m_(Main_toFloat)(dr[i]) +
+                    0.587f*liby4m_(Main_toFloat)(dg[i]) +
+                    0.114f*liby4m_(Main_toFloat)(db[i]);
+    py[i] = y4m_clamp(c.y0 + l / c.ky);
+  }
+  for (i=0; i<ch; i++) {
+    for (j=0; j<cw; j++) {
+      float sr = 0, sg = 0, sb = 0;
+      int n = 0;
+      for (y=i<<sy; y<((i+1)<<sy) && y<H; y++) {
+        for (x=j<<sx; x<((j+1)<<sx) && x<W; x++) {
+          sr += liby4m_(Main_toFloat)(dr[y*W+x]);
+          sg += liby4m_(Main_toFloat)(dg[y*W+x]);
+          sb += liby4m_(Main_toFloat)(db[y*W+x]);
+          n++;
+        }
+      }
+      sr /= n; sg /= n; sb /= n;
+      const float l = 0.299f*sr + 0.587f*sg + 0.114f*sb;
+      pu[i*cw+j] = y4m_clamp(128 + (sb - l) / c.bu);
+      pv[i*cw+j] = y4m_clamp(128 + (sr - l) / c.rv);
+    }
+  }
+  THTensor_(free)(tensorc);
+
+  if (!y4m_write_fd(w->fd, w->frame, w->size)) {
+    luaL_error(L, "write error");
+  }
+  return 0;
+}
+
+static const luaL_Reg liby4m_(Main__)[] =
+{
+  {"read", liby4m_(Main_read)},
+  {"readRGB", liby4m_(Main_readRGB)},
+  {"write", liby4m_(Main_write)},
+  {"writeRGB", liby4m_(Main_writeRGB)},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int liby4m_(Main_init)(lua_State *L)
+{
+  luaT_pushmetatable(L, torch_Tensor);
+  luaT_registeratname(L, liby4m_(Main__), "liby4m");
+  return 1;
+}
+
+#endif
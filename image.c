@@ -1,6 +1,11 @@
 
 #include <TH.h>
 #include <luaT.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #if LUA_VERSION_NUM >= 503
 #define luaL_checklong(L,n)     ((long)luaL_checkinteger(L, (n)))
@@ -26,6 +31,131 @@
 #include "generic/image.c"
 #include "THGenerateAllTypes.h"
 
+/* The format of an encoded image, as a file extension, from its magic
+ * number; NULL if unknown.
+ */
+#define IMAGE_MAGIC_LEN 8
+
+static const char *image_sniff(const unsigned char *p, size_t len)
+{
+  if (len >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff) {
+    // many 4th bytes are valid
+    return "jpg";
+  }
+  if (len >= 8 && !memcmp(p, "\x89PNG", 4)) {
+    return "png";
+  }
+  if (len >= 2 && p[0] == 'P') {
+    switch (p[1]) {
+      case '2': case '5': return "pgm";
+      case '3': case '6': return "ppm";
+      case '7': return "pam";
+      case 'F': case 'f': return "pfm";
+    }
+  }
+  if (len >= 4 && !memcmp(p, "qoif", 4)) {
+    return "qoi";
+  }
+  if (len >= 2 && p[0] == 'B' && p[1] == 'M') {
+    return "bmp";
+  }
+  return NULL;
+}
+
+static int image_pushformat(lua_State *L, const unsigned char *p, size_t len)
+{
+  const char *format = image_sniff(p, len);
+  if (format) {
+    lua_pushstring(L, format);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+/* detectFormat(source): the format of a file (from its first bytes) or of
+ * an encoded image held in a ByteTensor, or nil.
+ */
+static int image_detectFormat(lua_State *L)
+{
+  THByteTensor *src = luaT_toudata(L, 1, "torch.ByteTensor");
+  if (src) {
+    if (src->nDimension != 1 || !THByteTensor_isContiguous(src)) {
+      return luaL_error(L, "expecting a contiguous 1D ByteTensor");
+    }
+    return image_pushformat(L, THByteTensor_data(src), src->size[0]);
+  }
+
+  const char *filename = luaL_checkstring(L, 1);
+  unsigned char magic[IMAGE_MAGIC_LEN];
+  ssize_t n;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return luaL_error(L, "%s: %s", filename, strerror(errno));
+  }
+  while ((n = read(fd, magic, sizeof(magic))) < 0 && errno == EINTR) {
+  }
+  close(fd);
+  return image_pushformat(L, magic, n > 0 ? n : 0);
+}
+
+/* readFile(filename): the whole file in a ByteTensor, with one open and
+ * (for regular files) one read, and its format, as with detectFormat.
+ */
+static int image_readFile(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  struct stat st;
+  size_t len = 0;
+  int err = 0;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    return luaL_error(L, "%s: %s", filename, strerror(errno));
+  }
+
+  THByteTensor *bytes = THByteTensor_new();
+  luaT_pushudata(L, bytes, "torch.ByteTensor");
+  // pipes and the like are read until the end, growing the tensor
+  const int regular = (fstat(fd, &st) == 0 && S_ISREG(st.st_mode));
+  size_t cap = regular ? (size_t)st.st_size : 65536;
+  if (cap > 0) {
+    THByteTensor_resize1d(bytes, cap);
+  }
+  while (cap > 0) {
+    if (len == cap) {
+      if (regular) {
+        break;
+      }
+      cap *= 2;
+      THByteTensor_resize1d(bytes, cap);
+    }
+    const ssize_t n = read(fd, THByteTensor_data(bytes) + len, cap - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      err = (n < 0) ? errno : 0;
+      break;
+    }
+    len += n;
+  }
+  close(fd);
+  if (err) {
+    return luaL_error(L, "%s: %s", filename, strerror(err));
+  }
+  if (len != cap) {
+    THByteTensor_resize1d(bytes, len);
+  }
+  return 1 + image_pushformat(L, len ? THByteTensor_data(bytes) : NULL, len);
+}
+
+static const luaL_Reg image__[] =
+{
+  {"detectFormat", image_detectFormat},
+  {"readFile", image_readFile},
+  {NULL, NULL}
+};
+
 DLL_EXPORT int luaopen_libimage(lua_State *L)
 {
   image_FloatMain_init(L);
@@ -35,6 +165,7 @@ DLL_EXPORT int luaopen_libimage(lua_State *L)
   lua_newtable(L);
   lua_pushvalue(L, -1);
   lua_setglobal(L, "image");
+  luaT_setfuncs(L, image__, 0);
 
   lua_newtable(L);
   luaT_setfuncs(L, image_DoubleMain__, 0);
@@ -0,0 +1,490 @@
+
+/* realpath and the struct stat timestamps under -std=c99 */
+#define _GNU_SOURCE
+
+#include <TH.h>
+#include <luaT.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define torch_(NAME) TH_CONCAT_3(torch_, Real, NAME)
+#define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
+#define libimagecache_(NAME) TH_CONCAT_3(libimagecache_, Real, NAME)
+
+/* Decoded images kept in memory, shared by all the Lua states of the
+ * process (e.g. those of a pool of threads). Entries are tensors keyed by
+ * strings: the identity of a file or the digest of an encoded image, plus
+ * the load options. Entries of encoded images also keep their bytes, which
+ * lookups compare: digests can be made to collide, and the images decoded
+ * may come from untrusted sources. The cache is split into IMAGECACHE_SHARDS shards, by
+ * key hash, each with its lock, hash table, LRU list and share of the
+ * budget, so that lookups from many threads rarely wait on each other.
+ */
+#define IMAGECACHE_SHARDS 16
+
+typedef struct imagecache_entry {
+  char *key;
+  size_t keylen;
+  uint64_t hash;
+  unsigned char *blob;  /* the encoded image (NULL for files) */
+  size_t bloblen;
+  void *tensor;         /* a THTensor, of type */
+  const char *type;
+  void (*retain)(void *);
+  void *(*clone)(void *);
+  void (*free)(void *);
+  size_t bytes;
+  struct imagecache_entry *chain;       /* in the bucket */
+  struct imagecache_entry *prev, *next; /* in the LRU list, newest first */
+} imagecache_entry;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  imagecache_entry **buckets;
+  size_t nbuckets;
+  size_t count;
+  imagecache_entry *newest, *oldest;
+  size_t bytes;
+  size_t budget;
+  uint64_t hits, misses, evictions;
+} imagecache_shard;
+
+static imagecache_shard imagecache_shards[IMAGECACHE_SHARDS];
+static pthread_once_t imagecache_once = PTHREAD_ONCE_INIT;
+
+static void imagecache_init(void)
+{
+  int s;
+  for (s=0; s<IMAGECACHE_SHARDS; s++) {
+    memset(&imagecache_shards[s], 0, sizeof(imagecache_shard));
+    pthread_mutex_init(&imagecache_shards[s].mutex, NULL);
+  }
+}
+
+/* FNV-1a */
+static uint64_t imagecache_hash(const char *key, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i=0; i<len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+static inline uint64_t imagecache_mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+/* A 128-bit digest of an encoded image, 8 bytes at a time: two lanes with
+ * different multipliers, so that a collision needs both to collide.
+ */
+static void imagecache_digest(const unsigned char *p, size_t len, uint64_t *d)
+{
+  uint64_t a = 0x9e3779b97f4a7c15ULL ^ len;
+  uint64_t b = 0xc2b2ae3d27d4eb4fULL + len;
+  size_t i;
+  for (i=0; i+8<=len; i+=8) {
+    uint64_t v;
+    memcpy(&v, p + i, 8);
+    a = (a ^ v) * 0x100000001b3ULL;
+    a = (a << 31) | (a >> 33);
+    b = (b + v) * 0xff51afd7ed558ccdULL;
+    b = (b << 27) | (b >> 37);
+  }
+  uint64_t v = 0;
+  if (i < len) {
+    memcpy(&v, p + i, len - i);
+  }
+  d[0] = imagecache_mix(a ^ v);
+  d[1] = imagecache_mix(b + v + d[0]);
+}
+
+static imagecache_shard *imagecache_shard_of(uint64_t hash)
+{
+  return &imagecache_shards[(hash >> 60) % IMAGECACHE_SHARDS];
+}
+
+static imagecache_entry **imagecache_find(imagecache_shard *s, const char *key, size_t len,
+                                          uint64_t hash)
+{
+  imagecache_entry **e;
+  if (!s->nbuckets) {
+    return NULL;
+  }
+  for (e=&s->buckets[hash & (s->nbuckets - 1)]; *e; e=&(*e)->chain) {
+    if ((*e)->hash == hash && (*e)->keylen == len && !memcmp((*e)->key, key, len)) {
+      return e;
+    }
+  }
+  return e;
+}
+
+/* Whether e was put with the encoded image blob (NULL for files). */
+static int imagecache_same_blob(const imagecache_entry *e, const unsigned char *blob,
+                                size_t len)
+{
+  if (!e->blob || !blob) {
+    return !e->blob && !blob;
+  }
+  return e->bloblen == len && !memcmp(e->blob, blob, len);
+}
+
+static void imagecache_lru_remove(imagecache_shard *s, imagecache_entry *e)
+{
+  if (e->prev) {
+    e->prev->next = e->next;
+  } else {
+    s->newest = e->next;
+  }
+  if (e->next) {
+    e->next->prev = e->prev;
+  } else {
+    s->oldest = e->prev;
+  }
+}
+
+static void imagecache_lru_push(imagecache_shard *s, imagecache_entry *e)
+{
+  e->prev = NULL;
+  e->next = s->newest;
+  if (s->newest) {
+    s->newest->prev = e;
+  } else {
+    s->oldest = e;
+  }
+  s->newest = e;
+}
+
+/* Unlink entry *link from its shard and release it. Tensors still held by
+ * Lua stay alive until collected.
+ */
+static void imagecache_drop(imagecache_shard *s, imagecache_entry **link)
+{
+  imagecache_entry *e = *link;
+  *link = e->chain;
+  imagecache_lru_remove(s, e);
+  s->count--;
+  s->bytes -= e->bytes;
+  e->free(e->tensor);
+  free(e->key);
+  free(e->blob);
+  free(e);
+}
+
+static void imagecache_evict(imagecache_shard *s)
+{
+  while (s->oldest && s->bytes > s->budget) {
+    const imagecache_entry *e = s->oldest;
+    imagecache_drop(s, imagecache_find(s, e->key, e->keylen, e->hash));
+    s->evictions++;
+  }
+}
+
+static int imagecache_grow(imagecache_shard *s)
+{
+  const size_t n = s->nbuckets ? 2*s->nbuckets : 64;
+  imagecache_entry **buckets = calloc(n, sizeof(imagecache_entry *));
+  size_t b;
+  if (!buckets) {
+    return 0;
+  }
+  for (b=0; b<s->nbuckets; b++) {
+    imagecache_entry *e = s->buckets[b], *next;
+    for (; e; e=next) {
+      next = e->chain;
+      e->chain = buckets[e->hash & (n - 1)];
+      buckets[e->hash & (n - 1)] = e;
+    }
+  }
+  free(s->buckets);
+  s->buckets = buckets;
+  s->nbuckets = n;
+  return 1;
+}
+
+/* Insert tensor (retained here) under key, with a copy of the encoded image
+ * it was decoded from, if any, evicting the oldest entries to stay within
+ * the budget. Images larger than a shard are not cached.
+ */
+static void imagecache_put(const char *key, size_t len, const unsigned char *blob,
+                           size_t bloblen, void *tensor, const char *type, size_t bytes,
+                           void (*retain)(void *), void *(*clone)(void *),
+                           void (*release)(void *))
+{
+  const uint64_t hash = imagecache_hash(key, len);
+  imagecache_shard *s = imagecache_shard_of(hash);
+  imagecache_entry **link;
+  pthread_mutex_lock(&s->mutex);
+  bytes += len + bloblen + sizeof(imagecache_entry);
+  if (bytes > s->budget || (s->count >= s->nbuckets && !imagecache_grow(s))) {
+    pthread_mutex_unlock(&s->mutex);
+    return;
+  }
+  link = imagecache_find(s, key, len, hash);
+  if (*link) {
+    imagecache_drop(s, link);
+  }
+  imagecache_entry *e = malloc(sizeof(imagecache_entry));
+  char *copy = malloc(len + 1);
+  unsigned char *blobcopy = blob ? malloc(bloblen ? bloblen : 1) : NULL;
+  if (!e || !copy || (blob && !blobcopy)) {
+    free(e);
+    free(copy);
+    free(blobcopy);
+    pthread_mutex_unlock(&s->mutex);
+    return;
+  }
+  memcpy(copy, key, len);
+  copy[len] = 0;
+  if (blob) {
+    memcpy(blobcopy, blob, bloblen);
+  }
+  e->key = copy;
+  e->keylen = len;
+  e->hash = hash;
+  e->blob = blobcopy;
+  e->bloblen = bloblen;
+  e->tensor = tensor;
+  e->type = type;
+  e->retain = retain;
+  e->clone = clone;
+  e->free = release;
+  e->bytes = bytes;
+  retain(tensor);
+  e->chain = *link;
+  *link = e;
+  imagecache_lru_push(s, e);
+  s->count++;
+  s->bytes += bytes;
+  imagecache_evict(s);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static int imagecache_enabled(void)
+{
+  imagecache_shard *s = &imagecache_shards[0];
+  pthread_mutex_lock(&s->mutex);
+  const int on = s->budget > 0;
+  pthread_mutex_unlock(&s->mutex);
+  return on;
+}
+
+#include "generic/imagecache.c"
+#include "THGenerateAllTypes.h"
+
+/* get(key, [bytes]): a copy of the cached tensor, or nil. Entries put with
+ * the encoded image, a ByteTensor, are only hits for the same bytes. Hits
+ * move to the front of the LRU. The copy is made outside the shard's lock,
+ * on a reference taken under it.
+ */
+static int libimagecache_get(lua_State *L)
+{
+  size_t len;
+  const char *key = luaL_checklstring(L, 1, &len);
+  THByteTensor *bytes = lua_isnoneornil(L, 2) ? NULL
+                                              : luaT_checkudata(L, 2, "torch.ByteTensor");
+  THByteTensor *bytesc = bytes ? THByteTensor_newContiguous(bytes) : NULL;
+  const unsigned char *blob = bytesc ? THByteTensor_data(bytesc) : NULL;
+  const size_t bloblen = bytesc ? (size_t)THByteTensor_nElement(bytesc) : 0;
+  const uint64_t hash = imagecache_hash(key, len);
+  imagecache_shard *s = imagecache_shard_of(hash);
+  imagecache_entry **link;
+  void *tensor = NULL;
+  void *(*clone)(void *) = NULL;
+  void (*release)(void *) = NULL;
+  const char *type = NULL;
+  pthread_mutex_lock(&s->mutex);
+  link = imagecache_find(s, key, len, hash);
+  if (link && *link && imagecache_same_blob(*link, blob, bloblen)) {
+    imagecache_entry *e = *link;
+    imagecache_lru_remove(s, e);
+    imagecache_lru_push(s, e);
+    e->retain(e->tensor);
+    tensor = e->tensor;
+    clone = e->clone;
+    release = e->free;
+    type = e->type;
+    s->hits++;
+  } else {
+    s->misses++;
+  }
+  pthread_mutex_unlock(&s->mutex);
+  if (bytesc) {
+    THByteTensor_free(bytesc);
+  }
+  if (tensor) {
+    void *copy = clone(tensor);
+    release(tensor);
+    luaT_pushudata(L, copy, type);
+  } else {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+/* fileKey(filename, opts): the key of a file loaded with opts, from its
+ * canonical path, modification time, size and inode; nil when the cache is
+ * off or the file cannot be found.
+ */
+static int libimagecache_fileKey(lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  const char *opts = luaL_checkstring(L, 2);
+  char real[PATH_MAX], id[128];
+  struct stat st;
+  if (!imagecache_enabled() || !realpath(filename, real) || stat(real, &st) < 0) {
+    lua_pushnil(L);
+    return 1;
+  }
+#if defined(__APPLE__)
+  const struct timespec mtime = st.st_mtimespec;
+#else
+  const struct timespec mtime = st.st_mtim;
+#endif
+  snprintf(id, sizeof(id), "%lld.%09ld %lld %llu", (long long)mtime.tv_sec,
+           (long)mtime.tv_nsec, (long long)st.st_size, (unsigned long long)st.st_ino);
+  lua_pushfstring(L, "file %s %s %s", opts, id, real);
+  return 1;
+}
+
+/* blobKey(bytes, opts): the key of an encoded image in a ByteTensor, from a
+ * digest of its contents; nil when the cache is off.
+ */
+static int libimagecache_blobKey(lua_State *L)
+{
+  THByteTensor *bytes = luaT_checkudata(L, 1, "torch.ByteTensor");
+  const char *opts = luaL_checkstring(L, 2);
+  char key[64];
+  uint64_t d[2];
+  if (!imagecache_enabled()) {
+    lua_pushnil(L);
+    return 1;
+  }
+  THByteTensor *bytesc = THByteTensor_newContiguous(bytes);
+  imagecache_digest(THByteTensor_data(bytesc), THByteTensor_nElement(bytesc), d);
+  snprintf(key, sizeof(key), "%016llx%016llx %ld", (unsigned long long)d[0],
+           (unsigned long long)d[1], (long)THByteTensor_nElement(bytesc));
+  THByteTensor_free(bytesc);
+  lua_pushfstring(L, "blob %s %s", opts, key);
+  return 1;
+}
+
+/* configure(bytes): empty the cache and set its budget; 0 turns it off. */
+static int libimagecache_configure(lua_State *L)
+{
+  const double bytes = luaL_checknumber(L, 1);
+  int k;
+  if (bytes < 0) {
+    luaL_error(L, "the cache budget should be positive");
+  }
+  for (k=0; k<IMAGECACHE_SHARDS; k++) {
+    imagecache_shard *s = &imagecache_shards[k];
+    pthread_mutex_lock(&s->mutex);
+    s->budget = 0;
+    imagecache_evict(s);
+    s->budget = (size_t)(bytes / IMAGECACHE_SHARDS);
+    s->hits = s->misses = s->evictions = 0;
+    pthread_mutex_unlock(&s->mutex);
+  }
+  return 0;
+}
+
+/* clear(): drop all the entries, keeping the budget and counters. */
+static int libimagecache_clear(lua_State *L)
+{
+  int k;
+  for (k=0; k<IMAGECACHE_SHARDS; k++) {
+    imagecache_shard *s = &imagecache_shards[k];
+    pthread_mutex_lock(&s->mutex);
+    while (s->oldest) {
+      const imagecache_entry *e = s->oldest;
+      imagecache_drop(s, imagecache_find(s, e->key, e->keylen, e->hash));
+    }
+    pthread_mutex_unlock(&s->mutex);
+  }
+  return 0;
+}
+
+/* stats(): a table of counters, summed over the shards. */
+static int libimagecache_stats(lua_State *L)
+{
+  uint64_t hits = 0, misses = 0, evictions = 0, entries = 0, bytes = 0, budget = 0;
+  int k;
+  for (k=0; k<IMAGECACHE_SHARDS; k++) {
+    imagecache_shard *s = &imagecache_shards[k];
+    pthread_mutex_lock(&s->mutex);
+    hits += s->hits;
+    misses += s->misses;
+    evictions += s->evictions;
+    entries += s->count;
+    bytes += s->bytes;
+    budget += s->budget;
+    pthread_mutex_unlock(&s->mutex);
+  }
+  lua_newtable(L);
+  lua_pushnumber(L, (lua_Number)hits);
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number)misses);
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, (lua_Number)evictions);
+  lua_setfield(L, -2, "evictions");
+  lua_pushnumber(L, (lua_Number)entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, (lua_Number)bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, (lua_Number)budget);
+  lua_setfield(L, -2, "capacity");
+  return 1;
+}
+
+static const luaL_Reg libimagecache__[] =
+{
+  {"get", libimagecache_get},
+  {"fileKey", libimagecache_fileKey},
+  {"blobKey", libimagecache_blobKey},
+  {"configure", libimagecache_configure},
+  {"clear", libimagecache_clear},
+  {"stats", libimagecache_stats},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int luaopen_libimagecache(lua_State *L)
+{
+  pthread_once(&imagecache_once, imagecache_init);
+
+  libimagecache_FloatMain_init(L);
+  libimagecache_DoubleMain_init(L);
+  libimagecache_ByteMain_init(L);
+
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, "libimagecache");
+  luaT_setfuncs(L, libimagecache__, 0);
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libimagecache_DoubleMain__, 0);
+  lua_setfield(L, -2, "double");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libimagecache_FloatMain__, 0);
+  lua_setfield(L, -2, "float");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libimagecache_ByteMain__, 0);
+  lua_setfield(L, -2, "byte");
+
+  return 1;
+}
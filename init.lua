@@ -36,13 +36,6 @@ require 'libimage'
 
 local fpath = require 'sys.fpath'
 
-local startswith = function(str, prefix)
-  return string.find(str, prefix, 1, true) == 1
-end
-
-local magicJPG = string.char(0xff, 0xd8, 0xff)
-local magicPNG = string.char(0x89, 0x50, 0x4e, 0x47)
-
 ----------------------------------------------------------------------
 -- include unit test function
 --
@@ -64,6 +57,157 @@ local template = function(type)
    end
 end
 
+-- loaders take either (depth, tensortype) or a table of options
+local function loadArgs(depth, tensortype, opts)
+   if type(depth) == 'table' then
+      opts = depth
+      depth, tensortype = opts.depth, opts.type
+   end
+   return depth, tensortype, opts or {}
+end
+
+-- set by image.setLimits: {maxPixels=, maxBytes=, downscale=}
+local limits = {}
+
+local function checkLimits(opts, fname)
+   for _, k in ipairs({'maxPixels', 'maxBytes'}) do
+      if opts[k] ~= nil and (type(opts[k]) ~= 'number' or opts[k] < 0) then
+         dok.error(k .. ' must be a positive number (0 for no limit)', fname)
+      end
+   end
+end
+
+-- dopts with the limits of image.setLimits where it sets none of its own,
+-- as the decoders take them (see limits.c)
+local function limited(dopts)
+   if next(limits) == nil then
+      return dopts
+   end
+   local t = {}
+   for k, v in pairs(dopts or {}) do
+      t[k] = v
+   end
+   for k, v in pairs(limits) do
+      if t[k] == nil then
+         t[k] = v
+      end
+   end
+   return t
+end
+
+-- whether a cached image is within the limits of image.setLimits: the
+-- caches hold images decoded without any, so their hits are checked as the
+-- decoders check headers (see limits.c), and those over them are misses
+local function withinLimits(img)
+   local n = img:dim()
+   local pixels = img:size(n) * img:size(n - 1)
+   return not ((limits.maxPixels or 0) > 0 and pixels > limits.maxPixels) and
+          not ((limits.maxBytes or 0) > 0 and
+               img:nElement() * img:elementSize() > limits.maxBytes)
+end
+
+-- whether an image decoded from format within the limits of image.setLimits
+-- is the plain image the caches hold: with downscale, JPEG images may not be
+local function cacheable(format)
+   return not (limits.downscale and format == 'jpg')
+end
+
+-- the mean/std/order, layout and limits options of the loaders, checked,
+-- as the decoders take them (see normalize.c and limits.c), or nil without
+-- any
+local function decodeArgs(opts, depth, tensortype, fname)
+   local layout = opts.layout or 'chw'
+   if layout ~= 'chw' and layout ~= 'hwc' then
+      dok.error("layout must be 'chw' or 'hwc'", fname)
+   end
+   local dopts = {depth = depth, hwc = (layout == 'hwc')}
+   if opts.maxPixels ~= nil or opts.maxBytes ~= nil or opts.downscale ~= nil then
+      checkLimits(opts, fname)
+      dopts.limited = true
+      dopts.maxPixels, dopts.maxBytes = opts.maxPixels, opts.maxBytes
+      dopts.downscale = opts.downscale
+   end
+   if opts.mean == nil and opts.std == nil and (opts.order or 'rgb') == 'rgb' then
+      return (dopts.hwc or dopts.limited) and dopts or nil
+   end
+   if tensortype == 'byte' then
+      dok.error('mean, std and order need a float or double type', fname)
+   end
+   if opts.order ~= nil and opts.order ~= 'rgb' and opts.order ~= 'bgr' then
+      dok.error("order must be 'rgb' or 'bgr'", fname)
+   end
+   local function list(v, default, name)
+      if v == nil then
+         v = {default}
+      elseif type(v) == 'number' then
+         v = {v}
+      end
+      if type(v) ~= 'table' or #v == 0 or #v > 4 then
+         dok.error(name .. ' must be a number or a list of 1 to 4 numbers', fname)
+      end
+      for _, x in ipairs(v) do
+         if type(x) ~= 'number' or (name == 'std' and x == 0) then
+            dok.error('invalid ' .. name, fname)
+         end
+      end
+      return v
+   end
+   dopts.mean = list(opts.mean, 0, 'mean')
+   dopts.std = list(opts.std, 1, 'std')
+   dopts.bgr = (opts.order == 'bgr')
+   return dopts
+end
+
+-- normalizes a [0,1] CxHxW image as the decoders do (see normalize.c),
+-- into a new tensor
+local function normalize(img, dopts)
+   local out = img.new():resizeAs(img)
+   if img:nDimension() == 2 then
+      return out:copy(img):add(-dopts.mean[1]):div(dopts.std[1])
+   end
+   local planes = img:size(1)
+   for k = 1, planes do
+      local from = k
+      if dopts.bgr and planes >= 3 and k <= 3 then
+         from = 4 - k
+      end
+      local mean = dopts.mean[#dopts.mean == 1 and 1 or k] or 0
+      local std = dopts.std[#dopts.std == 1 and 1 or k] or 1
+      out[k]:copy(img[from]):add(-mean):div(std)
+   end
+   return out
+end
+
+-- applies the options of decodeArgs to a [0,1] CxHxW image, when the
+-- decoder could not: normalization, then layout
+local function finish(img, dopts)
+   if dopts.mean then
+      img = normalize(img, dopts)
+   end
+   if dopts.hwc and img:nDimension() == 3 then
+      img = img:permute(2, 3, 1):contiguous()
+   end
+   return img
+end
+
+-- a CxHxW view of an image decoded as HxWxC, for the conversions of the
+-- loaders; finish() turns it back
+local function chwView(img, dopts)
+   if dopts and dopts.hwc then
+      return img:permute(3, 1, 2)
+   end
+   return img
+end
+
+-- the HxWxC layout option of the savers; other tensors are CxHxW
+local function saveLayout(opts, fname)
+   local layout = (type(opts) == 'table' and opts.layout) or 'chw'
+   if layout ~= 'chw' and layout ~= 'hwc' then
+      dok.error("layout must be 'chw' or 'hwc'", fname)
+   end
+   return layout == 'hwc'
+end
+
 ----------------------------------------------------------------------
 -- save/load in multiple formats
 --
@@ -105,46 +249,111 @@ local function todepth(img, depth)
    return img
 end
 
-local function isPNG(magicTensor)
-    local pngMagic = torch.ByteTensor({0x89,0x50,0x4e,0x47})
-    return torch.all(torch.eq(magicTensor, pngMagic))
+-- decompressors by format, as found by image.detectFormat (libimage)
+local decompressors = {
+   jpg = 'decompressJPG',
+   png = 'decompressPNG',
+   ppm = 'decompressPPM',
+   pgm = 'decompressPPM',
+   pam = 'decompressPPM',
+   pfm = 'decompressPPM',
+   qoi = 'decompressQOI',
+   bmp = 'decompressBMP',
+}
+
+-- decodes bytes, an encoded image of format: JPEGs go through a file when
+-- libjpeg was built without jpeg_mem_src, filename if they were read from
+-- one, a temporary file otherwise
+local function decompressFormat(bytes, format, filename, ...)
+   if format == 'jpg' and xlua.require 'libjpeg' and not libjpeg.hasMemSrc then
+      if filename then
+         return image.loadJPG(filename, ...)
+      end
+      local tmp = os.tmpname()
+      local f = torch.DiskFile(tmp, 'w'):binary()
+      f:writeByte(bytes:clone():storage())
+      f:close()
+      local ok, img = pcall(image.loadJPG, tmp, ...)
+      os.remove(tmp)
+      if not ok then
+         error(img, 0)
+      end
+      return img
+   end
+   return image[decompressors[format]](bytes, ...)
 end
 
-local function isJPG(magicTensor)
-    -- There are many valid 4th bytes, so only check the first 3 bytes.
-    -- libjpeg should support most if not all of these:
-    -- source: http://filesignatures.net/?page=all&order=SIGNATURE&alpha=J
-    local jpgMagic = torch.ByteTensor({0xff, 0xd8, 0xff})
-    return torch.all(torch.eq(magicTensor, jpgMagic))
+-- the image.cache key of a file name or encoded ByteTensor loaded with
+-- depth and tensortype, or nil when the cache is off
+local function memCacheKey(source, depth, tensortype)
+   require 'libimagecache'
+   local opts = (depth or 0) .. ' ' .. torch.typename(template(tensortype))
+   if type(source) == 'string' then
+      return libimagecache.fileKey(source, opts)
+   end
+   return libimagecache.blobKey(source, opts)
 end
 
+-- the decompressors applying the options of decodeArgs themselves
+local decodesOptions = {
+   jpg = true,
+   png = true,
+   ppm = true,
+   pgm = true,
+   pam = true,
+   pfm = true,
+   qoi = true,
+   bmp = true,
+}
+
 local function decompress(tensor, depth, tensortype)
     if torch.typename(tensor) ~= 'torch.ByteTensor' then
         dok.error('Input tensor must be a byte tensor',
                   'image.decompress')
     end
-    if tensor:nElement() < 4 then
-    	dok.error('Input must be either jpg or png format',
-                  'image.decompress')
+    local opts
+    depth, tensortype, opts = loadArgs(depth, tensortype)
+    local dopts = decodeArgs(opts, depth, tensortype, 'image.decompress')
+    local key = memCacheKey(tensor, depth, tensortype)
+    local format = tensor:nElement() > 0 and image.detectFormat(tensor)
+    if dopts then
+        -- the cache holds plain images, decoded within the global limits
+        if (key and not dopts.limited) or not decodesOptions[format] then
+            return finish(decompress(tensor, depth, tensortype), dopts)
+        end
+        return decompressFormat(tensor, format, nil, opts)
     end
-    if isJPG(tensor[{{1,3}}]) then
-        return image.decompressJPG(tensor, depth, tensortype)
-    elseif isPNG(tensor[{{1,4}}]) then
-        return image.decompressPNG(tensor, depth, tensortype)
-    else
-        dok.error('Input must be either jpg or png format',
+    local cached = key and libimagecache.get(key, tensor)
+    if cached and withinLimits(cached) then
+        return cached
+    end
+    if not format then
+        dok.error('Input must be either jpg, png, ppm, qoi or bmp format',
                   'image.decompress')
     end
+    local img = decompressFormat(tensor, format, nil, depth, tensortype)
+    if key and cacheable(format) then
+        img.libimagecache.put(key, img, tensor)
+    end
+    return img
 end
 rawset(image, 'decompress', decompress)
 
-local function processPNG(img, depth, bit_depth, tensortype)
+-- normalized: whether libpng already applied the options of dopts
+local function processPNG(img, depth, bit_depth, tensortype, dopts, normalized)
+    if normalized then
+        return img
+    end
+    img = chwView(img, dopts)
     local MAXVAL = 255
     if bit_depth == 16 then MAXVAL = 65535 end
     if tensortype ~= 'byte' then
         img:mul(1/MAXVAL)
     end
     img = todepth(img, depth)
+    if dopts then
+        img = finish(img, dopts)
+    end
     return img
 end
 
@@ -152,29 +361,46 @@ local function loadPNG(filename, depth, tensortype)
    if not xlua.require 'liblua_png' then
       dok.error('libpng package not found, please install libpng','image.loadPNG')
    end
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.loadPNG')
    local load_from_file = 1
-   local a, bit_depth = template(tensortype).libpng.load(load_from_file, filename)
-   return processPNG(a, depth, bit_depth, tensortype)
+   local a, bit_depth, normalized = template(tensortype).libpng.load(load_from_file, filename,
+                                                                     limited(dopts))
+   return processPNG(a, depth, bit_depth, tensortype, dopts, normalized)
 end
 rawset(image, 'loadPNG', loadPNG)
 
-local function clampImage(tensor)
+local function clampImage(tensor, maxval)
    if tensor:type() == 'torch.ByteTensor' then
       return tensor
    end
    local a = torch.Tensor():resize(tensor:size()):copy(tensor)
    a.image.saturate(a) -- bound btwn 0 and 1
-   a:mul(255)          -- remap to [0..255]
+   a:mul(maxval or 255) -- remap to [0..maxval]
    return a
 end
 
-local function savePNG(filename, tensor)
+-- float and double tensors are quantized by the savers as they fill their
+-- rows, rounded or with opts.dither an ordered dither; returns the tensor
+-- to save and the quantization mode the savers take
+local function quantizeImage(tensor, opts, maxval)
+   local t = tensor:type()
+   if t == 'torch.FloatTensor' or t == 'torch.DoubleTensor' then
+      return tensor, (type(opts) == 'table' and opts.dither) and 2 or 1
+   end
+   return clampImage(tensor, maxval), 0
+end
+
+local function savePNG(filename, tensor, opts)
    if not xlua.require 'liblua_png' then
       dok.error('libpng package not found, please install libpng','image.savePNG')
    end
-   tensor = clampImage(tensor)
+   local hwc = saveLayout(opts, 'image.savePNG')
+   local quant
+   tensor, quant = quantizeImage(tensor, opts)
    local save_to_file = 1
-   tensor.libpng.save(filename, tensor, save_to_file)
+   tensor.libpng.save(filename, tensor, save_to_file, nil, hwc, quant)
 end
 rawset(image, 'savePNG', savePNG)
 
@@ -187,12 +413,16 @@ local function decompressPNG(tensor, depth, tensortype)
         dok.error('Input tensor (with compressed png) must be a byte tensor',
                   'image.decompressPNG')
     end
+    local opts
+    depth, tensortype, opts = loadArgs(depth, tensortype)
+    local dopts = decodeArgs(opts, depth, tensortype, 'image.decompressPNG')
     local load_from_file = 0
-    local a, bit_depth = template(tensortype).libpng.load(load_from_file, tensor)
+    local a, bit_depth, normalized = template(tensortype).libpng.load(load_from_file, tensor,
+                                                                      limited(dopts))
     if a == nil then
         return nil
     else
-        return processPNG(a, depth, bit_depth, tensortype)
+        return processPNG(a, depth, bit_depth, tensortype, dopts, normalized)
     end
 end
 rawset(image, 'decompressPNG', decompressPNG)
@@ -204,26 +434,36 @@ function image.getPNGsize(filename)
    return torch.Tensor().libpng.size(filename)
 end
 
-local function compressPNG(tensor)
+local function compressPNG(tensor, opts)
    if not xlua.require 'liblua_png' then
       dok.error('libpng package not found, please install libpng',
          'image.compressPNG')
    end
-   tensor = clampImage(tensor)
+   local hwc = saveLayout(opts, 'image.compressPNG')
+   local quant
+   tensor, quant = quantizeImage(tensor, opts)
    local b = torch.ByteTensor()
    local save_to_file = 0
-   tensor.libpng.save("", tensor, save_to_file, b)
+   tensor.libpng.save("", tensor, save_to_file, b, hwc, quant)
    return b
 end
 rawset(image, 'compressPNG', compressPNG)
 
 
-local function processJPG(img, depth, tensortype)
+-- normalized: whether libjpeg already applied the options of dopts
+local function processJPG(img, depth, tensortype, dopts, normalized)
+   if normalized then
+      return img
+   end
+   img = chwView(img, dopts)
    local MAXVAL = 255
    if tensortype ~= 'byte' then
       img:mul(1/MAXVAL)
    end
    img = todepth(img, depth)
+   if dopts then
+      img = finish(img, dopts)
+   end
    return img
 end
 
@@ -231,12 +471,16 @@ local function loadJPG(filename, depth, tensortype)
    if not xlua.require 'libjpeg' then
       dok.error('libjpeg package not found, please install libjpeg','image.loadJPG')
    end
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.loadJPG')
    local load_from_file = 1
-   local a = template(tensortype).libjpeg.load(load_from_file, filename)
+   local a, normalized = template(tensortype).libjpeg.load(load_from_file, filename,
+                                                           limited(dopts))
    if a == nil then
       return nil
    else
-      return processJPG(a, depth, tensortype)
+      return processJPG(a, depth, tensortype, dopts, normalized)
    end
 end
 rawset(image, 'loadJPG', loadJPG)
@@ -250,24 +494,30 @@ local function decompressJPG(tensor, depth, tensortype)
       dok.error('Input tensor (with compressed jpeg) must be a byte tensor',
         'image.decompressJPG')
    end
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.decompressJPG')
    local load_from_file = 0
-   local a = template(tensortype).libjpeg.load(load_from_file, tensor)
+   local a, normalized = template(tensortype).libjpeg.load(load_from_file, tensor,
+                                                           limited(dopts))
    if a == nil then
       return nil
    else
-      return processJPG(a, depth, tensortype)
+      return processJPG(a, depth, tensortype, dopts, normalized)
    end
 end
 rawset(image, 'decompressJPG', decompressJPG)
 
-local function saveJPG(filename, tensor)
+local function saveJPG(filename, tensor, opts)
    if not xlua.require 'libjpeg' then
       dok.error('libjpeg package not found, please install libjpeg','image.saveJPG')
    end
-   tensor = clampImage(tensor)
+   local hwc = saveLayout(opts, 'image.saveJPG')
+   local quant
+   tensor, quant = quantizeImage(tensor, opts)
    local save_to_file = 1
    local quality = 75
-   tensor.libjpeg.save(filename, tensor, save_to_file, quality)
+   tensor.libjpeg.save(filename, tensor, save_to_file, quality, nil, hwc, quant)
 end
 rawset(image, 'saveJPG', saveJPG)
 
@@ -283,58 +533,426 @@ local function compressJPG(tensor, quality)
       dok.error('libjpeg package not found, please install libjpeg',
          'image.compressJPG')
    end
-   tensor = clampImage(tensor)
+   -- quality, or a table of options: quality, layout, dither
+   local opts = type(quality) == 'table' and quality or {}
+   if type(quality) == 'table' then
+      quality = opts.quality
+   end
+   local hwc = saveLayout(opts, 'image.compressJPG')
+   local quant
+   tensor, quant = quantizeImage(tensor, opts)
    local b = torch.ByteTensor()
    local save_to_file = 0
    quality = quality or 75
-   tensor.libjpeg.save("", tensor, save_to_file, quality, b)
+   tensor.libjpeg.save("", tensor, save_to_file, quality, b, hwc, quant)
    return b
 end
 rawset(image, 'compressJPG', compressJPG)
 
-local function loadPPM(filename, depth, tensortype)
-   require 'libppm'
-   local MAXVAL = 255
-   local a = template(tensortype).libppm.load(filename)
-   if tensortype ~= 'byte' then
-      a:mul(1/MAXVAL)
+----------------------------------------------------------------------
+-- reads Motion-JPEG: back-to-back JPEG images in one file or pipe
+--
+local MJPEGReader = torch.class('image.MJPEGReader')
+
+function MJPEGReader:__init(source, tensortype)
+   if not xlua.require 'libjpeg' then
+      dok.error('libjpeg package not found, please install libjpeg',
+         'image.MJPEGReader')
    end
-   a = todepth(a, depth)
-   return a
+   if type(source) ~= 'string' and type(source) ~= 'number' then
+      dok.error('expecting a file name or a file descriptor', 'image.MJPEGReader')
+   end
+   self.stream = libjpeg.MJPEGStream(source)
+   self.tensortype = tensortype
+end
+
+-- decodes the next frame into out (resized as needed), or into a new
+-- tensor; returns nil at the end of the stream
+function MJPEGReader:read(out)
+   out = out or template(self.tensortype).new()
+   local img = out.libjpeg.read(self.stream, out)
+   if img and torch.typename(img) ~= 'torch.ByteTensor' then
+      img:mul(1/255)
+   end
+   return img
+end
+
+-- skips n frames (default 1) without decoding them; returns the number of
+-- frames skipped
+function MJPEGReader:skip(n)
+   return self.stream:skip(n)
+end
+
+function MJPEGReader:close()
+   self.stream:close()
+end
+
+-- dopts: the options of decodeArgs; libppm only applies the layout
+local function processPPM(img, depth, maxval, tensortype, dopts)
+   img = chwView(img, dopts)
+   -- float maps (PFM) come back unscaled, with maxval 1
+   if tensortype ~= 'byte' and maxval ~= 1 then
+      img:mul(1/maxval)
+   end
+   img = todepth(img, depth)
+   if dopts then
+      img = finish(img, dopts)
+   end
+   return img
+end
+
+local function loadPPM(filename, depth, tensortype, opts)
+   require 'libppm'
+   depth, tensortype, opts = loadArgs(depth, tensortype, opts)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.loadPPM')
+   local load_from_file = 1
+   local a, maxval = template(tensortype).libppm.load(load_from_file, filename, opts.mmap,
+                                                      dopts and dopts.hwc, limited(dopts))
+   return processPPM(a, depth, maxval, tensortype, dopts)
 end
 rawset(image, 'loadPPM', loadPPM)
 
-local function savePPM(filename, tensor)
+local function decompressPPM(tensor, depth, tensortype)
+   require 'libppm'
+   if torch.typename(tensor) ~= 'torch.ByteTensor' then
+      dok.error('Input tensor (with raw ppm/pgm) must be a byte tensor',
+        'image.decompressPPM')
+   end
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.decompressPPM')
+   local load_from_file = 0
+   local a, maxval = template(tensortype).libppm.load(load_from_file, tensor, nil,
+                                                      dopts and dopts.hwc, limited(dopts))
+   return processPPM(a, depth, maxval, tensortype, dopts)
+end
+rawset(image, 'decompressPPM', decompressPPM)
+
+local function savePPM(filename, tensor, opts)
    require 'libppm'
    if tensor:nDimension() ~= 3 or tensor:size(1) ~= 3 then
       dok.error('can only save 3xHxW images as PPM', 'image.savePPM')
    end
-   tensor = clampImage(tensor)
-   tensor.libppm.save(filename, tensor)
+   local quant
+   tensor, quant = quantizeImage(tensor, opts)
+   local save_to_file = 1
+   tensor.libppm.save(filename, tensor, save_to_file, nil, nil, nil, quant)
 end
 rawset(image, 'savePPM', savePPM)
 
-local function savePGM(filename, tensor)
+local function savePGM(filename, tensor, opts)
    require 'libppm'
    if tensor:nDimension() == 3 and tensor:size(1) ~= 1 then
       dok.error('can only save 1xHxW or HxW images as PGM', 'image.savePGM')
    end
-   tensor = clampImage(tensor)
-   tensor.libppm.save(filename, tensor)
+   local quant
+   tensor, quant = quantizeImage(tensor, opts)
+   local save_to_file = 1
+   tensor.libppm.save(filename, tensor, save_to_file, nil, nil, nil, quant)
 end
 rawset(image, 'savePGM', savePGM)
 
+local function savePAM(filename, tensor, maxval)
+   require 'libppm'
+   if tensor:nDimension() ~= 2 and tensor:nDimension() ~= 3 then
+      dok.error('can only save HxW or CxHxW images as PAM', 'image.savePAM')
+   end
+   -- byte tensors hold 8-bit samples
+   if tensor:type() == 'torch.ByteTensor' then
+      maxval = 255
+   end
+   maxval = maxval or 255
+   local quant
+   tensor, quant = quantizeImage(tensor, nil, maxval)
+   local save_to_file = 1
+   tensor.libppm.save(filename, tensor, save_to_file, nil, maxval, 'pam', quant)
+end
+rawset(image, 'savePAM', savePAM)
+
+local function savePFM(filename, tensor)
+   require 'libppm'
+   local depth = tensor:nDimension() == 2 and 1 or tensor:size(1)
+   if tensor:nDimension() > 3 or (depth ~= 1 and depth ~= 3) then
+      dok.error('can only save HxW, 1xHxW or 3xHxW images as PFM', 'image.savePFM')
+   end
+   -- samples are stored as floats: no clamping or quantization
+   local save_to_file = 1
+   tensor.libppm.save(filename, tensor, save_to_file, nil, nil, 'pfm')
+end
+rawset(image, 'savePFM', savePFM)
+
+local function compressPPM(tensor, opts)
+   require 'libppm'
+   local depth = tensor:nDimension() == 2 and 1 or tensor:size(1)
+   if tensor:nDimension() > 3 or (depth ~= 1 and depth ~= 3) then
+      dok.error('can only compress HxW, 1xHxW or 3xHxW images',
+         'image.compressPPM')
+   end
+   local quant
+   tensor, quant = quantizeImage(tensor, opts)
+   local b = torch.ByteTensor()
+   local save_to_file = 0
+   tensor.libppm.save("", tensor, save_to_file, b, nil, nil, quant)
+   return b
+end
+rawset(image, 'compressPPM', compressPPM)
+
+----------------------------------------------------------------------
+-- reads successive PGM/PPM/PAM/PFM images from one open stream, e.g. the
+-- output of `ffmpeg -i video -f image2pipe -vcodec ppm -`
+--
+local PPMStream = torch.class('image.PPMStream')
+
+function PPMStream:__init(source, tensortype)
+   require 'libppm'
+   if type(source) ~= 'string' and type(source) ~= 'number' then
+      dok.error('expecting a file name or a file descriptor', 'image.PPMStream')
+   end
+   self.stream = libppm.Stream(source)
+   self.tensortype = tensortype
+end
+
+-- reads the next image into out (resized as needed), or into a new tensor;
+-- returns nil at the end of the stream
+function PPMStream:read(out)
+   out = out or template(self.tensortype).new()
+   local img, maxval = out.libppm.read(self.stream, out)
+   if not img then
+      return nil
+   end
+   if torch.typename(img) ~= 'torch.ByteTensor' and maxval ~= 1 then
+      img:mul(1/maxval)
+   end
+   return img
+end
+
+function PPMStream:close()
+   self.stream:close()
+end
+
+----------------------------------------------------------------------
+-- YUV4MPEG2 (Y4M) raw video: 8-bit 4:2:0, 4:2:2, 4:4:4 or mono frames
+--
+local Y4MReader = torch.class('image.Y4MReader')
+
+function Y4MReader:__init(source, tensortype)
+   require 'liby4m'
+   if type(source) ~= 'string' and type(source) ~= 'number' then
+      dok.error('expecting a file name or a file descriptor', 'image.Y4MReader')
+   end
+   self.reader = liby4m.Reader(source)
+   self.width, self.height, self.chroma, self.fps_num, self.fps_den,
+      self.fullrange = self.reader:header()
+   self.tensortype = tensortype
+end
+
+-- reads the next frame's Y, U and V planes (into y, u and v if given);
+-- returns nil at the end of the stream
+function Y4MReader:read(y, u, v)
+   y = y or template(self.tensortype).new()
+   u = u or y.new()
+   v = v or y.new()
+   return y.liby4m.read(self.reader, y, u, v)
+end
+
+-- reads the next frame as a 3xHxW RGB image (into out if given);
+-- returns nil at the end of the stream
+function Y4MReader:readRGB(out)
+   out = out or template(self.tensortype).new()
+   return out.liby4m.readRGB(self.reader, out)
+end
+
+function Y4MReader:close()
+   self.reader:close()
+end
+
+local Y4MWriter = torch.class('image.Y4MWriter')
+
+function Y4MWriter:__init(dest, width, height, opts)
+   require 'liby4m'
+   if type(dest) ~= 'string' and type(dest) ~= 'number' then
+      dok.error('expecting a file name or a file descriptor', 'image.Y4MWriter')
+   end
+   opts = opts or {}
+   local fps = opts.fps or 25
+   if type(fps) == 'number' then
+      fps = {fps, 1}
+   end
+   self.writer = liby4m.Writer(dest, width, height, opts.chroma or '420jpeg',
+                               fps[1], fps[2], opts.fullrange)
+end
+
+-- writes a frame from its Y, U and V planes (just y for mono streams)
+function Y4MWriter:write(y, u, v)
+   y.liby4m.write(self.writer, y, u, v)
+end
+
+-- writes a frame from a 3xHxW RGB image
+function Y4MWriter:writeRGB(img)
+   img.liby4m.writeRGB(self.writer, img)
+end
+
+function Y4MWriter:close()
+   self.writer:close()
+end
+
+-- dopts: the options of decodeArgs; libqoi only applies the limits
+local function processQOI(img, depth, tensortype, dopts)
+   if tensortype ~= 'byte' then
+      img:mul(1/255)
+   end
+   img = todepth(img, depth)
+   if dopts then
+      img = finish(img, dopts)
+   end
+   return img
+end
+
+local function loadQOI(filename, depth, tensortype)
+   require 'libqoi'
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.loadQOI')
+   local load_from_file = 1
+   local a = template(tensortype).libqoi.load(load_from_file, filename, limited(dopts))
+   return processQOI(a, depth, tensortype, dopts)
+end
+rawset(image, 'loadQOI', loadQOI)
+
+local function decompressQOI(tensor, depth, tensortype)
+   require 'libqoi'
+   if torch.typename(tensor) ~= 'torch.ByteTensor' then
+      dok.error('Input tensor (with compressed qoi) must be a byte tensor',
+         'image.decompressQOI')
+   end
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.decompressQOI')
+   local load_from_file = 0
+   local a = template(tensortype).libqoi.load(load_from_file, tensor, limited(dopts))
+   return processQOI(a, depth, tensortype, dopts)
+end
+rawset(image, 'decompressQOI', decompressQOI)
+
+local function saveQOI(filename, tensor)
+   require 'libqoi'
+   tensor = clampImage(tensor)
+   local save_to_file = 1
+   tensor.libqoi.save(filename, tensor, save_to_file)
+end
+rawset(image, 'saveQOI', saveQOI)
+
+local function compressQOI(tensor)
+   require 'libqoi'
+   tensor = clampImage(tensor)
+   local b = torch.ByteTensor()
+   local save_to_file = 0
+   tensor.libqoi.save("", tensor, save_to_file, b)
+   return b
+end
+rawset(image, 'compressQOI', compressQOI)
+
+function image.getQOIsize(filename)
+   require 'libqoi'
+   return torch.Tensor().libqoi.size(filename)
+end
+
+-- dopts: the options of decodeArgs; libbmp only applies the limits
+local function processBMP(img, depth, tensortype, dopts)
+   if tensortype ~= 'byte' then
+      img:mul(1/255)
+   end
+   img = todepth(img, depth)
+   if dopts then
+      img = finish(img, dopts)
+   end
+   return img
+end
+
+local function loadBMP(filename, depth, tensortype)
+   require 'libbmp'
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.loadBMP')
+   local load_from_file = 1
+   local a = template(tensortype).libbmp.load(load_from_file, filename, limited(dopts))
+   return processBMP(a, depth, tensortype, dopts)
+end
+rawset(image, 'loadBMP', loadBMP)
+
+local function decompressBMP(tensor, depth, tensortype)
+   require 'libbmp'
+   if torch.typename(tensor) ~= 'torch.ByteTensor' then
+      dok.error('Input tensor (with compressed bmp) must be a byte tensor',
+         'image.decompressBMP')
+   end
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.decompressBMP')
+   local load_from_file = 0
+   local a = template(tensortype).libbmp.load(load_from_file, tensor, limited(dopts))
+   return processBMP(a, depth, tensortype, dopts)
+end
+rawset(image, 'decompressBMP', decompressBMP)
+
+local function saveBMP(filename, tensor)
+   require 'libbmp'
+   tensor = clampImage(tensor)
+   local save_to_file = 1
+   tensor.libbmp.save(filename, tensor, save_to_file)
+end
+rawset(image, 'saveBMP', saveBMP)
+
+local function compressBMP(tensor)
+   require 'libbmp'
+   tensor = clampImage(tensor)
+   local b = torch.ByteTensor()
+   local save_to_file = 0
+   tensor.libbmp.save("", tensor, save_to_file, b)
+   return b
+end
+rawset(image, 'compressBMP', compressBMP)
+
+function image.getBMPsize(filename)
+   require 'libbmp'
+   return torch.Tensor().libbmp.size(filename)
+end
+
 function image.getPPMsize(filename)
    require 'libppm'
    return torch.Tensor().libppm.size(filename)
 end
 
+----------------------------------------------------------------------
+-- instruction set of the pixel conversions shared by the codecs
+--
+local simdCodecs = {'libppm', 'libbmp', 'libjpeg', 'liblua_png'}
+
+local function simd(level)
+   if level ~= nil and type(level) ~= 'string' then
+      dok.error('level should be one of "none", "sse2", "ssse3" or "avx2"', 'image.simd')
+   end
+   local used
+   for _, name in ipairs(simdCodecs) do
+      local lib = xlua.require(name)
+      if lib then
+         used = lib.simd(level)
+      end
+   end
+   return used
+end
+rawset(image, 'simd', simd)
+
 local filetypes = {
    jpg = {loader = image.loadJPG, saver = image.saveJPG},
    png = {loader = image.loadPNG, saver = image.savePNG},
    ppm = {loader = image.loadPPM, saver = image.savePPM},
    -- yes, loadPPM not loadPGM
-   pgm = {loader = image.loadPPM, saver = image.savePGM}
+   pgm = {loader = image.loadPPM, saver = image.savePGM},
+   pam = {loader = image.loadPPM, saver = image.savePAM},
+   pfm = {loader = image.loadPPM, saver = image.savePFM},
+   qoi = {loader = image.loadQOI, saver = image.saveQOI},
+   bmp = {loader = image.loadBMP, saver = image.saveBMP}
 }
 
 filetypes['JPG']  = filetypes['jpg']
@@ -343,6 +961,10 @@ filetypes['jpeg'] = filetypes['jpg']
 filetypes['PNG']  = filetypes['png']
 filetypes['PPM']  = filetypes['ppm']
 filetypes['PGM']  = filetypes['pgm']
+filetypes['PAM']  = filetypes['pam']
+filetypes['PFM']  = filetypes['pfm']
+filetypes['QOI']  = filetypes['qoi']
+filetypes['BMP']  = filetypes['bmp']
 rawset(image, 'supported_filetypes', filetypes)
 
 local function is_supported(suffix)
@@ -350,6 +972,11 @@ local function is_supported(suffix)
 end
 rawset(image, 'is_supported', is_supported)
 
+-- set by image.setDiskCache
+local diskCache = false
+-- set by image.shmcache.open
+local sharedCache = false
+
 local function load(filename, depth, tensortype)
    if not filename then
       print(dok.usage('image.load',
@@ -357,49 +984,212 @@ local function load(filename, depth, tensortype)
                        {type='string', help='path to file', req=true},
                        {type='number', help='force destination depth: 1 | 3'},
                        {type='string', help='type: byte | float | double'}))
+      print('or image.load(filename, {depth=, type=, mean=, std=, order=})')
       dok.error('missing file name', 'image.load')
    end
+   local opts
+   depth, tensortype, opts = loadArgs(depth, tensortype)
+   local dopts = decodeArgs(opts, depth, tensortype, 'image.load')
+
+   local key = memCacheKey(filename, depth, tensortype)
+   if dopts then
+      -- the caches hold plain images: convert their hits, and fill them on
+      -- misses; without them, or with limits of its own, the decoders that
+      -- can apply the options
+      if (key or sharedCache or diskCache) and not dopts.limited then
+         return finish(load(filename, depth, tensortype), dopts)
+      end
+      local bytes, format = image.readFile(filename)
+      if decodesOptions[format] then
+         return decompressFormat(bytes, format, filename, opts)
+      elseif format then
+         return finish(decompressFormat(bytes, format, filename, depth, tensortype), dopts)
+      end
+      return finish(load(filename, depth, tensortype), dopts)
+   end
+   -- hits over the limits of image.setLimits are misses: the decoders
+   -- below refuse or downscale them
+   local cached = key and libimagecache.get(key)
+   if cached and withinLimits(cached) then
+      return cached
+   end
+   if sharedCache then
+      cached = template(tensortype).libshmcache.get(sharedCache, filename, depth)
+      if cached and withinLimits(cached) then
+         if key then
+            cached.libimagecache.put(key, cached)
+         end
+         return cached
+      end
+   end
+   if diskCache then
+      cached = template(tensortype).libloader.cacheGet(filename, depth)
+      if cached and withinLimits(cached) then
+         if sharedCache then
+            cached.libshmcache.put(sharedCache, filename, depth, cached)
+         end
+         if key then
+            cached.libimagecache.put(key, cached)
+         end
+         return cached
+      end
+   end
 
-   local ext
+   -- one open and one read: the format comes from the magic number, and
+   -- the image is decoded from memory
+   local bytes, format = image.readFile(filename)
+   local tensor
+   if format then
+      tensor = decompressFormat(bytes, format, filename, depth, tensortype)
+   else
+      local ext = string.match(filename,'%.(%a+)$')
+      if image.is_supported(ext) then
+         tensor = filetypes[ext].loader(filename, depth, tensortype)
+      elseif not ext then
+         dok.error('unable to determine image type for file: ' .. filename, 'image.load')
+      else
+         dok.error('unknown image type: ' .. ext, 'image.load')
+      end
+   end
 
-   local f, err = io.open(filename, 'rb')
-   if not f then
-      error(err)
+   if not cacheable(format) then
+      return tensor
+   end
+   if diskCache then
+      tensor.libloader.cachePut(filename, depth, tensor)
    end
-   local hdr = f:read(4) or ''
-   f:close()
+   if sharedCache then
+      tensor.libshmcache.put(sharedCache, filename, depth, tensor)
+   end
+   if key then
+      tensor.libimagecache.put(key, tensor)
+   end
+   return tensor
+end
+rawset(image, 'load', load)
 
-   if startswith(hdr, magicJPG) then
-      ext = 'jpg'
-   elseif startswith(hdr, magicPNG) then
-      ext = 'png'
-   elseif hdr:match('^P[25]') then
-      ext = 'pgm'
-   elseif hdr:match('^P[36]') then
-      ext = 'ppm'
+-- caches decoded images in dir, for image.load, image.loadBatch and
+-- image.Prefetcher; without dir, turns the cache off
+local function setDiskCache(dir, budget)
+   if dir ~= nil and type(dir) ~= 'string' then
+      print(dok.usage('image.setDiskCache',
+                       'caches decoded images on disk', nil,
+                       {type='string', help='cache directory, nil to turn the cache off'},
+                       {type='number', help='disk budget in bytes (0 for no limit)', default=0}))
+      dok.error('expecting a directory', 'image.setDiskCache')
+   end
+   require 'libloader'
+   libloader.setDiskCache(dir, budget)
+   diskCache = (dir ~= nil)
+end
+rawset(image, 'setDiskCache', setDiskCache)
+
+-- limits on the size of decoded images, checked against the headers of
+-- JPEG, PNG and PPM files before anything is allocated; without opts, no
+-- limits. Returns the previous ones.
+local function setLimits(opts)
+   if opts ~= nil and type(opts) ~= 'table' then
+      print(dok.usage('image.setLimits',
+                       'limits the size of decoded images', nil,
+                       {type='table', help='{maxPixels=, maxBytes=, downscale=}, nil for none'}))
+      dok.error('expecting a table of limits', 'image.setLimits')
    end
+   opts = opts or {}
+   checkLimits(opts, 'image.setLimits')
+   local previous = limits
+   limits = {maxPixels = opts.maxPixels, maxBytes = opts.maxBytes, downscale = opts.downscale}
+   require 'libloader'
+   libloader.setLimits(opts.maxPixels or 0, opts.maxBytes or 0)
+   return previous
+end
+rawset(image, 'setLimits', setLimits)
+
+----------------------------------------------------------------------
+-- cache: decoded images kept in memory, for image.load and
+-- image.decompress; shared by the threads of the process
+--
+local cache = {}
 
-   if not ext then
-      ext = string.match(filename,'%.(%a+)$')
+-- opts.bytes: the memory budget (0, the default, turns the cache off)
+function cache.configure(opts)
+   opts = opts or {}
+   if type(opts.bytes or 0) ~= 'number' then
+      dok.error('expecting a number of bytes', 'image.cache.configure')
    end
+   require 'libimagecache'
+   libimagecache.configure(opts.bytes or 0)
+end
 
-   local tensor
-   if image.is_supported(ext) then
-      tensor = filetypes[ext].loader(filename, depth, tensortype)
-   elseif not ext then
-      dok.error('unable to determine image type for file: ' .. filename, 'image.load')
-   else
-      dok.error('unknown image type: ' .. ext, 'image.load')
+-- returns {hits, misses, evictions, entries, bytes, capacity}
+function cache.stats()
+   require 'libimagecache'
+   return libimagecache.stats()
+end
+
+function cache.clear()
+   require 'libimagecache'
+   libimagecache.clear()
+end
+rawset(image, 'cache', cache)
+
+----------------------------------------------------------------------
+-- shmcache: decoded images in POSIX shared memory, for image.load;
+-- shared by the processes of the node that open the same segment
+--
+local shmcache = {}
+
+-- opts.name: the segment, e.g. '/images'; opts.bytes and opts.slots size
+-- it when this process is the first to open it
+function shmcache.open(opts)
+   opts = opts or {}
+   if type(opts.name) ~= 'string' then
+      print(dok.usage('image.shmcache.open',
+                       'caches decoded images in shared memory', nil,
+                       {type='string', help='segment name, e.g. /images', req=true},
+                       {type='number', help='segment size in bytes', default=2^30},
+                       {type='number', help='index slots, at most one image each', default=2^16}))
+      dok.error('expecting a segment name', 'image.shmcache.open')
+   end
+   require 'libshmcache'
+   local c = libshmcache.Cache(opts.name, opts.bytes, opts.slots)
+   if sharedCache then
+      sharedCache:close()
    end
+   sharedCache = c
+end
 
-   return tensor
+-- returns {hits, misses, entries, full, bytes, capacity, slots}, counted
+-- over all the processes
+function shmcache.stats()
+   if not sharedCache then
+      dok.error('no shared cache open', 'image.shmcache.stats')
+   end
+   return sharedCache:stats()
+end
+
+-- detaches this process; images loaded from the cache stay valid
+function shmcache.close()
+   if sharedCache then
+      sharedCache:close()
+      sharedCache = false
+   end
 end
-rawset(image, 'load', load)
+
+-- removes the segment; processes attached to it keep using it
+function shmcache.unlink(name)
+   require 'libshmcache'
+   return libshmcache.unlink(name)
+end
+rawset(image, 'shmcache', shmcache)
 
 filetypes.jpg.sizer = image.getJPGsize
 filetypes.png.sizer = image.getPNGsize
 filetypes.ppm.sizer = image.getPPMsize
 filetypes.pgm.sizer = image.getPPMsize -- sim. to loadPPM not loadPGM
+filetypes.pam.sizer = image.getPPMsize
+filetypes.pfm.sizer = image.getPPMsize
+filetypes.qoi.sizer = image.getQOIsize
+filetypes.bmp.sizer = image.getBMPsize
 
 local function getSize(filename)
    if not filename then
@@ -409,28 +1199,7 @@ local function getSize(filename)
       dok.error('missing file name', 'image.getSize')
    end
 
-   local ext
-
-   local f, err = io.open(filename, 'rb')
-   if not f then
-      error(err)
-   end
-   local hdr = f:read(4) or ''
-   f:close()
-
-   if startswith(hdr, magicJPG) then
-      ext = 'jpg'
-   elseif startswith(hdr, magicPNG) then
-      ext = 'png'
-   elseif hdr:match('^P[25]') then
-      ext = 'pgm'
-   elseif hdr:match('^P[36]') then
-      ext = 'ppm'
-   end
-
-   if not ext then
-      ext = string.match(filename,'%.(%a+)$')
-   end
+   local ext = image.detectFormat(filename) or string.match(filename,'%.(%a+)$')
    local size
    if image.is_supported(ext) then
       size = {filetypes[ext].sizer(filename)}
@@ -444,23 +1213,306 @@ local function getSize(filename)
 end
 rawset(image, 'getSize', getSize)
 
-local function save(filename, tensor)
+-- the savers and compressors taking HxWxC tensors as they are
+local interleavedSavers = {
+   [image.saveJPG] = true,
+   [image.savePNG] = true,
+   [image.compressJPG] = true,
+   [image.compressPNG] = true,
+}
+
+-- the other savers and compressors taking options (dither)
+local optionSavers = {
+   [image.savePPM] = true,
+   [image.savePGM] = true,
+   [image.compressPPM] = true,
+}
+
+local function save(filename, tensor, opts)
    if not filename or not tensor then
       print(dok.usage('image.save',
                        'saves a torch.Tensor to a disk', nil,
                        {type='string', help='path to file', req=true},
-                       {type='torch.Tensor', help='tensor to save (NxHxW, N = 1 | 3)'}))
+                       {type='torch.Tensor', help='tensor to save (NxHxW, N = 1 | 3)'},
+                       {type='table', help='options: layout = chw | hwc, dither'}))
       dok.error('missing file name | tensor to save', 'image.save')
    end
    local ext = string.match(filename,'%.(%a+)$')
    if image.is_supported(ext) then
-      tensor = filetypes[ext].saver(filename, tensor)
+      local saver = filetypes[ext].saver
+      if interleavedSavers[saver] then
+         saver(filename, tensor, opts)
+      else
+         if saveLayout(opts, 'image.save') and tensor:nDimension() == 3 then
+            tensor = tensor:permute(3, 1, 2)
+         end
+         if optionSavers[saver] then
+            saver(filename, tensor, opts)
+         else
+            saver(filename, tensor)
+         end
+      end
    else
       dok.error('unknown image type: ' .. ext, 'image.save')
    end
 end
 rawset(image, 'save', save)
 
+local compressors = {
+   jpg = image.compressJPG,
+   png = image.compressPNG,
+   ppm = image.compressPPM,
+   qoi = image.compressQOI,
+   bmp = image.compressBMP,
+}
+
+local function compress(tensor, format, ...)
+   local compressor = compressors[format and format:lower()]
+   if not tensor or not compressor then
+      print(dok.usage('image.compress',
+                       'compresses a torch.Tensor into a torch.ByteTensor', nil,
+                       {type='torch.Tensor', help='tensor to compress', req=true},
+                       {type='string', help='format: jpg | png | ppm | qoi | bmp', req=true}))
+      dok.error('missing tensor | unknown format', 'image.compress')
+   end
+   local opts = ...
+   if type(opts) == 'table' and not interleavedSavers[compressor] then
+      if saveLayout(opts, 'image.compress') and tensor:nDimension() == 3 then
+         tensor = tensor:permute(3, 1, 2)
+      end
+      if optionSavers[compressor] then
+         return compressor(tensor, opts)
+      end
+      return compressor(tensor)
+   end
+   return compressor(tensor, ...)
+end
+rawset(image, 'compress', compress)
+
+----------------------------------------------------------------------
+-- loadBatch
+--
+-- size = {height, width} or a single number for squares
+local function batchSize(size)
+   if type(size) == 'number' then
+      return size, size
+   elseif size then
+      return size[1], size[2]
+   end
+end
+
+local function loadBatch(items, opts)
+   if type(items) ~= 'table' or #items == 0 then
+      print(dok.usage('image.loadBatch',
+                       'loads images into a NxCxHxW torch.Tensor, on worker threads', nil,
+                       {type='table', help='file names and/or ByteTensors (JPEG, PNG or binary PPM/PGM)', req=true},
+                       {type='table', help='options: size = {h, w} | s, depth, type, threads'}))
+      dok.error('missing list of images', 'image.loadBatch')
+   end
+   require 'libloader'
+   opts = opts or {}
+   local height, width = batchSize(opts.size)
+   local batch = template(opts.type).new()
+   return batch.libloader.loadBatch(batch, items, opts.depth, height, width, opts.threads)
+end
+rawset(image, 'loadBatch', loadBatch)
+
+----------------------------------------------------------------------
+-- verify: check that images decode, without keeping their pixels
+--
+local function verify(items, opts)
+   if type(items) ~= 'table' then
+      print(dok.usage('image.verify',
+                       'checks that images decode, on worker threads', nil,
+                       {type='table', help='file names and/or ByteTensors (JPEG, PNG or binary PPM/PGM)', req=true},
+                       {type='table', help='options: threads'}))
+      dok.error('missing list of images', 'image.verify')
+   end
+   require 'libloader'
+   opts = opts or {}
+   return libloader.verify(items, opts.threads)
+end
+rawset(image, 'verify', verify)
+
+----------------------------------------------------------------------
+-- loadTransformed: decode, crop, resize and flip in a single pass
+--
+local function loadTransformed(source, opts)
+   if type(source) ~= 'string' and torch.typename(source) ~= 'torch.ByteTensor' then
+      print(dok.usage('image.loadTransformed',
+                       'loads a crop of an image, resized and flipped, into a CxHxW torch.Tensor', nil,
+                       {type='string | torch.ByteTensor', help='file name or encoded image (JPEG, PNG or binary PPM/PGM)', req=true},
+                       {type='table', help='options: crop = {x1, y1, x2, y2} | {format, w, h}, size = {h, w} | s, hflip, interp, depth, type'}))
+      dok.error('missing image', 'image.loadTransformed')
+   end
+   require 'libloader'
+   opts = opts or {}
+   return template(opts.type).libloader.loadTransformed(source, opts)
+end
+rawset(image, 'loadTransformed', loadTransformed)
+
+----------------------------------------------------------------------
+-- Prefetcher: decodes ahead on worker threads, into a bounded queue
+--
+local Prefetcher = torch.class('image.Prefetcher')
+
+function Prefetcher:__init(opts)
+   opts = opts or {}
+   if type(opts.paths) ~= 'table' or #opts.paths == 0 then
+      dok.error('expecting a table of paths', 'image.Prefetcher')
+   end
+   require 'libloader'
+   local height, width = batchSize(opts.size)
+   self.proto = template(opts.type)
+   self.prefetcher = self.proto.libloader.prefetcher(
+      opts.paths, opts.depth, height, width, opts.batch, opts.queue,
+      opts.threads, opts.shuffle, opts.seed or torch.random(), opts.epochs)
+end
+
+-- returns the next image (or batch), with its index in paths (or a table
+-- of them) and its error message (or a table of them), or nil once all
+-- epochs are done; the returned tensor is recycled on the next call
+function Prefetcher:next()
+   return self.proto.libloader.next(self.prefetcher)
+end
+
+function Prefetcher:close()
+   self.prefetcher:close()
+end
+
+----------------------------------------------------------------------
+-- Archive: encoded images packed into one file, with an index; entries
+-- are read from a mapping of the file, without copies
+--
+local Archive = torch.class('image.Archive')
+
+function Archive:__init(path)
+   if type(path) ~= 'string' then
+      dok.error('expecting the path of an archive', 'image.Archive')
+   end
+   require 'liblua_archive'
+   self.reader = libarchive.Reader(path)
+end
+
+-- returns an image.ArchiveWriter for a new archive at path
+function Archive.create(path)
+   return image.ArchiveWriter(path)
+end
+
+function Archive:size()
+   return self.reader:size()
+end
+
+-- returns the index of the entry called name, or nil
+function Archive:find(name)
+   return self.reader:find(name)
+end
+
+-- keys are indices (1-based) or names
+function Archive:index(key)
+   if type(key) == 'string' then
+      local i = self.reader:find(key)
+      if not i then
+         dok.error('no entry called ' .. key, 'image.Archive')
+      end
+      return i
+   end
+   return key
+end
+
+-- returns {name, format, size, depth, height, width}; the dimensions are
+-- 0 when they were not found in the image header
+function Archive:info(key)
+   local name, format, size, c, h, w = self.reader:entry(self:index(key))
+   return {name=name, format=format, size=size, depth=c, height=h, width=w}
+end
+
+-- returns the encoded image as a ByteTensor viewing the archive
+function Archive:bytes(key)
+   return self.reader:bytes(self:index(key))
+end
+
+function Archive:load(key, depth, tensortype)
+   local i = self:index(key)
+   local _, format = self.reader:entry(i)
+   return decompressFormat(self.reader:bytes(i), format, nil, depth, tensortype)
+end
+
+-- returns the encoded images of keys (all entries by default), as items
+-- for image.loadBatch or image.Prefetcher
+function Archive:items(keys)
+   local items = {}
+   if keys then
+      for k, key in ipairs(keys) do
+         items[k] = self:bytes(key)
+      end
+   else
+      for i = 1, self.reader:size() do
+         items[i] = self.reader:bytes(i)
+      end
+   end
+   return items
+end
+
+function Archive:loadBatch(keys, opts)
+   return image.loadBatch(self:items(keys), opts)
+end
+
+function Archive:close()
+   self.reader:close()
+end
+
+local ArchiveWriter = torch.class('image.ArchiveWriter')
+
+function ArchiveWriter:__init(path)
+   if type(path) ~= 'string' then
+      dok.error('expecting the path of an archive', 'image.Archive.create')
+   end
+   require 'liblua_archive'
+   self.writer = libarchive.Writer(path)
+end
+
+-- adds an image under name and returns its index. data is either an
+-- encoded image (a 1D ByteTensor) stored as is, or an image tensor encoded
+-- as format: 'raw' (the default: uncompressed PGM/PPM, or PAM for 2 or 4
+-- channels), or any format of image.compress
+function ArchiveWriter:add(name, data, format)
+   if type(name) ~= 'string' or not torch.isTensor(data) then
+      print(dok.usage('image.ArchiveWriter:add',
+                       'adds an image to an archive', nil,
+                       {type='string', help='entry name', req=true},
+                       {type='torch.Tensor', help='encoded image (1D ByteTensor) or CxHxW image', req=true},
+                       {type='string', help='format: raw | jpg | png | ppm | qoi | bmp', default='raw'}))
+      dok.error('missing name | image', 'image.ArchiveWriter:add')
+   end
+   local bytes
+   if torch.typename(data) == 'torch.ByteTensor' and data:nDimension() == 1 then
+      bytes = data:isContiguous() and data or data:clone()
+   elseif (format or 'raw') == 'raw' then
+      local depth = data:nDimension() == 2 and 1 or data:size(1)
+      if depth == 1 or depth == 3 then
+         bytes = image.compressPPM(data)
+      else
+         require 'libppm'
+         local tensor = clampImage(data, 255)
+         bytes = torch.ByteTensor()
+         tensor.libppm.save("", tensor, 0, bytes, 255, 'pam')
+      end
+   else
+      bytes = image.compress(data, format)
+   end
+   local detected = image.detectFormat(bytes)
+   if not detected then
+      dok.error('unknown image format for entry ' .. name, 'image.ArchiveWriter:add')
+   end
+   return self.writer:add(name, bytes, detected)
+end
+
+-- writes the index; an archive is only readable once closed
+function ArchiveWriter:close()
+   self.writer:close()
+end
+
 ----------------------------------------------------------------------
 -- crop
 --
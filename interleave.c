@@ -0,0 +1,682 @@
+
+/* Conversions between packed samples, pixel after pixel as image files
+ * store them, and the planes of CxHxW tensors, shared by the codecs.
+ * Samples are 8-bit, or 16-bit big-endian as in PNG and PNM files.
+ *
+ * The kernels work on runs of pixels: shuffles between packed pixels and
+ * 8 or 16-bit planes (SSSE3), and conversions between those planes and
+ * float or double ones (SSE2, AVX2). generic/interleave.c chains them
+ * through a small staging buffer for each tensor type. The instruction set
+ * is picked at run time, and can be lowered with image.simd().
+ */
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_SIMD_X86 1
+#include <immintrin.h>
+#define IMAGE_SIMD_TARGET(isa) __attribute__((target(isa)))
+#define IMAGE_SIMD_INLINE(isa) static inline __attribute__((always_inline, target(isa)))
+#else
+#define IMAGE_SIMD_X86 0
+#endif
+
+#define IMAGE_IL_CHANS 4        /* most channels the kernels shuffle */
+#define IMAGE_IL_BLOCK 512      /* pixels staged at a time */
+
+/* Where each plane of a conversion takes its samples from: plane k
+ * receives channel src[k] of the pixels, as sample * scale[k] + bias[k].
+ */
+typedef struct {
+  int src[IMAGE_IL_CHANS];
+  double scale[IMAGE_IL_CHANS];
+  double bias[IMAGE_IL_CHANS];
+} image_chanmap;
+
+/* How the savers turn float and double samples in [0, 1] into 8 or 16-bit
+ * ones: clamped, scaled to maxval and rounded, or with dither, through a
+ * 4x4 ordered (Bayer) dither. Dithering goes by the position of each
+ * sample: the first one converted is on row y, and rows are width pixels
+ * of step samples (1 for planes, C for HxWxC data).
+ */
+typedef struct {
+  double maxval;
+  int dither;
+  long width, step, y;
+} image_quant;
+
+static const float image_il_bayer[4][4] = {
+  { 0.5f/16,  8.5f/16,  2.5f/16, 10.5f/16},
+  {12.5f/16,  4.5f/16, 14.5f/16,  6.5f/16},
+  { 3.5f/16, 11.5f/16,  1.5f/16,  9.5f/16},
+  {15.5f/16,  7.5f/16, 13.5f/16,  5.5f/16},
+};
+
+enum { IMAGE_SIMD_NONE, IMAGE_SIMD_SSE2, IMAGE_SIMD_SSSE3, IMAGE_SIMD_AVX2 };
+static const char *const image_simd_names[] = {"none", "sse2", "ssse3", "avx2", NULL};
+static int image_simd_level = -1;
+
+static int image_simd_detect(void)
+{
+#if IMAGE_SIMD_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return IMAGE_SIMD_AVX2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    return IMAGE_SIMD_SSSE3;
+  } else if (__builtin_cpu_supports("sse2")) {
+    return IMAGE_SIMD_SSE2;
+  }
+#endif
+  return IMAGE_SIMD_NONE;
+}
+
+/* The instruction set in use, detected on first use. */
+static int image_simd(void)
+{
+  int level = __atomic_load_n(&image_simd_level, __ATOMIC_RELAXED);
+  if (level < 0) {
+    level = image_simd_detect();
+    __atomic_store_n(&image_simd_level, level, __ATOMIC_RELAXED);
+  }
+  return level;
+}
+
+/* simd([level]): the instruction set of the conversions, "none", "sse2",
+ * "ssse3" or "avx2", after lowering it to level if given (levels above
+ * what the CPU supports pick the best it does).
+ */
+static int image_simd_lua(lua_State *L)
+{
+  if (!lua_isnoneornil(L, 1)) {
+    const int want = luaL_checkoption(L, 1, NULL, image_simd_names);
+    const int best = image_simd_detect();
+    __atomic_store_n(&image_simd_level, want < best ? want : best, __ATOMIC_RELAXED);
+  }
+  lua_pushstring(L, image_simd_names[image_simd()]);
+  return 1;
+}
+
+/* pshufb masks, as constant tables. Unpacking a block of packed samples
+ * (es bytes each) into planes (eo bytes each) gathers byte b of plane k
+ * from byte s of the block, whose register s/16 is shuffled with mask
+ * [k][s/16]; bytes of the other registers are zeroed (-128). Blocks hold
+ * 16/eo pixels. 16-bit planes are native (little-endian) while packed
+ * samples are big-endian, and 8-bit planes of 16-bit samples keep their
+ * high byte.
+ */
+#define IMAGE_IL_USRC(C, es, eo, k, b) \
+  ((((b)/(eo))*(C) + (k))*(es) + ((es) == 2 && (eo) == 2 ? 1 - (b)%2 : 0))
+#define IMAGE_IL_UBYTE(C, es, eo, k, r, b) \
+  (IMAGE_IL_USRC(C, es, eo, k, b)/16 == (r) ? IMAGE_IL_USRC(C, es, eo, k, b)%16 : -128)
+/* packing is the reverse: byte b of register r of the block comes from
+ * plane k's register, at the byte unpacking would have sent it to */
+#define IMAGE_IL_PSRC(C, es, eo, s) \
+  (((s)/(es)/(C))*(eo) + ((es) == 2 && (eo) == 2 ? 1 - (s)%2 : 0))
+#define IMAGE_IL_PBYTE(C, es, eo, r, k, b) \
+  (((16*(r) + (b))/(es))%(C) == (k) ? IMAGE_IL_PSRC(C, es, eo, 16*(r) + (b)) : -128)
+
+#define IMAGE_IL_MASK(M, ...) {                                              \
+    M(__VA_ARGS__, 0), M(__VA_ARGS__, 1), M(__VA_ARGS__, 2), M(__VA_ARGS__, 3),     \
+    M(__VA_ARGS__, 4), M(__VA_ARGS__, 5), M(__VA_ARGS__, 6), M(__VA_ARGS__, 7),     \
+    M(__VA_ARGS__, 8), M(__VA_ARGS__, 9), M(__VA_ARGS__, 10), M(__VA_ARGS__, 11),   \
+    M(__VA_ARGS__, 12), M(__VA_ARGS__, 13), M(__VA_ARGS__, 14), M(__VA_ARGS__, 15) }
+#define IMAGE_IL_UREGS(C, es, eo, k) {                                       \
+    IMAGE_IL_MASK(IMAGE_IL_UBYTE, C, es, eo, k, 0), IMAGE_IL_MASK(IMAGE_IL_UBYTE, C, es, eo, k, 1), \
+    IMAGE_IL_MASK(IMAGE_IL_UBYTE, C, es, eo, k, 2), IMAGE_IL_MASK(IMAGE_IL_UBYTE, C, es, eo, k, 3), \
+    IMAGE_IL_MASK(IMAGE_IL_UBYTE, C, es, eo, k, 4), IMAGE_IL_MASK(IMAGE_IL_UBYTE, C, es, eo, k, 5), \
+    IMAGE_IL_MASK(IMAGE_IL_UBYTE, C, es, eo, k, 6), IMAGE_IL_MASK(IMAGE_IL_UBYTE, C, es, eo, k, 7) }
+#define IMAGE_IL_UCHANS(C, es, eo) {                                         \
+    IMAGE_IL_UREGS(C, es, eo, 0), IMAGE_IL_UREGS(C, es, eo, 1),              \
+    IMAGE_IL_UREGS(C, es, eo, 2), IMAGE_IL_UREGS(C, es, eo, 3) }
+#define IMAGE_IL_UKIND(es, eo) {                                             \
+    IMAGE_IL_UCHANS(1, es, eo), IMAGE_IL_UCHANS(2, es, eo),                  \
+    IMAGE_IL_UCHANS(3, es, eo), IMAGE_IL_UCHANS(4, es, eo) }
+#define IMAGE_IL_PPLANES(C, es, eo, r) {                                     \
+    IMAGE_IL_MASK(IMAGE_IL_PBYTE, C, es, eo, r, 0), IMAGE_IL_MASK(IMAGE_IL_PBYTE, C, es, eo, r, 1), \
+    IMAGE_IL_MASK(IMAGE_IL_PBYTE, C, es, eo, r, 2), IMAGE_IL_MASK(IMAGE_IL_PBYTE, C, es, eo, r, 3) }
+#define IMAGE_IL_PCHANS(C, es, eo) {                                         \
+    IMAGE_IL_PPLANES(C, es, eo, 0), IMAGE_IL_PPLANES(C, es, eo, 1),          \
+    IMAGE_IL_PPLANES(C, es, eo, 2), IMAGE_IL_PPLANES(C, es, eo, 3) }
+#define IMAGE_IL_PKIND(es, eo) {                                             \
+    IMAGE_IL_PCHANS(1, es, eo), IMAGE_IL_PCHANS(2, es, eo),                  \
+    IMAGE_IL_PCHANS(3, es, eo), IMAGE_IL_PCHANS(4, es, eo) }
+
+enum { IMAGE_IL_8TO8, IMAGE_IL_16TO16, IMAGE_IL_16TO8 };
+
+#if IMAGE_SIMD_X86
+/* [kind][chans-1][plane][register][byte] */
+static const signed char image_il_unpack_masks[3][4][4][8][16] = {
+  IMAGE_IL_UKIND(1, 1), IMAGE_IL_UKIND(2, 2), IMAGE_IL_UKIND(2, 1)
+};
+/* [kind][chans-1][register][plane][byte] */
+static const signed char image_il_pack_masks[2][4][4][4][16] = {
+  IMAGE_IL_PKIND(1, 1), IMAGE_IL_PKIND(2, 2)
+};
+
+/* Unpack the whole blocks of n pixels; returns the number of pixels done. */
+IMAGE_SIMD_INLINE("ssse3")
+long image_il_unpack_ssse3(unsigned char *dst, long plane, const unsigned char *src, long n,
+                           const int chans, const int kind)
+{
+  const int es = (kind == IMAGE_IL_8TO8) ? 1 : 2;
+  const int eo = (kind == IMAGE_IL_16TO16) ? 2 : 1;
+  const int px = 16 / eo;
+  const int regs = chans * es / eo;
+  const signed char (*mask)[8][16] = image_il_unpack_masks[kind][chans-1];
+  long i;
+  int k, r;
+  for (i=0; i+px<=n; i+=px) {
+    const unsigned char *s = src + i*chans*es;
+    __m128i in[2*IMAGE_IL_CHANS];
+    for (r=0; r<regs; r++) {
+      in[r] = _mm_loadu_si128((const __m128i *)(s + 16*r));
+    }
+    for (k=0; k<chans; k++) {
+      __m128i o = _mm_shuffle_epi8(in[0], _mm_loadu_si128((const __m128i *)mask[k][0]));
+      for (r=1; r<regs; r++) {
+        o = _mm_or_si128(o, _mm_shuffle_epi8(in[r], _mm_loadu_si128((const __m128i *)mask[k][r])));
+      }
+      _mm_storeu_si128((__m128i *)(dst + (k*plane + i)*eo), o);
+    }
+  }
+  return i;
+}
+
+IMAGE_SIMD_INLINE("ssse3")
+long image_il_pack_ssse3(unsigned char *dst, const unsigned char *src, long plane, long n,
+                         const int chans, const int kind)
+{
+  const int es = (kind == IMAGE_IL_8TO8) ? 1 : 2;
+  const int px = 16 / es;
+  const signed char (*mask)[4][16] = image_il_pack_masks[kind][chans-1];
+  long i;
+  int k, r;
+  for (i=0; i+px<=n; i+=px) {
+    __m128i in[IMAGE_IL_CHANS];
+    for (k=0; k<chans; k++) {
+      in[k] = _mm_loadu_si128((const __m128i *)(src + (k*plane + i)*es));
+    }
+    unsigned char *d = dst + i*chans*es;
+    for (r=0; r<chans; r++) {
+      __m128i o = _mm_shuffle_epi8(in[0], _mm_loadu_si128((const __m128i *)mask[r][0]));
+      for (k=1; k<chans; k++) {
+        o = _mm_or_si128(o, _mm_shuffle_epi8(in[k], _mm_loadu_si128((const __m128i *)mask[r][k])));
+      }
+      _mm_storeu_si128((__m128i *)(d + 16*r), o);
+    }
+  }
+  return i;
+}
+
+/* One specialization per channel count and kind, so that the loops over
+ * registers unroll with their masks in registers. */
+IMAGE_SIMD_TARGET("ssse3")
+static long image_il_unpack_simd(unsigned char *dst, long plane, const unsigned char *src, long n,
+                                 int chans, int kind)
+{
+  switch (kind*4 + chans-1) {
+  case IMAGE_IL_8TO8*4 + 1: return image_il_unpack_ssse3(dst, plane, src, n, 2, IMAGE_IL_8TO8);
+  case IMAGE_IL_8TO8*4 + 2: return image_il_unpack_ssse3(dst, plane, src, n, 3, IMAGE_IL_8TO8);
+  case IMAGE_IL_8TO8*4 + 3: return image_il_unpack_ssse3(dst, plane, src, n, 4, IMAGE_IL_8TO8);
+  case IMAGE_IL_16TO16*4 + 0: return image_il_unpack_ssse3(dst, plane, src, n, 1, IMAGE_IL_16TO16);
+  case IMAGE_IL_16TO16*4 + 1: return image_il_unpack_ssse3(dst, plane, src, n, 2, IMAGE_IL_16TO16);
+  case IMAGE_IL_16TO16*4 + 2: return image_il_unpack_ssse3(dst, plane, src, n, 3, IMAGE_IL_16TO16);
+  case IMAGE_IL_16TO16*4 + 3: return image_il_unpack_ssse3(dst, plane, src, n, 4, IMAGE_IL_16TO16);
+  case IMAGE_IL_16TO8*4 + 0: return image_il_unpack_ssse3(dst, plane, src, n, 1, IMAGE_IL_16TO8);
+  case IMAGE_IL_16TO8*4 + 1: return image_il_unpack_ssse3(dst, plane, src, n, 2, IMAGE_IL_16TO8);
+  case IMAGE_IL_16TO8*4 + 2: return image_il_unpack_ssse3(dst, plane, src, n, 3, IMAGE_IL_16TO8);
+  case IMAGE_IL_16TO8*4 + 3: return image_il_unpack_ssse3(dst, plane, src, n, 4, IMAGE_IL_16TO8);
+  }
+  return 0;
+}
+
+IMAGE_SIMD_TARGET("ssse3")
+static long image_il_pack_simd(unsigned char *dst, const unsigned char *src, long plane, long n,
+                               int chans, int kind)
+{
+  switch (kind*4 + chans-1) {
+  case IMAGE_IL_8TO8*4 + 1: return image_il_pack_ssse3(dst, src, plane, n, 2, IMAGE_IL_8TO8);
+  case IMAGE_IL_8TO8*4 + 2: return image_il_pack_ssse3(dst, src, plane, n, 3, IMAGE_IL_8TO8);
+  case IMAGE_IL_8TO8*4 + 3: return image_il_pack_ssse3(dst, src, plane, n, 4, IMAGE_IL_8TO8);
+  case IMAGE_IL_16TO16*4 + 0: return image_il_pack_ssse3(dst, src, plane, n, 1, IMAGE_IL_16TO16);
+  case IMAGE_IL_16TO16*4 + 1: return image_il_pack_ssse3(dst, src, plane, n, 2, IMAGE_IL_16TO16);
+  case IMAGE_IL_16TO16*4 + 2: return image_il_pack_ssse3(dst, src, plane, n, 3, IMAGE_IL_16TO16);
+  case IMAGE_IL_16TO16*4 + 3: return image_il_pack_ssse3(dst, src, plane, n, 4, IMAGE_IL_16TO16);
+  }
+  return 0;
+}
+#endif
+
+/* Packed pixels of chans samples to planes, plane elements apart: 8-bit
+ * samples to 8-bit planes, 16-bit ones to native 16-bit planes, or to the
+ * 8-bit planes of their high bytes.
+ */
+static void image_il_unpack(void *dst, long plane, const unsigned char *src, long n,
+                            int chans, int kind)
+{
+  long i = 0;
+  int k;
+  if (chans == 1 && kind == IMAGE_IL_8TO8) {
+    memcpy(dst, src, n);
+    return;
+  }
+#if IMAGE_SIMD_X86
+  if (chans <= IMAGE_IL_CHANS && image_simd() >= IMAGE_SIMD_SSSE3) {
+    i = image_il_unpack_simd(dst, plane, src, n, chans, kind);
+  }
+#endif
+  for (k=0; k<chans; k++) {
+    long j;
+    if (kind == IMAGE_IL_16TO16) {
+      uint16_t *d = (uint16_t *)dst + k*plane;
+      const unsigned char *s = src + 2*k;
+      for (j=i; j<n; j++) {
+        d[j] = (s[2*chans*j] << 8) | s[2*chans*j+1];
+      }
+    } else {
+      const int es = (kind == IMAGE_IL_16TO8) ? 2 : 1;
+      unsigned char *d = (unsigned char *)dst + k*plane;
+      const unsigned char *s = src + es*k;
+      for (j=i; j<n; j++) {
+        d[j] = s[es*chans*j];
+      }
+    }
+  }
+}
+
+/* Planes of 8-bit or native 16-bit samples, plane elements apart, to
+ * packed pixels of chans samples (16-bit ones big-endian).
+ */
+static void image_il_pack(unsigned char *dst, const void *src, long plane, long n,
+                          int chans, int kind)
+{
+  long i = 0;
+  int k;
+  if (chans == 1 && kind == IMAGE_IL_8TO8) {
+    memcpy(dst, src, n);
+    return;
+  }
+#if IMAGE_SIMD_X86
+  if (chans <= IMAGE_IL_CHANS && image_simd() >= IMAGE_SIMD_SSSE3) {
+    i = image_il_pack_simd(dst, src, plane, n, chans, kind);
+  }
+#endif
+  for (k=0; k<chans; k++) {
+    long j;
+    if (kind == IMAGE_IL_16TO16) {
+      const uint16_t *s = (const uint16_t *)src + k*plane;
+      unsigned char *d = dst + 2*k;
+      for (j=i; j<n; j++) {
+        d[2*chans*j] = (unsigned char)(s[j] >> 8);
+        d[2*chans*j+1] = (unsigned char)s[j];
+      }
+    } else {
+      const unsigned char *s = (const unsigned char *)src + k*plane;
+      unsigned char *d = dst + k;
+      for (j=i; j<n; j++) {
+        d[chans*j] = s[j];
+      }
+    }
+  }
+}
+
+/* Widening conversions of 8 or 16-bit samples, as sample * scale + bias:
+ * the multiply and add are kept apart so that results match the scalar
+ * loops bit for bit.
+ */
+#if IMAGE_SIMD_X86
+IMAGE_SIMD_TARGET("sse2")
+static long image_il_widen_float_sse2(float *dst, const void *src, long n, int wide,
+                                      float scale, float bias)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 vs = _mm_set1_ps(scale), vb = _mm_set1_ps(bias);
+  long i;
+  for (i=0; i+8<=n; i+=8) {
+    const __m128i v = wide
+      ? _mm_loadu_si128((const __m128i *)((const uint16_t *)src + i))
+      : _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)((const unsigned char *)src + i)), zero);
+    const __m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+    const __m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, zero));
+    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(lo, vs), vb));
+    _mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_mul_ps(hi, vs), vb));
+  }
+  return i;
+}
+
+IMAGE_SIMD_TARGET("avx2")
+static long image_il_widen_float_avx2(float *dst, const void *src, long n, int wide,
+                                      float scale, float bias)
+{
+  const __m256 vs = _mm256_set1_ps(scale), vb = _mm256_set1_ps(bias);
+  long i;
+  for (i=0; i+8<=n; i+=8) {
+    const __m256i v = wide
+      ? _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)((const uint16_t *)src + i)))
+      : _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)((const unsigned char *)src + i)));
+    _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(_mm256_cvtepi32_ps(v), vs), vb));
+  }
+  return i;
+}
+
+IMAGE_SIMD_TARGET("sse2")
+static long image_il_widen_double_sse2(double *dst, const void *src, long n, int wide,
+                                       double scale, double bias)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128d vs = _mm_set1_pd(scale), vb = _mm_set1_pd(bias);
+  long i;
+  for (i=0; i+8<=n; i+=8) {
+    const __m128i v = wide
+      ? _mm_loadu_si128((const __m128i *)((const uint16_t *)src + i))
+      : _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)((const unsigned char *)src + i)), zero);
+    const __m128i lo = _mm_unpacklo_epi16(v, zero);
+    const __m128i hi = _mm_unpackhi_epi16(v, zero);
+    _mm_storeu_pd(dst + i, _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(lo), vs), vb));
+    _mm_storeu_pd(dst + i + 2, _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(lo, 8)), vs), vb));
+    _mm_storeu_pd(dst + i + 4, _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(hi), vs), vb));
+    _mm_storeu_pd(dst + i + 6, _mm_add_pd(_mm_mul_pd(_mm_cvtepi32_pd(_mm_srli_si128(hi, 8)), vs), vb));
+  }
+  return i;
+}
+
+IMAGE_SIMD_TARGET("avx2")
+static long image_il_widen_double_avx2(double *dst, const void *src, long n, int wide,
+                                       double scale, double bias)
+{
+  const __m256d vs = _mm256_set1_pd(scale), vb = _mm256_set1_pd(bias);
+  long i;
+  for (i=0; i+8<=n; i+=8) {
+    const __m256i v = wide
+      ? _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)((const uint16_t *)src + i)))
+      : _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)((const unsigned char *)src + i)));
+    const __m256d lo = _mm256_cvtepi32_pd(_mm256_castsi256_si128(v));
+    const __m256d hi = _mm256_cvtepi32_pd(_mm256_extracti128_si256(v, 1));
+    _mm256_storeu_pd(dst + i, _mm256_add_pd(_mm256_mul_pd(lo, vs), vb));
+    _mm256_storeu_pd(dst + i + 4, _mm256_add_pd(_mm256_mul_pd(hi, vs), vb));
+  }
+  return i;
+}
+
+/* Narrowing conversions to 8-bit samples, truncating as a cast does:
+ * min(max(v, 0), 255), clamped before the conversion so that values out of
+ * the int32 range saturate too (NaNs go to 0). */
+IMAGE_SIMD_TARGET("sse2")
+static long image_il_narrow_float_sse2(unsigned char *dst, const float *src, long n)
+{
+  const __m128 lo = _mm_setzero_ps(), hi = _mm_set1_ps(255.0f);
+  __m128i q[4];
+  long i;
+  int j;
+  for (i=0; i+16<=n; i+=16) {
+    for (j=0; j<4; j++) {
+      q[j] = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4*j), lo), hi));
+    }
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+  }
+  return i;
+}
+
+IMAGE_SIMD_TARGET("avx2")
+static long image_il_narrow_float_avx2(unsigned char *dst, const float *src, long n)
+{
+  const __m256 lo = _mm256_setzero_ps(), hi = _mm256_set1_ps(255.0f);
+  __m256i q[4];
+  long i;
+  int j;
+  for (i=0; i+32<=n; i+=32) {
+    for (j=0; j<4; j++) {
+      q[j] = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + i + 8*j), lo),
+                                               hi));
+    }
+    /* packs work within 128-bit lanes: put the quadwords back in order */
+    const __m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[0], q[1]), 0xd8);
+    const __m256i cd = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[2], q[3]), 0xd8);
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_permute4x64_epi64(_mm256_packus_epi16(ab, cd), 0xd8));
+  }
+  return i;
+}
+
+IMAGE_SIMD_TARGET("sse2")
+static long image_il_narrow_double_sse2(unsigned char *dst, const double *src, long n)
+{
+  const __m128d lo = _mm_setzero_pd(), hi = _mm_set1_pd(255.0);
+  __m128i q[4];
+  long i;
+  int j;
+  for (i=0; i+16<=n; i+=16) {
+    for (j=0; j<4; j++) {
+      const __m128d a = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(src + i + 4*j), lo), hi);
+      const __m128d b = _mm_min_pd(_mm_max_pd(_mm_loadu_pd(src + i + 4*j + 2), lo), hi);
+      q[j] = _mm_unpacklo_epi64(_mm_cvttpd_epi32(a), _mm_cvttpd_epi32(b));
+    }
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+  }
+  return i;
+}
+
+/* Quantizing conversions to 8-bit samples: min(max(v * maxval, 0), maxval)
+ * rounded (NaNs go to 0). */
+IMAGE_SIMD_TARGET("sse2")
+static long image_il_quantize_float_sse2(unsigned char *dst, const float *src, long n,
+                                         float maxval)
+{
+  const __m128 s = _mm_set1_ps(maxval);
+  const __m128 z = _mm_setzero_ps();
+  const __m128 h = _mm_set1_ps(0.5f);
+  long i;
+  int j;
+  for (i=0; i+16<=n; i+=16) {
+    __m128i q[4];
+    for (j=0; j<4; j++) {
+      const __m128 v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src + i + 4*j), s), z), s);
+      q[j] = _mm_cvttps_epi32(_mm_add_ps(v, h));
+    }
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+  }
+  return i;
+}
+
+IMAGE_SIMD_TARGET("avx2")
+static long image_il_quantize_float_avx2(unsigned char *dst, const float *src, long n,
+                                         float maxval)
+{
+  const __m256 s = _mm256_set1_ps(maxval);
+  const __m256 z = _mm256_setzero_ps();
+  const __m256 h = _mm256_set1_ps(0.5f);
+  long i;
+  int j;
+  for (i=0; i+32<=n; i+=32) {
+    __m256i q[4];
+    for (j=0; j<4; j++) {
+      const __m256 v = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8*j), s), z), s);
+      q[j] = _mm256_cvttps_epi32(_mm256_add_ps(v, h));
+    }
+    const __m256i ab = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[0], q[1]), 0xd8);
+    const __m256i cd = _mm256_permute4x64_epi64(_mm256_packs_epi32(q[2], q[3]), 0xd8);
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_permute4x64_epi64(_mm256_packus_epi16(ab, cd), 0xd8));
+  }
+  return i;
+}
+
+IMAGE_SIMD_TARGET("sse2")
+static long image_il_quantize_double_sse2(unsigned char *dst, const double *src, long n,
+                                          double maxval)
+{
+  const __m128d s = _mm_set1_pd(maxval);
+  const __m128d z = _mm_setzero_pd();
+  const __m128d h = _mm_set1_pd(0.5);
+  long i;
+  int j;
+  for (i=0; i+16<=n; i+=16) {
+    __m128i q[4];
+    for (j=0; j<4; j++) {
+      const __m128d a = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(src + i + 4*j), s), z), s);
+      const __m128d b = _mm_min_pd(_mm_max_pd(_mm_mul_pd(_mm_loadu_pd(src + i + 4*j + 2), s), z), s);
+      q[j] = _mm_unpacklo_epi64(_mm_cvttpd_epi32(_mm_add_pd(a, h)),
+                                _mm_cvttpd_epi32(_mm_add_pd(b, h)));
+    }
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3])));
+  }
+  return i;
+}
+#endif
+
+/* n 8-bit samples, or 16-bit ones if wide, to floats. */
+static void image_il_widen_float(float *dst, const void *src, long n, int wide,
+                                 float scale, float bias)
+{
+  long i = 0;
+#if IMAGE_SIMD_X86
+  const int level = image_simd();
+  if (level >= IMAGE_SIMD_AVX2) {
+    i = image_il_widen_float_avx2(dst, src, n, wide, scale, bias);
+  } else if (level >= IMAGE_SIMD_SSE2) {
+    i = image_il_widen_float_sse2(dst, src, n, wide, scale, bias);
+  }
+#endif
+  if (wide) {
+    for (; i<n; i++) {
+      dst[i] = ((const uint16_t *)src)[i] * scale + bias;
+    }
+  } else {
+    for (; i<n; i++) {
+      dst[i] = ((const unsigned char *)src)[i] * scale + bias;
+    }
+  }
+}
+
+/* n 8-bit samples, or 16-bit ones if wide, to doubles. */
+static void image_il_widen_double(double *dst, const void *src, long n, int wide,
+                                  double scale, double bias)
+{
+  long i = 0;
+#if IMAGE_SIMD_X86
+  const int level = image_simd();
+  if (level >= IMAGE_SIMD_AVX2) {
+    i = image_il_widen_double_avx2(dst, src, n, wide, scale, bias);
+  } else if (level >= IMAGE_SIMD_SSE2) {
+    i = image_il_widen_double_sse2(dst, src, n, wide, scale, bias);
+  }
+#endif
+  if (wide) {
+    for (; i<n; i++) {
+      dst[i] = ((const uint16_t *)src)[i] * scale + bias;
+    }
+  } else {
+    for (; i<n; i++) {
+      dst[i] = ((const unsigned char *)src)[i] * scale + bias;
+    }
+  }
+}
+
+/* A sample truncated to 0..255, as the SIMD kernels do: casting a value
+ * out of range, or NaN, is undefined.
+ */
+static inline unsigned char image_il_sat8(double v)
+{
+  return (v > 0) ? (v < 255 ? (unsigned char)v : 255) : 0;
+}
+
+/* The same, to 0..65535. */
+static inline uint16_t image_il_sat16(double v)
+{
+  return (v > 0) ? (v < 65535 ? (uint16_t)v : 65535) : 0;
+}
+
+/* n floats to 8-bit samples. */
+static void image_il_narrow_float(unsigned char *dst, const float *src, long n)
+{
+  long i = 0;
+#if IMAGE_SIMD_X86
+  const int level = image_simd();
+  if (level >= IMAGE_SIMD_AVX2) {
+    i = image_il_narrow_float_avx2(dst, src, n);
+  } else if (level >= IMAGE_SIMD_SSE2) {
+    i = image_il_narrow_float_sse2(dst, src, n);
+  }
+#endif
+  for (; i<n; i++) {
+    dst[i] = image_il_sat8(src[i]);
+  }
+}
+
+/* n doubles to 8-bit samples. */
+static void image_il_narrow_double(unsigned char *dst, const double *src, long n)
+{
+  long i = 0;
+#if IMAGE_SIMD_X86
+  if (image_simd() >= IMAGE_SIMD_SSE2) {
+    i = image_il_narrow_double_sse2(dst, src, n);
+  }
+#endif
+  for (; i<n; i++) {
+    dst[i] = image_il_sat8(src[i]);
+  }
+}
+
+/* The quantization asked for by argument idx of a saver: 0 or none to
+ * cast samples as they are, 1 to quantize [0, 1] samples to maxval, 2 to
+ * dither them too. Returns q, with the layout of a single plane of one row,
+ * or NULL.
+ */
+static image_quant *image_quant_check(lua_State *L, int idx, double maxval, image_quant *q)
+{
+  const int mode = (int)luaL_optinteger(L, idx, 0);
+  if (mode <= 0) {
+    return NULL;
+  }
+  q->maxval = maxval;
+  q->dither = (mode >= 2);
+  q->width = LONG_MAX;
+  q->step = 1;
+  q->y = 0;
+  return q;
+}
+
+/* n floats in [0, 1] quantized to 8-bit samples of up to maxval. */
+static void image_il_quantize_float(unsigned char *dst, const float *src, long n, float maxval)
+{
+  long i = 0;
+#if IMAGE_SIMD_X86
+  if (image_simd() >= IMAGE_SIMD_AVX2) {
+    i = image_il_quantize_float_avx2(dst, src, n, maxval);
+  } else if (image_simd() >= IMAGE_SIMD_SSE2) {
+    i = image_il_quantize_float_sse2(dst, src, n, maxval);
+  }
+#endif
+  for (; i<n; i++) {
+    float v = src[i] * maxval;
+    v = (v > 0) ? (v < maxval ? v : maxval) : 0;
+    dst[i] = (unsigned char)(v + 0.5f);
+  }
+}
+
+/* n doubles in [0, 1] quantized to 8-bit samples of up to maxval. */
+static void image_il_quantize_double(unsigned char *dst, const double *src, long n, double maxval)
+{
+  long i = 0;
+#if IMAGE_SIMD_X86
+  if (image_simd() >= IMAGE_SIMD_SSE2) {
+    i = image_il_quantize_double_sse2(dst, src, n, maxval);
+  }
+#endif
+  for (; i<n; i++) {
+    double v = src[i] * maxval;
+    v = (v > 0) ? (v < maxval ? v : maxval) : 0;
+    dst[i] = (unsigned char)(v + 0.5);
+  }
+}
+
+#define image_(NAME) TH_CONCAT_3(image_, Real, NAME)
+
+#include "generic/interleave.c"
+#include "THGenerateAllTypes.h"
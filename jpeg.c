@@ -3,6 +3,10 @@
 #include <luaT.h>
 #include <jpeglib.h>
 #include <setjmp.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #if LUA_VERSION_NUM >= 503
 #define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
@@ -39,9 +43,272 @@ jpeg_mem_dest_dummy(j_compress_ptr c, unsigned char **obuf, unsigned long *osiz)
 #define jpeg_mem_dest jpeg_mem_dest_dummy
 #endif
 
+/* Our extension of the JPEG error handler: see generic/jpeg.c. */
+struct my_error_mgr {
+  struct jpeg_error_mgr pub;	/* "public" fields */
+
+  jmp_buf setjmp_buffer;	/* for return to caller */
+
+  char msg[JMSG_LENGTH_MAX]; /* last error message */
+};
+
+typedef struct my_error_mgr * my_error_ptr;
+
+#define MJPEG_BUFSIZE (1 << 20)
+
+/* A Motion-JPEG stream: back-to-back JPEG images in a file or pipe. Frames
+ * are delimited by scanning their markers in a sliding window over the
+ * stream, and decoded from there by a decompressor kept across frames.
+ */
+typedef struct {
+  int fd;
+  int owned;              /* the descriptor was opened by us */
+  unsigned char *buf;
+  size_t cap;
+  size_t start;           /* start of the current frame */
+  size_t end;             /* end of valid data */
+  size_t scan;            /* where the marker scan resumes */
+  int soi;                /* the current frame's SOI was found */
+  int entropy;            /* the scan is in entropy-coded data */
+  struct jpeg_decompress_struct cinfo;
+  struct my_error_mgr jerr;
+} mjpeg_stream;
+
+/* Read more of the stream, making room first: the consumed part of the
+ * window is dropped, and the window grows if a frame fills it.
+ */
+static int mjpeg_fill(mjpeg_stream *s)
+{
+  if (s->end == s->cap) {
+    if (s->start > 0) {
+      memmove(s->buf, s->buf + s->start, s->end - s->start);
+      s->end -= s->start;
+      s->scan -= s->start;
+      s->start = 0;
+    } else {
+      unsigned char *b = realloc(s->buf, 2*s->cap);
+      if (!b) {
+        return 0;
+      }
+      s->buf = b;
+      s->cap *= 2;
+    }
+  }
+
+  ssize_t m;
+  do {
+    m = read(s->fd, s->buf + s->end, s->cap - s->end);
+  } while (m < 0 && errno == EINTR);
+  if (m <= 0) {
+    return 0;
+  }
+  s->end += m;
+  return 1;
+}
+
+#define MJPEG_FOUND      1
+#define MJPEG_MORE       0
+#define MJPEG_CORRUPTED -1
+
+/* Scan the buffered data for the end of the current frame. Segments are
+ * skipped by their length, and entropy-coded data up to the next marker,
+ * so that EOI markers of embedded thumbnails are never mistaken for the
+ * frame's own.
+ */
+static int mjpeg_scan(mjpeg_stream *s, size_t *len)
+{
+  const unsigned char *b = s->buf;
+  size_t p;
+
+  if (!s->soi) {
+    // skip anything before the SOI marker
+    while (s->start + 1 < s->end && !(b[s->start] == 0xFF && b[s->start+1] == 0xD8)) {
+      s->start++;
+    }
+    if (s->start + 1 >= s->end) {
+      return MJPEG_MORE;
+    }
+    s->soi = 1;
+    s->entropy = 0;
+    s->scan = s->start + 2;
+  }
+
+  p = s->scan;
+  for (;;) {
+    if (s->entropy) {
+      // stuffed bytes (FF 00) and restart markers belong to the data
+      while (p + 1 < s->end && !(b[p] == 0xFF && b[p+1] != 0x00 &&
+                                 (b[p+1] < 0xD0 || b[p+1] > 0xD7))) {
+        p++;
+      }
+      if (p + 1 >= s->end) {
+        s->scan = p;
+        return MJPEG_MORE;
+      }
+      s->entropy = 0;
+    }
+    if (p + 1 >= s->end) {
+      s->scan = p;
+      return MJPEG_MORE;
+    }
+    if (b[p] != 0xFF) {
+      return MJPEG_CORRUPTED;
+    }
+    const int marker = b[p+1];
+    if (marker == 0xFF) {
+      p++;                    // fill byte
+    } else if (marker == 0xD9) {
+      *len = p + 2 - s->start;
+      return MJPEG_FOUND;
+    } else if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      p += 2;                 // no payload
+    } else if (p + 3 >= s->end) {
+      s->scan = p;
+      return MJPEG_MORE;
+    } else {
+      p += 2 + ((b[p+2] << 8) | b[p+3]);
+      s->entropy = (marker == 0xDA);
+    }
+  }
+}
+
+/* Find the next frame, which then starts at s->start. Returns its length,
+ * 0 at the end of the stream or -1 if the stream is corrupted or truncated.
+ */
+static long mjpeg_next_frame(mjpeg_stream *s)
+{
+  size_t len;
+  for (;;) {
+    int res = mjpeg_scan(s, &len);
+    if (res == MJPEG_FOUND) {
+      return len;
+    } else if (res == MJPEG_CORRUPTED) {
+      return -1;
+    }
+    if (!mjpeg_fill(s)) {
+      // trailing bytes without an SOI are ignored
+      return s->soi ? -1 : 0;
+    }
+  }
+}
+
+/* Move past the current frame. */
+static void mjpeg_consume(mjpeg_stream *s, size_t len)
+{
+  s->start += len;
+  s->soi = 0;
+}
+
+#include "interleave.c"
+#include "normalize.c"
+#include "limits.c"
+
 #include "generic/jpeg.c"
 #include "THGenerateAllTypes.h"
 
+static int libjpeg_MJPEGStream_new(lua_State *L)
+{
+  mjpeg_stream *s = luaT_alloc(L, sizeof(mjpeg_stream));
+  s->fd = -1;
+  s->buf = NULL;
+  luaT_pushudata(L, s, "libjpeg.MJPEGStream");
+
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    const char *filename = lua_tostring(L, 1);
+    s->fd = open(filename, O_RDONLY);
+    if (s->fd < 0) {
+      luaL_error(L, "cannot open file <%s> for reading", filename);
+    }
+    s->owned = 1;
+  } else {
+    s->fd = luaL_checkint(L, 1);
+    if (s->fd < 0) {
+      luaL_argerror(L, 1, "invalid file descriptor");
+    }
+    s->owned = 0;
+  }
+
+  s->cap = MJPEG_BUFSIZE;
+  s->buf = malloc(s->cap);
+  if (!s->buf) {
+    /* no decompressor yet: close here, so that __gc does not destroy one */
+    if (s->owned) {
+      close(s->fd);
+    }
+    s->fd = -1;
+    luaL_error(L, "out of memory");
+  }
+  s->start = s->end = s->scan = 0;
+  s->soi = s->entropy = 0;
+
+  /* one decompressor for the whole stream */
+  s->cinfo.err = jpeg_std_error(&s->jerr.pub);
+  s->jerr.pub.error_exit = libjpeg_ByteMain_error;
+  s->jerr.pub.output_message = libjpeg_ByteMain_output_message;
+  jpeg_create_decompress(&s->cinfo);
+  return 1;
+}
+
+static void libjpeg_MJPEGStream_release(mjpeg_stream *s)
+{
+  if (s->fd >= 0) {
+    jpeg_destroy_decompress(&s->cinfo);
+    if (s->owned) {
+      close(s->fd);
+    }
+    s->fd = -1;
+  }
+  free(s->buf);
+  s->buf = NULL;
+}
+
+/* skip(n): skip n frames, scanning their markers without decoding them.
+ * Returns the number of frames skipped, less than n at the end of the stream.
+ */
+static int libjpeg_MJPEGStream_skip(lua_State *L)
+{
+  mjpeg_stream *s = luaT_checkudata(L, 1, "libjpeg.MJPEGStream");
+  const long n = luaL_optlong(L, 2, 1);
+  long i, len = 0;
+  if (s->fd < 0) {
+    luaL_error(L, "attempt to read from a closed stream");
+  }
+  for (i=0; i<n; i++) {
+    len = mjpeg_next_frame(s);
+    if (len <= 0) {
+      break;
+    }
+    mjpeg_consume(s, len);
+  }
+  if (len < 0) {
+    luaL_error(L, "corrupted stream");
+  }
+  lua_pushnumber(L, i);
+  return 1;
+}
+
+static int libjpeg_MJPEGStream_close(lua_State *L)
+{
+  mjpeg_stream *s = luaT_checkudata(L, 1, "libjpeg.MJPEGStream");
+  libjpeg_MJPEGStream_release(s);
+  return 0;
+}
+
+static int libjpeg_MJPEGStream_free(lua_State *L)
+{
+  mjpeg_stream *s = luaT_checkudata(L, 1, "libjpeg.MJPEGStream");
+  libjpeg_MJPEGStream_release(s);
+  luaT_free(L, s);
+  return 0;
+}
+
+static const luaL_Reg libjpeg_MJPEGStream__[] =
+{
+  {"skip", libjpeg_MJPEGStream_skip},
+  {"close", libjpeg_MJPEGStream_close},
+  {NULL, NULL}
+};
+
 DLL_EXPORT int luaopen_libjpeg(lua_State *L)
 {
   libjpeg_FloatMain_init(L);
@@ -52,6 +319,11 @@ DLL_EXPORT int luaopen_libjpeg(lua_State *L)
   lua_pushvalue(L, -1);
   lua_setglobal(L, "libjpeg");
 
+  luaT_newmetatable(L, "libjpeg.MJPEGStream", NULL,
+                    libjpeg_MJPEGStream_new, libjpeg_MJPEGStream_free, NULL);
+  luaT_setfuncs(L, libjpeg_MJPEGStream__, 0);
+  lua_pop(L, 1);
+
   lua_newtable(L);
   luaT_setfuncs(L, libjpeg_DoubleMain__, 0);
   lua_setfield(L, -2, "double");
@@ -64,5 +336,16 @@ DLL_EXPORT int luaopen_libjpeg(lua_State *L)
   luaT_setfuncs(L, libjpeg_ByteMain__, 0);
   lua_setfield(L, -2, "byte");
 
+  lua_pushcfunction(L, image_simd_lua);
+  lua_setfield(L, -2, "simd");
+
+  /* without jpeg_mem_src, load and MJPEGStream only read files */
+#if defined(HAVE_JPEG_MEM_SRC)
+  lua_pushboolean(L, 1);
+#else
+  lua_pushboolean(L, 0);
+#endif
+  lua_setfield(L, -2, "hasMemSrc");
+
   return 1;
 }
@@ -0,0 +1,57 @@
+
+/* Limits on the size of the images the decoders produce (image.setLimits),
+ * checked against the dimensions in their headers before anything is
+ * allocated: a few kilobytes of PNG can claim 60000x60000 pixels. The
+ * options table of the decoders carries them as
+ *
+ *   {maxPixels=, maxBytes=, downscale=}
+ *
+ * maxPixels bounds H*W, maxBytes the decoded tensor; 0 or nil is no limit.
+ * With downscale, JPEG images too large are decoded at 1/2, 1/4 or 1/8 of
+ * their size (DCT scaling) when that fits, instead of failing.
+ */
+typedef struct {
+  double pixels;
+  double bytes;
+  int downscale;
+} image_limits;
+
+static double image_limits_number(lua_State *L, int idx, const char *field)
+{
+  double v;
+  lua_getfield(L, idx, field);
+  v = lua_isnumber(L, -1) ? lua_tonumber(L, -1) : 0;
+  lua_pop(L, 1);
+  return (v > 0) ? v : 0;
+}
+
+/* Reads the limits in the options table at idx, if any: none without one. */
+static void image_limits_check(lua_State *L, int idx, image_limits *l)
+{
+  memset(l, 0, sizeof(*l));
+  if (!lua_istable(L, idx)) {
+    return;
+  }
+  l->pixels = image_limits_number(L, idx, "maxPixels");
+  l->bytes = image_limits_number(L, idx, "maxBytes");
+  lua_getfield(L, idx, "downscale");
+  l->downscale = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+}
+
+/* NULL when a W x H image of C channels, of elem bytes each, is within the
+ * limits, or which one it exceeds.
+ */
+static const char *image_limits_exceeded(const image_limits *l, double W, double H,
+                                         double C, size_t elem)
+{
+  if (l->pixels && W * H > l->pixels) {
+    return "maxPixels";
+  }
+  if (l->bytes && W * H * C * elem > l->bytes) {
+    return "maxBytes";
+  }
+  return NULL;
+}
+
+#define IMAGE_LIMITS_ERR_MSG "%ldx%ld image exceeds the %s limit (see image.setLimits)"
@@ -0,0 +1,2330 @@
+
+/* pread, posix_fadvise and O_CLOEXEC under -std=c99 (and cpu_set_t for
+ * liburing.h)
+ */
+#define _GNU_SOURCE
+
+#include <TH.h>
+#include <luaT.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(HAVE_LIBURING)
+#include <liburing.h>
+#endif
+
+#if defined(HAVE_JPEG)
+#include <jpeglib.h>
+#include <jerror.h>
+#endif
+#if defined(HAVE_PNG)
+#include <png.h>
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
+#define luaL_optint(L,n,d)      ((int)luaL_optinteger(L, (n), (d)))
+#endif
+
+#define torch_(NAME) TH_CONCAT_3(torch_, Real, NAME)
+#define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
+#define libloader_(NAME) TH_CONCAT_3(libloader_, Real, NAME)
+
+/* Everything up to the Lua bindings runs on worker threads: it never
+ * touches the Lua state, and reports errors through a message buffer.
+ */
+#define LOADER_ERRLEN 256
+
+/* A decoded image: 8-bit samples, interleaved (HxWxC). */
+typedef struct {
+  unsigned char *data;
+  size_t cap;
+  long C, H, W;
+} loader_image;
+
+static int loader_fail(char *err, const char *msg)
+{
+  snprintf(err, LOADER_ERRLEN, "%s", msg);
+  return 0;
+}
+
+static int loader_reserve(unsigned char **buf, size_t *cap, size_t n)
+{
+  if (n > *cap) {
+    unsigned char *b = realloc(*buf, n);
+    if (!b) {
+      return 0;
+    }
+    *buf = b;
+    *cap = n;
+  }
+  return 1;
+}
+
+/* Limits on the images the workers decode (image.setLimits): pixels and
+ * bytes of a decoded image, 0 for none. setLimits can change them while
+ * the threads of a Prefetcher decode, so they are accessed atomically.
+ */
+static struct {
+  double pixels;
+  double bytes;
+} loader_limits = {0, 0};
+
+static double loader_limit(double *limit)
+{
+  double v;
+  __atomic_load(limit, &v, __ATOMIC_RELAXED);
+  return v;
+}
+
+/* Checks a C x H x W image against the limits, from its header. */
+static int loader_within_limits(long C, long H, long W, char *err)
+{
+  const double pixels = loader_limit(&loader_limits.pixels);
+  const double bytes = loader_limit(&loader_limits.bytes);
+  if (pixels && (double)H*W > pixels) {
+    snprintf(err, LOADER_ERRLEN, "%ldx%ld image exceeds the maxPixels limit", W, H);
+    return 0;
+  }
+  if (bytes && (double)C*H*W > bytes) {
+    snprintf(err, LOADER_ERRLEN, "%ldx%ld image exceeds the maxBytes limit", W, H);
+    return 0;
+  }
+  return 1;
+}
+
+static int loader_alloc(loader_image *img, long C, long H, long W, char *err)
+{
+  img->C = C;
+  img->H = H;
+  img->W = W;
+  if (W <= 0 || H <= 0 || W > (1L << 24) || H > (1L << 24)) {
+    return loader_fail(err, "image size not supported");
+  }
+  if (!loader_within_limits(C, H, W, err)) {
+    return 0;
+  }
+  if (!loader_reserve(&img->data, &img->cap, (size_t)C*H*W)) {
+    return loader_fail(err, "out of memory");
+  }
+  return 1;
+}
+
+/* Reading files. Workers read a run of up to LOADER_READ_MAX files ahead of
+ * decoding them: each file is opened once and read whole into a buffer of
+ * its own, either all at once through an io_uring (with HAVE_LIBURING, when
+ * the kernel allows it) or with pread, once posix_fadvise(WILLNEED) has got
+ * the kernel fetching every file of the run. Runs are sized so that about
+ * LOADER_READ_INFLIGHT reads are in flight across the workers.
+ */
+#define LOADER_READ_MAX      64
+#define LOADER_READ_INFLIGHT 256
+
+typedef struct {
+  int fd;
+  unsigned char *buf;
+  size_t cap;
+  size_t len;           /* size of the file */
+  size_t done;          /* bytes read so far */
+  int error;            /* errno of a failed open or read */
+  int pending;          /* queued on the ring */
+} loader_read;
+
+typedef struct {
+  loader_read reads[LOADER_READ_MAX];
+  long count;
+#if defined(HAVE_LIBURING)
+  struct io_uring ring;
+  int ring_state;       /* 0 not set up yet, 1 ready, -1 unavailable */
+#endif
+} loader_reader;
+
+/* Run length for each of nthreads workers, to keep inflight reads going. */
+static long loader_read_depth(long inflight, long nthreads)
+{
+  const long depth = inflight / (nthreads > 0 ? nthreads : 1);
+  return depth < 1 ? 1 : (depth > LOADER_READ_MAX ? LOADER_READ_MAX : depth);
+}
+
+static void loader_read_open(loader_read *rd, const char *filename, int hint)
+{
+  struct stat st;
+  rd->fd = open(filename, O_RDONLY | O_CLOEXEC);
+  if (rd->fd < 0) {
+    rd->error = errno;
+    return;
+  }
+  if (fstat(rd->fd, &st) < 0 ||
+      !loader_reserve(&rd->buf, &rd->cap, st.st_size > 0 ? st.st_size : 1)) {
+    rd->error = errno ? errno : ENOMEM;
+    close(rd->fd);
+    rd->fd = -1;
+    return;
+  }
+  rd->len = st.st_size;
+#if defined(POSIX_FADV_WILLNEED)
+  if (hint) {
+    posix_fadvise(rd->fd, 0, 0, POSIX_FADV_WILLNEED);
+  }
+#endif
+}
+
+/* Open the files of a run (NULL names are items held in memory) and start
+ * reading them.
+ */
+static void loader_reader_start(loader_reader *r, const char *const *filenames,
+                                long count)
+{
+  int ring = 0;
+  long k;
+#if defined(HAVE_LIBURING)
+  if (count > 1 && r->ring_state == 0) {
+    r->ring_state = (io_uring_queue_init(LOADER_READ_MAX, &r->ring, 0) == 0) ? 1 : -1;
+  }
+  ring = (count > 1 && r->ring_state == 1);
+#endif
+  r->count = count;
+  for (k=0; k<count; k++) {
+    loader_read *rd = &r->reads[k];
+    rd->fd = -1;
+    rd->len = rd->done = 0;
+    rd->error = 0;
+    rd->pending = 0;
+    if (!filenames[k]) {
+      continue;
+    }
+    // hints only help when there is more than one file to overlap
+    loader_read_open(rd, filenames[k], count > 1 && !ring);
+#if defined(HAVE_LIBURING)
+    struct io_uring_sqe *sqe;
+    if (ring && rd->fd >= 0 && rd->len > 0 && (sqe = io_uring_get_sqe(&r->ring))) {
+      io_uring_prep_read(sqe, rd->fd, rd->buf, rd->len, 0);
+      io_uring_sqe_set_data(sqe, rd);
+      rd->pending = 1;
+    }
+#endif
+  }
+#if defined(HAVE_LIBURING)
+  if (ring) {
+    // whatever is not taken now is submitted again while waiting
+    io_uring_submit(&r->ring);
+  }
+#endif
+}
+
+#if defined(HAVE_LIBURING)
+/* Reap completions until rd is done. Short or failed reads are finished
+ * with pread.
+ */
+static void loader_reader_wait(loader_reader *r, loader_read *rd)
+{
+  long k;
+  while (rd->pending) {
+    struct io_uring_cqe *cqe;
+    if (io_uring_peek_cqe(&r->ring, &cqe) != 0) {
+      const int res = io_uring_submit_and_wait(&r->ring, 1);
+      if (res < 0 && res != -EINTR && res != -EAGAIN && res != -EBUSY) {
+        // the ring is broken: leave the reads to pread
+        for (k=0; k<r->count; k++) {
+          r->reads[k].pending = 0;
+        }
+        io_uring_queue_exit(&r->ring);
+        r->ring_state = -1;
+      }
+      continue;
+    }
+    loader_read *done = io_uring_cqe_get_data(cqe);
+    if (cqe->res > 0) {
+      done->done = cqe->res;
+    }
+    done->pending = 0;
+    io_uring_cqe_seen(&r->ring, cqe);
+  }
+}
+#endif
+
+/* The contents of file k of the run, once read. The file is closed. */
+static int loader_reader_get(loader_reader *r, long k, const char *filename,
+                             const unsigned char **p, size_t *len, char *err)
+{
+  loader_read *rd = &r->reads[k];
+  const int opened = (rd->fd >= 0);
+#if defined(HAVE_LIBURING)
+  loader_reader_wait(r, rd);
+#endif
+  while (!rd->error && rd->done < rd->len) {
+    const ssize_t n = pread(rd->fd, rd->buf + rd->done, rd->len - rd->done, rd->done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      rd->error = errno;
+    } else if (n == 0) {
+      // the file shrank
+      rd->len = rd->done;
+    } else {
+      rd->done += n;
+    }
+  }
+  if (rd->fd >= 0) {
+    close(rd->fd);
+    rd->fd = -1;
+  }
+  if (rd->error) {
+    snprintf(err, LOADER_ERRLEN, opened ? "cannot read file <%s> (%s)"
+                                        : "cannot open file <%s> for reading (%s)",
+             filename, strerror(rd->error));
+    return 0;
+  }
+  *p = rd->buf;
+  *len = rd->len;
+  return 1;
+}
+
+/* Wait for reads still in flight and close what is left of the run. */
+static void loader_reader_finish(loader_reader *r)
+{
+  long k;
+  for (k=0; k<r->count; k++) {
+#if defined(HAVE_LIBURING)
+    loader_reader_wait(r, &r->reads[k]);
+#endif
+    if (r->reads[k].fd >= 0) {
+      close(r->reads[k].fd);
+      r->reads[k].fd = -1;
+    }
+  }
+  r->count = 0;
+}
+
+static void loader_reader_free(loader_reader *r)
+{
+  long k;
+  loader_reader_finish(r);
+  for (k=0; k<LOADER_READ_MAX; k++) {
+    free(r->reads[k].buf);
+  }
+#if defined(HAVE_LIBURING)
+  if (r->ring_state == 1) {
+    io_uring_queue_exit(&r->ring);
+  }
+#endif
+}
+
+/* Binary PGM (P5) and PPM (P6), 8 or 16-bit. */
+static int loader_ppm_int(const unsigned char *p, size_t len, size_t *pos, long *v)
+{
+  size_t i = *pos;
+  for (;;) {
+    while (i < len && (p[i] == ' ' || p[i] == '\t' || p[i] == '\r' || p[i] == '\n')) {
+      i++;
+    }
+    if (i < len && p[i] == '#') {
+      while (i < len && p[i] != '\n') {
+        i++;
+      }
+    } else {
+      break;
+    }
+  }
+  if (i >= len || p[i] < '0' || p[i] > '9') {
+    return 0;
+  }
+  *v = 0;
+  while (i < len && p[i] >= '0' && p[i] <= '9' && *v < (1L << 24)) {
+    *v = *v * 10 + (p[i++] - '0');
+  }
+  *pos = i;
+  return 1;
+}
+
+/* Scale a sample to 0..255; samples above maxval are clamped to it. */
+static inline unsigned char loader_ppm_scale(long v, long D)
+{
+  return (v >= D) ? 255 : (unsigned char)((v * 255 + D/2) / D);
+}
+
+/* Parse the header: returns the offset of the samples, or 0. */
+static size_t loader_ppm_header(const unsigned char *p, size_t len,
+                                long *W, long *H, long *D, char *err)
+{
+  size_t pos = 2;
+  if (!loader_ppm_int(p, len, &pos, W) || !loader_ppm_int(p, len, &pos, H) ||
+      !loader_ppm_int(p, len, &pos, D) || *W < 1 || *H < 1 || *D < 1 || *D > 65535 ||
+      pos >= len) {
+    return loader_fail(err, "corrupted PPM header");
+  }
+  // single whitespace before the samples
+  return pos + 1;
+}
+
+static int loader_decode_ppm(const unsigned char *p, size_t len, loader_image *img,
+                             int header_only, char *err)
+{
+  const long C = (p[1] == '6') ? 3 : 1;
+  long W, H, D, i;
+  const size_t pos = loader_ppm_header(p, len, &W, &H, &D, err);
+  if (!pos) {
+    return 0;
+  }
+  if (header_only) {
+    img->C = C; img->H = H; img->W = W;
+    return 1;
+  }
+  if (!loader_alloc(img, C, H, W, err)) {
+    return 0;
+  }
+  const long n = C*H*W;
+  const int wide = (D > 255);
+  if (len - pos < (size_t)n << wide) {
+    return loader_fail(err, "truncated PPM file");
+  }
+  p += pos;
+  if (D == 255) {
+    memcpy(img->data, p, n);
+  } else if (!wide) {
+    for (i=0; i<n; i++) {
+      img->data[i] = loader_ppm_scale(p[i], D);
+    }
+  } else {
+    for (i=0; i<n; i++) {
+      img->data[i] = loader_ppm_scale((p[2*i] << 8) | p[2*i+1], D);
+    }
+  }
+  return 1;
+}
+
+#if defined(HAVE_JPEG)
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+  char *err;
+} loader_jpeg_error;
+
+static void loader_jpeg_error_exit(j_common_ptr cinfo)
+{
+  loader_jpeg_error *jerr = (loader_jpeg_error *)cinfo->err;
+  char msg[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, msg);
+  snprintf(jerr->err, LOADER_ERRLEN, "%s", msg);
+  longjmp(jerr->setjmp_buffer, 1);
+}
+
+static void loader_jpeg_output_message(j_common_ptr cinfo)
+{
+  // warnings (e.g. on truncated files) must not go to stderr from workers
+}
+
+/* A memory source, so as not to depend on jpeg_mem_src (libjpeg v8+). */
+static void loader_jpeg_init_source(j_decompress_ptr cinfo)
+{
+}
+
+static boolean loader_jpeg_fill_input_buffer(j_decompress_ptr cinfo)
+{
+  static const JOCTET eoi[2] = {0xFF, JPEG_EOI};
+  // premature end of data: insert a fake EOI, as jdatasrc.c does
+  WARNMS(cinfo, JWRN_JPEG_EOF);
+  cinfo->src->next_input_byte = eoi;
+  cinfo->src->bytes_in_buffer = 2;
+  return TRUE;
+}
+
+static void loader_jpeg_skip_input_data(j_decompress_ptr cinfo, long n)
+{
+  struct jpeg_source_mgr *src = cinfo->src;
+  if (n > 0) {
+    while (n > (long)src->bytes_in_buffer) {
+      n -= (long)src->bytes_in_buffer;
+      (*src->fill_input_buffer)(cinfo);
+    }
+    src->next_input_byte += n;
+    src->bytes_in_buffer -= n;
+  }
+}
+
+static void loader_jpeg_term_source(j_decompress_ptr cinfo)
+{
+}
+
+static void loader_jpeg_source(j_decompress_ptr cinfo, struct jpeg_source_mgr *src,
+                               const unsigned char *p, size_t len)
+{
+  src->init_source = loader_jpeg_init_source;
+  src->fill_input_buffer = loader_jpeg_fill_input_buffer;
+  src->skip_input_data = loader_jpeg_skip_input_data;
+  src->resync_to_restart = jpeg_resync_to_restart;
+  src->term_source = loader_jpeg_term_source;
+  src->next_input_byte = p;
+  src->bytes_in_buffer = len;
+  cinfo->src = src;
+}
+
+static int loader_decode_jpeg(const unsigned char *p, size_t len, loader_image *img,
+                              int header_only, char *err)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_source_mgr src;
+  loader_jpeg_error jerr;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = loader_jpeg_error_exit;
+  jerr.pub.output_message = loader_jpeg_output_message;
+  jerr.err = err;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+  }
+  jpeg_create_decompress(&cinfo);
+  loader_jpeg_source(&cinfo, &src, p, len);
+
+  jpeg_read_header(&cinfo, TRUE);
+  if (header_only) {
+    img->C = (cinfo.num_components == 1) ? 1 : 3;
+    img->H = cinfo.image_height;
+    img->W = cinfo.image_width;
+    jpeg_destroy_decompress(&cinfo);
+    return 1;
+  }
+  if (cinfo.jpeg_color_space != JCS_GRAYSCALE) {
+    cinfo.out_color_space = JCS_RGB;
+  }
+  // progressive images hold all their coefficients: check before starting
+  if (!loader_within_limits(cinfo.num_components == 1 ? 1 : 3, cinfo.image_height,
+                            cinfo.image_width, err)) {
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+  }
+  jpeg_start_decompress(&cinfo);
+  if (!loader_alloc(img, cinfo.output_components, cinfo.output_height,
+                    cinfo.output_width, err)) {
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+  }
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = img->data + (size_t)cinfo.output_scanline * img->W * img->C;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return 1;
+}
+#endif
+
+#if defined(HAVE_PNG)
+typedef struct {
+  const unsigned char *p;
+  size_t len;
+  size_t pos;
+  char *err;
+} loader_png_source;
+
+static void loader_png_error_fn(png_structp png_ptr, png_const_charp msg)
+{
+  loader_png_source *src = png_get_error_ptr(png_ptr);
+  snprintf(src->err, LOADER_ERRLEN, "%s", msg);
+  longjmp(png_jmpbuf(png_ptr), 1);
+}
+
+static void loader_png_warning_fn(png_structp png_ptr, png_const_charp msg)
+{
+}
+
+static void loader_png_read_fn(png_structp png_ptr, png_bytep dest, png_size_t n)
+{
+  loader_png_source *src = png_get_io_ptr(png_ptr);
+  if (n > src->len - src->pos) {
+    png_error(png_ptr, "truncated PNG file");
+  }
+  memcpy(dest, src->p + src->pos, n);
+  src->pos += n;
+}
+
+/* 16-bit samples are reduced to 8 bits; palettes are expanded to RGB. */
+static int loader_decode_png(const unsigned char *p, size_t len, loader_image *img,
+                             int header_only, char *err)
+{
+  loader_png_source src = {p, len, 0, err};
+  png_structp png_ptr;
+  png_infop info_ptr = NULL;
+  long y;
+  int pass;
+
+  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, &src,
+                                   loader_png_error_fn, loader_png_warning_fn);
+  if (!png_ptr || !(info_ptr = png_create_info_struct(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, NULL, NULL);
+    return loader_fail(err, "out of memory");
+  }
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return 0;
+  }
+  png_set_read_fn(png_ptr, &src, loader_png_read_fn);
+  png_read_info(png_ptr, info_ptr);
+
+  const int color_type = png_get_color_type(png_ptr, info_ptr);
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb(png_ptr);
+  } else if (color_type == PNG_COLOR_TYPE_GRAY) {
+    png_set_expand_gray_1_2_4_to_8(png_ptr);
+  }
+  png_set_strip_16(png_ptr);
+  const int passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  const long C = png_get_channels(png_ptr, info_ptr);
+  const long H = png_get_image_height(png_ptr, info_ptr);
+  const long W = png_get_image_width(png_ptr, info_ptr);
+  if (header_only) {
+    img->C = C; img->H = H; img->W = W;
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return 1;
+  }
+  if (!loader_alloc(img, C, H, W, err)) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return 0;
+  }
+  // interlaced rows are refined in place, pass after pass
+  for (pass=0; pass<passes; pass++) {
+    for (y=0; y<H; y++) {
+      png_read_row(png_ptr, img->data + y*W*C, NULL);
+    }
+  }
+  png_read_end(png_ptr, NULL);
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  return 1;
+}
+#endif
+
+/* Sniff the format from the magic number, and decode (or, with header_only,
+ * just find the size of) an image held in memory.
+ */
+static int loader_decode(const unsigned char *p, size_t len, loader_image *img,
+                         int header_only, char *err)
+{
+  if (len >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff) {
+#if defined(HAVE_JPEG)
+    return loader_decode_jpeg(p, len, img, header_only, err);
+#else
+    return loader_fail(err, "JPEG support was not compiled in");
+#endif
+  }
+  if (len >= 8 && !memcmp(p, "\x89PNG", 4)) {
+#if defined(HAVE_PNG)
+    return loader_decode_png(p, len, img, header_only, err);
+#else
+    return loader_fail(err, "PNG support was not compiled in");
+#endif
+  }
+  if (len >= 3 && p[0] == 'P' && (p[1] == '5' || p[1] == '6')) {
+    return loader_decode_ppm(p, len, img, header_only, err);
+  }
+  return loader_fail(err, "unknown image format (expecting JPEG, PNG or binary PPM/PGM)");
+}
+
+/* One item of a batch: a file name or an encoded image in memory. */
+typedef struct {
+  const char *filename;
+  const unsigned char *bytes;
+  size_t len;
+  THByteTensor *blob;   /* holding bytes */
+} loader_item;
+
+/* Per-thread scratch buffers, reused from item to item. */
+typedef struct {
+  loader_reader reader;
+  loader_image img;
+  float *tmp;
+  size_t tmp_cap;
+  char err[LOADER_ERRLEN];
+} loader_worker;
+
+static void loader_worker_free(loader_worker *w)
+{
+  loader_reader_free(&w->reader);
+  free(w->img.data);
+  free(w->tmp);
+}
+
+/* Decode item, the k-th of the worker's current run of reads. */
+static int loader_decode_read(loader_worker *w, const loader_item *item, long k,
+                              int header_only)
+{
+  const unsigned char *p = item->bytes;
+  size_t len = item->len;
+  if (item->filename &&
+      !loader_reader_get(&w->reader, k, item->filename, &p, &len, w->err)) {
+    return 0;
+  }
+  return loader_decode(p, len, &w->img, header_only, w->err);
+}
+
+/* Decode a single item with the worker's buffers. */
+static int loader_decode_item(loader_worker *w, const loader_item *item, int header_only)
+{
+  loader_reader_start(&w->reader, &item->filename, 1);
+  return loader_decode_read(w, item, 0, header_only);
+}
+
+/* Where each output channel comes from: a source channel, the luminance of
+ * the RGB channels, or an opaque alpha. This mirrors image.load's depth
+ * conversions.
+ */
+#define LOADER_LUMA   -1
+#define LOADER_OPAQUE -2
+
+static void loader_channel_map(long sc, long dc, int *map)
+{
+  long k;
+  for (k=0; k<dc; k++) {
+    const int alpha = (dc == 2 || dc == 4) && k == dc-1;
+    if (alpha) {
+      map[k] = (sc == 2 || sc == 4) ? sc-1 : LOADER_OPAQUE;
+    } else if (sc >= 3) {
+      map[k] = (dc <= 2) ? LOADER_LUMA : k;
+    } else {
+      map[k] = 0;
+    }
+  }
+}
+
+static inline float loader_sample(const unsigned char *px, int m)
+{
+  if (m >= 0) {
+    return px[m];
+  }
+  if (m == LOADER_LUMA) {
+    return 0.299f*px[0] + 0.587f*px[1] + 0.114f*px[2];
+  }
+  return 255;
+}
+
+/* Resample one line like image.scale (bilinear): interpolate when growing,
+ * average the covered source samples when shrinking.
+ */
+static void loader_scale_line(const float *src, long sstride, long slen,
+                              float *dst, long dstride, long dlen)
+{
+  long di, si;
+  if (dlen == slen) {
+    for (di=0; di<dlen; di++) {
+      dst[di*dstride] = src[di*sstride];
+    }
+  } else if (dlen > slen) {
+    const float scale = (dlen > 1) ? (float)(slen - 1) / (dlen - 1) : 0;
+    for (di=0; di<dlen-1; di++) {
+      float f = di * scale;
+      long i = (long)f;
+      f -= i;
+      dst[di*dstride] = (slen == 1) ? src[0] :
+        (1 - f) * src[i*sstride] + f * src[(i+1)*sstride];
+    }
+    dst[(dlen-1)*dstride] = src[(slen-1)*sstride];
+  } else {
+    const float scale = (float)slen / dlen;
+    long i0 = 0, i1;
+    float f0 = 0, f1;
+    for (di=0; di<dlen; di++) {
+      f1 = (di + 1) * scale;
+      i1 = (long)f1;
+      f1 -= i1;
+      float acc = (1 - f0) * src[i0*sstride];
+      float n = 1 - f0;
+      for (si=i0+1; si<i1; si++) {
+        acc += src[si*sstride];
+        n += 1;
+      }
+      if (i1 < slen) {
+        acc += f1 * src[i1*sstride];
+        n += f1;
+      }
+      dst[di*dstride] = acc / n;
+      i0 = i1;
+      f0 = f1;
+    }
+  }
+}
+
+/* A batch being loaded: workers pull runs of items off a shared counter. */
+typedef struct {
+  const loader_item *items;
+  long n;
+  long next;
+  long nthreads;
+  pthread_mutex_t mutex;
+  void *out;            /* the NxCxHxW data */
+  long C, H, W;
+  char **errors;        /* per item, NULL on success */
+} loader_batch;
+
+/* Claim the next run of up to depth items, starting at *first. What is left
+ * is shared between the workers, so that none sits idle at the end.
+ */
+static long loader_batch_claim(loader_batch *b, long depth, long *first)
+{
+  pthread_mutex_lock(&b->mutex);
+  const long left = b->n - b->next;
+  long count = (left + b->nthreads - 1) / b->nthreads;
+  if (count > depth) {
+    count = depth;
+  }
+  *first = b->next;
+  b->next += count;
+  pthread_mutex_unlock(&b->mutex);
+  return count;
+}
+
+static long loader_default_threads(void)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n > 0 ? n : 1;
+}
+
+static char *loader_strdup(const char *str)
+{
+  char *copy = malloc(strlen(str) + 1);
+  if (copy) {
+    strcpy(copy, str);
+  }
+  return copy;
+}
+
+/* Decoded images cached on disk: one file per source file and set of load
+ * options, so that later loads read (or map) the samples back instead of
+ * decoding. A cache file holds a header, its key and the samples:
+ *
+ *   loader_cache_header
+ *   key                   padded to LOADER_CACHE_ALIGN
+ *   samples               ndim = 2 (HxW) or 3 (CxHxW), of elsize bytes
+ *
+ * The header also records the size of the decoded source, which batch
+ * entries are resized from: hits are checked against the limits with it,
+ * as the decoders check headers, and those over them are misses.
+ *
+ * The key holds the tensor type, the load options, the modification time,
+ * size and inode of the source, and its canonical path. Files are named
+ * after a hash of the key, which is checked on lookup. A hit touches the
+ * file, and once the files outgrow the budget, the least recently used are
+ * removed first. Files are written under a temporary name and renamed, so
+ * that processes can share a cache directory.
+ */
+#define LOADER_CACHE_MAGIC  "TIMGDC02"
+#define LOADER_CACHE_ALIGN  64
+#define LOADER_CACHE_KEYLEN (PATH_MAX + 256)
+#define LOADER_CACHE_SUFFIX ".tc"
+
+typedef struct {
+  char magic[8];
+  uint32_t elsize;
+  uint32_t ndim;
+  uint32_t C, H, W;
+  uint32_t srcC, srcH, srcW;  /* of the decoded source */
+  uint32_t keylen;
+} loader_cache_header;
+
+typedef struct {
+  long ndim, C, H, W;
+  size_t offset;        /* of the samples */
+  size_t size;          /* of the samples, in bytes */
+} loader_cache_entry;
+
+static struct {
+  pthread_mutex_t mutex;
+  char *dir;            /* NULL when the cache is off */
+  uint64_t budget;      /* in bytes, 0 for no limit */
+  uint64_t used;        /* by the cache files, as last counted */
+} loader_cache = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0};
+
+#if defined(__APPLE__)
+#define loader_mtime(st) ((st)->st_mtimespec)
+#else
+#define loader_mtime(st) ((st)->st_mtim)
+#endif
+
+/* The cache file and key of filename loaded as type with opts. Returns 0
+ * when the cache is off, or when the source cannot be found (loading it
+ * reports that).
+ */
+static int loader_cache_locate(const char *filename, const char *type, const char *opts,
+                               char *path, char *key, size_t *keylen)
+{
+  char dir[PATH_MAX], real[PATH_MAX];
+  struct stat st;
+  int on, n;
+  pthread_mutex_lock(&loader_cache.mutex);
+  on = loader_cache.dir && snprintf(dir, PATH_MAX, "%s", loader_cache.dir) < PATH_MAX;
+  pthread_mutex_unlock(&loader_cache.mutex);
+  if (!on || !realpath(filename, real) || stat(real, &st) < 0) {
+    return 0;
+  }
+  n = snprintf(key, LOADER_CACHE_KEYLEN, "%s %s %lld.%09ld %lld %llu %s", type, opts,
+               (long long)loader_mtime(&st).tv_sec, (long)loader_mtime(&st).tv_nsec,
+               (long long)st.st_size, (unsigned long long)st.st_ino, real);
+  if (n < 0 || n >= LOADER_CACHE_KEYLEN) {
+    return 0;
+  }
+  *keylen = n;
+  // FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for (n=0; n<(int)*keylen; n++) {
+    h ^= (unsigned char)key[n];
+    h *= 1099511628211ULL;
+  }
+  n = snprintf(path, PATH_MAX, "%s/%016llx" LOADER_CACHE_SUFFIX, dir, (unsigned long long)h);
+  return n > 0 && n < PATH_MAX;
+}
+
+static size_t loader_cache_offset(size_t keylen)
+{
+  const size_t n = sizeof(loader_cache_header) + keylen;
+  return (n + LOADER_CACHE_ALIGN - 1) / LOADER_CACHE_ALIGN * LOADER_CACHE_ALIGN;
+}
+
+/* Open the cache file of filename and check it. Returns its descriptor, or
+ * -1 on a miss.
+ */
+static int loader_cache_open(const char *filename, const char *type, const char *opts,
+                             size_t elsize, loader_cache_entry *e)
+{
+  char path[PATH_MAX], key[LOADER_CACHE_KEYLEN], stored[LOADER_CACHE_KEYLEN];
+  char err[LOADER_ERRLEN];
+  loader_cache_header h;
+  struct stat st;
+  size_t keylen;
+  if (!loader_cache_locate(filename, type, opts, path, key, &keylen)) {
+    return -1;
+  }
+  const int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (pread(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+      memcmp(h.magic, LOADER_CACHE_MAGIC, 8) || h.elsize != elsize ||
+      h.ndim < 2 || h.ndim > 3 || h.keylen != keylen ||
+      pread(fd, stored, keylen, sizeof(h)) != (ssize_t)keylen ||
+      memcmp(stored, key, keylen) || fstat(fd, &st) < 0 ||
+      !loader_within_limits(h.srcC, h.srcH, h.srcW, err)) {
+    close(fd);
+    return -1;
+  }
+  e->ndim = h.ndim;
+  e->C = h.C;
+  e->H = h.H;
+  e->W = h.W;
+  e->offset = loader_cache_offset(keylen);
+  e->size = (size_t)h.C * h.H * h.W * elsize;
+  if ((uint64_t)st.st_size != e->offset + e->size) {
+    close(fd);
+    return -1;
+  }
+  // most recently used
+  futimens(fd, NULL);
+  return fd;
+}
+
+/* Read the samples of an open cache file into dst, and close it. */
+static int loader_cache_fetch(int fd, const loader_cache_entry *e, void *dst)
+{
+  size_t done = 0;
+  while (done < e->size) {
+    const ssize_t n = pread(fd, (char *)dst + done, e->size - done, e->offset + done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+  return done == e->size;
+}
+
+/* Open the cache file of filename resized into a CxHxW batch slice.
+ * Returns -1 on a miss.
+ */
+static int loader_cache_open_batch(const char *filename, const char *type, const char *opts,
+                                   size_t elsize, long C, long H, long W,
+                                   loader_cache_entry *e)
+{
+  const int fd = loader_cache_open(filename, type, opts, elsize, e);
+  if (fd >= 0 && (e->ndim != 3 || e->C != C || e->H != H || e->W != W)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int loader_cache_write_all(int fd, const void *p, size_t n)
+{
+  while (n > 0) {
+    const ssize_t k = write(fd, p, n);
+    if (k < 0 && errno == EINTR) {
+      continue;
+    }
+    if (k <= 0) {
+      return 0;
+    }
+    p = (const char *)p + k;
+    n -= k;
+  }
+  return 1;
+}
+
+typedef struct {
+  struct timespec mtime;
+  uint64_t size;
+  char name[32];
+} loader_cache_file;
+
+static int loader_cache_older(const void *a, const void *b)
+{
+  const struct timespec *x = &((const loader_cache_file *)a)->mtime;
+  const struct timespec *y = &((const loader_cache_file *)b)->mtime;
+  if (x->tv_sec != y->tv_sec) {
+    return x->tv_sec < y->tv_sec ? -1 : 1;
+  }
+  return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+/* Count the cache files and, over budget, remove the least recently used
+ * ones down to 7/8 of it, so that trimming does not follow every write.
+ * Called with the mutex held.
+ */
+static void loader_cache_trim(void)
+{
+  loader_cache_file *files = NULL;
+  size_t n = 0, cap = 0, i;
+  uint64_t used = 0;
+  char path[PATH_MAX];
+  struct dirent *ent;
+  struct stat st;
+  DIR *d = opendir(loader_cache.dir);
+  if (!d) {
+    return;
+  }
+  while ((ent = readdir(d))) {
+    const size_t len = strlen(ent->d_name);
+    const size_t slen = strlen(LOADER_CACHE_SUFFIX);
+    if (len >= sizeof(files->name) || len <= slen ||
+        strcmp(ent->d_name + len - slen, LOADER_CACHE_SUFFIX) ||
+        snprintf(path, PATH_MAX, "%s/%s", loader_cache.dir, ent->d_name) >= PATH_MAX ||
+        stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (n == cap) {
+      loader_cache_file *more = realloc(files, (cap ? 2*cap : 256) * sizeof(loader_cache_file));
+      if (!more) {
+        break;
+      }
+      files = more;
+      cap = cap ? 2*cap : 256;
+    }
+    files[n].mtime = loader_mtime(&st);
+    files[n].size = st.st_size;
+    strcpy(files[n].name, ent->d_name);
+    used += st.st_size;
+    n++;
+  }
+  closedir(d);
+
+  if (loader_cache.budget && used > loader_cache.budget) {
+    const uint64_t target = loader_cache.budget - loader_cache.budget / 8;
+    qsort(files, n, sizeof(loader_cache_file), loader_cache_older);
+    for (i=0; i<n && used > target; i++) {
+      snprintf(path, PATH_MAX, "%s/%s", loader_cache.dir, files[i].name);
+      if (unlink(path) == 0 || errno == ENOENT) {
+        used -= files[i].size;
+      }
+    }
+  }
+  loader_cache.used = used;
+  free(files);
+}
+
+/* Cache the samples of filename, resized from src (NULL if they are the
+ * decoded image itself). Failures are ignored: the cache only ever saves
+ * work.
+ */
+static void loader_cache_write(const char *filename, const char *type, const char *opts,
+                               size_t elsize, long ndim, long C, long H, long W,
+                               const loader_image *src, const void *data)
+{
+  static const char zeros[LOADER_CACHE_ALIGN] = {0};
+  char path[PATH_MAX], tmp[PATH_MAX], key[LOADER_CACHE_KEYLEN];
+  loader_cache_header h;
+  size_t keylen;
+  if (!loader_cache_locate(filename, type, opts, path, key, &keylen) ||
+      snprintf(tmp, PATH_MAX, "%s.XXXXXX", path) >= PATH_MAX) {
+    return;
+  }
+  const int fd = mkstemp(tmp);
+  if (fd < 0) {
+    return;
+  }
+  memcpy(h.magic, LOADER_CACHE_MAGIC, 8);
+  h.elsize = elsize;
+  h.ndim = ndim;
+  h.C = C;
+  h.H = H;
+  h.W = W;
+  h.srcC = src ? src->C : C;
+  h.srcH = src ? src->H : H;
+  h.srcW = src ? src->W : W;
+  h.keylen = keylen;
+  const size_t offset = loader_cache_offset(keylen);
+  const size_t size = (size_t)C * H * W * elsize;
+  int ok = loader_cache_write_all(fd, &h, sizeof(h)) &&
+           loader_cache_write_all(fd, key, keylen) &&
+           loader_cache_write_all(fd, zeros, offset - sizeof(h) - keylen) &&
+           loader_cache_write_all(fd, data, size);
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(tmp, path) < 0) {
+    unlink(tmp);
+    return;
+  }
+
+  pthread_mutex_lock(&loader_cache.mutex);
+  loader_cache.used += offset + size;
+  if (loader_cache.dir && loader_cache.budget && loader_cache.used > loader_cache.budget) {
+    loader_cache_trim();
+  }
+  pthread_mutex_unlock(&loader_cache.mutex);
+}
+
+/* Storages of cached samples map the whole cache file. */
+typedef struct {
+  void *base;
+  size_t len;
+} loader_cache_map;
+
+static void loader_cache_unmap(void *ctx, void *data)
+{
+  loader_cache_map *m = ctx;
+  munmap(m->base, m->len);
+  free(m);
+}
+
+// the storages are not resizable: nothing is ever allocated
+static THAllocator loader_cache_allocator = {NULL, NULL, loader_cache_unmap};
+
+/* The options of images converted and resized into batches: bump the
+ * version when the conversion changes.
+ */
+#define LOADER_CACHE_OPTLEN 64
+
+static void loader_cache_batch_opts(char *opts, long C, long H, long W)
+{
+  snprintf(opts, LOADER_CACHE_OPTLEN, "batch1 %ldx%ldx%ld", C, H, W);
+}
+
+/* A prefetcher: workers decode the items of a stream of batches, in order,
+ * into a ring of K slots. A slot is only refilled once the caller has moved
+ * on to the next batch, which bounds memory and makes workers wait when
+ * they get K batches ahead.
+ */
+typedef struct {
+  void *tensor;         /* a THTensor of the prefetcher's type */
+  char *data;
+  long seq;             /* the batch held, or being decoded, in the slot */
+  long pending;         /* items of that batch still being decoded */
+  long *indices;        /* the item at each position of the batch */
+  char **errors;        /* per position, NULL on success */
+} loader_slot;
+
+typedef struct {
+  loader_item *items;   /* copies, owned by the prefetcher */
+  long n;
+  long *order;          /* the order of the items in the current epoch */
+  int shuffle;
+  uint64_t rng;
+  long total;           /* number of items to deliver, -1 for no limit */
+  long C, H, W;
+  long B;               /* batch size */
+  long K;               /* number of slots */
+  int batched;          /* deliver BxCxHxW batches rather than CxHxW images */
+  size_t elsize;
+  const char *type;     /* the tensor type name */
+  int (*store)(loader_worker *, long, long, long, void *);
+  void (*free_tensor)(void *);
+  loader_slot *slots;
+  long depth;           /* run of reads of each worker */
+  long claimed;         /* the next item to decode */
+  long delivered;       /* the next batch to hand out */
+  int held;             /* the caller still has the previous batch */
+  int stop;
+  pthread_mutex_t mutex;
+  pthread_cond_t filled;
+  pthread_cond_t freed;
+  pthread_t *threads;
+  long nthreads;
+} loader_prefetcher;
+
+static uint64_t loader_rand(uint64_t *state)
+{
+  // xorshift64*
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+}
+
+static void loader_shuffle(loader_prefetcher *p)
+{
+  long i;
+  for (i=p->n-1; i>0; i--) {
+    const long j = loader_rand(&p->rng) % (i + 1);
+    const long t = p->order[i];
+    p->order[i] = p->order[j];
+    p->order[j] = t;
+  }
+}
+
+/* Number of items in batch seq. */
+static long loader_batch_count(const loader_prefetcher *p, long seq)
+{
+  if (p->total < 0) {
+    return p->B;
+  }
+  const long left = p->total - seq*p->B;
+  return left <= 0 ? 0 : (left < p->B ? left : p->B);
+}
+
+/* Worker thread: claim runs of items (resolving them in stream order),
+ * read them, then decode each once its slot is free.
+ */
+static void *loader_prefetch_work(void *arg)
+{
+  loader_prefetcher *p = arg;
+  loader_worker w;
+  const size_t S = p->C*p->H*p->W*p->elsize;
+  long idx[LOADER_READ_MAX];
+  const char *names[LOADER_READ_MAX];
+  int cached[LOADER_READ_MAX];
+  loader_cache_entry entries[LOADER_READ_MAX];
+  char opts[LOADER_CACHE_OPTLEN];
+  long k;
+  memset(&w, 0, sizeof(w));
+  loader_cache_batch_opts(opts, p->C, p->H, p->W);
+
+  pthread_mutex_lock(&p->mutex);
+  while (!p->stop && (p->total < 0 || p->claimed < p->total)) {
+    const long first = p->claimed;
+    long count = p->depth;
+    if (p->total >= 0 && count > p->total - first) {
+      count = p->total - first;
+    }
+    for (k=0; k<count; k++) {
+      const long j = first + k;
+      if (j % p->n == 0 && j > 0 && p->shuffle) {
+        // epoch rollover; earlier items have already been resolved
+        loader_shuffle(p);
+      }
+      idx[k] = p->order[j % p->n];
+      names[k] = p->items[idx[k]].filename;
+    }
+    p->claimed += count;
+    pthread_mutex_unlock(&p->mutex);
+    for (k=0; k<count; k++) {
+      // cache hits are neither read nor decoded; the open file is read
+      // once the slot is free
+      cached[k] = names[k] ? loader_cache_open_batch(names[k], p->type, opts, p->elsize,
+                                                     p->C, p->H, p->W, &entries[k]) : -1;
+      if (cached[k] >= 0) {
+        names[k] = NULL;
+      }
+    }
+    loader_reader_start(&w.reader, names, count);
+    pthread_mutex_lock(&p->mutex);
+
+    for (k=0; k<count; k++) {
+      const long j = first + k;
+      loader_slot *slot = &p->slots[(j / p->B) % p->K];
+      while (!p->stop && slot->seq != j / p->B) {
+        pthread_cond_wait(&p->freed, &p->mutex);
+      }
+      if (p->stop) {
+        break;
+      }
+      pthread_mutex_unlock(&p->mutex);
+
+      char *dst = slot->data + (j % p->B) * S;
+      const loader_item *item = &p->items[idx[k]];
+      int ok;
+      if (cached[k] >= 0) {
+        ok = loader_cache_fetch(cached[k], &entries[k], dst) ||
+             loader_fail(w.err, "cannot read the cached image");
+        cached[k] = -1;
+      } else {
+        ok = loader_decode_read(&w, item, k, 0) && p->store(&w, p->C, p->H, p->W, dst);
+        if (ok && item->filename) {
+          loader_cache_write(item->filename, p->type, opts, p->elsize, 3,
+                             p->C, p->H, p->W, &w.img, dst);
+        }
+      }
+      if (!ok) {
+        memset(dst, 0, S);
+      }
+
+      pthread_mutex_lock(&p->mutex);
+      slot->indices[j % p->B] = idx[k];
+      if (!ok) {
+        slot->errors[j % p->B] = loader_strdup(w.err);
+      }
+      if (--slot->pending == 0) {
+        pthread_cond_broadcast(&p->filled);
+      }
+    }
+    // cache files of an abandoned run
+    for (k=0; k<count; k++) {
+      if (cached[k] >= 0) {
+        close(cached[k]);
+      }
+    }
+  }
+  pthread_mutex_unlock(&p->mutex);
+  // also waits for the reads of an abandoned run
+  loader_worker_free(&w);
+  return NULL;
+}
+
+/* Hand a slot back to the workers, for the batch K places further. Called
+ * with the mutex held.
+ */
+static void loader_prefetch_recycle(loader_prefetcher *p, loader_slot *slot)
+{
+  long i;
+  for (i=0; i<p->B; i++) {
+    free(slot->errors[i]);
+    slot->errors[i] = NULL;
+  }
+  slot->seq += p->K;
+  slot->pending = loader_batch_count(p, slot->seq);
+  pthread_cond_broadcast(&p->freed);
+}
+
+static void loader_prefetch_start(loader_prefetcher *p, long nthreads)
+{
+  pthread_mutex_init(&p->mutex, NULL);
+  pthread_cond_init(&p->filled, NULL);
+  pthread_cond_init(&p->freed, NULL);
+  // runs stay within the queue, or workers would wait on each other's slots
+  p->depth = loader_read_depth(p->K*p->B < LOADER_READ_INFLIGHT ? p->K*p->B
+                                                                : LOADER_READ_INFLIGHT,
+                               nthreads);
+  p->threads = malloc(nthreads * sizeof(pthread_t));
+  p->nthreads = 0;
+  while (p->threads && p->nthreads < nthreads &&
+         pthread_create(&p->threads[p->nthreads], NULL, loader_prefetch_work, p) == 0) {
+    p->nthreads++;
+  }
+}
+
+static void loader_prefetch_release(loader_prefetcher *p)
+{
+  long i, k;
+  if (!p->slots) {
+    return;
+  }
+  pthread_mutex_lock(&p->mutex);
+  p->stop = 1;
+  pthread_cond_broadcast(&p->freed);
+  pthread_mutex_unlock(&p->mutex);
+  for (i=0; i<p->nthreads; i++) {
+    pthread_join(p->threads[i], NULL);
+  }
+  free(p->threads);
+  pthread_cond_destroy(&p->filled);
+  pthread_cond_destroy(&p->freed);
+  pthread_mutex_destroy(&p->mutex);
+
+  for (k=0; k<p->K; k++) {
+    for (i=0; i<p->B; i++) {
+      free(p->slots[k].errors[i]);
+    }
+    free(p->slots[k].errors);
+    free(p->slots[k].indices);
+    p->free_tensor(p->slots[k].tensor);
+  }
+  free(p->slots);
+  p->slots = NULL;
+  for (i=0; i<p->n; i++) {
+    free((char *)p->items[i].filename);
+    if (p->items[i].blob) {
+      THByteTensor_free(p->items[i].blob);
+    }
+  }
+  free(p->items);
+  free(p->order);
+}
+
+/* Collect a table of file names and/or ByteTensors into items[n]. */
+static void loader_check_items(lua_State *L, int idx, loader_item *items, long n)
+{
+  long i;
+  for (i=0; i<n; i++) {
+    lua_rawgeti(L, idx, i+1);
+    THByteTensor *blob;
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      items[i].filename = lua_tostring(L, -1);
+      items[i].bytes = NULL;
+      items[i].len = 0;
+      items[i].blob = NULL;
+    } else if ((blob = luaT_toudata(L, -1, "torch.ByteTensor"))) {
+      if (blob->nDimension != 1 || !THByteTensor_isContiguous(blob)) {
+        luaL_error(L, "item %d: expecting a contiguous 1D ByteTensor", (int)(i+1));
+      }
+      items[i].filename = NULL;
+      items[i].bytes = THByteTensor_data(blob);
+      items[i].len = blob->size[0];
+      items[i].blob = blob;
+    } else {
+      luaL_error(L, "item %d: expecting a file name or a ByteTensor", (int)(i+1));
+    }
+    // the table keeps the item alive
+    lua_pop(L, 1);
+  }
+}
+
+/* Fill in the missing dimensions from the first image that can be read. */
+static void loader_probe(lua_State *L, const loader_item *items, long n,
+                         long *C, long *H, long *W)
+{
+  loader_worker w;
+  long i;
+  if (*C && *H && *W) {
+    return;
+  }
+  memset(&w, 0, sizeof(w));
+  for (i=0; i<n && !loader_decode_item(&w, &items[i], 1); i++) {
+  }
+  loader_worker_free(&w);
+  if (i == n) {
+    luaL_error(L, "none of the images could be read (%s)", w.err);
+  }
+  *C = *C ? *C : w.img.C;
+  *H = *H ? *H : w.img.H;
+  *W = *W ? *W : w.img.W;
+}
+
+/* Fused load and transform (loadTransformed): a crop of the image, resized
+ * as with image.scale and optionally mirrored, is built as the rows come
+ * out of the decoder, so that the full-size image is never held. JPEGs are
+ * decoded at the smallest DCT scale (1/2, 1/4 or 1/8) that leaves the crop
+ * at least as large as the output, and decoding stops after the last row
+ * of the crop; with libjpeg-turbo, the rows above it are skipped and only
+ * its columns are decoded.
+ */
+typedef struct {
+  long C, H, W;         /* output, 0 for the image's depth and the crop's size */
+  long x1, y1, x2, y2;  /* crop, in pixels of the full-size image */
+  char at[3];           /* or a crop of cw x ch at "c", "tl", "tr", "bl", "br" */
+  long cw, ch;
+  int crop;
+  int hflip;
+  int nearest;          /* interp = 'simple' */
+} loader_transform;
+
+/* Read the options table {depth=, size=, crop=, hflip=, interp=} at idx. */
+static void loader_transform_check(lua_State *L, int idx, loader_transform *t)
+{
+  memset(t, 0, sizeof(*t));
+  if (!lua_istable(L, idx)) {
+    return;
+  }
+  lua_getfield(L, idx, "depth");
+  t->C = lua_isnumber(L, -1) ? (long)lua_tonumber(L, -1) : 0;
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "size");
+  if (lua_isnumber(L, -1)) {
+    t->H = t->W = (long)lua_tonumber(L, -1);
+  } else if (lua_istable(L, -1)) {
+    lua_rawgeti(L, -1, 1);
+    lua_rawgeti(L, -2, 2);
+    t->H = luaL_checkint(L, -2);
+    t->W = luaL_checkint(L, -1);
+    lua_pop(L, 2);
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "crop");
+  if (lua_istable(L, -1)) {
+    t->crop = 1;
+    lua_rawgeti(L, -1, 1);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      snprintf(t->at, sizeof(t->at), "%s", lua_tostring(L, -1));
+      lua_rawgeti(L, -2, 2);
+      lua_rawgeti(L, -3, 3);
+      t->cw = luaL_checkint(L, -2);
+      t->ch = luaL_checkint(L, -1);
+      lua_pop(L, 2);
+    } else {
+      lua_rawgeti(L, -2, 2);
+      lua_rawgeti(L, -3, 3);
+      lua_rawgeti(L, -4, 4);
+      t->x1 = luaL_checkint(L, -4);
+      t->y1 = luaL_checkint(L, -3);
+      t->x2 = luaL_checkint(L, -2);
+      t->y2 = luaL_checkint(L, -1);
+      lua_pop(L, 3);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "hflip");
+  t->hflip = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "interp");
+  if (lua_isstring(L, -1)) {
+    const char *interp = lua_tostring(L, -1);
+    if (!strcmp(interp, "simple")) {
+      t->nearest = 1;
+    } else if (strcmp(interp, "bilinear")) {
+      luaL_error(L, "interp must be one of: bilinear | simple");
+    }
+  }
+  lua_pop(L, 1);
+  if (t->C < 0 || t->C > 4 || t->H < 0 || t->W < 0) {
+    luaL_error(L, "invalid output geometry");
+  }
+}
+
+/* Settle the crop and the output of an image of C x H x W. */
+static int loader_transform_plan(loader_transform *t, long C, long H, long W, char *err)
+{
+  if (!loader_within_limits(C, H, W, err)) {
+    return 0;
+  }
+  if (t->crop && t->at[0]) {
+    const long cw = t->cw, ch = t->ch;
+    if (!strcmp(t->at, "c")) {
+      t->x1 = (W - cw) / 2;
+      t->y1 = (H - ch) / 2;
+    } else if (!strcmp(t->at, "tl")) {
+      t->x1 = 0;
+      t->y1 = 0;
+    } else if (!strcmp(t->at, "tr")) {
+      t->x1 = W - cw;
+      t->y1 = 0;
+    } else if (!strcmp(t->at, "bl")) {
+      t->x1 = 0;
+      t->y1 = H - ch;
+    } else if (!strcmp(t->at, "br")) {
+      t->x1 = W - cw;
+      t->y1 = H - ch;
+    } else {
+      return loader_fail(err, "crop format must be \"c\"|\"tl\"|\"tr\"|\"bl\"|\"br\"");
+    }
+    t->x2 = t->x1 + cw;
+    t->y2 = t->y1 + ch;
+  } else if (!t->crop) {
+    t->x1 = t->y1 = 0;
+    t->x2 = W;
+    t->y2 = H;
+  }
+  if (t->x1 < 0 || t->y1 < 0 || t->x2 > W || t->y2 > H ||
+      t->x1 >= t->x2 || t->y1 >= t->y2) {
+    return loader_fail(err, "crop region out of the image");
+  }
+  t->C = t->C ? t->C : C;
+  t->H = t->H ? t->H : t->y2 - t->y1;
+  t->W = t->W ? t->W : t->x2 - t->x1;
+  return 1;
+}
+
+/* Resampling from slen samples to dlen, as loader_scale_line does (or as
+ * image.scale's 'simple' mode does, with nearest): output sample i is the
+ * sum of weight[offset[i] + j] * input[first[i] + j], j < offset[i+1] -
+ * offset[i].
+ */
+typedef struct {
+  long *first;
+  long *offset;
+  float *weight;
+} loader_taps;
+
+static void loader_taps_free(loader_taps *t)
+{
+  free(t->first);
+  free(t->offset);
+  free(t->weight);
+}
+
+static int loader_taps_init(loader_taps *t, long slen, long dlen, int nearest)
+{
+  long di, si, n = 0;
+  t->first = malloc(dlen * sizeof(long));
+  t->offset = malloc((dlen + 1) * sizeof(long));
+  t->weight = malloc((slen + 2*dlen) * sizeof(float));
+  if (!t->first || !t->offset || !t->weight) {
+    return 0;
+  }
+  if (nearest) {
+    const float scale = (float)slen / dlen;
+    for (di=0; di<dlen; di++) {
+      const long i = (long)(di * scale);
+      t->first[di] = i < slen ? i : slen-1;
+      t->offset[di] = n;
+      t->weight[n++] = 1;
+    }
+  } else if (dlen == slen) {
+    for (di=0; di<dlen; di++) {
+      t->first[di] = di;
+      t->offset[di] = n;
+      t->weight[n++] = 1;
+    }
+  } else if (dlen > slen) {
+    const float scale = (dlen > 1) ? (float)(slen - 1) / (dlen - 1) : 0;
+    for (di=0; di<dlen; di++) {
+      float f = di * scale;
+      long i = (long)f;
+      f -= i;
+      t->offset[di] = n;
+      if (slen == 1 || di == dlen-1 || i >= slen-1) {
+        t->first[di] = (slen == 1) ? 0 : (di == dlen-1 ? slen-1 : i);
+        t->weight[n++] = 1;
+      } else {
+        t->first[di] = i;
+        t->weight[n++] = 1 - f;
+        t->weight[n++] = f;
+      }
+    }
+  } else {
+    const float scale = (float)slen / dlen;
+    long i0 = 0, i1;
+    float f0 = 0, f1;
+    for (di=0; di<dlen; di++) {
+      f1 = (di + 1) * scale;
+      i1 = (long)f1;
+      f1 -= i1;
+      const float norm = (1 - f0) + (i1 - i0 - 1) + (i1 < slen ? f1 : 0);
+      t->first[di] = i0;
+      t->offset[di] = n;
+      t->weight[n++] = (1 - f0) / norm;
+      for (si=i0+1; si<i1 && si<slen; si++) {
+        t->weight[n++] = 1 / norm;
+      }
+      if (i1 < slen) {
+        t->weight[n++] = f1 / norm;
+      }
+      i0 = i1;
+      f0 = f1;
+    }
+  }
+  t->offset[dlen] = n;
+  return 1;
+}
+
+/* Rows of the crop (of sC channels of 8 bits) go through the stream one at
+ * a time: each is resampled across into a ring holding the last R of them,
+ * and each output row is made, and handed to emit, as soon as the ring has
+ * the rows it needs.
+ */
+typedef struct {
+  const loader_transform *t;
+  long sC, cW, cH;      /* channels of the decoded rows, size of the crop in them */
+  int map[4];
+  loader_taps htaps, vtaps;
+  float *line;          /* one channel of a row of the crop */
+  float *ring;          /* R rows, of C x W */
+  float *out;           /* an output row, of C x W */
+  long R;
+  long y;               /* rows of the crop seen so far */
+  long next;            /* the next output row */
+  unsigned char *bytes; /* for the decoders */
+  size_t bytes_cap;
+  void (*emit)(void *, const loader_transform *, long, const float *);
+  void *dst;
+} loader_stream;
+
+static void loader_stream_free(loader_stream *s)
+{
+  loader_taps_free(&s->htaps);
+  loader_taps_free(&s->vtaps);
+  free(s->line);
+  free(s->ring);
+  free(s->out);
+  free(s->bytes);
+}
+
+static int loader_stream_init(loader_stream *s, long sC, long cW, long cH, char *err)
+{
+  const loader_transform *t = s->t;
+  long d;
+  s->sC = sC;
+  s->cW = cW;
+  s->cH = cH;
+  loader_channel_map(sC, t->C, s->map);
+  if (!loader_taps_init(&s->htaps, cW, t->W, t->nearest) ||
+      !loader_taps_init(&s->vtaps, cH, t->H, t->nearest)) {
+    return loader_fail(err, "out of memory");
+  }
+  s->R = 1;
+  for (d=0; d<t->H; d++) {
+    const long n = s->vtaps.offset[d+1] - s->vtaps.offset[d];
+    s->R = n > s->R ? n : s->R;
+  }
+  s->line = malloc(cW * sizeof(float));
+  s->ring = malloc(s->R * t->C * t->W * sizeof(float));
+  s->out = malloc(t->C * t->W * sizeof(float));
+  if (!s->line || !s->ring || !s->out) {
+    return loader_fail(err, "out of memory");
+  }
+  return 1;
+}
+
+/* Feed the next row of the crop: px is its first pixel. */
+static void loader_stream_row(loader_stream *s, const unsigned char *px)
+{
+  const loader_transform *t = s->t;
+  const long C = t->C, W = t->W, CW = C*W;
+  const loader_taps *h = &s->htaps, *v = &s->vtaps;
+  float *row = s->ring + (s->y % s->R) * CW;
+  long i, j, k, x;
+  for (k=0; k<C; k++) {
+    const int m = s->map[k];
+    float *d = row + k*W;
+    for (i=0; i<s->cW; i++) {
+      s->line[i] = loader_sample(px + i*s->sC, m);
+    }
+    for (x=0; x<W; x++) {
+      const float *src = s->line + h->first[x];
+      const float *w = h->weight + h->offset[x];
+      const long n = h->offset[x+1] - h->offset[x];
+      float acc = 0;
+      for (j=0; j<n; j++) {
+        acc += w[j] * src[j];
+      }
+      d[t->hflip ? W-1-x : x] = acc;
+    }
+  }
+  s->y++;
+  while (s->next < t->H &&
+         v->first[s->next] + v->offset[s->next+1] - v->offset[s->next] <= s->y) {
+    const long first = v->first[s->next];
+    const float *w = v->weight + v->offset[s->next];
+    const long n = v->offset[s->next+1] - v->offset[s->next];
+    for (j=0; j<n; j++) {
+      const float *src = s->ring + ((first + j) % s->R) * CW;
+      if (j == 0) {
+        for (i=0; i<CW; i++) {
+          s->out[i] = w[0] * src[i];
+        }
+      } else {
+        for (i=0; i<CW; i++) {
+          s->out[i] += w[j] * src[i];
+        }
+      }
+    }
+    s->emit(s->dst, t, s->next, s->out);
+    s->next++;
+  }
+}
+
+/* Feed rows y1 to y2 of a packed image, from column x1 on. */
+static void loader_stream_image(loader_stream *s, const unsigned char *data, long W,
+                                long x1, long y1, long y2)
+{
+  long y;
+  for (y=y1; y<y2; y++) {
+    loader_stream_row(s, data + (y*W + x1) * s->sC);
+  }
+}
+
+static int loader_transform_ppm(const unsigned char *p, size_t len, loader_stream *s,
+                                char *err)
+{
+  const loader_transform *t = s->t;
+  const long C = (p[1] == '6') ? 3 : 1;
+  long W, H, D, i, y;
+  const size_t pos = loader_ppm_header(p, len, &W, &H, &D, err);
+  if (!pos) {
+    return 0;
+  }
+  const int wide = (D > 255);
+  const long n = (t->x2 - t->x1) * C;
+  if (len - pos < (size_t)C*H*W << wide) {
+    return loader_fail(err, "truncated PPM file");
+  }
+  if (!loader_stream_init(s, C, t->x2 - t->x1, t->y2 - t->y1, err) ||
+      !loader_reserve(&s->bytes, &s->bytes_cap, n)) {
+    return loader_fail(err, "out of memory");
+  }
+  for (y=t->y1; y<t->y2; y++) {
+    const unsigned char *r = p + pos + ((y*W + t->x1) * C << wide);
+    if (D == 255) {
+      loader_stream_row(s, r);
+      continue;
+    }
+    for (i=0; i<n; i++) {
+      const long v = wide ? (r[2*i] << 8) | r[2*i+1] : r[i];
+      s->bytes[i] = loader_ppm_scale(v, D);
+    }
+    loader_stream_row(s, s->bytes);
+  }
+  return 1;
+}
+
+#if defined(HAVE_JPEG)
+/* An edge of the crop, in pixels of the image decoded at a smaller scale. */
+static long loader_jpeg_edge(long x, long full, long scaled)
+{
+  return (x * scaled + full/2) / full;
+}
+
+static int loader_transform_jpeg(const unsigned char *p, size_t len, loader_stream *s,
+                                 char *err)
+{
+  const loader_transform *t = s->t;
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_source_mgr src;
+  loader_jpeg_error jerr;
+  int denom = 8;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = loader_jpeg_error_exit;
+  jerr.pub.output_message = loader_jpeg_output_message;
+  jerr.err = err;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    return 0;
+  }
+  jpeg_create_decompress(&cinfo);
+  loader_jpeg_source(&cinfo, &src, p, len);
+  jpeg_read_header(&cinfo, TRUE);
+  if (cinfo.jpeg_color_space != JCS_GRAYSCALE) {
+    cinfo.out_color_space = JCS_RGB;
+  }
+  // the smallest scale at which the crop still covers the output
+  while (denom > 1 && ((t->x2 - t->x1) < denom * t->W || (t->y2 - t->y1) < denom * t->H)) {
+    denom /= 2;
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+  jpeg_start_decompress(&cinfo);
+
+  const long C = cinfo.output_components;
+  const long sW = cinfo.output_width, sH = cinfo.output_height;
+  const long x1 = loader_jpeg_edge(t->x1, cinfo.image_width, sW);
+  const long y1 = loader_jpeg_edge(t->y1, cinfo.image_height, sH);
+  long x2 = loader_jpeg_edge(t->x2, cinfo.image_width, sW);
+  long y2 = loader_jpeg_edge(t->y2, cinfo.image_height, sH);
+  x2 = x2 > x1 ? x2 : x1 + 1;
+  y2 = y2 > y1 ? y2 : y1 + 1;
+  JDIMENSION xoff = 0, width = sW;
+#if defined(HAVE_JPEG_CROP_SCANLINE)
+  // whole iMCUs: xoff and width may grow around the crop
+  xoff = x1;
+  width = x2 - x1;
+  jpeg_crop_scanline(&cinfo, &xoff, &width);
+#endif
+  if (!loader_stream_init(s, C, x2 - x1, y2 - y1, err) ||
+      !loader_reserve(&s->bytes, &s->bytes_cap, (size_t)width * C)) {
+    jpeg_destroy_decompress(&cinfo);
+    return loader_fail(err, "out of memory");
+  }
+#if defined(HAVE_JPEG_SKIP_SCANLINES)
+  if (y1 > 0) {
+    jpeg_skip_scanlines(&cinfo, y1);
+  }
+#endif
+  JSAMPROW row = s->bytes;
+  while (cinfo.output_scanline < (JDIMENSION)y2) {
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    if (cinfo.output_scanline > (JDIMENSION)y1) {
+      loader_stream_row(s, s->bytes + (x1 - xoff) * C);
+    }
+  }
+  // the rows below the crop are never decoded
+  jpeg_destroy_decompress(&cinfo);
+  return 1;
+}
+#endif
+
+#if defined(HAVE_PNG)
+static int loader_transform_png(const unsigned char *p, size_t len, loader_stream *s,
+                                char *err)
+{
+  const loader_transform *t = s->t;
+  loader_png_source src = {p, len, 0, err};
+  png_structp png_ptr;
+  png_infop info_ptr = NULL;
+  long y;
+
+  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, &src,
+                                   loader_png_error_fn, loader_png_warning_fn);
+  if (!png_ptr || !(info_ptr = png_create_info_struct(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, NULL, NULL);
+    return loader_fail(err, "out of memory");
+  }
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return 0;
+  }
+  png_set_read_fn(png_ptr, &src, loader_png_read_fn);
+  png_read_info(png_ptr, info_ptr);
+  if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+    // the last pass is needed for any row: decode the whole image
+    loader_image img = {NULL, 0, 0, 0, 0};
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    const int ok = loader_decode_png(p, len, &img, 0, err) &&
+                   loader_stream_init(s, img.C, t->x2 - t->x1, t->y2 - t->y1, err);
+    if (ok) {
+      loader_stream_image(s, img.data, img.W, t->x1, t->y1, t->y2);
+    }
+    free(img.data);
+    return ok;
+  }
+
+  const int color_type = png_get_color_type(png_ptr, info_ptr);
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb(png_ptr);
+  } else if (color_type == PNG_COLOR_TYPE_GRAY) {
+    png_set_expand_gray_1_2_4_to_8(png_ptr);
+  }
+  png_set_strip_16(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  const long C = png_get_channels(png_ptr, info_ptr);
+  const long W = png_get_image_width(png_ptr, info_ptr);
+  if (!loader_stream_init(s, C, t->x2 - t->x1, t->y2 - t->y1, err) ||
+      !loader_reserve(&s->bytes, &s->bytes_cap, (size_t)W * C)) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return loader_fail(err, "out of memory");
+  }
+  // rows are filtered against the previous one: those above the crop are
+  // decoded, and dropped
+  for (y=0; y<t->y2; y++) {
+    png_read_row(png_ptr, s->bytes, NULL);
+    if (y >= t->y1) {
+      loader_stream_row(s, s->bytes + t->x1 * C);
+    }
+  }
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  return 1;
+}
+#endif
+
+/* Decode an image held in memory through the transform t, whose plan is
+ * settled, handing each output row to emit(dst, t, y, row).
+ */
+static int loader_transform_decode(const unsigned char *p, size_t len,
+                                   const loader_transform *t,
+                                   void (*emit)(void *, const loader_transform *, long,
+                                                const float *),
+                                   void *dst, char *err)
+{
+  loader_stream s;
+  int ok;
+  memset(&s, 0, sizeof(s));
+  s.t = t;
+  s.emit = emit;
+  s.dst = dst;
+  if (len >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff) {
+#if defined(HAVE_JPEG)
+    ok = loader_transform_jpeg(p, len, &s, err);
+#else
+    ok = loader_fail(err, "JPEG support was not compiled in");
+#endif
+  } else if (len >= 8 && !memcmp(p, "\x89PNG", 4)) {
+#if defined(HAVE_PNG)
+    ok = loader_transform_png(p, len, &s, err);
+#else
+    ok = loader_fail(err, "PNG support was not compiled in");
+#endif
+  } else if (len >= 3 && p[0] == 'P' && (p[1] == '5' || p[1] == '6')) {
+    ok = loader_transform_ppm(p, len, &s, err);
+  } else {
+    ok = loader_fail(err, "unknown image format (expecting JPEG, PNG or binary PPM/PGM)");
+  }
+  loader_stream_free(&s);
+  return ok;
+}
+
+/* Integrity checks (verify): each image is decoded as far as it takes to
+ * find corruption, into a scratch row, without keeping its pixels. JPEGs
+ * are entropy-decoded in full at the 1/8 DCT scale, where the inverse DCT
+ * is a single coefficient (jpeg_skip_scanlines would jump straight to the
+ * end of the image instead); libjpeg warnings, e.g. on truncated data, are
+ * failures. PNG chunk CRCs are all checked and the IDAT stream inflated and
+ * unfiltered row by row. PPM/PGM headers are checked against the size of
+ * the file.
+ */
+#define LOADER_VERIFY_OK         0
+#define LOADER_VERIFY_UNREADABLE 1
+#define LOADER_VERIFY_UNKNOWN    2
+#define LOADER_VERIFY_CORRUPT    3
+#define LOADER_VERIFY_LIMITS     4
+
+#if defined(HAVE_JPEG)
+/* libjpeg only outputs the first warning: keep it as the error. */
+static void loader_verify_jpeg_warning(j_common_ptr cinfo)
+{
+  loader_jpeg_error *jerr = (loader_jpeg_error *)cinfo->err;
+  char msg[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, msg);
+  snprintf(jerr->err, LOADER_ERRLEN, "%s", msg);
+}
+
+static int loader_verify_jpeg(const unsigned char *p, size_t len, loader_worker *w)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct jpeg_source_mgr src;
+  loader_jpeg_error jerr;
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = loader_jpeg_error_exit;
+  jerr.pub.output_message = loader_verify_jpeg_warning;
+  jerr.err = w->err;
+  if (setjmp(jerr.setjmp_buffer)) {
+    jpeg_destroy_decompress(&cinfo);
+    return LOADER_VERIFY_CORRUPT;
+  }
+  jpeg_create_decompress(&cinfo);
+  loader_jpeg_source(&cinfo, &src, p, len);
+  jpeg_read_header(&cinfo, TRUE);
+  if (!loader_within_limits(cinfo.num_components, cinfo.image_height, cinfo.image_width,
+                            w->err)) {
+    jpeg_destroy_decompress(&cinfo);
+    return LOADER_VERIFY_LIMITS;
+  }
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = 8;
+  jpeg_start_decompress(&cinfo);
+  if (!loader_reserve(&w->img.data, &w->img.cap,
+                      (size_t)cinfo.output_width * cinfo.output_components)) {
+    jpeg_destroy_decompress(&cinfo);
+    loader_fail(w->err, "out of memory");
+    return LOADER_VERIFY_CORRUPT;
+  }
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = w->img.data;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return jerr.pub.num_warnings ? LOADER_VERIFY_CORRUPT : LOADER_VERIFY_OK;
+}
+#endif
+
+#if defined(HAVE_PNG)
+static int loader_verify_png(const unsigned char *p, size_t len, loader_worker *w)
+{
+  loader_png_source src = {p, len, 0, w->err};
+  png_structp png_ptr;
+  png_infop info_ptr = NULL;
+  long y;
+  int pass;
+
+  png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, &src,
+                                   loader_png_error_fn, loader_png_warning_fn);
+  if (!png_ptr || !(info_ptr = png_create_info_struct(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, NULL, NULL);
+    loader_fail(w->err, "out of memory");
+    return LOADER_VERIFY_CORRUPT;
+  }
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return LOADER_VERIFY_CORRUPT;
+  }
+  png_set_read_fn(png_ptr, &src, loader_png_read_fn);
+  // a bad CRC fails any chunk, not only the critical ones
+  png_set_crc_action(png_ptr, PNG_CRC_ERROR_QUIT, PNG_CRC_ERROR_QUIT);
+  png_read_info(png_ptr, info_ptr);
+
+  const long C = png_get_channels(png_ptr, info_ptr);
+  const long H = png_get_image_height(png_ptr, info_ptr);
+  if (!loader_within_limits(C, H, png_get_image_width(png_ptr, info_ptr), w->err)) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    return LOADER_VERIFY_LIMITS;
+  }
+  // rows as stored, without transformations
+  const int passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+  if (!loader_reserve(&w->img.data, &w->img.cap, png_get_rowbytes(png_ptr, info_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    loader_fail(w->err, "out of memory");
+    return LOADER_VERIFY_CORRUPT;
+  }
+  for (pass=0; pass<passes; pass++) {
+    for (y=0; y<H; y++) {
+      png_read_row(png_ptr, w->img.data, NULL);
+    }
+  }
+  // the chunks after the image, up to IEND
+  png_read_end(png_ptr, NULL);
+  png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+  return LOADER_VERIFY_OK;
+}
+#endif
+
+static int loader_verify_ppm(const unsigned char *p, size_t len, loader_worker *w)
+{
+  const long C = (p[1] == '6') ? 3 : 1;
+  long W, H, D;
+  const size_t pos = loader_ppm_header(p, len, &W, &H, &D, w->err);
+  if (!pos) {
+    return LOADER_VERIFY_CORRUPT;
+  }
+  if (!loader_within_limits(C, H, W, w->err)) {
+    return LOADER_VERIFY_LIMITS;
+  }
+  if ((double)(len - pos) < (double)C*H*W*(D > 255 ? 2 : 1)) {
+    loader_fail(w->err, "truncated PPM file");
+    return LOADER_VERIFY_CORRUPT;
+  }
+  return LOADER_VERIFY_OK;
+}
+
+/* Verify the k-th item of the worker's current run of reads. */
+static int loader_verify_read(loader_worker *w, const loader_item *item, long k)
+{
+  const unsigned char *p = item->bytes;
+  size_t len = item->len;
+  if (item->filename &&
+      !loader_reader_get(&w->reader, k, item->filename, &p, &len, w->err)) {
+    return LOADER_VERIFY_UNREADABLE;
+  }
+  if (len >= 3 && p[0] == 0xff && p[1] == 0xd8 && p[2] == 0xff) {
+#if defined(HAVE_JPEG)
+    return loader_verify_jpeg(p, len, w);
+#else
+    loader_fail(w->err, "JPEG support was not compiled in");
+    return LOADER_VERIFY_UNKNOWN;
+#endif
+  }
+  if (len >= 8 && !memcmp(p, "\x89PNG", 4)) {
+#if defined(HAVE_PNG)
+    return loader_verify_png(p, len, w);
+#else
+    loader_fail(w->err, "PNG support was not compiled in");
+    return LOADER_VERIFY_UNKNOWN;
+#endif
+  }
+  if (len >= 3 && p[0] == 'P' && (p[1] == '5' || p[1] == '6')) {
+    return loader_verify_ppm(p, len, w);
+  }
+  loader_fail(w->err, "unknown image format (expecting JPEG, PNG or binary PPM/PGM)");
+  return LOADER_VERIFY_UNKNOWN;
+}
+
+/* Worker thread of verify: check runs of items until the batch is
+ * exhausted, into the status bytes at b->out.
+ */
+static void *loader_verify_work(void *arg)
+{
+  loader_batch *b = arg;
+  unsigned char *status = b->out;
+  loader_worker w;
+  const long depth = loader_read_depth(LOADER_READ_INFLIGHT, b->nthreads);
+  const char *names[LOADER_READ_MAX];
+  long first, count, k;
+  memset(&w, 0, sizeof(w));
+
+  while ((count = loader_batch_claim(b, depth, &first)) > 0) {
+    for (k=0; k<count; k++) {
+      names[k] = b->items[first+k].filename;
+    }
+    loader_reader_start(&w.reader, names, count);
+    for (k=0; k<count; k++) {
+      const long i = first + k;
+      w.err[0] = '\0';
+      status[i] = loader_verify_read(&w, &b->items[i], k);
+      if (status[i] != LOADER_VERIFY_OK) {
+        b->errors[i] = loader_strdup(w.err);
+      }
+    }
+  }
+  loader_worker_free(&w);
+  return NULL;
+}
+
+#include "generic/loader.c"
+#include "THGenerateAllTypes.h"
+
+static int libloader_Prefetcher_close(lua_State *L)
+{
+  loader_prefetcher *p = luaT_checkudata(L, 1, "libloader.Prefetcher");
+  loader_prefetch_release(p);
+  return 0;
+}
+
+static int libloader_Prefetcher_free(lua_State *L)
+{
+  loader_prefetcher *p = luaT_checkudata(L, 1, "libloader.Prefetcher");
+  loader_prefetch_release(p);
+  luaT_free(L, p);
+  return 0;
+}
+
+/* setDiskCache(dir, [budget]): cache decoded images in dir, within budget
+ * bytes (0 for no limit). Without dir, the cache is turned off; the files
+ * are kept.
+ */
+static int libloader_setDiskCache(lua_State *L)
+{
+  const char *dir = luaL_optstring(L, 1, NULL);
+  const double budget = luaL_optnumber(L, 2, 0);
+  struct stat st;
+  char *copy = NULL;
+  if (budget < 0) {
+    luaL_error(L, "the cache budget should be positive");
+  }
+  if (dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+      luaL_error(L, "cannot create cache directory <%s> (%s)", dir, strerror(errno));
+    }
+    if (stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+      luaL_error(L, "<%s> is not a directory", dir);
+    }
+    if (!(copy = loader_strdup(dir))) {
+      luaL_error(L, "out of memory");
+    }
+  }
+  pthread_mutex_lock(&loader_cache.mutex);
+  free(loader_cache.dir);
+  loader_cache.dir = copy;
+  loader_cache.budget = (uint64_t)budget;
+  loader_cache.used = 0;
+  if (copy) {
+    loader_cache_trim();
+  }
+  pthread_mutex_unlock(&loader_cache.mutex);
+  return 0;
+}
+
+/* setLimits([maxPixels], [maxBytes]): the limits of the images decoded by
+ * loadBatch, Prefetcher and loadTransformed (0 for none).
+ */
+static int libloader_setLimits(lua_State *L)
+{
+  double pixels = luaL_optnumber(L, 1, 0);
+  double bytes = luaL_optnumber(L, 2, 0);
+  if (pixels < 0 || bytes < 0) {
+    luaL_error(L, "the limits should be positive");
+  }
+  __atomic_store(&loader_limits.pixels, &pixels, __ATOMIC_RELAXED);
+  __atomic_store(&loader_limits.bytes, &bytes, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/* verify(items, [threads]): check that a table of file names and/or
+ * ByteTensors decode, on a pool of threads, without keeping their pixels.
+ * Returns a ByteTensor of the status of each item (LOADER_VERIFY_*), and a
+ * table of error messages indexed by the items that failed.
+ */
+static int libloader_verify(lua_State *L)
+{
+  luaL_checktype(L, 1, LUA_TTABLE);
+  long nthreads = luaL_optint(L, 2, 0);
+  const long n = lua_objlen(L, 1);
+  long i;
+
+  loader_item *items = lua_newuserdata(L, (n > 0 ? n : 1) * sizeof(loader_item));
+  loader_check_items(L, 1, items, n);
+  THByteTensor *status = THByteTensor_newWithSize1d(n);
+  luaT_pushudata(L, status, "torch.ByteTensor");
+  if (n == 0) {
+    lua_newtable(L);
+    return 2;
+  }
+
+  loader_batch b;
+  memset(&b, 0, sizeof(b));
+  b.items = items;
+  b.n = n;
+  b.out = THByteTensor_data(status);
+  b.errors = calloc(n, sizeof(char *));
+  if (!b.errors) {
+    luaL_error(L, "out of memory");
+  }
+  pthread_mutex_init(&b.mutex, NULL);
+
+  if (nthreads <= 0) {
+    nthreads = loader_default_threads();
+  }
+  if (nthreads > n) {
+    nthreads = n;
+  }
+  b.nthreads = nthreads;
+  // the calling thread works too
+  pthread_t *threads = (nthreads > 1) ? malloc((nthreads - 1) * sizeof(pthread_t)) : NULL;
+  long started = 0;
+  while (threads && started < nthreads - 1 &&
+         pthread_create(&threads[started], NULL, loader_verify_work, &b) == 0) {
+    started++;
+  }
+  loader_verify_work(&b);
+  for (i=0; i<started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&b.mutex);
+
+  lua_newtable(L);
+  for (i=0; i<n; i++) {
+    if (b.errors[i]) {
+      lua_pushstring(L, b.errors[i]);
+      lua_rawseti(L, -2, i+1);
+      free(b.errors[i]);
+    }
+  }
+  free(b.errors);
+  return 2;
+}
+
+static const luaL_Reg libloader__[] =
+{
+  {"setDiskCache", libloader_setDiskCache},
+  {"setLimits", libloader_setLimits},
+  {"verify", libloader_verify},
+  {NULL, NULL}
+};
+
+static const luaL_Reg libloader_Prefetcher__[] =
+{
+  {"close", libloader_Prefetcher_close},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int luaopen_libloader(lua_State *L)
+{
+  libloader_FloatMain_init(L);
+  libloader_DoubleMain_init(L);
+  libloader_ByteMain_init(L);
+
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, "libloader");
+  luaT_setfuncs(L, libloader__, 0);
+
+  luaT_newmetatable(L, "libloader.Prefetcher", NULL,
+                    NULL, libloader_Prefetcher_free, NULL);
+  luaT_setfuncs(L, libloader_Prefetcher__, 0);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libloader_DoubleMain__, 0);
+  lua_setfield(L, -2, "double");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libloader_FloatMain__, 0);
+  lua_setfield(L, -2, "float");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libloader_ByteMain__, 0);
+  lua_setfield(L, -2, "byte");
+
+  return 1;
+}
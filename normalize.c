@@ -0,0 +1,92 @@
+
+/* Options of the decoders (libjpeg, libpng) applied in their scanline
+ * loops, so that image.load{mean=, std=, order=, layout=} writes each
+ * sample once: the layout of the tensor, CxHxW or HxWxC (hwc), and a
+ * normalization. Channel k of the tensor receives channel src[k] of the
+ * image as
+ *
+ *   (sample / maxval - mean[k]) / std[k]  =  sample * scale[k] + bias[k]
+ *
+ * mean and std are given in the order of the tensor's channels; a single
+ * value applies to all of them, and channels past the end of a longer
+ * list (e.g. alpha) are only scaled.
+ */
+#define IMAGE_NORM_CHANS IMAGE_IL_CHANS
+
+typedef struct {
+  int depth;            /* requested depth, 0 for any */
+  int nmean, nstd;
+  double mean[IMAGE_NORM_CHANS];
+  double std[IMAGE_NORM_CHANS];
+  int bgr;
+  int hwc;              /* interleaved HxWxC tensors */
+} image_norm_opts;
+
+/* a channel map of interleave.c */
+typedef image_chanmap image_norm;
+
+static int image_norm_list(lua_State *L, int idx, const char *field, double *values)
+{
+  int n = 0;
+  lua_getfield(L, idx, field);
+  if (lua_type(L, -1) == LUA_TNUMBER) {
+    values[n++] = lua_tonumber(L, -1);
+  } else if (lua_istable(L, -1)) {
+    while (n < IMAGE_NORM_CHANS) {
+      lua_rawgeti(L, -1, n + 1);
+      if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        break;
+      }
+      values[n++] = luaL_checknumber(L, -1);
+      lua_pop(L, 1);
+    }
+  }
+  lua_pop(L, 1);
+  return n;
+}
+
+/* Reads the options table {depth=, mean=, std=, bgr=, hwc=} at idx, if
+ * any: everything is off without one.
+ */
+static void image_norm_check(lua_State *L, int idx, image_norm_opts *o)
+{
+  memset(o, 0, sizeof(*o));
+  if (!lua_istable(L, idx)) {
+    return;
+  }
+  lua_getfield(L, idx, "depth");
+  o->depth = lua_isnumber(L, -1) ? (int)lua_tonumber(L, -1) : 0;
+  lua_pop(L, 1);
+  o->nmean = image_norm_list(L, idx, "mean", o->mean);
+  o->nstd = image_norm_list(L, idx, "std", o->std);
+  lua_getfield(L, idx, "bgr");
+  o->bgr = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+  lua_getfield(L, idx, "hwc");
+  o->hwc = lua_toboolean(L, -1);
+  lua_pop(L, 1);
+}
+
+/* Plans the normalization of an image of chans channels with samples in
+ * [0, maxval]. Returns 0 without one, or when the decoder must leave it
+ * to the caller, as a depth conversion comes first.
+ */
+static int image_norm_plan(const image_norm_opts *o, int chans, double maxval, image_norm *n)
+{
+  int k;
+  if (!o->nmean && !o->nstd && !o->bgr) {
+    return 0;
+  }
+  if ((o->depth && o->depth != chans) || chans > IMAGE_NORM_CHANS) {
+    return 0;
+  }
+  for (k = 0; k < chans; k++) {
+    const double mean = (o->nmean == 1) ? o->mean[0] : (k < o->nmean ? o->mean[k] : 0);
+    const double std = (o->nstd == 1) ? o->std[0] : (k < o->nstd ? o->std[k] : 1);
+    n->src[k] = (o->bgr && chans >= 3 && k < 3) ? 2 - k : k;
+    n->scale[k] = 1 / (maxval * std);
+    n->bias[k] = -mean / std;
+  }
+  return 1;
+}
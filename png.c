@@ -77,6 +77,10 @@ libpng_error_fn(png_structp png_ptr, png_const_charp error_msg)
   longjmp(png_jmpbuf(png_ptr), 1);
 }
 
+#include "interleave.c"
+#include "normalize.c"
+#include "limits.c"
+
 #include "generic/png.c"
 #include "THGenerateAllTypes.h"
 
@@ -102,5 +106,8 @@ DLL_EXPORT int luaopen_liblua_png(lua_State *L)
   luaT_setfuncs(L, libpng_ByteMain__, 0);
   lua_setfield(L, -2, "byte");
 
+  lua_pushcfunction(L, image_simd_lua);
+  lua_setfield(L, -2, "simd");
+
   return 1;
 }
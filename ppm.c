@@ -1,46 +1,458 @@
 
 #include <TH.h>
 #include <luaT.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "fdio.c"
 
 #define torch_(NAME) TH_CONCAT_3(torch_, Real, NAME)
 #define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
 #define libppm_(NAME) TH_CONCAT_3(libppm_, Real, NAME)
 
+#define PPM_BUFSIZE 65536
+
+/* Largest width, height, depth or sample accepted: as for BMP, this keeps
+ * every product of header fields well within a double and an int64.
+ */
+#define PPM_MAX_SIZE (1L << 24)
+
+/* Block-buffered reader, so that headers and ASCII samples are scanned out
+ * of large reads instead of going through stdio one call per character.
+ * When reading from memory, buf is the whole source and is never refilled.
+ * Streams (pipes, sockets) are read through a descriptor, so that a refill
+ * returns whatever is available instead of blocking for a full buffer.
+ */
+typedef struct {
+  FILE *fp;     /* source file (NULL if reading from memory or a stream) */
+  int fd;       /* source stream (-1 if reading from a file or memory) */
+  unsigned char *buf;
+  size_t pos;   /* next unread byte in buf */
+  size_t len;   /* valid bytes in buf */
+  long offset;  /* file offset of buf[0] */
+  double size;  /* size of the source, or -1 if unknown (streams) */
+} ppm_reader;
+
+static int ppm_reader_open(ppm_reader *r, const char *filename)
+{
+  struct stat st;
+  r->fp = fopen(filename, "rb");
+  if (!r->fp) {
+    return 0;
+  }
+  r->fd = -1;
+  r->buf = malloc(PPM_BUFSIZE);
+  if (!r->buf) {
+    fclose(r->fp);
+    return 0;
+  }
+  r->pos = r->len = 0;
+  r->offset = 0;
+  r->size = (stat(filename, &st) == 0 && S_ISREG(st.st_mode)) ? (double)st.st_size : -1;
+  return 1;
+}
+
+static void ppm_reader_init_mem(ppm_reader *r, unsigned char *buf, size_t len)
+{
+  r->fp = NULL;
+  r->fd = -1;
+  r->buf = buf;
+  r->pos = 0;
+  r->len = len;
+  r->offset = 0;
+  r->size = (double)len;
+}
+
+static int ppm_reader_init_fd(ppm_reader *r, int fd)
+{
+  r->fp = NULL;
+  r->fd = fd;
+  r->buf = malloc(PPM_BUFSIZE);
+  if (!r->buf) {
+    return 0;
+  }
+  r->pos = r->len = 0;
+  r->offset = 0;
+  r->size = -1;
+  return 1;
+}
+
+/* Release the reader's buffer and file. Streams are closed by their owner. */
+static void ppm_reader_close(ppm_reader *r)
+{
+  if (r->fp) {
+    free(r->buf);
+    fclose(r->fp);
+  } else if (r->fd >= 0) {
+    free(r->buf);
+  }
+}
+
+/* Offset of the next unread byte in the file. */
+static long ppm_tell(ppm_reader *r)
+{
+  return r->offset + r->pos;
+}
+
+/* Bytes left to read, or -1 if unknown (streams). */
+static double ppm_remaining(ppm_reader *r)
+{
+  return (r->size < 0) ? -1 : r->size - ppm_tell(r);
+}
+
+static int ppm_fill(ppm_reader *r)
+{
+  if (!r->fp && r->fd < 0) {
+    return 0;
+  }
+  r->offset += r->len;
+  r->pos = 0;
+  if (r->fp) {
+    r->len = fread(r->buf, 1, PPM_BUFSIZE, r->fp);
+  } else {
+    r->len = image_read_fd(r->fd, r->buf, PPM_BUFSIZE, 0);
+  }
+  return r->len > 0;
+}
+
+static inline int ppm_rawgetc(ppm_reader *r)
+{
+  if (r->pos == r->len && !ppm_fill(r)) {
+    return EOF;
+  }
+  return r->buf[r->pos++];
+}
+
 /* Get the next character in the file, skipping over comments, which
  * start with a # and continue to the end of the line. 
  */
-static char ppm_getc(FILE *fp)
+static inline int ppm_getc(ppm_reader *r)
 {
-   char ch;
+   int ch;
 
-   ch = (char)getc(fp);
+   ch = ppm_rawgetc(r);
    if (ch == '#') {
       do {
-         ch = (char)getc(fp);
-      } while (ch != '\n' && ch != '\r');
+         ch = ppm_rawgetc(r);
+      } while (ch != '\n' && ch != '\r' && ch != EOF);
    }
 
    return ch;
 }
 
-/* Get the next integer, skipping whitespace and comments. */
-static long ppm_get_long(FILE *fp)
+/* Get the next integer, skipping whitespace and comments. Returns -1 if
+ * there is no integer to read. Values saturate past PPM_MAX_SIZE.
+ */
+static inline long ppm_get_long(ppm_reader *r)
 {
-   char ch;
+   int ch;
    long i = 0;
 
    do {
-      ch = ppm_getc(fp);
+      ch = ppm_getc(r);
    } while (ch == ' ' || ch == ',' || ch == '\t' || ch == '\n' || ch == '\r');
 
+   if (ch < '0' || ch > '9') {
+      return -1;
+   }
+
    do {
-      i = i * 10 + ch - '0';
-      ch = ppm_getc(fp);
+      if (i <= PPM_MAX_SIZE) {
+         i = i * 10 + ch - '0';
+      }
+      ch = ppm_getc(r);
    } while (ch >= '0' && ch <= '9');
 
    return i;
 }
 
+/* Read n raw bytes: whatever is buffered first, then straight from the file. */
+static int ppm_read(ppm_reader *r, unsigned char *dst, size_t n)
+{
+  size_t k = r->len - r->pos;
+  if (k > n) {
+    k = n;
+  }
+  memcpy(dst, r->buf + r->pos, k);
+  r->pos += k;
+  if (k < n) {
+    size_t m = 0;
+    if (r->fp) {
+      m = fread(dst + k, 1, n - k, r->fp);
+    } else if (r->fd >= 0) {
+      m = image_read_fd(r->fd, dst + k, n - k, 1);
+    }
+    r->offset += r->len + m;
+    r->pos = r->len = 0;
+    return k + m == n;
+  }
+  return 1;
+}
+
+/* Skip whitespace, returning the next character without consuming it. */
+static int ppm_peek(ppm_reader *r)
+{
+  int ch;
+  do {
+    ch = ppm_rawgetc(r);
+  } while (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
+  if (ch != EOF) {
+    r->pos--;
+  }
+  return ch;
+}
+
+/* Get the next whitespace-delimited word, skipping comments. */
+static int ppm_get_word(ppm_reader *r, char *word, int size)
+{
+  int ch, n = 0;
+
+  do {
+    ch = ppm_getc(r);
+  } while (ch == ' ' || ch == '\t' || ch == '\n' || ch == '\r');
+
+  while (ch != EOF && ch != ' ' && ch != '\t' && ch != '\n' && ch != '\r') {
+    if (n < size - 1) {
+      word[n++] = (char)ch;
+    }
+    ch = ppm_getc(r);
+  }
+  word[n] = '\0';
+
+  return n > 0;
+}
+
+#define PPM_OK          0
+#define PPM_CORRUPTED   1
+#define PPM_UNSUPPORTED 2
+
+typedef struct {
+  int magic;  /* the character following 'P' */
+  int ascii;  /* samples are ASCII (P2/P3) rather than binary */
+  int pfm;    /* samples are 32-bit floats, stored bottom row first */
+  int swap;   /* PFM samples need swapping to host byte order */
+  long W, H;
+  long C;     /* channels (PAM DEPTH) */
+  long D;     /* max color value (1 for PFM) */
+} ppm_header;
+
+static int ppm_little_endian(void)
+{
+  const uint16_t one = 1;
+  return *(const unsigned char *)&one;
+}
+
+/* Get a 32-bit float sample from a PFM file. */
+static inline float ppm_get_float(const unsigned char *p, int swap)
+{
+  uint32_t u;
+  float f;
+  memcpy(&u, p, 4);
+  if (swap) {
+    u = (u >> 24) | ((u >> 8) & 0xff00) | ((u << 8) & 0xff0000) | (u << 24);
+  }
+  memcpy(&f, &u, 4);
+  return f;
+}
+
+/* Put a 32-bit float sample, little-endian. */
+static inline void ppm_put_float(unsigned char *p, float f, int swap)
+{
+  uint32_t u;
+  memcpy(&u, &f, 4);
+  if (swap) {
+    u = (u >> 24) | ((u >> 8) & 0xff00) | ((u << 8) & 0xff0000) | (u << 24);
+  }
+  memcpy(p, &u, 4);
+}
+
+/* Parse the PAM header that follows "P7", up to and including ENDHDR. */
+static int ppm_read_pam_header(ppm_reader *r, ppm_header *h)
+{
+  char word[32];
+  int ch;
+
+  h->W = h->H = h->C = h->D = -1;
+  for (;;) {
+    if (!ppm_get_word(r, word, sizeof(word))) {
+      return PPM_CORRUPTED;
+    }
+    if (strcmp(word, "ENDHDR") == 0) {
+      break;
+    } else if (strcmp(word, "WIDTH") == 0) {
+      h->W = ppm_get_long(r);
+    } else if (strcmp(word, "HEIGHT") == 0) {
+      h->H = ppm_get_long(r);
+    } else if (strcmp(word, "DEPTH") == 0) {
+      h->C = ppm_get_long(r);
+    } else if (strcmp(word, "MAXVAL") == 0) {
+      h->D = ppm_get_long(r);
+    } else if (strcmp(word, "TUPLTYPE") == 0) {
+      // informative only: the tensor is shaped by DEPTH
+      do {
+        ch = ppm_rawgetc(r);
+      } while (ch != '\n' && ch != EOF);
+    } else {
+      return PPM_CORRUPTED;
+    }
+  }
+
+  return h->C < 1 ? PPM_CORRUPTED : PPM_OK;
+}
+
+/* Bytes per sample in the file's payload. */
+static int ppm_sample_bytes(ppm_header *h)
+{
+  if (h->pfm) {
+    return 4;
+  }
+  return h->D > 255 ? 2 : 1;
+}
+
+/* Parse a PGM, PPM or PAM header, leaving the reader on the first sample. */
+static int ppm_read_header(ppm_reader *r, ppm_header *h)
+{
+  if (ppm_rawgetc(r) != 'P') {
+    return PPM_CORRUPTED;
+  }
+
+  h->magic = ppm_rawgetc(r);
+  h->ascii = (h->magic == '2' || h->magic == '3');
+  h->pfm = (h->magic == 'F' || h->magic == 'f');
+  h->swap = 0;
+  if (h->pfm) {
+    char word[32];
+    h->C = (h->magic == 'F') ? 3 : 1;
+    h->W = ppm_get_long(r);
+    h->H = ppm_get_long(r);
+
+    // the sign of the scale gives the byte order
+    if (!ppm_get_word(r, word, sizeof(word))) {
+      return PPM_CORRUPTED;
+    }
+    h->swap = (strtod(word, NULL) < 0) != ppm_little_endian();
+    h->D = 1;
+  } else if (h->magic == '7') {
+    int res = ppm_read_pam_header(r, h);
+    if (res != PPM_OK) {
+      return res;
+    }
+  } else {
+    if (h->magic == '3' || h->magic == '6') {
+      h->C = 3;
+    } else if (h->magic == '2' || h->magic == '5') {
+      h->C = 1;
+    } else {
+      return PPM_UNSUPPORTED;
+    }
+
+    // Dimensions
+    h->W = ppm_get_long(r);
+    h->H = ppm_get_long(r);
+
+    // Max color value
+    h->D = ppm_get_long(r);
+  }
+
+  if (h->W < 0 || h->H < 0 || h->D < 1 || h->D > 65535 ||
+      h->W > PPM_MAX_SIZE || h->H > PPM_MAX_SIZE || h->C > PPM_MAX_SIZE) {
+    return PPM_CORRUPTED;
+  }
+
+  // the payload must fit in what is left of the source (ASCII samples take
+  // at least a byte each), and its decoded size in a size_t, so that a
+  // crafted header cannot wrap the allocation or claim more than there is
+  double left = ppm_remaining(r);
+  double need = (double)h->W * h->H * h->C * (h->ascii ? 1 : ppm_sample_bytes(h));
+  if (need * sizeof(double) > (double)SIZE_MAX || (left >= 0 && need > left)) {
+    return PPM_CORRUPTED;
+  }
+  return PPM_OK;
+}
+
+/* A stream of concatenated images (e.g. ffmpeg's image2pipe output), with
+ * a read buffer and a sample buffer kept from one image to the next.
+ */
+typedef struct {
+  ppm_reader rd;
+  int owned;            /* the descriptor was opened by us */
+  unsigned char *buf;   /* staging for binary samples */
+  size_t cap;
+} ppm_stream;
+
+static int libppm_Stream_new(lua_State *L)
+{
+  int fd, owned = 0;
+  if (lua_type(L, 1) == LUA_TSTRING) {
+    const char *filename = lua_tostring(L, 1);
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+      luaL_error(L, "cannot open file <%s> for reading", filename);
+    }
+    owned = 1;
+  } else {
+    fd = luaL_checkint(L, 1);
+    if (fd < 0) {
+      luaL_argerror(L, 1, "invalid file descriptor");
+    }
+  }
+
+  ppm_stream *stream = luaT_alloc(L, sizeof(ppm_stream));
+  if (!ppm_reader_init_fd(&stream->rd, fd)) {
+    if (owned) {
+      close(fd);
+    }
+    luaT_free(L, stream);
+    luaL_error(L, "out of memory");
+  }
+  stream->owned = owned;
+  stream->buf = NULL;
+  stream->cap = 0;
+  luaT_pushudata(L, stream, "libppm.Stream");
+  return 1;
+}
+
+static void libppm_Stream_release(ppm_stream *stream)
+{
+  if (stream->rd.fd >= 0) {
+    ppm_reader_close(&stream->rd);
+    if (stream->owned) {
+      close(stream->rd.fd);
+    }
+    stream->rd.fd = -1;
+  }
+  free(stream->buf);
+  stream->buf = NULL;
+  stream->cap = 0;
+}
+
+static int libppm_Stream_close(lua_State *L)
+{
+  ppm_stream *stream = luaT_checkudata(L, 1, "libppm.Stream");
+  libppm_Stream_release(stream);
+  return 0;
+}
+
+static int libppm_Stream_free(lua_State *L)
+{
+  ppm_stream *stream = luaT_checkudata(L, 1, "libppm.Stream");
+  libppm_Stream_release(stream);
+  luaT_free(L, stream);
+  return 0;
+}
+
+static const luaL_Reg libppm_Stream__[] =
+{
+  {"close", libppm_Stream_close},
+  {NULL, NULL}
+};
+
+#include "interleave.c"
+#include "limits.c"
+
 #include "generic/ppm.c"
 #include "THGenerateAllTypes.h"
 
@@ -54,6 +466,11 @@ DLL_EXPORT int luaopen_libppm(lua_State *L)
   lua_pushvalue(L, -1);
   lua_setglobal(L, "libppm");
 
+  luaT_newmetatable(L, "libppm.Stream", NULL,
+                    libppm_Stream_new, libppm_Stream_free, NULL);
+  luaT_setfuncs(L, libppm_Stream__, 0);
+  lua_pop(L, 1);
+
   lua_newtable(L);
   luaT_setfuncs(L, libppm_DoubleMain__, 0);
   lua_setfield(L, -2, "double");
@@ -66,5 +483,8 @@ DLL_EXPORT int luaopen_libppm(lua_State *L)
   luaT_setfuncs(L, libppm_ByteMain__, 0);
   lua_setfield(L, -2, "byte");
 
+  lua_pushcfunction(L, image_simd_lua);
+  lua_setfield(L, -2, "simd");
+
   return 1;
 }
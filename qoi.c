@@ -0,0 +1,128 @@
+
+#include <TH.h>
+#include <luaT.h>
+#include <stdint.h>
+
+#if LUA_VERSION_NUM >= 503
+#define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
+#define luaL_optint(L,n,d)      ((int)luaL_optinteger(L, (n), (d)))
+#endif
+
+#define torch_(NAME) TH_CONCAT_3(torch_, Real, NAME)
+#define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
+#define libqoi_(NAME) TH_CONCAT_3(libqoi_, Real, NAME)
+
+/* The "Quite OK Image" format: https://qoiformat.org/qoi-specification.pdf
+ * A 14-byte header, then a stream of ops over RGB(A) pixels, then an 8-byte
+ * end marker.
+ */
+#define QOI_OP_INDEX  0x00 /* 00xxxxxx */
+#define QOI_OP_DIFF   0x40 /* 01xxxxxx */
+#define QOI_OP_LUMA   0x80 /* 10xxxxxx */
+#define QOI_OP_RUN    0xc0 /* 11xxxxxx */
+#define QOI_OP_RGB    0xfe /* 11111110 */
+#define QOI_OP_RGBA   0xff /* 11111111 */
+#define QOI_MASK_2    0xc0 /* 11000000 */
+
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING     8
+/* keep well below 4 GB of pixels, like the reference implementation */
+#define QOI_PIXELS_MAX  400000000L
+
+static const unsigned char qoi_padding[QOI_PADDING] = {0,0,0,0,0,0,0,1};
+
+typedef struct {
+  unsigned char r, g, b, a;
+} qoi_rgba;
+
+static inline int qoi_hash(qoi_rgba px)
+{
+  return (px.r*3 + px.g*5 + px.b*7 + px.a*11) % 64;
+}
+
+static inline int qoi_equal(qoi_rgba p, qoi_rgba q)
+{
+  return p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+}
+
+static inline uint32_t qoi_get32(const unsigned char *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static inline void qoi_put32(unsigned char *p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+typedef struct {
+  long W, H;
+  int C;        /* channels: 3 (RGB) or 4 (RGBA) */
+  int linear;   /* colorspace: 0 = sRGB with linear alpha, 1 = all linear */
+} qoi_header;
+
+static int qoi_read_header(const unsigned char *p, size_t len, qoi_header *h)
+{
+  if (len < QOI_HEADER_SIZE || memcmp(p, "qoif", 4) != 0) {
+    return 0;
+  }
+  h->W = qoi_get32(p + 4);
+  h->H = qoi_get32(p + 8);
+  h->C = p[12];
+  h->linear = p[13];
+  return h->W > 0 && h->H > 0 && (h->C == 3 || h->C == 4) && h->linear <= 1 &&
+         h->H < QOI_PIXELS_MAX / h->W;
+}
+
+/* Read a whole file into a malloc'ed buffer. */
+static unsigned char *qoi_read_file(const char *filename, size_t *len)
+{
+  FILE *fp = fopen(filename, "rb");
+  if (!fp) {
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  long n = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+  unsigned char *buf = n > 0 ? malloc(n) : NULL;
+  if (buf && fread(buf, 1, n, fp) != (size_t)n) {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(fp);
+  *len = n;
+  return buf;
+}
+
+#include "limits.c"
+
+#include "generic/qoi.c"
+#include "THGenerateAllTypes.h"
+
+DLL_EXPORT int luaopen_libqoi(lua_State *L)
+{
+  libqoi_FloatMain_init(L);
+  libqoi_DoubleMain_init(L);
+  libqoi_ByteMain_init(L);
+
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, "libqoi");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libqoi_DoubleMain__, 0);
+  lua_setfield(L, -2, "double");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libqoi_FloatMain__, 0);
+  lua_setfield(L, -2, "float");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libqoi_ByteMain__, 0);
+  lua_setfield(L, -2, "byte");
+
+  return 1;
+}
@@ -0,0 +1,514 @@
+
+/* shm_open, realpath and the struct stat timestamps under -std=c99 */
+#define _GNU_SOURCE
+
+#include <TH.h>
+#include <luaT.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if LUA_VERSION_NUM >= 503
+#define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
+#define luaL_optint(L,n,d)      ((int)luaL_optinteger(L, (n), (d)))
+#endif
+
+#define torch_(NAME) TH_CONCAT_3(torch_, Real, NAME)
+#define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
+#define libshmcache_(NAME) TH_CONCAT_3(libshmcache_, Real, NAME)
+
+/* Decoded images shared between processes, in a POSIX shared memory
+ * segment, so that the loader processes of a node decode each image once
+ * and keep a single copy of it:
+ *
+ *   shmcache_header       geometry, arena cursor and counters
+ *   slots[nslots]         hash index: key hash, and offset of the entry
+ *   arena                 entries: shmcache_entry, key, samples
+ *
+ * The index is lock-free. A slot is claimed first, by a compare-and-swap
+ * of its hash; the entry is then written to freshly allocated arena space
+ * and published by a release store of its offset, so readers never see a
+ * partial entry, and no arena space is taken for an image that another
+ * process is already inserting. Entries are never removed, since other
+ * processes may hold views on them: once the arena or the index is full,
+ * new images are just not cached.
+ *
+ * Each tensor handed out views its own private (copy-on-write) mapping of
+ * its entry: pages stay shared until the tensor is written to, and writes
+ * only ever change that tensor. The arena and its entries are page-aligned,
+ * so that these mappings start at their entry and a page copied on write
+ * never holds part of a later one.
+ */
+#define SHMCACHE_MAGIC   "TIMGSHM2"
+#define SHMCACHE_ALIGN   64
+#define SHMCACHE_HEADER  4096
+#define SHMCACHE_KEYLEN  (PATH_MAX + 256)
+
+/* The entry offset of a slot released when its image did not fit in the
+ * arena: entries are aligned, so it is never that of one.
+ */
+#define SHMCACHE_DEAD    1
+
+typedef struct {
+  char magic[8];
+  uint64_t size;        /* of the segment */
+  uint64_t nslots;      /* a power of 2 */
+  uint64_t arena_off;
+  uint64_t arena_size;
+  uint64_t used;        /* arena bytes allocated, atomic */
+  uint64_t hits, misses, inserts, full; /* atomic */
+  uint64_t page;        /* the page size, entries are aligned to */
+  uint32_t ready;       /* set once initialized, atomic */
+} shmcache_header;
+
+typedef struct {
+  uint64_t hash;        /* 0 when free */
+  uint64_t entry;       /* arena offset of the entry, 0 while being written,
+                           SHMCACHE_DEAD if released */
+} shmcache_slot;
+
+typedef struct {
+  uint32_t keylen;
+  uint32_t elsize;
+  uint32_t ndim;
+  uint32_t C, H, W;
+} shmcache_entry;
+
+/* A process's mapping of a segment, and its descriptor, which the views
+ * are mapped from.
+ */
+typedef struct {
+  unsigned char *rw;
+  size_t size;
+  int fd;
+} shmcache_map;
+
+/* The private mapping of an entry a view is on, released with it. */
+typedef struct {
+  void *base;
+  size_t len;
+} shmcache_view;
+
+typedef struct {
+  shmcache_map *map;
+} shmcache;
+
+static shmcache_header *shmcache_head(const shmcache_map *m)
+{
+  return (shmcache_header *)m->rw;
+}
+
+static shmcache_slot *shmcache_slots(const shmcache_map *m)
+{
+  return (shmcache_slot *)(m->rw + SHMCACHE_HEADER);
+}
+
+/* Views handed out do not use the segment's mapping: they stay valid. */
+static void shmcache_map_release(shmcache_map *m)
+{
+  munmap(m->rw, m->size);
+  close(m->fd);
+  free(m);
+}
+
+static void shmcache_unmap(void *ctx, void *data)
+{
+  shmcache_view *v = ctx;
+  munmap(v->base, v->len);
+  free(v);
+}
+
+// the storages are not resizable: nothing is ever allocated
+static THAllocator shmcache_allocator = {NULL, NULL, shmcache_unmap};
+
+static size_t shmcache_align(size_t n)
+{
+  return (n + SHMCACHE_ALIGN - 1) / SHMCACHE_ALIGN * SHMCACHE_ALIGN;
+}
+
+static uint64_t shmcache_page_align(uint64_t n, uint64_t page)
+{
+  return (n + page - 1) / page * page;
+}
+
+/* Offset of the arena in a segment of nslots slots. */
+static uint64_t shmcache_arena_off(uint64_t nslots, uint64_t page)
+{
+  return shmcache_page_align(SHMCACHE_HEADER + nslots * sizeof(shmcache_slot), page);
+}
+
+/* FNV-1a, never 0 (free slots) */
+static uint64_t shmcache_hash(const char *key, size_t len)
+{
+  uint64_t h = 14695981039346656037ULL;
+  size_t i;
+  for (i=0; i<len; i++) {
+    h ^= (unsigned char)key[i];
+    h *= 1099511628211ULL;
+  }
+  return h ? h : 1;
+}
+
+/* The key of filename loaded as type with depth: canonical path,
+ * modification time, size and inode. Returns 0 if the file is not found.
+ */
+static size_t shmcache_key(const char *filename, const char *type, int depth, char *key)
+{
+  char real[PATH_MAX];
+  struct stat st;
+  if (!realpath(filename, real) || stat(real, &st) < 0) {
+    return 0;
+  }
+#if defined(__APPLE__)
+  const struct timespec mtime = st.st_mtimespec;
+#else
+  const struct timespec mtime = st.st_mtim;
+#endif
+  const int n = snprintf(key, SHMCACHE_KEYLEN, "%s %d %lld.%09ld %lld %llu %s", type, depth,
+                         (long long)mtime.tv_sec, (long)mtime.tv_nsec,
+                         (long long)st.st_size, (unsigned long long)st.st_ino, real);
+  return (n > 0 && n < SHMCACHE_KEYLEN) ? n : 0;
+}
+
+/* The published entry for key, or NULL. */
+static const shmcache_entry *shmcache_find(const shmcache_map *m, const char *key, size_t len,
+                                           uint64_t hash)
+{
+  const shmcache_header *h = shmcache_head(m);
+  shmcache_slot *slots = shmcache_slots(m);
+  uint64_t i = hash & (h->nslots - 1), probes;
+  for (probes=0; probes<h->nslots; probes++) {
+    const uint64_t sh = __atomic_load_n(&slots[i].hash, __ATOMIC_ACQUIRE);
+    if (sh == 0) {
+      return NULL;
+    }
+    if (sh == hash) {
+      const uint64_t off = __atomic_load_n(&slots[i].entry, __ATOMIC_ACQUIRE);
+      if (off && off != SHMCACHE_DEAD) {
+        const shmcache_entry *e = (const shmcache_entry *)(m->rw + h->arena_off + off);
+        if (e->keylen == len && !memcmp(e + 1, key, len)) {
+          return e;
+        }
+      }
+    }
+    i = (i + 1) & (h->nslots - 1);
+  }
+  return NULL;
+}
+
+/* Copy an image into the arena and publish it under key. Gives up when
+ * full, or when another process is inserting the same key.
+ */
+static void shmcache_insert(shmcache_map *m, const char *key, size_t len, uint64_t hash,
+                            size_t elsize, int ndim, long C, long H, long W,
+                            const void *data)
+{
+  shmcache_header *h = shmcache_head(m);
+  shmcache_slot *slots = shmcache_slots(m);
+  const size_t head = shmcache_align(sizeof(shmcache_entry) + len);
+  const size_t size = (size_t)C * H * W * elsize;
+  const size_t need = shmcache_page_align(head + size, h->page);
+  uint64_t i = hash & (h->nslots - 1), probes;
+
+  if (need > h->arena_size - __atomic_load_n(&h->used, __ATOMIC_RELAXED)) {
+    __atomic_add_fetch(&h->full, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // claim a slot, its entry still 0
+  for (probes=0; probes<h->nslots; probes++) {
+    uint64_t sh = 0;
+    if (__atomic_compare_exchange_n(&slots[i].hash, &sh, hash, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    if (sh == hash) {
+      // the same key, or a collision: leave the slot to its owner
+      const uint64_t other = __atomic_load_n(&slots[i].entry, __ATOMIC_ACQUIRE);
+      const shmcache_entry *o = (const shmcache_entry *)(m->rw + h->arena_off + other);
+      if (!other || (other != SHMCACHE_DEAD && o->keylen == len && !memcmp(o + 1, key, len))) {
+        return;
+      }
+    }
+    i = (i + 1) & (h->nslots - 1);
+  }
+  if (probes == h->nslots) {
+    __atomic_add_fetch(&h->full, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // offset 0 marks entries being written: the arena starts a page in.
+  // Images that do not fit leave the space to smaller ones, and release
+  // their slot; it keeps its hash, as clearing it would cut the probe
+  // sequences of the keys inserted past it.
+  uint64_t off = __atomic_load_n(&h->used, __ATOMIC_RELAXED);
+  do {
+    if (need > h->arena_size - off) {
+      __atomic_store_n(&slots[i].entry, SHMCACHE_DEAD, __ATOMIC_RELEASE);
+      __atomic_add_fetch(&h->full, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&h->used, &off, off + need, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  unsigned char *p = m->rw + h->arena_off + off;
+  shmcache_entry *e = (shmcache_entry *)p;
+  e->keylen = len;
+  e->elsize = elsize;
+  e->ndim = ndim;
+  e->C = C;
+  e->H = H;
+  e->W = W;
+  memcpy(e + 1, key, len);
+  memcpy(p + head, data, size);
+  __atomic_store_n(&slots[i].entry, off, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&h->inserts, 1, __ATOMIC_RELAXED);
+}
+
+/* The samples of entry e, size bytes from head bytes in, in a private
+ * copy-on-write mapping of the entry (released with view), or NULL.
+ */
+static void *shmcache_map_view(const shmcache_map *m, const shmcache_entry *e, size_t head,
+                               size_t size, shmcache_view **view)
+{
+  const uint64_t off = (const unsigned char *)e - m->rw;
+  shmcache_view *v = malloc(sizeof(shmcache_view));
+  if (!v) {
+    return NULL;
+  }
+  v->len = head + size;
+  v->base = mmap(NULL, v->len, PROT_READ | PROT_WRITE, MAP_PRIVATE, m->fd, off);
+  if (v->base == MAP_FAILED) {
+    free(v);
+    return NULL;
+  }
+  *view = v;
+  return (unsigned char *)v->base + head;
+}
+
+/* Create the segment name, or attach to it if it exists. */
+static shmcache_map *shmcache_open(const char *name, uint64_t bytes, uint64_t nslots,
+                                   char *err, size_t errlen)
+{
+  const uint64_t page = sysconf(_SC_PAGESIZE);
+  int created = 1;
+  struct stat st;
+  long waited;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    created = 0;
+    fd = shm_open(name, O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    snprintf(err, errlen, "cannot open shared memory <%s> (%s)", name, strerror(errno));
+    return NULL;
+  }
+  if (created) {
+    const uint64_t arena_off = shmcache_arena_off(nslots, page);
+    if (bytes <= arena_off + page || ftruncate(fd, bytes) < 0) {
+      snprintf(err, errlen, "cannot size shared memory <%s> (%s)", name,
+               bytes <= arena_off + page ? "too small" : strerror(errno));
+      close(fd);
+      shm_unlink(name);
+      return NULL;
+    }
+  } else {
+    // wait for the creator to size and initialize it
+    for (waited=0; fstat(fd, &st) == 0 && st.st_size < SHMCACHE_HEADER && waited < 5000;
+         waited++) {
+      struct timespec ms = {0, 1000000};
+      nanosleep(&ms, NULL);
+    }
+    bytes = (fstat(fd, &st) == 0) ? (uint64_t)st.st_size : 0;
+    if (bytes < SHMCACHE_HEADER) {
+      snprintf(err, errlen, "shared memory <%s> is not an image cache", name);
+      close(fd);
+      return NULL;
+    }
+  }
+
+  // the descriptor is kept, to map the views from
+  shmcache_map *m = calloc(1, sizeof(shmcache_map));
+  if (m) {
+    m->size = bytes;
+    m->rw = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    m->fd = fd;
+  }
+  if (!m || m->rw == MAP_FAILED) {
+    snprintf(err, errlen, "cannot map shared memory <%s>", name);
+    free(m);
+    close(fd);
+    return NULL;
+  }
+
+  shmcache_header *h = shmcache_head(m);
+  if (created) {
+    // the segment starts zeroed: free slots, no entries
+    memcpy(h->magic, SHMCACHE_MAGIC, 8);
+    h->size = bytes;
+    h->nslots = nslots;
+    h->page = page;
+    h->arena_off = shmcache_arena_off(nslots, page);
+    h->arena_size = bytes - h->arena_off;
+    h->used = page;
+    __atomic_store_n(&h->ready, 1, __ATOMIC_RELEASE);
+  } else {
+    for (waited=0; !__atomic_load_n(&h->ready, __ATOMIC_ACQUIRE) && waited < 5000; waited++) {
+      struct timespec ms = {0, 1000000};
+      nanosleep(&ms, NULL);
+    }
+    if (!__atomic_load_n(&h->ready, __ATOMIC_ACQUIRE) || memcmp(h->magic, SHMCACHE_MAGIC, 8) ||
+        h->size != bytes || !h->nslots || (h->nslots & (h->nslots - 1)) || h->page != page ||
+        h->arena_off != shmcache_arena_off(h->nslots, page) ||
+        h->arena_off + h->arena_size != bytes) {
+      snprintf(err, errlen, "shared memory <%s> is not an image cache", name);
+      shmcache_map_release(m);
+      return NULL;
+    }
+  }
+  return m;
+}
+
+static shmcache *shmcache_check(lua_State *L, int idx)
+{
+  shmcache *c = luaT_checkudata(L, idx, "libshmcache.Cache");
+  if (!c->map) {
+    luaL_error(L, "attempt to use a closed cache");
+  }
+  return c;
+}
+
+#include "generic/shmcache.c"
+#include "THGenerateAllTypes.h"
+
+/* Cache(name, [bytes, slots]): create the shared memory segment name
+ * (e.g. "/images"), or attach to it; bytes and slots only apply when
+ * creating it.
+ */
+static int libshmcache_Cache_new(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  const double bytes = luaL_optnumber(L, 2, 1 << 30);
+  const double slots = luaL_optnumber(L, 3, 1 << 16);
+  char err[PATH_MAX + 128];
+  uint64_t nslots = 1;
+  if (bytes < 1 || slots < 1 || slots > (1ULL << 40)) {
+    luaL_error(L, "invalid cache geometry");
+  }
+  while (nslots < slots) {
+    nslots *= 2;
+  }
+  shmcache *c = luaT_alloc(L, sizeof(shmcache));
+  c->map = NULL;
+  luaT_pushudata(L, c, "libshmcache.Cache");
+  c->map = shmcache_open(name, (uint64_t)bytes, nslots, err, sizeof(err));
+  if (!c->map) {
+    luaL_error(L, "%s", err);
+  }
+  return 1;
+}
+
+/* stats(): the counters of the segment, shared by all its processes. */
+static int libshmcache_Cache_stats(lua_State *L)
+{
+  shmcache *c = shmcache_check(L, 1);
+  shmcache_header *h = shmcache_head(c->map);
+  lua_newtable(L);
+  lua_pushnumber(L, (lua_Number)__atomic_load_n(&h->hits, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "hits");
+  lua_pushnumber(L, (lua_Number)__atomic_load_n(&h->misses, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "misses");
+  lua_pushnumber(L, (lua_Number)__atomic_load_n(&h->inserts, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "entries");
+  lua_pushnumber(L, (lua_Number)__atomic_load_n(&h->full, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "full");
+  lua_pushnumber(L, (lua_Number)__atomic_load_n(&h->used, __ATOMIC_RELAXED));
+  lua_setfield(L, -2, "bytes");
+  lua_pushnumber(L, (lua_Number)h->arena_size);
+  lua_setfield(L, -2, "capacity");
+  lua_pushnumber(L, (lua_Number)h->nslots);
+  lua_setfield(L, -2, "slots");
+  return 1;
+}
+
+static int libshmcache_Cache_close(lua_State *L)
+{
+  shmcache *c = luaT_checkudata(L, 1, "libshmcache.Cache");
+  if (c->map) {
+    // views handed out have mappings of their own
+    shmcache_map_release(c->map);
+    c->map = NULL;
+  }
+  return 0;
+}
+
+static int libshmcache_Cache_free(lua_State *L)
+{
+  shmcache *c = luaT_checkudata(L, 1, "libshmcache.Cache");
+  if (c->map) {
+    shmcache_map_release(c->map);
+  }
+  luaT_free(L, c);
+  return 0;
+}
+
+/* unlink(name): remove the segment name. Processes attached to it keep
+ * their mappings.
+ */
+static int libshmcache_unlink(lua_State *L)
+{
+  const char *name = luaL_checkstring(L, 1);
+  lua_pushboolean(L, shm_unlink(name) == 0);
+  return 1;
+}
+
+static const luaL_Reg libshmcache_Cache__[] =
+{
+  {"stats", libshmcache_Cache_stats},
+  {"close", libshmcache_Cache_close},
+  {NULL, NULL}
+};
+
+static const luaL_Reg libshmcache__[] =
+{
+  {"unlink", libshmcache_unlink},
+  {NULL, NULL}
+};
+
+DLL_EXPORT int luaopen_libshmcache(lua_State *L)
+{
+  libshmcache_FloatMain_init(L);
+  libshmcache_DoubleMain_init(L);
+  libshmcache_ByteMain_init(L);
+
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, "libshmcache");
+  luaT_setfuncs(L, libshmcache__, 0);
+
+  luaT_newmetatable(L, "libshmcache.Cache", NULL,
+                    libshmcache_Cache_new, libshmcache_Cache_free, NULL);
+  luaT_setfuncs(L, libshmcache_Cache__, 0);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libshmcache_DoubleMain__, 0);
+  lua_setfield(L, -2, "double");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libshmcache_FloatMain__, 0);
+  lua_setfield(L, -2, "float");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, libshmcache_ByteMain__, 0);
+  lua_setfield(L, -2, "byte");
+
+  return 1;
+}
@@ -0,0 +1,57 @@
+-- Times decoding and encoding each format with the SIMD pixel conversions
+-- of the codecs, and with plain C loops (see image.simd):
+--
+--   th bench_codecs.lua [repeats]
+require 'image'
+
+torch.setdefaulttensortype('torch.FloatTensor')
+
+local repeats = tonumber(arg and arg[1]) or 20
+
+-- a full HD frame, so that conversions weigh more than the calls around them
+local src = image.load(paths.concat(sys.fpath(), 'assets', 'grace_hopper_512.png'), 3, 'byte')
+src = image.scale(src, 1920, 1080)
+
+local formats = {
+   {name = 'jpg', compress = image.compressJPG},
+   {name = 'png', compress = image.compressPNG},
+   {name = 'ppm', compress = image.compressPPM},
+   {name = 'bmp', compress = image.compressBMP},
+}
+
+local function time(fn)
+   fn()
+   collectgarbage()
+   local timer = torch.Timer()
+   for i = 1, repeats do
+      fn()
+   end
+   return timer:time().real / repeats * 1000
+end
+
+local best = image.simd()
+print(string.format('%-4s %-6s %-12s %10s %10s %8s',
+                    'fmt', 'type', 'op', 'none (ms)', best .. ' (ms)', 'speedup'))
+for _, f in ipairs(formats) do
+   local bytes = f.compress(src)
+   for _, t in ipairs({'byte', 'float', 'double'}) do
+      local img = image.decompress(bytes, 3, t)
+      local cases = {
+         {'decode', function() image.decompress(bytes, 3, t) end},
+         {'encode', function() f.compress(img) end},
+      }
+      if t ~= 'byte' then
+         table.insert(cases, 2, {'decode+norm', function()
+            image.decompress(bytes, {type = t, mean = {0.485, 0.456, 0.406}, std = {0.229, 0.224, 0.225}})
+         end})
+      end
+      for _, case in ipairs(cases) do
+         image.simd('none')
+         local plain = time(case[2])
+         image.simd(best)
+         local fast = time(case[2])
+         print(string.format('%-4s %-6s %-12s %10.2f %10.2f %7.2fx',
+                             f.name, t, case[1], plain, fast, plain / fast))
+      end
+   end
+end
@@ -380,6 +380,110 @@ function test.LoadInvalid()
   )
 end
 
+function test.LoadNormalized()
+  local mean, std = {0.4, 0.5, 0.6}, {0.2, 0.25, 0.3}
+  local function reference(img, bgr)
+    local out = img:clone()
+    for k = 1, 3 do
+      out[k]:copy(img[bgr and 4 - k or k]):add(-mean[k]):div(std[k])
+    end
+    return out
+  end
+  for _, name in ipairs({'grace_hopper_512.jpg', 'grace_hopper_512.png', 'rgb16-2x1.png'}) do
+    local path = getTestImagePath(name)
+    local img = image.load(path, 3, 'float')
+    for _, order in ipairs({'rgb', 'bgr'}) do
+      local norm = image.load(path, {type='float', mean=mean, std=std, order=order})
+      tester:assertTensorEq(norm, reference(img, order == 'bgr'), 1e-5,
+                            'image.load normalization (' .. name .. ', ' .. order .. ')')
+    end
+  end
+
+  -- a depth conversion comes before the normalization
+  local path = getTestImagePath('grace_hopper_512.jpg')
+  local gray = image.load(path, 1, 'double')
+  tester:assertTensorEq(image.load(path, {depth=1, type='double', mean=0.5, std=2}),
+                        (gray - 0.5) / 2, 1e-9, 'image.load normalization after depth conversion')
+  tester:assertError(function() image.load(path, {type='byte', mean=0.5}) end,
+                     'normalization should need a float or double type')
+  tester:assertError(function() image.load(path, {type='float', std=0}) end,
+                     'image.load should reject std=0')
+end
+
+function test.LoadLayout()
+  local ppm = getTestImagePath('P6.ppm')
+  for _, name in ipairs({'grace_hopper_512.jpg', 'grace_hopper_512.png', 'P6.ppm', 'P5.pgm'}) do
+    local path = getTestImagePath(name)
+    for _, t in ipairs({'byte', 'float'}) do
+      local chw = image.load(path, nil, t)
+      local hwc = image.load(path, {type=t, layout='hwc'})
+      tester:assertTensorEq(hwc, chw:permute(2, 3, 1), 1e-6, 'image.load hwc (' .. name .. ', ' .. t .. ')')
+      tester:assert(hwc:isContiguous(), 'image.load hwc should be contiguous')
+    end
+  end
+  local mapped = image.loadPPM(ppm, {type='byte', layout='hwc', mmap=true})
+  tester:assertTensorEq(mapped, image.load(ppm, nil, 'byte'):permute(2, 3, 1), 0, 'image.loadPPM hwc mmap')
+
+  -- normalized, converted in depth, or decompressed
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local norm = image.load(jpg, {type='float', mean=0.5, order='bgr', layout='hwc'})
+  tester:assertTensorEq(norm, image.load(jpg, {type='float', mean=0.5, order='bgr'}):permute(2, 3, 1),
+                        1e-6, 'image.load hwc normalized')
+  local gray = image.load(getTestImagePath('grace_hopper_512.png'), {depth=1, type='float', layout='hwc'})
+  tester:assertTableEq(gray:size():totable(), {512, 512}, 'image.load hwc depth 1')
+  local bytes = image.compressQOI(image.load(jpg, 3, 'byte'))
+  tester:assertTensorEq(image.decompress(bytes, {type='byte', layout='hwc'}),
+                        image.decompress(bytes, nil, 'byte'):permute(2, 3, 1), 0, 'image.decompress hwc')
+  tester:assertError(function() image.load(jpg, {layout='whc'}) end, 'image.load should reject unknown layouts')
+
+  -- savers take interleaved tensors
+  local img = image.load(getTestImagePath('grace_hopper_512.png'), nil, 'byte')
+  local png = image.compressPNG(img:permute(2, 3, 1):contiguous(), {layout='hwc'})
+  tester:assertTensorEq(image.decompress(png, nil, 'byte'), img, 0, 'image.compressPNG hwc')
+  tester:assert(torch.all(torch.eq(image.compressJPG(img:permute(2, 3, 1):contiguous(), {quality=90, layout='hwc'}),
+                                   image.compressJPG(img, 90))), 'image.compressJPG hwc')
+  local filename = os.tmpname() .. '.ppm'
+  image.save(filename, img:permute(2, 3, 1):contiguous(), {layout='hwc'})
+  tester:assertTensorEq(image.load(filename, nil, 'byte'), img, 0, 'image.save hwc')
+  os.remove(filename)
+end
+
+function test.SimdConversions()
+  local best = image.simd()
+  tester:assert(({none=true, sse2=true, ssse3=true, avx2=true})[best], 'image.simd level')
+  local img = image.load(getTestImagePath('grace_hopper_512.png'), nil, 'byte')
+  local files = {getTestImagePath('grace_hopper_512.jpg'), getTestImagePath('grace_hopper_512.png'),
+                 getTestImagePath('rgb16-2x1.png'), getTestImagePath('P6.ppm')}
+  local encoded = {image.compressPNG(img), image.compressPPM(img), image.compressBMP(img)}
+  local function run()
+    local res = {}
+    for _, t in ipairs({'byte', 'float', 'double'}) do
+      for _, f in ipairs(files) do
+        table.insert(res, image.load(f, nil, t))
+        if t ~= 'byte' then
+          table.insert(res, image.load(f, {type=t, mean={0.5, 0.4, 0.3}, std=0.2}))
+        end
+      end
+      for _, bytes in ipairs(encoded) do
+        table.insert(res, image.decompress(bytes, nil, t))
+      end
+      local saved = (t == 'byte') and img or img[t](img):div(255)
+      table.insert(res, image.compressPNG(saved))
+      table.insert(res, image.compressJPG(saved))
+      table.insert(res, image.compressBMP(saved))
+    end
+    return res
+  end
+  local fast = run()
+  image.simd('none')
+  local plain = run()
+  image.simd(best)
+  tester:asserteq(image.simd(), best, 'image.simd should restore the level')
+  for i = 1, #fast do
+    tester:assertTensorEq(fast[i]:double(), plain[i]:double(), 0, 'SIMD and scalar conversions should match')
+  end
+end
+
 ----------------------------------------------------------------------
 -- compress jpg test
 --
@@ -425,6 +529,535 @@ function test.CompressAndDecompressPNG()
   tester:assertlt(mean_err_png, precision_mean, 'compressPNG error is too high! ')
   tester:assertlt(std_err_png, precision_std, 'compressPNG error is too high! ')
 end
+
+function test.CompressAndDecompressPPM()
+  local img = image.lena()
+
+  -- samples are rounded to 8 bits on the way in
+  local blob = image.compressPPM(img)
+  local raw = image.decompressPPM(blob)
+  tester:assertTensorEq(raw, img, 1/255 + precision, 'compressPPM error is too high! ')
+  tester:assertTensorEq(image.decompress(blob), raw, 0,
+    'decompress should recognise PPM data')
+
+  local gray = image.rgb2y(img)
+  local grayblob = image.compressPPM(gray)
+  tester:assertTensorEq(image.decompress(grayblob, 1, 'float'):double(),
+    image.decompressPPM(grayblob), 1e-6, 'decompress should recognise PGM data')
+  tester:assertTensorEq(image.decompressPPM(grayblob), gray, 1/255 + precision,
+    'compressPPM error is too high! ')
+end
+
+function test.SaveQuantize()
+  -- float samples, some out of [0, 1], are clamped and rounded by the savers
+  local img = torch.FloatTensor(3, 17, 23):uniform(-0.2, 1.2)
+  local expected = img:clone():clamp(0, 1):mul(255):add(0.5):floor():byte()
+  for _, fmt in ipairs({'png', 'ppm'}) do
+    local blob = image.compress(img, fmt)
+    tester:assertTensorEq(image.decompress(blob, 3, 'byte'), expected, 0,
+      fmt .. ' samples should be rounded')
+    tester:assertTensorEq(image.decompress(image.compress(img:double(), fmt), 3, 'byte'),
+      expected, 0, fmt .. ' double samples should be rounded')
+  end
+  tester:assertTensorEq(image.decompressPNG(image.compressPNG(img:permute(2, 3, 1):contiguous(),
+    {layout = 'hwc'}), 3, 'byte'), expected, 0, 'HxWxC samples should be rounded')
+
+  -- an ordered dither keeps the mean of a flat area between two levels
+  local flat = torch.FloatTensor(1, 32, 32):fill(0.3)
+  local plain = image.decompressPPM(image.compressPPM(flat), 1, 'byte'):double()
+  local dithered = image.decompressPPM(image.compressPPM(flat, {dither = true}), 1, 'byte'):double()
+  tester:asserteq(plain:min(), plain:max(), 'rounding should give a flat area')
+  tester:assertlt(math.abs(dithered:mean() - 0.3 * 255), 0.1, 'dither should keep the mean')
+  tester:assertle(dithered:max() - dithered:min(), 1, 'dither should use two levels')
+end
+
+function test.PPMStream()
+  -- frames of different kinds, concatenated as in ffmpeg's image2pipe output
+  local img = image.lena()
+  local gray = image.rgb2y(img)
+  local frames = {image.compressPPM(img), image.compressPPM(gray),
+                  image.compressPPM(img)}
+  local filename = os.tmpname()
+  local f = io.open(filename, 'wb')
+  for _, frame in ipairs(frames) do
+    f:write(frame:storage():string())
+  end
+  f:close()
+
+  local stream = image.PPMStream(filename)
+  local out = torch.ByteTensor()
+  for i, frame in ipairs(frames) do
+    local res = stream:read(out)
+    tester:assert(res == out, 'PPMStream should read into the given tensor')
+    tester:assertTensorEq(res, image.decompressPPM(frame, nil, 'byte'), 0,
+                          'PPMStream frame ' .. i .. ' differs')
+  end
+  tester:assert(stream:read(out) == nil, 'PPMStream should return nil at EOF')
+  stream:close()
+
+  stream = image.PPMStream(filename, 'float')
+  tester:assertTensorEq(stream:read():double(), image.decompressPPM(frames[1]),
+                        1e-6, 'PPMStream float frame differs')
+  stream:close()
+  os.remove(filename)
+end
+
+function test.Y4MWriteRead()
+  local img = image.lena():float()
+  local filename = os.tmpname()
+  local writer = image.Y4MWriter(filename, img:size(3), img:size(2),
+                                 {chroma = '444', fullrange = true})
+  writer:writeRGB(img)
+  writer:writeRGB(img)
+  writer:close()
+
+  local reader = image.Y4MReader(filename, 'float')
+  tester:asserteq(reader.width, img:size(3), 'Y4M width')
+  tester:asserteq(reader.chroma, '444', 'Y4M chroma format')
+  local out = torch.FloatTensor()
+  tester:assert(reader:readRGB(out) == out, 'Y4M should read into the given tensor')
+  tester:assertTensorEq(out, img, 2/255, 'Y4M RGB round trip error is too high')
+  local y, u, v = reader:read()
+  tester:assertTableEq(u:size():totable(), {img:size(2), img:size(3)}, 'Y4M plane size')
+  tester:assert(reader:read() == nil, 'Y4MReader should return nil at EOF')
+  reader:close()
+
+  -- 4:2:0 planes are subsampled
+  writer = image.Y4MWriter(filename, 5, 3)
+  writer:write(torch.ByteTensor(3, 5):fill(100), torch.ByteTensor(2, 3):fill(110),
+               torch.ByteTensor(2, 3):fill(120))
+  writer:close()
+  y, u, v = image.Y4MReader(filename, 'byte'):read()
+  tester:assertTableEq({y:size(1), y:size(2), u:size(1), u:size(2), v[2][3]},
+                       {3, 5, 2, 3, 120}, 'Y4M 4:2:0 planes')
+
+  -- frame sizes whose planes would overflow are rejected
+  local f = io.open(filename, 'wb')
+  f:write('YUV4MPEG2 W8589934592 H8589934592 F25:1 C420jpeg\n')
+  f:close()
+  tester:assert(not pcall(image.Y4MReader, filename), 'Y4M oversized header')
+  tester:assert(not pcall(image.Y4MWriter, filename, 2^25, 2^25), 'Y4M oversized writer')
+  os.remove(filename)
+end
+
+function test.MJPEGReader()
+  local img = image.lena()
+  local frames = {image.compressJPG(img, 90), image.compressJPG(image.rgb2y(img), 90),
+                  image.compressJPG(img, 50)}
+  local filename = os.tmpname()
+  local f = io.open(filename, 'wb')
+  for _, frame in ipairs(frames) do
+    f:write(frame:storage():string())
+  end
+  f:close()
+
+  local reader = image.MJPEGReader(filename, 'byte')
+  local out = torch.ByteTensor()
+  for i = 1, 2 do
+    tester:assert(reader:read(out) == out, 'MJPEGReader should read into the given tensor')
+    tester:assertTensorEq(out, image.decompressJPG(frames[i], nil, 'byte'), 0,
+                          'MJPEGReader frame ' .. i .. ' differs')
+  end
+  tester:assert(reader:read(out) ~= nil, 'MJPEGReader should read the last frame')
+  tester:assert(reader:read(out) == nil, 'MJPEGReader should return nil at EOF')
+  reader:close()
+
+  reader = image.MJPEGReader(filename)
+  tester:asserteq(reader:skip(2), 2, 'MJPEGReader should skip frames')
+  tester:assertTensorEq(reader:read(), image.decompressJPG(frames[3]), 0,
+                        'MJPEGReader frame after skip differs')
+  tester:asserteq(reader:skip(), 0, 'MJPEGReader should not skip past EOF')
+  reader:close()
+  os.remove(filename)
+end
+
+function test.CompressAndDecompressQOI()
+  local img = image.lena()
+
+  -- lossless, up to the 8-bit quantization
+  local blob = image.compress(img, 'qoi')
+  tester:assertTensorEq(image.decompressQOI(blob), img, 1/255 + precision,
+                        'compressQOI error is too high! ')
+  local bytes = image.decompress(blob, nil, 'byte')
+  tester:assertTensorEq(image.decompressQOI(image.compressQOI(bytes), nil, 'byte'),
+                        bytes, 0, 'QOI should be lossless')
+
+  local rgba = torch.rand(4, 20, 30):mul(255):floor():byte()
+  local tmpname = os.tmpname()
+  local filename = tmpname .. '.qoi'
+  image.save(filename, rgba)
+  tester:assertTensorEq(image.load(filename, nil, 'byte'), rgba, 0,
+                        'QOI save/load should keep the alpha channel')
+  tester:assertTableEq(image.getSize(filename):totable(), {4, 20, 30}, 'QOI size')
+  os.remove(filename)
+  os.remove(tmpname)
+end
+
+function test.SaveAndLoadBMP()
+  local tmpname = os.tmpname()
+  local filename = tmpname .. '.bmp'
+  -- odd widths exercise the row padding
+  for _, c in ipairs({1, 3, 4}) do
+    local img = torch.rand(c, 7, 13):mul(255):floor():byte()
+    image.save(filename, img)
+    tester:assertTensorEq(image.load(filename, nil, 'byte'), img, 0,
+                          'BMP save/load should be lossless')
+    tester:assertTableEq(image.getSize(filename):totable(), {c, 7, 13}, 'BMP size')
+    tester:assertTensorEq(image.decompress(image.compressBMP(img), nil, 'byte'), img, 0,
+                          'BMP compress/decompress should be lossless')
+  end
+  os.remove(filename)
+  os.remove(tmpname)
+end
+
+function test.LoadBatch()
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local png = getTestImagePath('grace_hopper_512.png')
+  local items = {jpg, png, getTestImagePath('bmp-without-ext'), torch.ByteTensor(10):fill(7)}
+  local batch, errors = image.loadBatch(items, {threads=2})
+  tester:assertTableEq(batch:size():totable(), {4, 3, 512, 512}, 'batch size')
+  tester:assertTensorEq(batch[1], image.load(jpg, 3), precision, 'loadBatch JPEG differs')
+  tester:assertTensorEq(batch[2], image.load(png, 3), precision, 'loadBatch PNG differs')
+  tester:assert(errors[1] == nil and errors[2] == nil, 'unexpected loadBatch errors')
+  tester:assert(errors[3] ~= nil and errors[4] ~= nil, 'loadBatch should report bad items')
+  tester:asserteq(batch[4]:sum(), 0, 'failed items should be zeroed')
+
+  local small = image.loadBatch({jpg, png}, {size={64, 32}, depth=1, type='byte'})
+  tester:assertTableEq(small:size():totable(), {2, 1, 64, 32}, 'resized batch size')
+  local expected = image.scale(image.rgb2y(image.load(jpg)), 32, 64):mul(255)
+  tester:assertTensorEq(small[1]:double(), expected:double(), 2, 'loadBatch resize differs')
+end
+
+function test.LoadTransformed()
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local png = getTestImagePath('grace_hopper_512.png')
+  local full = image.load(png, 3)
+  local out = image.loadTransformed(png, {crop={32, 64, 480, 400}, size={84, 112}, hflip=true})
+  tester:assertTableEq(out:size():totable(), {3, 84, 112}, 'loadTransformed size')
+  local expected = image.hflip(image.scale(image.crop(full, 32, 64, 480, 400), 112, 84))
+  tester:assertTensorEq(out, expected, 2/255, 'loadTransformed PNG differs')
+
+  -- a crop alone is exact, from memory too
+  local bytes = image.compressPNG(full)
+  local crop = image.loadTransformed(bytes, {crop={'c', 100, 50}, type='byte', depth=1})
+  local y = image.rgb2y(full):mul(255):add(0.5):floor():byte()
+  tester:assertTableEq(crop:size():totable(), {1, 50, 100}, 'loadTransformed crop size')
+  tester:assertTensorEq(crop:double(), image.crop(y, 'c', 100, 50):double(), 1,
+                        'loadTransformed crop differs')
+
+  -- JPEGs shrink through the DCT, which averages a little differently
+  local small = image.loadTransformed(jpg, {size=64})
+  local ref = image.scale(image.load(jpg, 3), 64, 64)
+  tester:assert((small - ref):abs():mean() < 0.03, 'loadTransformed JPEG differs')
+
+  tester:assertError(function() image.loadTransformed(png, {crop={0, 0, 600, 10}}) end,
+                     'loadTransformed should reject crops out of the image')
+end
+
+function test.Limits()
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local png = getTestImagePath('grace_hopper_512.png')
+  local ppm = image.compressPPM(image.load(png, 3, 'byte'))
+  local qoi = image.compressQOI(image.load(png, 3, 'byte'))
+  local bmp = image.compressBMP(image.load(png, 3, 'byte'))
+  -- a 14-byte QOI header claiming 19968x19968 RGBA pixels
+  local bomb = torch.ByteTensor({0x71, 0x6f, 0x69, 0x66, 0, 0, 0x4e, 0x00,
+                                 0, 0, 0x4e, 0x00, 4, 0})
+  local previous = image.setLimits{maxPixels = 300 * 300}
+  for _, load in ipairs({function() return image.load(jpg) end,
+                         function() return image.load(png) end,
+                         function() return image.decompress(ppm) end,
+                         function() return image.decompress(qoi) end,
+                         function() return image.decompress(bmp) end,
+                         function() return image.decompress(bomb) end}) do
+    local ok, err = pcall(load)
+    tester:assert(not ok and err:find('maxPixels'), 'images over maxPixels should fail')
+  end
+  local _, errors = image.loadBatch({png, jpg}, {size = 32, depth = 3})
+  tester:assert(errors[1] and errors[1]:find('maxPixels') and errors[2],
+    'batch items over maxPixels should fail')
+
+  -- per call, limits override those of setLimits
+  tester:asserteq(image.load(png, {maxPixels = 0}):size(2), 512, 'maxPixels = 0 is no limit')
+  tester:asserteq(image.decompress(qoi, {maxPixels = 0}):size(2), 512, 'QOI with maxPixels = 0')
+  tester:asserteq(image.decompressBMP(bmp, {maxPixels = 0}):size(2), 512, 'BMP with maxPixels = 0')
+
+  -- JPEG images can be downscaled (DCT scaling) to fit instead
+  image.setLimits{maxPixels = 300 * 300, downscale = true}
+  tester:assertTableEq(image.load(jpg, 3, 'byte'):size():totable(), {3, 256, 256},
+    'downscale should halve the image')
+  tester:assertTableEq(image.load(jpg, {maxPixels = 100 * 100}):size():totable(), {3, 64, 64},
+    'downscale should go down to fit')
+
+  -- maxBytes counts the samples of the tensor type
+  image.setLimits{maxBytes = 512 * 512 * 3}
+  tester:asserteq(image.load(png, 3, 'byte'):nElement(), 512 * 512 * 3, 'byte image within maxBytes')
+  tester:assert(not pcall(image.load, png, 3, 'float'), 'float image over maxBytes')
+
+  image.setLimits(previous)
+  tester:asserteq(image.load(png):size(2), 512, 'limits should be restored')
+end
+
+function test.LimitsCache()
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local png = getTestImagePath('grace_hopper_512.png')
+  image.cache.configure{bytes = 64 * 2^20}
+  image.load(jpg, 3)
+
+  -- hits over the limits are misses, and the decoders refuse them
+  local previous = image.setLimits{maxPixels = 300 * 300}
+  tester:assert(not pcall(image.load, jpg, 3), 'cached images should not bypass the limits')
+
+  -- the cache is read and filled under limits
+  image.setLimits{maxPixels = 600 * 600}
+  image.load(png, 3)
+  local hits = image.cache.stats().hits
+  image.load(png, 3)
+  image.load(jpg, 3)
+  tester:asserteq(image.cache.stats().hits, hits + 2, 'image.cache hits under limits')
+
+  -- but downscaled images are not cached
+  local entries = image.cache.stats().entries
+  image.setLimits{maxPixels = 300 * 300, downscale = true}
+  tester:asserteq(image.load(jpg, 3):size(2), 256, 'downscale with image.cache on')
+  tester:asserteq(image.cache.stats().entries, entries, 'downscaled images should not be cached')
+  image.setLimits(previous)
+  tester:asserteq(image.load(jpg, 3):size(2), 512, 'limits should be restored')
+  image.cache.configure{bytes = 0}
+end
+
+function test.Verify()
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local png = getTestImagePath('grace_hopper_512.png')
+  local ppm = image.compressPPM(image.load(png, 3, 'byte'))
+  local truncatedJPG = image.readFile(jpg)
+  truncatedJPG = truncatedJPG:narrow(1, 1, math.floor(truncatedJPG:size(1) / 2)):clone()
+  local badCRC = image.readFile(png):clone()
+  badCRC[60] = 255 - badCRC[60]  -- in the first IDAT chunk
+  local truncatedPPM = ppm:narrow(1, 1, ppm:size(1) - 10):clone()
+
+  local items = {jpg, png, ppm, '/nonexistent.png', torch.ByteTensor(16):fill(7),
+                 truncatedJPG, badCRC, truncatedPPM}
+  local status, errors = image.verify(items, {threads = 3})
+  tester:assertTableEq(status:totable(), {0, 0, 0, 1, 2, 3, 3, 3}, 'verify status')
+  tester:asserteq(errors[1], nil, 'sound images have no error')
+  for i = 4, #items do
+    tester:assert(type(errors[i]) == 'string', 'failed items should have an error')
+  end
+
+  local previous = image.setLimits{maxPixels = 100 * 100}
+  tester:asserteq(image.verify({jpg})[1], 4, 'verify should apply the limits')
+  image.setLimits(previous)
+end
+
+function test.LoadBatchManyFiles()
+  -- more files than fit in one run of reads, and a missing one
+  local tmpnames, paths = {}, {}
+  for i = 1, 300 do
+    tmpnames[i] = os.tmpname()
+    paths[i] = tmpnames[i] .. '.pgm'
+    image.save(paths[i], torch.ByteTensor(1, 2, 3):fill(i % 256))
+  end
+  local items = {}
+  for i = 1, #paths do
+    items[i] = paths[i]
+  end
+  items[123] = paths[123] .. '.missing'
+  local batch, errors = image.loadBatch(items, {type='byte', threads=3})
+  for i = 1, #items do
+    if i == 123 then
+      tester:assert(errors[i] and errors[i]:find('cannot open'), 'loadBatch should report missing files')
+      tester:asserteq(batch[i]:sum(), 0, 'failed items should be zeroed')
+    else
+      tester:assert(errors[i] == nil, 'unexpected loadBatch error')
+      tester:asserteq(batch[i][1][2][3], i % 256, 'loadBatch image differs')
+    end
+  end
+  for i = 1, #paths do
+    os.remove(paths[i])
+    os.remove(tmpnames[i])
+  end
+end
+
+function test.Prefetcher()
+  local tmpnames, paths = {}, {}
+  for i = 1, 5 do
+    tmpnames[i] = os.tmpname()
+    paths[i] = tmpnames[i] .. '.pgm'
+    image.save(paths[i], torch.ByteTensor(1, 4, 6):fill(i * 10))
+  end
+
+  -- in order, with epoch rollover
+  local prefetcher = image.Prefetcher{paths=paths, type='byte', queue=2, threads=3, epochs=2}
+  for epoch = 1, 2 do
+    for i = 1, #paths do
+      local img, index, err = prefetcher:next()
+      tester:asserteq(index, i, 'Prefetcher should keep the order')
+      tester:assert(err == nil, 'unexpected Prefetcher error')
+      tester:assertTensorEq(img, torch.ByteTensor(1, 4, 6):fill(i * 10), 0,
+                            'Prefetcher image differs')
+    end
+  end
+  tester:assert(prefetcher:next() == nil, 'Prefetcher should stop after the last epoch')
+  prefetcher:close()
+
+  -- shuffled batches: each epoch still sees every image once
+  prefetcher = image.Prefetcher{paths=paths, batch=2, shuffle=true, epochs=1, size={8, 8}}
+  local seen = {}
+  local batch, indices = prefetcher:next()
+  while batch do
+    tester:asserteq(batch:size(2), 1, 'Prefetcher batch depth')
+    for b, index in ipairs(indices) do
+      tester:asserteq(seen[index], nil, 'Prefetcher repeated an image')
+      seen[index] = true
+      tester:assertlt(math.abs(batch[b]:mean() - index * 10 / 255), precision,
+                      'Prefetcher batch image differs')
+    end
+    batch, indices = prefetcher:next()
+  end
+  tester:asserteq(#seen, #paths, 'Prefetcher missed images')
+  prefetcher:close()
+
+  for i = 1, #paths do
+    os.remove(paths[i])
+    os.remove(tmpnames[i])
+  end
+end
+
+function test.DiskCache()
+  local dir = os.tmpname()
+  os.remove(dir)
+  local tmpname = os.tmpname()
+  local filename = tmpname .. '.pgm'
+  local img = torch.rand(1, 6, 9):mul(255):floor():byte()
+  image.save(filename, img)
+
+  image.setDiskCache(dir)
+  local first = image.load(filename, nil, 'byte')
+  local cached = image.load(filename, nil, 'byte')
+  tester:assertTensorEq(cached, img, 0, 'cached image.load differs')
+  tester:assertTensorEq(cached, first, 0, 'cached image.load differs')
+  local batch = image.loadBatch({filename, filename}, {size={4, 3}})
+  local again = image.loadBatch({filename, filename}, {size={4, 3}})
+  tester:assertTensorEq(again, batch, 0, 'cached image.loadBatch differs')
+
+  -- an edited file is decoded again
+  local edited = img:clone():fill(17)
+  os.execute('sleep 1')
+  image.save(filename, edited)
+  tester:assertTensorEq(image.load(filename, nil, 'byte'), edited, 0,
+                        'image.load should not use stale cache entries')
+
+  image.setDiskCache()
+  os.execute('rm -rf "' .. dir .. '"')
+  os.remove(filename)
+  os.remove(tmpname)
+end
+
+function test.MemoryCache()
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  image.cache.configure{bytes=64 * 2^20}
+  local first = image.load(jpg, 3)
+  local second = image.load(jpg, 3)
+  tester:assertTensorEq(first, second, 0, 'image.cache hit differs')
+  tester:asserteq(image.load(jpg, 1):size(1), 1, 'the depth should be part of the key')
+  local bytes = torch.ByteTensor(torch.ByteStorage(jpg))
+  local a = image.decompress(bytes, 3, 'byte')
+  tester:assertTensorEq(image.decompress(bytes:clone(), 3, 'byte'), a, 0,
+                        'image.decompress should hit the cache on equal bytes')
+  local stats = image.cache.stats()
+  tester:asserteq(stats.hits, 2, 'image.cache hits')
+  tester:asserteq(stats.misses, 3, 'image.cache misses')
+  tester:asserteq(stats.entries, 3, 'image.cache entries')
+
+  -- the cache keeps copies: changing the images it returned leaves it as is
+  local expected = first:clone()
+  first:zero()
+  second:fill(1)
+  tester:assertTensorEq(image.load(jpg, 3), expected, 0, 'image.cache entry was modified')
+
+  -- more images than fit in the budget
+  image.cache.configure{bytes=16 * 1024}
+  for i = 1, 100 do
+    image.decompress(image.compressPPM(torch.ByteTensor(1, 8, 8):fill(i)))
+  end
+  stats = image.cache.stats()
+  tester:assert(stats.evictions > 0 and stats.bytes <= stats.capacity, 'image.cache should evict')
+
+  image.cache.configure{bytes=0}
+  image.load(jpg)
+  image.load(jpg)
+  tester:asserteq(image.cache.stats().hits, 0, 'image.cache should be off')
+end
+
+function test.SharedCache()
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local name = '/torch-image-test-' .. tostring(os.time()) .. '-' .. tostring(math.random(1e6))
+  image.shmcache.open{name=name, bytes=16 * 2^20, slots=64}
+
+  -- processes of the node loading the same image at once
+  local child = string.format("th -e \"require 'image'; image.shmcache.open{name='%s'}; image.load('%s', 3)\"",
+                              name, jpg)
+  os.execute('(' .. child .. ' & ' .. child .. ' & ' .. child .. ' & wait)')
+  local stats = image.shmcache.stats()
+  tester:asserteq(stats.entries, 1, 'image.shmcache should hold the image once')
+  local imageBytes = 3 * 512 * 512 * torch.Tensor():elementSize()
+  tester:assert(stats.bytes >= imageBytes and stats.bytes < 2 * imageBytes,
+                'image.shmcache should allocate the image once')
+  tester:asserteq(stats.hits + stats.misses, 3, 'image.shmcache lookups')
+
+  local shared = image.load(jpg, 3)
+  tester:asserteq(image.shmcache.stats().hits, stats.hits + 1, 'image.load should hit the shared cache')
+
+  -- hits can be written to, without changing the cache
+  local written = image.load(jpg, 3)
+  written:mul(2)
+  image.shmcache.close()
+  local decoded = image.load(jpg, 3)
+  tester:assertTensorEq(shared, decoded, 0, 'image.shmcache should return the decoded image')
+  tester:assertTensorEq(written, decoded:mul(2), 1e-6, 'image.shmcache hits should be writable')
+
+  tester:assert(image.shmcache.unlink(name), 'image.shmcache.unlink')
+end
+
+function test.Archive()
+  local tmpname = os.tmpname()
+  local filename = tmpname .. '.arc'
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local gray = torch.rand(1, 5, 7):mul(255):floor():byte()
+  local rgba = torch.rand(4, 3, 2):mul(255):floor():byte()
+
+  local writer = image.Archive.create(filename)
+  tester:asserteq(writer:add('hopper', image.readFile(jpg)), 1, 'Archive index')
+  tester:asserteq(writer:add('gray', gray), 2, 'Archive index')
+  tester:asserteq(writer:add('rgba', rgba), 3, 'Archive index')
+  tester:asserteq(writer:add('gray.png', gray, 'png'), 4, 'Archive index')
+  tester:assertError(function() writer:add('gray', gray) end, 'Archive should reject duplicate names')
+  writer:close()
+
+  local archive = image.Archive(filename)
+  tester:asserteq(archive:size(), 4, 'Archive size')
+  tester:asserteq(archive:find('rgba'), 3, 'Archive find')
+  tester:asserteq(archive:find('missing'), nil, 'Archive find should miss unknown names')
+  local info = archive:info('hopper')
+  tester:assertTableEq({info.format, info.depth, info.height, info.width}, {'jpg', 3, 512, 512},
+                       'Archive entry info')
+  tester:asserteq(archive:info(2).format, 'pgm', 'raw images should be stored uncompressed')
+  tester:assertTensorEq(archive:load('hopper'), image.load(jpg), precision, 'Archive JPEG differs')
+  tester:assertTensorEq(archive:load('gray', nil, 'byte'), gray, 0, 'Archive raw image differs')
+  tester:assertTensorEq(archive:load('rgba', nil, 'byte'), rgba, 0, 'Archive PAM image differs')
+  tester:assertTensorEq(archive:load(4, nil, 'byte'), gray, 0, 'Archive PNG image differs')
+
+  local batch, errors = archive:loadBatch({'gray', 4}, {type='byte'})
+  tester:assert(errors[1] == nil and errors[2] == nil, 'unexpected loadBatch errors')
+  tester:assertTensorEq(batch[1], gray, 0, 'Archive loadBatch differs')
+  tester:assertTensorEq(batch[2], gray, 0, 'Archive loadBatch differs')
+  archive:close()
+
+  os.remove(filename)
+  os.remove(tmpname)
+end
+
 ----------------------------------------------------------------------
 -- Lab conversion test
 -- These tests break if someone removes lena from the repo
@@ -625,6 +1258,19 @@ function test.test_pgmaload()
     tester:asserteq(pix, ref, "PGMA load: pixel check failed")
 end
 
+function test.test_pgmaload16()
+    -- 16-bit ASCII samples keep their full precision, and comments may
+    -- appear anywhere between samples
+    local filename = os.tmpname()
+    local f = io.open(filename, 'w')
+    f:write('P2\n# 16-bit\n3 1\n65535\n0 # black\n32768\n65535\n')
+    f:close()
+    local img = image.loadPPM(filename, 1, 'double')
+    os.remove(filename)
+    local ref = torch.DoubleTensor({{{0, 32768/65535, 1}}})
+    tester:assertTensorEq(img, ref, 1e-12, "PGMA load: 16-bit samples check failed")
+end
+
 function test.test_pgmload()
     -- test.ppm is a 100x1 "French flag" like image, i.e the first pixel is blue
     -- the 84 next pixels are white and the 15 last pixels are red.
@@ -638,6 +1284,58 @@ function test.test_pgmload()
     tester:assertTensorEq(pix, ref, 0.001, "PPM load: first pixel check failed")
 end
 
+function test.test_ppmloadMmap()
+    -- mapped loads must match regular loads, for the zero-copy byte path and
+    -- for the converting paths alike
+    for _, name in ipairs({"P5.pgm", "P6.ppm"}) do
+      local path = getTestImagePath(name)
+      for _, tensortype in ipairs({"byte", "float"}) do
+        local ref = image.loadPPM(path, nil, tensortype)
+        local img = image.loadPPM(path, {type = tensortype, mmap = true})
+        tester:assertTensorEq(img:double(), ref:double(), 0,
+                              "PPM mmap load: " .. name .. " " .. tensortype)
+      end
+    end
+end
+
+function test.test_pamSaveLoad()
+    -- PAM keeps any number of channels, in 8 or 16 bits
+    local tmpname = os.tmpname()
+    local filename = tmpname .. '.pam'
+    local rgba = torch.rand(4, 5, 7):mul(255):floor():byte()
+    image.save(filename, rgba)
+    tester:assertTensorEq(image.load(filename, nil, 'byte'):double(), rgba:double(), 0,
+                          "PAM save/load: 8-bit RGBA check failed")
+    tester:assertTableEq(image.getSize(filename):totable(), {4, 5, 7},
+                         "PAM size check failed")
+
+    local features = torch.rand(6, 5, 7)
+    image.savePAM(filename, features, 65535)
+    local img = image.load(filename, nil, 'double')
+    tester:assertTensorEq(img, features, 1/65535 + 1e-9,
+                          "PAM save/load: 16-bit check failed")
+    os.remove(filename)
+    os.remove(tmpname)
+end
+
+function test.test_pfmSaveLoad()
+    -- float maps round-trip without clamping or quantization
+    local tmpname = os.tmpname()
+    local filename = tmpname .. '.pfm'
+    for _, depth in ipairs({1, 3}) do
+      local map = torch.randn(depth, 6, 9):float():mul(100)
+      image.save(filename, map)
+      for _, mmap in ipairs({false, true}) do
+        local img = image.loadPPM(filename, {type = 'float', mmap = mmap})
+        tester:assertTensorEq(img, map, 0, "PFM save/load: float check failed")
+      end
+      tester:assertTensorEq(image.load(filename, nil, 'double'), map:double(), 0,
+                            "PFM save/load: double check failed")
+    end
+    os.remove(filename)
+    os.remove(tmpname)
+end
+
 function test.test_pbmload()
   -- test.pbm is a Portable BitMap (not supported)
   tester:assertErrorPattern(
@@ -648,14 +1346,45 @@ function test.test_pbmload()
 end
 
 ----------------------------------------------------------------------
--- Load unknown image type without extension test
+-- Load image without extension tests
 --
+function test.DetectFormat()
+  local jpg = getTestImagePath('grace_hopper_512.jpg')
+  local png = getTestImagePath('grace_hopper_512.png')
+  tester:asserteq(image.detectFormat(jpg), 'jpg', 'JPEG magic number')
+  tester:asserteq(image.detectFormat(png), 'png', 'PNG magic number')
+  tester:asserteq(image.detectFormat(getTestImagePath('bmp-without-ext')), 'bmp',
+                  'BMP magic number')
+  tester:asserteq(image.detectFormat(toBlob(png)), 'png', 'PNG magic number in memory')
+  tester:asserteq(image.detectFormat(torch.ByteTensor{0x50, 0x36, 0x0a}), 'ppm',
+                  'PPM magic number in memory')
+  tester:asserteq(image.detectFormat(torch.ByteTensor(10):fill(7)), nil,
+                  'unknown magic number')
+  -- loading from memory gives what the format loaders give
+  tester:assertTensorEq(image.load(jpg), image.loadJPG(jpg), 0, 'image.load JPEG differs')
+  tester:assertTensorEq(image.load(png, 1, 'byte'), image.loadPNG(png, 1, 'byte'), 0,
+                        'image.load PNG differs')
+end
+
+function test.LoadBMPWithoutExtension()
+  -- 1x1 white, opaque pixel (32-bit BI_BITFIELDS, V5 header)
+  local img = image.load(getTestImagePath("bmp-without-ext"))
+  tester:assertTableEq(img:size():totable(), {4, 1, 1}, 'BMP size')
+  tester:assertTensorEq(img, torch.ones(4, 1, 1), precision,
+                        'BMP should be recognised by its magic number')
+end
+
 function test.LoadUnknownImageTypeWithoutExtension()
+  local filename = os.tmpname()
+  local f = io.open(filename, 'wb')
+  f:write('not an image')
+  f:close()
   tester:assertErrorPattern(
-    function() image.load(getTestImagePath("bmp-without-ext")) end,
+    function() image.load(filename) end,
     "unable to determine image type for file",
     "unknown image type should not be loaded or unexpected error message"
   )
+  os.remove(filename)
 end
 
 ----------------------------------------------------------------------
@@ -0,0 +1,463 @@
+
+#include <TH.h>
+#include <luaT.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fdio.c"
+
+#if LUA_VERSION_NUM >= 503
+#define luaL_checkint(L,n)      ((int)luaL_checkinteger(L, (n)))
+#define luaL_optint(L,n,d)      ((int)luaL_optinteger(L, (n), (d)))
+#endif
+
+#define torch_(NAME) TH_CONCAT_3(torch_, Real, NAME)
+#define torch_Tensor TH_CONCAT_STRING_3(torch., Real, Tensor)
+#define liby4m_(NAME) TH_CONCAT_3(liby4m_, Real, NAME)
+
+#define Y4M_BUFSIZE 65536
+
+/* Largest width or height accepted, as for PPM and BMP: plane sizes and the
+ * tensors they fill then stay well within a long.
+ */
+#define Y4M_MAX_SIZE (1L << 24)
+
+/* Chroma subsampling. */
+#define Y4M_420  0
+#define Y4M_422  1
+#define Y4M_444  2
+#define Y4M_MONO 3
+
+typedef struct {
+  long W, H;
+  int chroma;
+  int full;               /* full (JPEG) rather than limited (TV) range */
+  long fps_num, fps_den;
+  char tag[16];           /* C parameter, as found in the stream */
+} y4m_header;
+
+/* Size of the chroma planes, (0, 0) for monochrome streams. */
+static void y4m_chroma_size(const y4m_header *h, long *cw, long *ch)
+{
+  switch (h->chroma) {
+  case Y4M_420:
+    *cw = (h->W + 1) / 2;
+    *ch = (h->H + 1) / 2;
+    break;
+  case Y4M_422:
+    *cw = (h->W + 1) / 2;
+    *ch = h->H;
+    break;
+  case Y4M_444:
+    *cw = h->W;
+    *ch = h->H;
+    break;
+  default:
+    *cw = *ch = 0;
+  }
+}
+
+/* Parse a C parameter (e.g. "420jpeg"), or return -1. */
+static int y4m_parse_chroma(const char *tag)
+{
+  if (strcmp(tag, "420jpeg") == 0 || strcmp(tag, "420paldv") == 0 ||
+      strcmp(tag, "420mpeg2") == 0 || strcmp(tag, "420") == 0) {
+    return Y4M_420;
+  } else if (strcmp(tag, "422") == 0) {
+    return Y4M_422;
+  } else if (strcmp(tag, "444") == 0) {
+    return Y4M_444;
+  } else if (strcmp(tag, "mono") == 0) {
+    return Y4M_MONO;
+  }
+  return -1;
+}
+
+static int y4m_write_fd(int fd, const unsigned char *src, size_t n)
+{
+  while (n > 0) {
+    ssize_t m = write(fd, src, n);
+    if (m < 0 && errno == EINTR) {
+      continue;
+    }
+    if (m <= 0) {
+      return 0;
+    }
+    src += m;
+    n -= m;
+  }
+  return 1;
+}
+
+/* A stream being read: header lines are scanned out of buf, while frame
+ * planes bypass it and are read straight into their destination.
+ */
+typedef struct {
+  int fd;
+  int owned;              /* the descriptor was opened by us */
+  unsigned char *buf;
+  size_t pos, len;
+  y4m_header hdr;
+  unsigned char *frame;   /* staging for converted frames */
+  size_t cap;
+} y4m_reader;
+
+static int y4m_getc(y4m_reader *r)
+{
+  if (r->pos == r->len) {
+    r->pos = 0;
+    r->len = image_read_fd(r->fd, r->buf, Y4M_BUFSIZE, 0);
+    if (r->len == 0) {
+      return EOF;
+    }
+  }
+  return r->buf[r->pos++];
+}
+
+/* Read n bytes: whatever is buffered first, then straight from the stream. */
+static int y4m_read(y4m_reader *r, unsigned char *dst, size_t n)
+{
+  size_t k = r->len - r->pos;
+  if (k > n) {
+    k = n;
+  }
+  memcpy(dst, r->buf + r->pos, k);
+  r->pos += k;
+  if (k < n) {
+    return image_read_fd(r->fd, dst + k, n - k, 1) == n - k;
+  }
+  return 1;
+}
+
+/* Read a header line (without its newline), or return 0 at EOF. */
+static int y4m_getline(y4m_reader *r, char *line, int size)
+{
+  int ch, n = 0;
+  while ((ch = y4m_getc(r)) != '\n') {
+    if (ch == EOF) {
+      line[n] = '\0';
+      return 0;
+    }
+    if (n < size - 1) {
+      line[n++] = (char)ch;
+    }
+  }
+  line[n] = '\0';
+  return 1;
+}
+
+/* Parse the stream header, e.g. "YUV4MPEG2 W640 H480 F30:1 Ip A1:1 C420jpeg". */
+static int y4m_read_header(y4m_reader *r)
+{
+  char line[512];
+  y4m_header *h = &r->hdr;
+  if (!y4m_getline(r, line, sizeof(line)) || strncmp(line, "YUV4MPEG2 ", 10) != 0) {
+    return 0;
+  }
+
+  h->W = h->H = -1;
+  h->fps_num = 25;
+  h->fps_den = 1;
+  h->full = 0;
+  strcpy(h->tag, "420jpeg");
+  char *tok = strtok(line + 10, " ");
+  for (; tok; tok = strtok(NULL, " ")) {
+    switch (tok[0]) {
+    case 'W':
+      h->W = strtol(tok + 1, NULL, 10);
+      break;
+    case 'H':
+      h->H = strtol(tok + 1, NULL, 10);
+      break;
+    case 'F':
+      sscanf(tok + 1, "%ld:%ld", &h->fps_num, &h->fps_den);
+      break;
+    case 'C':
+      snprintf(h->tag, sizeof(h->tag), "%s", tok + 1);
+      break;
+    case 'X':
+      if (strcmp(tok, "XCOLORRANGE=FULL") == 0) {
+        h->full = 1;
+      }
+      break;
+    default:
+      // interlacing, aspect ratio: informative only
+      break;
+    }
+  }
+  h->chroma = y4m_parse_chroma(h->tag);
+
+  return h->W > 0 && h->H > 0 && h->W <= Y4M_MAX_SIZE && h->H <= Y4M_MAX_SIZE;
+}
+
+/* Skip to the next frame's samples, or return 0 at EOF. */
+static int y4m_read_frame_header(y4m_reader *r, int *corrupted)
+{
+  char line[256];
+  *corrupted = 0;
+  if (!y4m_getline(r, line, sizeof(line))) {
+    // a partial line is a truncated stream, nothing at all is a clean end
+    *corrupted = (line[0] != '\0');
+    return 0;
+  }
+  if (strncmp(line, "FRAME", 5) != 0) {
+    *corrupted = 1;
+    return 0;
+  }
+  return 1;
+}
+
+/* Grow the reader's staging buffer to n bytes. */
+static unsigned char *y4m_staging(y4m_reader *r, size_t n)
+{
+  if (n > r->cap) {
+    unsigned char *b = realloc(r->frame, n);
+    if (!b) {
+      return NULL;
+    }
+    r->frame = b;
+    r->cap = n;
+  }
+  return r->frame;
+}
+
+/* Open a file name, or take a file descriptor from the stack. */
+static int y4m_open(lua_State *L, int idx, int flags, int *owned)
+{
+  int fd;
+  if (lua_type(L, idx) == LUA_TSTRING) {
+    const char *filename = lua_tostring(L, idx);
+    fd = open(filename, flags, 0666);
+    if (fd < 0) {
+      luaL_error(L, "cannot open file <%s>", filename);
+    }
+    *owned = 1;
+  } else {
+    fd = luaL_checkint(L, idx);
+    if (fd < 0) {
+      luaL_argerror(L, idx, "invalid file descriptor");
+    }
+    *owned = 0;
+  }
+  return fd;
+}
+
+static void liby4m_Reader_release(y4m_reader *r)
+{
+  if (r->fd >= 0 && r->owned) {
+    close(r->fd);
+  }
+  r->fd = -1;
+  free(r->buf);
+  free(r->frame);
+  r->buf = r->frame = NULL;
+  r->cap = 0;
+}
+
+static int liby4m_Reader_new(lua_State *L)
+{
+  y4m_reader *r = luaT_alloc(L, sizeof(y4m_reader));
+  r->fd = -1;
+  r->buf = r->frame = NULL;
+  r->cap = 0;
+  luaT_pushudata(L, r, "liby4m.Reader");
+
+  r->fd = y4m_open(L, 1, O_RDONLY, &r->owned);
+  r->buf = malloc(Y4M_BUFSIZE);
+  if (!r->buf) {
+    liby4m_Reader_release(r);
+    luaL_error(L, "out of memory");
+  }
+  r->pos = r->len = 0;
+  if (!y4m_read_header(r)) {
+    liby4m_Reader_release(r);
+    luaL_error(L, "not a YUV4MPEG2 stream");
+  }
+  if (r->hdr.chroma < 0) {
+    liby4m_Reader_release(r);
+    luaL_error(L, "unsupported chroma format: C%s", r->hdr.tag);
+  }
+  return 1;
+}
+
+/* Returns width, height, chroma format, frame rate (numerator, denominator)
+ * and whether samples use the full range.
+ */
+static int liby4m_Reader_header(lua_State *L)
+{
+  y4m_reader *r = luaT_checkudata(L, 1, "liby4m.Reader");
+  lua_pushnumber(L, r->hdr.W);
+  lua_pushnumber(L, r->hdr.H);
+  lua_pushstring(L, r->hdr.tag);
+  lua_pushnumber(L, r->hdr.fps_num);
+  lua_pushnumber(L, r->hdr.fps_den);
+  lua_pushboolean(L, r->hdr.full);
+  return 6;
+}
+
+static int liby4m_Reader_close(lua_State *L)
+{
+  y4m_reader *r = luaT_checkudata(L, 1, "liby4m.Reader");
+  liby4m_Reader_release(r);
+  return 0;
+}
+
+static int liby4m_Reader_free(lua_State *L)
+{
+  y4m_reader *r = luaT_checkudata(L, 1, "liby4m.Reader");
+  liby4m_Reader_release(r);
+  luaT_free(L, r);
+  return 0;
+}
+
+static const luaL_Reg liby4m_Reader__[] =
+{
+  {"header", liby4m_Reader_header},
+  {"close", liby4m_Reader_close},
+  {NULL, NULL}
+};
+
+/* A stream being written, with the header already out. */
+typedef struct {
+  int fd;
+  int owned;
+  y4m_header hdr;
+  unsigned char *frame;   /* one frame, "FRAME\n" included */
+  size_t size;
+} y4m_writer;
+
+static void liby4m_Writer_release(y4m_writer *w)
+{
+  if (w->fd >= 0 && w->owned) {
+    close(w->fd);
+  }
+  w->fd = -1;
+  free(w->frame);
+  w->frame = NULL;
+}
+
+/* Writer(path_or_fd, width, height, [chroma], [fps_num], [fps_den], [full]) */
+static int liby4m_Writer_new(lua_State *L)
+{
+  y4m_writer *w = luaT_alloc(L, sizeof(y4m_writer));
+  y4m_header *h = &w->hdr;
+  w->fd = -1;
+  w->frame = NULL;
+  luaT_pushudata(L, w, "liby4m.Writer");
+
+  h->W = luaL_checklong(L, 2);
+  h->H = luaL_checklong(L, 3);
+  snprintf(h->tag, sizeof(h->tag), "%s", luaL_optstring(L, 4, "420jpeg"));
+  h->chroma = y4m_parse_chroma(h->tag);
+  h->fps_num = luaL_optlong(L, 5, 25);
+  h->fps_den = luaL_optlong(L, 6, 1);
+  h->full = lua_toboolean(L, 7);
+  if (h->W < 1 || h->H < 1 || h->W > Y4M_MAX_SIZE || h->H > Y4M_MAX_SIZE) {
+    luaL_error(L, "invalid frame size");
+  }
+  if (h->chroma < 0) {
+    luaL_error(L, "unsupported chroma format: C%s", h->tag);
+  }
+
+  long cw, ch;
+  y4m_chroma_size(h, &cw, &ch);
+  w->size = 6 + h->W*h->H + 2*cw*ch;
+  w->frame = malloc(w->size);
+  if (!w->frame) {
+    luaL_error(L, "out of memory");
+  }
+  memcpy(w->frame, "FRAME\n", 6);
+
+  w->fd = y4m_open(L, 1, O_WRONLY | O_CREAT | O_TRUNC, &w->owned);
+  char header[128];
+  int hlen = snprintf(header, sizeof(header), "YUV4MPEG2 W%ld H%ld F%ld:%ld Ip A1:1 C%s%s\n",
+                      h->W, h->H, h->fps_num, h->fps_den, h->tag,
+                      h->full ? " XCOLORRANGE=FULL" : "");
+  if (!y4m_write_fd(w->fd, (unsigned char *)header, hlen)) {
+    liby4m_Writer_release(w);
+    luaL_error(L, "write error");
+  }
+  return 1;
+}
+
+static int liby4m_Writer_close(lua_State *L)
+{
+  y4m_writer *w = luaT_checkudata(L, 1, "liby4m.Writer");
+  liby4m_Writer_release(w);
+  return 0;
+}
+
+static int liby4m_Writer_free(lua_State *L)
+{
+  y4m_writer *w = luaT_checkudata(L, 1, "liby4m.Writer");
+  liby4m_Writer_release(w);
+  luaT_free(L, w);
+  return 0;
+}
+
+static const luaL_Reg liby4m_Writer__[] =
+{
+  {"close", liby4m_Writer_close},
+  {NULL, NULL}
+};
+
+/* BT.601 coefficients, for limited (TV) and full (JPEG) range. */
+typedef struct {
+  float y0, ky;           /* Y offset and scale */
+  float rv, gu, gv, bu;   /* YUV to RGB */
+} y4m_coefs;
+
+static void y4m_get_coefs(y4m_coefs *c, int full)
+{
+  if (full) {
+    c->y0 = 0; c->ky = 1;
+    c->rv = 1.402f; c->gu = 0.344136f; c->gv = 0.714136f; c->bu = 1.772f;
+  } else {
+    c->y0 = 16; c->ky = 255.f/219;
+    c->rv = 1.596027f; c->gu = 0.391762f; c->gv = 0.812968f; c->bu = 2.017232f;
+  }
+}
+
+static inline unsigned char y4m_clamp(float v)
+{
+  return v <= 0 ? 0 : (v >= 255 ? 255 : (unsigned char)(v + 0.5f));
+}
+
+#include "generic/y4m.c"
+#include "THGenerateAllTypes.h"
+
+DLL_EXPORT int luaopen_liby4m(lua_State *L)
+{
+  liby4m_FloatMain_init(L);
+  liby4m_DoubleMain_init(L);
+  liby4m_ByteMain_init(L);
+
+  lua_newtable(L);
+  lua_pushvalue(L, -1);
+  lua_setglobal(L, "liby4m");
+
+  luaT_newmetatable(L, "liby4m.Reader", NULL,
+                    liby4m_Reader_new, liby4m_Reader_free, NULL);
+  luaT_setfuncs(L, liby4m_Reader__, 0);
+  lua_pop(L, 1);
+
+  luaT_newmetatable(L, "liby4m.Writer", NULL,
+                    liby4m_Writer_new, liby4m_Writer_free, NULL);
+  luaT_setfuncs(L, liby4m_Writer__, 0);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  luaT_setfuncs(L, liby4m_DoubleMain__, 0);
+  lua_setfield(L, -2, "double");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, liby4m_FloatMain__, 0);
+  lua_setfield(L, -2, "float");
+
+  lua_newtable(L);
+  luaT_setfuncs(L, liby4m_ByteMain__, 0);
+  lua_setfield(L, -2, "byte");
+
+  return 1;
+}